@@ -21,19 +21,26 @@
 #include <stdlib.h>
 #include <iv_avl.h>
 #include <iv_list.h>
-#include <nettle/sha2.h>
-#include <gnutls/abstract.h>
 #include <string.h>
 #include "adj_rib_in.h"
 #include "lsa_diff.h"
 #include "lsa_path.h"
 #include "lsa_serialise.h"
 #include "lsa_type.h"
+#include "sig_cache.h"
 #include "util.h"
 
+/*
+ * ->sig is the signature cache entry of the LSA, if there is one,
+ * which is held for as long as the LSA is, so that the LSA doesn't
+ * have to be verified again when it is compared against its
+ * successor by some other adj_rib_in.
+ */
 struct adj_rib_in_lsa_ref {
 	struct iv_avl_node	an;
 	struct lsa		*lsa;
+	int			accepted;
+	struct sig_cache_entry	*sig;
 };
 
 static int compare_refs(struct iv_avl_node *_a, struct iv_avl_node *_b)
@@ -55,7 +62,7 @@ void adj_rib_in_init(struct adj_rib_in *rib)
 }
 
 static struct adj_rib_in_lsa_ref *
-adj_rib_in_find_ref(struct adj_rib_in *rib, uint8_t *id)
+adj_rib_in_find_ref(struct adj_rib_in *rib, const uint8_t *id)
 {
 	struct iv_avl_node *an;
 
@@ -79,111 +86,91 @@ adj_rib_in_find_ref(struct adj_rib_in *rib, uint8_t *id)
 	return NULL;
 }
 
-static struct lsa *map(struct adj_rib_in *rib, struct lsa *lsa)
+struct lsa *adj_rib_in_find_lsa(struct adj_rib_in *rib, const uint8_t *id)
+{
+	struct adj_rib_in_lsa_ref *ref;
+
+	ref = adj_rib_in_find_ref(rib, id);
+
+	return (ref != NULL) ? ref->lsa : NULL;
+}
+
+static int check(struct adj_rib_in *rib, struct lsa *lsa, int valid,
+		 struct sig_cache_entry **sigp)
 {
 	struct lsa_attr *attr;
-	struct sha256_ctx ctx;
-	uint8_t id[NODE_ID_LEN];
-	gnutls_pubkey_t pubkey;
+	struct sig_check sc;
+	struct sig_cache_entry *sig;
 	int ret;
-	gnutls_datum_t datum;
-	size_t serlen;
-	size_t buflen;
-	void *buf;
-	size_t len;
-	gnutls_datum_t data;
 
-	if (lsa == NULL)
-		return NULL;
+	*sigp = NULL;
 
 	if (lsa->bytes + NODE_ID_LEN > LSA_MAX_BYTES)
-		return NULL;
+		return 0;
 
 	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
 	if (attr == NULL)
-		return NULL;
+		return 0;
 
 	if (attr->datalen < NODE_ID_LEN || (attr->datalen % NODE_ID_LEN) != 0)
-		return NULL;
+		return 0;
 
 	if (rib->remoteid == NULL ||
 	    memcmp(rib->remoteid, lsa_attr_data(attr), NODE_ID_LEN))
-		return NULL;
+		return 0;
 
 	if (rib->myid != NULL && lsa_path_contains(attr, rib->myid))
-		return NULL;
-
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_PUBKEY, NULL, 0);
-	if (attr == NULL)
-		return NULL;
-
-	sha256_init(&ctx);
-	sha256_update(&ctx, attr->datalen, lsa_attr_data(attr));
-	sha256_digest(&ctx, SHA256_DIGEST_SIZE, id);
-
-	if (memcmp(lsa->id, id, NODE_ID_LEN))
-		return NULL;
-
-	ret = gnutls_pubkey_init(&pubkey);
-	if (ret < 0) {
-		gnutls_perror(ret);
-		return NULL;
-	}
-
-	datum.data = lsa_attr_data(attr);
-	datum.size = attr->datalen;
+		return 0;
 
-	ret = gnutls_pubkey_import(pubkey, &datum, GNUTLS_X509_FMT_DER);
-	if (ret < 0) {
-		gnutls_perror(ret);
-		gnutls_pubkey_deinit(pubkey);
-		return NULL;
-	}
+	if (sig_check_init(&sc, lsa) < 0)
+		return 0;
 
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_SIGNATURE, NULL, 0);
-	if (attr == NULL) {
-		gnutls_pubkey_deinit(pubkey);
-		return NULL;
+	/*
+	 * If the signature couldn't be checked at all, the LSA is
+	 * rejected, but the next LSA with this signature is checked
+	 * again.
+	 */
+	sig = sig_cache_get(sc.key);
+	if (valid < 0) {
+		if (sig != NULL) {
+			valid = sig->valid;
+		} else {
+			ret = sig_check_verify(&sc);
+			if (ret >= 0)
+				sig = sig_cache_insert(sc.key, !ret);
+			valid = !ret;
+		}
 	}
 
-	datum.data = lsa_attr_data(attr);
-	datum.size = attr->datalen;
-
-	serlen = lsa_serialise_length(lsa, 1, NULL);
-	if (serlen > 65536 - 128)
-		abort();
+	sig_check_deinit(&sc);
 
-	buflen = serlen + 128;
-	buf = alloca(buflen);
+	/*
+	 * Only verified LSAs are interned, so that a forged copy can't
+	 * take the place of the real body for its node id and version,
+	 * and keep the real copies from sharing it.
+	 */
+	if (valid)
+		lsa_intern(lsa);
 
-	len = lsa_serialise(buf, buflen, serlen, lsa, 1, NULL);
-	if (len > buflen)
-		abort();
+	*sigp = sig;
 
-	data.data = buf;
-	data.size = len;
-
-	ret = gnutls_pubkey_verify_data2(pubkey, GNUTLS_SIGN_RSA_SHA256,
-					 0, &data, &datum);
-	if (ret < 0) {
-		gnutls_perror(ret);
-		gnutls_pubkey_deinit(pubkey);
-		return NULL;
-	}
-
-	gnutls_pubkey_deinit(pubkey);
+	return valid;
+}
 
-	return lsa;
+static struct lsa *map(struct lsa *lsa, int accepted)
+{
+	return accepted ? lsa : NULL;
 }
 
-static void notify(struct adj_rib_in *rib, struct lsa *old, struct lsa *new)
+static void notify(struct adj_rib_in *rib, struct lsa *old, int oldaccepted,
+		   struct lsa *new, int newaccepted)
 {
 	struct iv_list_head *ilh;
 	struct iv_list_head *ilh2;
 	struct rib_listener *rl;
 
-	old = map(rib, old);
-	new = map(rib, new);
+	old = map(old, oldaccepted);
+	new = map(new, newaccepted);
 
 	if (old != NULL)
 		rib->size -= old->bytes;
@@ -212,20 +199,24 @@ static void notify(struct adj_rib_in *rib, struct lsa *old, struct lsa *new)
 static void
 adj_rib_in_del_lsa(struct adj_rib_in *rib, struct adj_rib_in_lsa_ref *ref)
 {
-	notify(rib, ref->lsa, NULL);
+	notify(rib, ref->lsa, ref->accepted, NULL, 0);
 
 	iv_avl_tree_delete(&rib->lsas, &ref->an);
 	lsa_put(ref->lsa);
+	if (ref->sig != NULL)
+		sig_cache_put(ref->sig);
 	free(ref);
 }
 
-int adj_rib_in_add_lsa(struct adj_rib_in *rib, struct lsa *lsa)
+int adj_rib_in_add_lsa(struct adj_rib_in *rib, struct lsa *lsa, int valid)
 {
 	struct adj_rib_in_lsa_ref *ref;
+	struct sig_cache_entry *sig;
+	int accepted;
 
 	ref = adj_rib_in_find_ref(rib, lsa->id);
 
-	if (iv_avl_tree_empty(&lsa->root.attrs)) {
+	if (lsa_empty(lsa)) {
 		if (ref == NULL)
 			return -1;
 
@@ -253,15 +244,23 @@ int adj_rib_in_add_lsa(struct adj_rib_in *rib, struct lsa *lsa)
 			return -1;
 		}
 
-		notify(rib, NULL, lsa);
+		accepted = check(rib, lsa, valid, &sig);
+		notify(rib, NULL, 0, lsa, accepted);
 
 		ref->lsa = lsa_get(lsa);
+		ref->accepted = accepted;
+		ref->sig = sig;
 		iv_avl_tree_insert(&rib->lsas, &ref->an);
 	} else if (lsa_diff(ref->lsa, lsa, NULL, NULL, NULL, NULL)) {
-		notify(rib, ref->lsa, lsa);
+		accepted = check(rib, lsa, valid, &sig);
+		notify(rib, ref->lsa, ref->accepted, lsa, accepted);
 
 		lsa_put(ref->lsa);
+		if (ref->sig != NULL)
+			sig_cache_put(ref->sig);
 		ref->lsa = lsa_get(lsa);
+		ref->accepted = accepted;
+		ref->sig = sig;
 	}
 
 	return 0;
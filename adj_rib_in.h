@@ -38,7 +38,14 @@ struct adj_rib_in {
 };
 
 void adj_rib_in_init(struct adj_rib_in *rib);
-int adj_rib_in_add_lsa(struct adj_rib_in *rib, struct lsa *lsa);
+
+/*
+ * @valid is 1 if the caller has found the signature of @lsa to be
+ * valid, 0 if it has found it to be invalid or couldn't check it,
+ * and -1 if it hasn't checked it, in which case adj_rib_in does.
+ */
+int adj_rib_in_add_lsa(struct adj_rib_in *rib, struct lsa *lsa, int valid);
+struct lsa *adj_rib_in_find_lsa(struct adj_rib_in *rib, const uint8_t *id);
 void adj_rib_in_truncate(struct adj_rib_in *rib);
 
 void adj_rib_in_listener_register(struct adj_rib_in *rib,
@@ -0,0 +1,42 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gnutls/gnutls.h>
+#include "tls_prio.h"
+
+int bench_ciphers(void)
+{
+	char *prio;
+
+	gnutls_global_init();
+
+	tls_prio_bench(stdout);
+
+	prio = tls_prio_get(NULL, 0);
+	if (prio != NULL) {
+		printf("\npriority string: %s\n", prio);
+		free(prio);
+	}
+
+	gnutls_global_deinit();
+
+	return 0;
+}
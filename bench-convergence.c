@@ -0,0 +1,250 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <iv.h>
+#include "bench.h"
+#include "loc_rib.h"
+#include "lsa.h"
+#include "rt_builder.h"
+
+/*
+ * Feeds the LSAs of a randomly generated graph, in which every node
+ * peers with BENCH_DEGREE other nodes on average, into a loc_rib
+ * with an rt_builder attached, first in path vector mode and then in
+ * link state mode, and times how long it takes for the routes to
+ * settle after the metric of one randomly chosen link changes.
+ *
+ * Every node's LSA is stored once for each of our peers, with the
+ * ADV_PATH of the shortest hop count path from that peer that does
+ * not go through us, which is what the adj_rib_ins would hold once
+ * flooding has finished.  Only the local computation is timed: in
+ * a real network, path vector routing additionally has to wait for
+ * every node on a changed path to readvertise it.
+ */
+#define BENCH_DEGREE	4
+#define BENCH_UPDATES	100
+
+static int routes_changed;
+
+static void rt_add(void *cookie, uint8_t *dest, uint8_t *nh)
+{
+	routes_changed++;
+}
+
+static void rt_mod(void *cookie, uint8_t *dest, uint8_t *oldnh,
+		   uint8_t *newnh)
+{
+	routes_changed++;
+}
+
+static void rt_del(void *cookie, uint8_t *dest, uint8_t *nh)
+{
+	routes_changed++;
+}
+
+static void bench_mode(struct bench_graph *g, struct bench_tree *trees,
+		       int spf)
+{
+	struct bench_graph_node *nodes = g->nodes;
+	int num_nodes = g->num_nodes;
+	int num_trees = nodes[0].num_peers;
+	struct loc_rib rib;
+	struct rt_builder rb;
+	uint64_t start;
+	uint64_t initial_us;
+	uint64_t update_us;
+	int initial_routes;
+	int i;
+	int j;
+
+	rib.myid = nodes[0].id;
+	loc_rib_init(&rib);
+
+	rb.rib = &rib;
+	rb.myid = nodes[0].id;
+	rb.spf = spf;
+	rb.cookie = NULL;
+	rb.rt_add = rt_add;
+	rb.rt_mod = rt_mod;
+	rb.rt_del = rt_del;
+	rt_builder_init(&rb);
+
+	routes_changed = 0;
+
+	start = now_us();
+	nodes[0].lsas[0] = bench_node_lsa(g, 0, NULL);
+	loc_rib_add_lsa(&rib, nodes[0].lsas[0]);
+	for (i = 1; i < num_nodes; i++) {
+		for (j = 0; j < num_trees; j++) {
+			if (trees[j].depth[i] < 0)
+				continue;
+
+			nodes[i].lsas[j] = bench_node_lsa(g, i, &trees[j]);
+			loc_rib_add_lsa(&rib, nodes[i].lsas[j]);
+		}
+	}
+	iv_main();
+	initial_us = now_us() - start;
+
+	initial_routes = routes_changed;
+	routes_changed = 0;
+
+	update_us = 0;
+	for (i = 0; i < BENCH_UPDATES; i++) {
+		struct bench_graph_node *n;
+		struct lsa *lsa[num_trees];
+
+		n = bench_graph_change_metric(g);
+
+		for (j = 0; j < num_trees; j++) {
+			lsa[j] = NULL;
+			if (n->lsas[j] != NULL)
+				lsa[j] = bench_node_lsa(g, n - nodes,
+							&trees[j]);
+		}
+
+		/*
+		 * The new LSA arrives from every peer at once.
+		 */
+		start = now_us();
+		for (j = 0; j < num_trees; j++) {
+			if (lsa[j] != NULL)
+				loc_rib_mod_lsa(&rib, n->lsas[j], lsa[j]);
+		}
+		iv_main();
+		update_us += now_us() - start;
+
+		for (j = 0; j < num_trees; j++) {
+			if (lsa[j] != NULL) {
+				lsa_put(n->lsas[j]);
+				n->lsas[j] = lsa[j];
+			}
+		}
+	}
+
+	printf("%8d nodes, %s: initial %10.3f ms (%d routes), "
+	       "per update %8.3f ms (%d route changes)\n", num_nodes,
+	       spf ? "link state " : "path vector", initial_us / 1000.0,
+	       initial_routes, update_us / 1000.0 / BENCH_UPDATES,
+	       routes_changed);
+
+	rt_builder_deinit(&rb);
+	loc_rib_deinit(&rib);
+
+	for (i = 0; i < num_nodes; i++) {
+		for (j = 0; j < num_trees; j++) {
+			if (nodes[i].lsas[j] != NULL) {
+				lsa_put(nodes[i].lsas[j]);
+				nodes[i].lsas[j] = NULL;
+			}
+		}
+	}
+}
+
+static int bench_convergence_graph(int num_nodes)
+{
+	struct bench_graph g;
+	struct bench_tree *trees;
+	int num_trees;
+	int ret;
+	int i;
+
+	if (bench_graph_init(&g, num_nodes, BENCH_DEGREE) < 0) {
+		fprintf(stderr, "bench_convergence: error allocating memory "
+				"for %d nodes\n", num_nodes);
+		return -1;
+	}
+
+	ret = -1;
+
+	num_trees = g.nodes[0].num_peers;
+
+	trees = calloc(num_trees, sizeof(*trees));
+	if (trees == NULL)
+		goto err;
+
+	for (i = 0; i < num_trees; i++) {
+		if (bench_tree_init(&trees[i], &g,
+				    g.nodes[0].peers[i].node) < 0)
+			goto err;
+	}
+
+	if (bench_graph_alloc_lsas(&g, num_trees) < 0)
+		goto err;
+
+	bench_mode(&g, trees, 0);
+	bench_mode(&g, trees, 1);
+
+	ret = 0;
+	goto out;
+
+err:
+	fprintf(stderr, "bench_convergence: error allocating memory\n");
+
+out:
+	if (trees != NULL) {
+		for (i = 0; i < num_trees; i++)
+			bench_tree_deinit(&trees[i]);
+	}
+	free(trees);
+
+	bench_graph_deinit(&g);
+
+	return ret;
+}
+
+int bench_convergence(const char *nodes)
+{
+	int num;
+	int ret;
+
+	srandom(1);
+
+	iv_init();
+
+	ret = 0;
+	if (nodes != NULL) {
+		num = atoi(nodes);
+		if (num < 2) {
+			fprintf(stderr, "bench_convergence: need at least "
+					"2 nodes\n");
+			ret = 1;
+		} else {
+			ret = !!bench_convergence_graph(num);
+		}
+	} else {
+		/*
+		 * Every node's LSA is stored once per peer, so this
+		 * stops short of bench-spf's largest graph.
+		 */
+		for (num = 1000; num <= 10000; num *= 10) {
+			if (bench_convergence_graph(num) < 0) {
+				ret = 1;
+				break;
+			}
+		}
+	}
+
+	iv_deinit();
+
+	return ret;
+}
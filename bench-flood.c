@@ -0,0 +1,356 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+#include <gnutls/x509.h>
+#include <string.h>
+#include "adj_rib_in.h"
+#include "bench.h"
+#include "lsa.h"
+#include "lsa_serialise.h"
+#include "lsa_type.h"
+#include "pubkey_cache.h"
+#include "sig_cache.h"
+#include "x509.h"
+
+/*
+ * Floods signed LSAs from BENCH_ORIGINS nodes to us over BENCH_PEERS
+ * peers.  The first origin advertises a single version, while the
+ * others keep readvertising new versions until their signatures
+ * alone would have pushed every other entry out of the signature
+ * cache, and we then check that the entry of the LSA that we still
+ * hold from the first origin wasn't evicted.
+ *
+ * After that, one origin advertises a version with a forged
+ * signature, which has to be rejected and cached, and a node that
+ * we haven't seen before advertises an LSA with a public key that
+ * can't be imported, which has to be rejected without being cached.
+ */
+#define BENCH_PEERS	8
+#define BENCH_ORIGINS	16
+#define BENCH_VERSIONS	(SIG_CACHE_SIZE / (BENCH_ORIGINS - 1) + 2)
+
+struct bench_origin {
+	gnutls_x509_privkey_t	key;
+	uint8_t			id[NODE_ID_LEN];
+};
+
+static uint8_t myid[NODE_ID_LEN];
+static uint8_t peerid[BENCH_PEERS][NODE_ID_LEN];
+static struct adj_rib_in ribs[BENCH_PEERS];
+static struct rib_listener rl[BENCH_PEERS];
+static int adds;
+static int mods;
+static int dels;
+
+static void lsa_add(void *cookie, struct lsa *a, uint32_t cost)
+{
+	adds++;
+}
+
+static void lsa_mod(void *cookie, struct lsa *a, uint32_t acost,
+		    struct lsa *b, uint32_t bcost)
+{
+	mods++;
+}
+
+static void lsa_del(void *cookie, struct lsa *a, uint32_t cost)
+{
+	dels++;
+}
+
+static void bench_sign(struct lsa_builder *b, gnutls_x509_privkey_t key)
+{
+	struct lsa *lsa;
+	const uint8_t *buf;
+	size_t len;
+	gnutls_privkey_t pk;
+	gnutls_datum_t data;
+	gnutls_datum_t sig;
+
+	lsa = lsa_builder_finish(b);
+	if (lsa == NULL)
+		abort();
+
+	buf = lsa_serialise_signed(lsa, &len);
+	if (buf == NULL)
+		abort();
+
+	if (gnutls_privkey_init(&pk) < 0)
+		abort();
+
+	if (gnutls_privkey_import_x509(pk, key, 0) < 0)
+		abort();
+
+	data.data = (void *)buf;
+	data.size = len;
+	if (gnutls_privkey_sign_data(pk, GNUTLS_DIG_SHA256, 0,
+				     &data, &sig) < 0) {
+		abort();
+	}
+
+	gnutls_privkey_deinit(pk);
+
+	lsa_put(lsa);
+
+	lsa_builder_add_attr(b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_SIGNATURE, 0,
+			     NULL, 0, sig.data, sig.size);
+
+	gnutls_free(sig.data);
+}
+
+/*
+ * Builds version @version of the LSA of @o, signed with @signer's
+ * key.  If @pubkey is NULL, the LSA carries @o's own public key.
+ */
+static void bench_lsa(struct lsa_builder *b, struct bench_origin *o,
+		      uint32_t version, struct bench_origin *signer,
+		      const uint8_t *pubkey, int pubkeylen)
+{
+	uint8_t buf[4096];
+	uint32_t t32[2];
+
+	if (pubkey == NULL) {
+		pubkeylen = x509_privkey_to_der_pubkey(buf, sizeof(buf),
+						       o->key);
+		if (pubkeylen < 0)
+			abort();
+		pubkey = buf;
+	}
+
+	lsa_builder_init(b, o->id);
+	lsa_builder_add_attr(b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_PUBKEY, 1,
+			     NULL, 0, pubkey, pubkeylen);
+
+	t32[0] = 0;
+	t32[1] = htonl(version);
+	lsa_builder_add_attr(b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_VERSION, 1,
+			     NULL, 0, t32, sizeof(t32));
+
+	bench_sign(b, signer->key);
+}
+
+/*
+ * Hands the LSA in @b to every adj_rib_in, as it would have been
+ * received from each peer, and returns the time that took.  If @last
+ * is not NULL, it is set to the last LSA flooded, with a reference.
+ */
+static uint64_t bench_flood_lsa(struct lsa_builder *b, struct lsa **last)
+{
+	uint64_t us;
+	int i;
+
+	us = 0;
+	for (i = 0; i < BENCH_PEERS; i++) {
+		uint8_t path[2 * NODE_ID_LEN];
+		struct lsa *lsa;
+		uint64_t start;
+
+		memcpy(path, peerid[i], NODE_ID_LEN);
+		memcpy(path + NODE_ID_LEN, b->id, NODE_ID_LEN);
+
+		lsa_builder_del_attr(b, LSA_BUILDER_ROOT,
+				     LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
+		lsa_builder_add_attr(b, LSA_BUILDER_ROOT,
+				     LSA_ATTR_TYPE_ADV_PATH, 0, NULL, 0,
+				     path, sizeof(path));
+
+		lsa = lsa_builder_finish(b);
+		if (lsa == NULL)
+			abort();
+
+		start = now_us();
+		adj_rib_in_add_lsa(&ribs[i], lsa, -1);
+		us += now_us() - start;
+
+		if (last != NULL && i == BENCH_PEERS - 1)
+			*last = lsa;
+		else
+			lsa_put(lsa);
+	}
+
+	lsa_builder_deinit(b);
+
+	return us;
+}
+
+static int sig_cached(struct lsa *lsa, int *valid)
+{
+	struct sig_check sc;
+	struct sig_cache_entry *sig;
+
+	if (sig_check_init(&sc, lsa) < 0)
+		return 0;
+
+	sig = NULL;
+	if (sig_cache_contains(sc.key)) {
+		sig = sig_cache_get(sc.key);
+		*valid = sig->valid;
+		sig_cache_put(sig);
+	}
+
+	sig_check_deinit(&sc);
+
+	return sig != NULL;
+}
+
+static int bench_flood_run(struct bench_origin *origins)
+{
+	struct bench_origin fake;
+	struct lsa_builder b;
+	struct lsa *lsa;
+	uint64_t us;
+	uint8_t junk[256];
+	int valid;
+	int i;
+	int j;
+
+	for (i = 0; i < BENCH_ORIGINS; i++) {
+		bench_lsa(&b, &origins[i], 1, &origins[i], NULL, 0);
+		bench_flood_lsa(&b, NULL);
+	}
+
+	if (adds != BENCH_ORIGINS * BENCH_PEERS) {
+		fprintf(stderr, "bench_flood: %d LSAs added, expected %d\n",
+			adds, BENCH_ORIGINS * BENCH_PEERS);
+		return -1;
+	}
+
+	us = 0;
+	for (i = 2; i <= BENCH_VERSIONS; i++) {
+		for (j = 1; j < BENCH_ORIGINS; j++) {
+			bench_lsa(&b, &origins[j], i, &origins[j], NULL, 0);
+			us += bench_flood_lsa(&b, NULL);
+		}
+	}
+
+	printf("%d LSAs flooded over %d peers: %.3f us per LSA\n",
+	       (BENCH_VERSIONS - 1) * (BENCH_ORIGINS - 1) * BENCH_PEERS,
+	       BENCH_PEERS, (double)us /
+	       ((BENCH_VERSIONS - 1) * (BENCH_ORIGINS - 1) * BENCH_PEERS));
+
+	if (mods != (BENCH_VERSIONS - 1) * (BENCH_ORIGINS - 1) * BENCH_PEERS) {
+		fprintf(stderr, "bench_flood: %d LSAs modified, expected %d\n",
+			mods, (BENCH_VERSIONS - 1) * (BENCH_ORIGINS - 1) *
+			      BENCH_PEERS);
+		return -1;
+	}
+
+	lsa = adj_rib_in_find_lsa(&ribs[0], origins[0].id);
+	if (lsa == NULL || !sig_cached(lsa, &valid) || !valid) {
+		fprintf(stderr, "bench_flood: signature of a held LSA was "
+				"evicted from the cache\n");
+		return -1;
+	}
+
+	bench_lsa(&b, &origins[1], BENCH_VERSIONS + 1, &origins[2], NULL, 0);
+	bench_flood_lsa(&b, &lsa);
+
+	if (dels != BENCH_PEERS || !sig_cached(lsa, &valid) || valid) {
+		fprintf(stderr, "bench_flood: forged signature was not "
+				"rejected and cached\n");
+		lsa_put(lsa);
+		return -1;
+	}
+	lsa_put(lsa);
+
+	memset(fake.id, 0x77, NODE_ID_LEN);
+	memset(junk, 0x5a, sizeof(junk));
+	bench_lsa(&b, &fake, 1, &origins[3], junk, sizeof(junk));
+	bench_flood_lsa(&b, &lsa);
+
+	if (adds != BENCH_ORIGINS * BENCH_PEERS || sig_cached(lsa, &valid)) {
+		fprintf(stderr, "bench_flood: signature that couldn't be "
+				"checked was not rejected, or was cached\n");
+		lsa_put(lsa);
+		return -1;
+	}
+	lsa_put(lsa);
+
+	sig_cache_print_stats(stdout);
+	pubkey_cache_print_stats(stdout);
+
+	return 0;
+}
+
+int bench_flood(void)
+{
+	struct bench_origin origins[BENCH_ORIGINS];
+	int ret;
+	int i;
+
+	gnutls_global_init();
+
+	memset(myid, 0xee, NODE_ID_LEN);
+
+	for (i = 0; i < BENCH_ORIGINS; i++) {
+		struct bench_origin *o = &origins[i];
+
+		ret = gnutls_x509_privkey_init(&o->key);
+		if (ret < 0) {
+			fprintf(stderr, "gnutls_x509_privkey_init: ");
+			gnutls_perror(ret);
+			return 1;
+		}
+
+		ret = gnutls_x509_privkey_generate(o->key, GNUTLS_PK_RSA,
+						   2048, 0);
+		if (ret < 0) {
+			fprintf(stderr, "gnutls_x509_privkey_generate: ");
+			gnutls_perror(ret);
+			return 1;
+		}
+
+		if (x509_get_privkey_id(o->id, o->key) < 0)
+			return 1;
+	}
+
+	for (i = 0; i < BENCH_PEERS; i++) {
+		memset(peerid[i], i + 1, NODE_ID_LEN);
+
+		ribs[i].myid = myid;
+		ribs[i].remoteid = peerid[i];
+		adj_rib_in_init(&ribs[i]);
+
+		rl[i].cookie = NULL;
+		rl[i].lsa_add = lsa_add;
+		rl[i].lsa_mod = lsa_mod;
+		rl[i].lsa_del = lsa_del;
+		adj_rib_in_listener_register(&ribs[i], &rl[i]);
+	}
+
+	ret = !!bench_flood_run(origins);
+
+	for (i = 0; i < BENCH_PEERS; i++) {
+		adj_rib_in_listener_unregister(&ribs[i], &rl[i]);
+		adj_rib_in_truncate(&ribs[i]);
+	}
+
+	for (i = 0; i < BENCH_ORIGINS; i++)
+		gnutls_x509_privkey_deinit(origins[i].key);
+
+	gnutls_global_deinit();
+
+	return ret;
+}
@@ -0,0 +1,150 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <iv.h>
+#include "bench.h"
+#include "loc_rib.h"
+#include "lsa.h"
+
+/*
+ * Fills a loc_rib with the LSAs of a randomly generated graph in
+ * which every node peers with BENCH_DEGREE other nodes on average,
+ * each LSA carrying the path to its node in a breadth-first tree
+ * rooted at our own node, and then changes the metric of one
+ * randomly chosen link at a time, letting loc_rib recompute just
+ * the affected ids, and then again with a full recompute forced for
+ * every change, which is what every change used to cost.
+ */
+#define BENCH_DEGREE	4
+#define BENCH_UPDATES	100
+
+static uint64_t bench_updates(struct loc_rib *rib, struct bench_graph *g,
+			      struct bench_tree *t, int full)
+{
+	uint64_t start;
+	int i;
+
+	start = now_us();
+	for (i = 0; i < BENCH_UPDATES; i++) {
+		struct bench_graph_node *n;
+		struct lsa *lsa;
+
+		n = bench_graph_change_metric(g);
+		lsa = bench_node_lsa(g, n - g->nodes, t);
+
+		if (full)
+			rib->recompute_all = 1;
+		loc_rib_mod_lsa(rib, n->lsas[0], lsa);
+		lsa_put(n->lsas[0]);
+		n->lsas[0] = lsa;
+
+		iv_main();
+	}
+
+	return now_us() - start;
+}
+
+static int bench_loc_rib_graph(int num_nodes)
+{
+	struct bench_graph g;
+	struct bench_tree t;
+	struct loc_rib rib;
+	uint64_t start;
+	uint64_t initial_us;
+	uint64_t incremental_us;
+	uint64_t full_us;
+	int i;
+
+	if (bench_graph_init(&g, num_nodes, BENCH_DEGREE) < 0) {
+		fprintf(stderr, "bench_loc_rib: error allocating memory for "
+				"%d nodes\n", num_nodes);
+		return -1;
+	}
+
+	if (bench_graph_alloc_lsas(&g, 1) < 0 ||
+	    bench_tree_init(&t, &g, 0) < 0) {
+		fprintf(stderr, "bench_loc_rib: error allocating memory\n");
+		bench_graph_deinit(&g);
+		return -1;
+	}
+
+	rib.myid = g.nodes[0].id;
+	loc_rib_init(&rib);
+
+	start = now_us();
+	for (i = 0; i < num_nodes; i++) {
+		g.nodes[i].lsas[0] = bench_node_lsa(&g, i, &t);
+		loc_rib_add_lsa(&rib, g.nodes[i].lsas[0]);
+	}
+	iv_main();
+	initial_us = now_us() - start;
+
+	incremental_us = bench_updates(&rib, &g, &t, 0);
+	full_us = bench_updates(&rib, &g, &t, 1);
+
+	printf("%8d nodes: initial %10.3f ms, per update: incremental "
+	       "%8.3f ms, full %8.3f ms\n", num_nodes, initial_us / 1000.0,
+	       incremental_us / 1000.0 / BENCH_UPDATES,
+	       full_us / 1000.0 / BENCH_UPDATES);
+
+	loc_rib_deinit(&rib);
+	for (i = 0; i < num_nodes; i++)
+		lsa_put(g.nodes[i].lsas[0]);
+
+	bench_tree_deinit(&t);
+	bench_graph_deinit(&g);
+
+	return 0;
+}
+
+int bench_loc_rib(const char *nodes)
+{
+	int num;
+	int ret;
+
+	srandom(1);
+
+	iv_init();
+
+	ret = 0;
+	if (nodes != NULL) {
+		num = atoi(nodes);
+		if (num < 2) {
+			fprintf(stderr, "bench_loc_rib: need at least "
+					"2 nodes\n");
+			ret = 1;
+		} else {
+			ret = !!bench_loc_rib_graph(num);
+		}
+	} else {
+		for (num = 1000; num <= 100000; num *= 10) {
+			if (bench_loc_rib_graph(num) < 0) {
+				ret = 1;
+				break;
+			}
+		}
+	}
+
+	iv_deinit();
+
+	return ret;
+}
@@ -0,0 +1,230 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include "bench.h"
+#include "lsa.h"
+#include "lsa_deserialise.h"
+#include "lsa_serialise.h"
+#include "lsa_type.h"
+
+/*
+ * Deserialises, looks up every PEER attribute of, and frees
+ * BENCH_ATTRS / (peers + 10) LSAs that each carry the given number
+ * of PEER attributes, plus an ADV_PATH, NODE_NAME, VERSION, PUBKEY
+ * and SIGNATURE attribute of realistic sizes.  Every LSA has its own
+ * version, so no bodies are shared.
+ */
+#define BENCH_ATTRS	200000
+
+static void bench_peer_id(uint8_t *id, int i)
+{
+	memset(id, 0, NODE_ID_LEN);
+	id[0] = i >> 8;
+	id[1] = i & 0xff;
+	id[NODE_ID_LEN - 1] = 0x07;
+}
+
+static uint8_t *bench_lsa_wire(int num_peers, uint32_t version, size_t *len)
+{
+	static uint8_t dummy[550];
+	uint8_t id[NODE_ID_LEN];
+	struct lsa_builder b;
+	uint32_t t32[2];
+	struct lsa *lsa;
+	size_t serlen;
+	uint8_t *buf;
+	int i;
+
+	memset(id, 0x42, sizeof(id));
+	memset(dummy, 0x5a, sizeof(dummy));
+
+	lsa_builder_init(&b, id);
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_ADV_PATH, 0,
+			     NULL, 0, dummy, 2 * NODE_ID_LEN);
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_NODE_NAME, 1,
+			     NULL, 0, "bench", 5);
+
+	t32[0] = 0;
+	t32[1] = htonl(version);
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_VERSION, 1,
+			     NULL, 0, t32, sizeof(t32));
+
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_PUBKEY, 1,
+			     NULL, 0, dummy, 550);
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_SIGNATURE, 0,
+			     NULL, 0, dummy, 512);
+
+	for (i = 0; i < num_peers; i++) {
+		uint8_t peerid[NODE_ID_LEN];
+		uint16_t metric;
+		uint8_t peer_flags;
+		int set;
+
+		bench_peer_id(peerid, i);
+		set = lsa_builder_add_attr_set(&b, LSA_BUILDER_ROOT,
+					       LSA_ATTR_TYPE_PEER, 1,
+					       peerid, NODE_ID_LEN);
+
+		metric = htons(10);
+		lsa_builder_add_attr(&b, set, LSA_PEER_ATTR_TYPE_METRIC, 1,
+				     NULL, 0, &metric, sizeof(metric));
+
+		peer_flags = LSA_PEER_FLAGS_CUSTOMER | LSA_PEER_FLAGS_TRANSIT;
+		lsa_builder_add_attr(&b, set, LSA_PEER_ATTR_TYPE_PEER_FLAGS, 1,
+				     NULL, 0, &peer_flags, sizeof(peer_flags));
+	}
+
+	lsa = lsa_builder_finish(&b);
+	lsa_builder_deinit(&b);
+	if (lsa == NULL)
+		return NULL;
+
+	serlen = lsa_serialise_length(lsa, 0, NULL);
+
+	buf = malloc(serlen + 16);
+	if (buf != NULL)
+		*len = lsa_serialise(buf, serlen + 16, serlen, lsa, 0, NULL);
+
+	lsa_put(lsa);
+
+	return buf;
+}
+
+static int bench_lsa_peers(int num_peers)
+{
+	int num_lsas;
+	uint8_t **bufs;
+	size_t *lens;
+	struct lsa **lsas;
+	uint64_t start;
+	uint64_t build_us;
+	uint64_t lookup_us;
+	uint64_t free_us;
+	uint64_t bytes;
+	int found;
+	int ret;
+	int i;
+
+	num_lsas = BENCH_ATTRS / (num_peers + 10);
+	if (num_lsas < 1)
+		num_lsas = 1;
+
+	bufs = calloc(num_lsas, sizeof(*bufs));
+	lens = calloc(num_lsas, sizeof(*lens));
+	lsas = calloc(num_lsas, sizeof(*lsas));
+	if (bufs == NULL || lens == NULL || lsas == NULL)
+		goto err;
+
+	bytes = 0;
+	for (i = 0; i < num_lsas; i++) {
+		bufs[i] = bench_lsa_wire(num_peers, i + 1, &lens[i]);
+		if (bufs[i] == NULL)
+			goto err;
+		bytes += lens[i];
+	}
+
+	start = now_us();
+	for (i = 0; i < num_lsas; i++) {
+		if (lsa_deserialise(&lsas[i], bufs[i], lens[i]) != lens[i]) {
+			fprintf(stderr, "bench_lsa: error deserialising "
+					"LSA\n");
+			abort();
+		}
+	}
+	build_us = now_us() - start;
+
+	found = 0;
+	start = now_us();
+	for (i = 0; i < num_lsas; i++) {
+		int j;
+
+		for (j = 0; j < num_peers; j++) {
+			uint8_t peerid[NODE_ID_LEN];
+
+			bench_peer_id(peerid, j);
+			if (lsa_find_attr(lsas[i], LSA_ATTR_TYPE_PEER,
+					  peerid, NODE_ID_LEN) != NULL) {
+				found++;
+			}
+		}
+	}
+	lookup_us = now_us() - start;
+
+	start = now_us();
+	for (i = 0; i < num_lsas; i++)
+		lsa_put(lsas[i]);
+	free_us = now_us() - start;
+
+	printf("%6d peers %7d LSAs: build %9.2f us/LSA (%7.1f MB/s), "
+	       "lookup %7.1f ns, free %8.2f us/LSA\n", num_peers, num_lsas,
+	       (double)build_us / num_lsas,
+	       build_us ? (double)bytes / build_us : 0.0,
+	       num_peers ? 1000.0 * lookup_us / num_lsas / num_peers : 0.0,
+	       (double)free_us / num_lsas);
+
+	ret = (found == num_lsas * num_peers) ? 0 : -1;
+	if (ret < 0)
+		fprintf(stderr, "bench_lsa: PEER attribute lookup failed\n");
+
+	goto out;
+
+err:
+	fprintf(stderr, "bench_lsa: error allocating memory for %d peers\n",
+		num_peers);
+	ret = -1;
+
+out:
+	if (bufs != NULL) {
+		for (i = 0; i < num_lsas; i++)
+			free(bufs[i]);
+	}
+	free(bufs);
+	free(lens);
+	free(lsas);
+
+	return ret;
+}
+
+int bench_lsa(const char *peers)
+{
+	int num;
+
+	if (peers != NULL) {
+		num = atoi(peers);
+		if (num < 0 || num > 65535) {
+			fprintf(stderr, "bench_lsa: need between 0 and 65535 "
+					"peers\n");
+			return 1;
+		}
+
+		return !!bench_lsa_peers(num);
+	}
+
+	for (num = 10; num <= 1000; num *= 10) {
+		if (bench_lsa_peers(num) < 0)
+			return 1;
+	}
+
+	return 0;
+}
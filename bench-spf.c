@@ -0,0 +1,180 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include "bench.h"
+#include "spf.h"
+#include "util.h"
+
+/*
+ * Runs spf_run() and spf_update() on randomly generated graphs in
+ * which every node peers with BENCH_DEGREE other nodes on average.
+ */
+#define BENCH_DEGREE	4
+#define BENCH_UPDATES	1000
+
+struct bench_node {
+	uint8_t			id[NODE_ID_LEN];
+	struct spf_node		node;
+};
+
+struct bench_edge {
+	struct spf_node		*from;
+	struct spf_edge		edge;
+};
+
+static int bench_spf_graph(int num_nodes)
+{
+	struct spf_context ctx;
+	struct bench_node *nodes;
+	struct bench_edge *edges;
+	int num_edges;
+	uint64_t start;
+	uint64_t full_us;
+	uint64_t update_us;
+	int reached;
+	int i;
+
+	nodes = malloc(num_nodes * sizeof(*nodes));
+	num_edges = num_nodes * BENCH_DEGREE;
+	edges = malloc(num_edges * sizeof(*edges));
+	if (nodes == NULL || edges == NULL) {
+		fprintf(stderr, "bench_spf: error allocating memory for "
+				"%d nodes\n", num_nodes);
+		free(nodes);
+		free(edges);
+		return -1;
+	}
+
+	spf_init(&ctx);
+
+	for (i = 0; i < num_nodes; i++) {
+		struct bench_node *n = &nodes[i];
+		int j;
+
+		for (j = 0; j < NODE_ID_LEN; j++)
+			n->id[j] = random();
+
+		n->node.id = n->id;
+		n->node.cookie = n;
+		spf_node_add(&ctx, &n->node);
+	}
+
+	/*
+	 * Edges come in pairs, one in each direction, and the first
+	 * pair out of every node goes to the next node, so that the
+	 * graph is connected.
+	 */
+	for (i = 0; i < num_edges; i += 2) {
+		int a;
+		int b;
+		int cost;
+
+		a = (i / 2) % num_nodes;
+		if (i < 2 * num_nodes)
+			b = (a + 1) % num_nodes;
+		else
+			b = random() % num_nodes;
+		if (a == b)
+			b = (a + 1) % num_nodes;
+
+		cost = 1 + random() % 100;
+
+		edges[i].from = &nodes[a].node;
+		edges[i].edge.to = &nodes[b].node;
+		edges[i].edge.cost = cost;
+		spf_edge_add(edges[i].from, &edges[i].edge);
+
+		edges[i + 1].from = &nodes[b].node;
+		edges[i + 1].edge.to = &nodes[a].node;
+		edges[i + 1].edge.cost = cost;
+		spf_edge_add(edges[i + 1].from, &edges[i + 1].edge);
+	}
+
+	start = now_us();
+	spf_run(&ctx, &nodes[0].node);
+	full_us = now_us() - start;
+
+	reached = 0;
+	for (i = 0; i < num_nodes; i++) {
+		if (nodes[i].node.cost != INT_MAX)
+			reached++;
+	}
+
+	/*
+	 * Change the cost of one randomly chosen link at a time, and
+	 * let spf_update() repair the tree.
+	 */
+	start = now_us();
+	for (i = 0; i < BENCH_UPDATES; i++) {
+		struct bench_edge *e;
+		int cost;
+
+		e = &edges[(random() % (num_edges / 2)) * 2];
+		cost = 1 + random() % 100;
+
+		spf_edge_del(e[0].from, &e[0].edge);
+		spf_edge_del(e[1].from, &e[1].edge);
+		e[0].edge.cost = cost;
+		e[1].edge.cost = cost;
+		spf_edge_add(e[0].from, &e[0].edge);
+		spf_edge_add(e[1].from, &e[1].edge);
+
+		spf_update(&ctx, &nodes[0].node);
+	}
+	update_us = now_us() - start;
+
+	printf("%8d nodes %9d edges: full run %10.3f ms, "
+	       "incremental update %8.3f ms (%d reached)\n",
+	       num_nodes, num_edges, full_us / 1000.0,
+	       update_us / 1000.0 / BENCH_UPDATES, reached);
+
+	free(edges);
+	free(nodes);
+
+	return 0;
+}
+
+int bench_spf(const char *nodes)
+{
+	int num;
+
+	srandom(1);
+
+	if (nodes != NULL) {
+		num = atoi(nodes);
+		if (num < 2) {
+			fprintf(stderr, "bench_spf: need at least 2 nodes\n");
+			return 1;
+		}
+
+		return !!bench_spf_graph(num);
+	}
+
+	for (num = 1000; num <= 100000; num *= 10) {
+		if (bench_spf_graph(num) < 0)
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,460 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+#include <gnutls/x509.h>
+#include <iv.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "adj_rib_in.h"
+#include "bench.h"
+#include "dgp_reader.h"
+#include "loc_rib.h"
+#include "lsa.h"
+#include "lsa_deserialise.h"
+#include "lsa_serialise.h"
+#include "lsa_type.h"
+#include "util.h"
+#include "x509.h"
+
+/*
+ * Times the initial sync of an LSDB from a new peer, once by
+ * deserialising and applying every LSA inline, as dgp_reader used
+ * to, and once through dgp_reader, which verifies signatures on its
+ * work pool.  Both passes get LSAs with their own signatures, so
+ * neither is helped by the signature cache.
+ *
+ * Generating thousands of RSA keys would take longer than the
+ * benchmark itself, so the LSAs are spread over BENCH_ORIGINS nodes,
+ * each advertising a series of versions.  That costs as many
+ * signature verifications as a sync of as many different nodes.
+ */
+#define BENCH_LSAS	5000
+#define BENCH_ORIGINS	16
+
+struct bench_stream {
+	uint8_t			*buf;
+	size_t			len;
+	size_t			off;
+};
+
+static gnutls_x509_privkey_t keys[BENCH_ORIGINS];
+static uint8_t ids[BENCH_ORIGINS][NODE_ID_LEN];
+static uint8_t myid[NODE_ID_LEN];
+static uint8_t remoteid[NODE_ID_LEN];
+
+static struct lsa *bench_lsa(int origin, uint32_t version)
+{
+	struct lsa_builder b;
+	uint8_t buf[4096];
+	uint32_t t32[2];
+	const uint8_t *data;
+	size_t len;
+	gnutls_privkey_t pk;
+	gnutls_datum_t d;
+	gnutls_datum_t sig;
+	struct lsa *lsa;
+	int ret;
+
+	lsa_builder_init(&b, ids[origin]);
+
+	ret = x509_privkey_to_der_pubkey(buf, sizeof(buf), keys[origin]);
+	if (ret < 0)
+		abort();
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_PUBKEY, 1,
+			     NULL, 0, buf, ret);
+
+	t32[0] = 0;
+	t32[1] = htonl(version);
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_VERSION, 1,
+			     NULL, 0, t32, sizeof(t32));
+
+	lsa = lsa_builder_finish(&b);
+	if (lsa == NULL)
+		abort();
+
+	data = lsa_serialise_signed(lsa, &len);
+	if (data == NULL)
+		abort();
+
+	if (gnutls_privkey_init(&pk) < 0)
+		abort();
+
+	if (gnutls_privkey_import_x509(pk, keys[origin], 0) < 0)
+		abort();
+
+	d.data = (void *)data;
+	d.size = len;
+	if (gnutls_privkey_sign_data(pk, GNUTLS_DIG_SHA256, 0, &d, &sig) < 0)
+		abort();
+
+	gnutls_privkey_deinit(pk);
+
+	lsa_put(lsa);
+
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_SIGNATURE, 0,
+			     NULL, 0, sig.data, sig.size);
+	gnutls_free(sig.data);
+
+	/*
+	 * The peer prepends its own id when it sends the LSA to us.
+	 */
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_ADV_PATH, 0,
+			     NULL, 0, ids[origin], NODE_ID_LEN);
+
+	lsa = lsa_builder_finish(&b);
+	if (lsa == NULL)
+		abort();
+
+	lsa_builder_deinit(&b);
+
+	return lsa;
+}
+
+static int bench_stream_init(struct bench_stream *s, int num, int first)
+{
+	size_t size;
+	int i;
+
+	size = 0;
+	s->buf = NULL;
+	s->len = 0;
+	s->off = 0;
+
+	for (i = 0; i < num; i++) {
+		struct lsa *lsa;
+		size_t serlen;
+
+		lsa = bench_lsa(i % BENCH_ORIGINS, first + i / BENCH_ORIGINS);
+
+		serlen = lsa_serialise_length(lsa, 0, remoteid);
+		if (s->len + serlen + MAX_SERIALISED_INT_LEN > size) {
+			uint8_t *buf;
+
+			size = 2 * (s->len + serlen + MAX_SERIALISED_INT_LEN);
+
+			buf = realloc(s->buf, size);
+			if (buf == NULL) {
+				lsa_put(lsa);
+				free(s->buf);
+				return -1;
+			}
+			s->buf = buf;
+		}
+
+		s->len += lsa_serialise(s->buf + s->len, size - s->len,
+					serlen, lsa, 0, remoteid);
+
+		lsa_put(lsa);
+	}
+
+	return 0;
+}
+
+static int applied;
+
+static void count_lsa_add(void *cookie, struct lsa *a, uint32_t cost)
+{
+	applied++;
+}
+
+static void count_lsa_mod(void *cookie, struct lsa *a, uint32_t acost,
+			  struct lsa *b, uint32_t bcost)
+{
+	applied++;
+}
+
+static void count_lsa_del(void *cookie, struct lsa *a, uint32_t cost)
+{
+}
+
+static struct rib_listener count = {
+	.lsa_add	= count_lsa_add,
+	.lsa_mod	= count_lsa_mod,
+	.lsa_del	= count_lsa_del,
+};
+
+static int bench_inline(struct bench_stream *s, int num)
+{
+	struct adj_rib_in rib;
+	uint64_t start;
+	uint64_t us;
+
+	rib.myid = myid;
+	rib.remoteid = remoteid;
+	adj_rib_in_init(&rib);
+	adj_rib_in_listener_register(&rib, &count);
+
+	applied = 0;
+
+	start = now_us();
+	while (s->off < s->len) {
+		struct lsa *lsa;
+		int len;
+
+		len = lsa_deserialise(&lsa, s->buf + s->off, s->len - s->off);
+		if (len <= 0 || lsa == NULL)
+			abort();
+		s->off += len;
+
+		adj_rib_in_add_lsa(&rib, lsa, -1);
+		lsa_put(lsa);
+	}
+	us = now_us() - start;
+
+	adj_rib_in_listener_unregister(&rib, &count);
+	adj_rib_in_truncate(&rib);
+
+	if (applied != num) {
+		fprintf(stderr, "bench_sync: %d of %d LSAs applied\n",
+			applied, num);
+		return -1;
+	}
+
+	printf("inline:     %8.3f ms\n", us / 1000.0);
+
+	return 0;
+}
+
+static struct bench_stream *ws;
+static int pipelined_num;
+static struct iv_fd wfd;
+static struct iv_fd rfd;
+static struct dgp_reader dr;
+static struct loc_rib loc_rib;
+static struct iv_task done;
+static int failed;
+
+static void bench_stop(void)
+{
+	if (iv_fd_registered(&wfd)) {
+		iv_fd_unregister(&wfd);
+		close(wfd.fd);
+	}
+
+	if (iv_fd_registered(&rfd)) {
+		dgp_reader_unregister(&dr);
+		iv_fd_unregister(&rfd);
+		close(rfd.fd);
+	}
+}
+
+static void got_write(void *cookie)
+{
+	int ret;
+
+	ret = write(wfd.fd, ws->buf + ws->off, ws->len - ws->off);
+	if (ret < 0) {
+		if (errno == EAGAIN)
+			return;
+		perror("write");
+		failed = 1;
+		bench_stop();
+		return;
+	}
+
+	ws->off += ret;
+	if (ws->off == ws->len)
+		iv_fd_set_handler_out(&wfd, NULL);
+}
+
+static void got_read(void *cookie)
+{
+	if (dgp_reader_read(&dr) < 0)
+		dr.io_error(dr.cookie);
+}
+
+static void reader_io_error(void *cookie)
+{
+	fprintf(stderr, "bench_sync: read error\n");
+	failed = 1;
+	bench_stop();
+}
+
+/*
+ * The counting listener runs from inside dgp_reader, which can't be
+ * unregistered from there.
+ */
+static void pipelined_lsa_add(void *cookie, struct lsa *a, uint32_t cost)
+{
+	count_lsa_add(cookie, a, cost);
+	if (applied == pipelined_num && !iv_task_registered(&done))
+		iv_task_register(&done);
+}
+
+static void pipelined_lsa_mod(void *cookie, struct lsa *a, uint32_t acost,
+			      struct lsa *b, uint32_t bcost)
+{
+	count_lsa_mod(cookie, a, acost, b, bcost);
+	if (applied == pipelined_num && !iv_task_registered(&done))
+		iv_task_register(&done);
+}
+
+static void pipelined_done(void *cookie)
+{
+	bench_stop();
+}
+
+static int bench_pipelined(struct bench_stream *s, int num)
+{
+	struct rib_listener rl;
+	uint64_t start;
+	uint64_t us;
+	int fd[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0) {
+		perror("socketpair");
+		return -1;
+	}
+
+	ws = s;
+	pipelined_num = num;
+	applied = 0;
+	failed = 0;
+
+	loc_rib.myid = myid;
+	loc_rib_init(&loc_rib);
+
+	IV_TASK_INIT(&done);
+	done.handler = pipelined_done;
+
+	IV_FD_INIT(&wfd);
+	wfd.fd = fd[0];
+	wfd.handler_out = got_write;
+	iv_fd_register(&wfd);
+
+	IV_FD_INIT(&rfd);
+	rfd.fd = fd[1];
+	rfd.handler_in = got_read;
+	iv_fd_register(&rfd);
+
+	dr.fd = &rfd;
+	dr.myid = myid;
+	dr.remoteid = remoteid;
+	dr.rib = &loc_rib;
+	dr.cookie = NULL;
+	dr.io_error = reader_io_error;
+	dgp_reader_register(&dr);
+
+	rl.cookie = NULL;
+	rl.lsa_add = pipelined_lsa_add;
+	rl.lsa_mod = pipelined_lsa_mod;
+	rl.lsa_del = count_lsa_del;
+	adj_rib_in_listener_register(&dr.adj_rib_in, &rl);
+
+	start = now_us();
+	iv_main();
+	us = now_us() - start;
+
+	if (iv_task_registered(&done))
+		iv_task_unregister(&done);
+
+	loc_rib_deinit(&loc_rib);
+
+	if (failed || applied != num) {
+		fprintf(stderr, "bench_sync: %d of %d LSAs applied\n",
+			applied, num);
+		return -1;
+	}
+
+	printf("pipelined:  %8.3f ms (%ld CPUs)\n", us / 1000.0,
+	       sysconf(_SC_NPROCESSORS_ONLN));
+
+	return 0;
+}
+
+int bench_sync(const char *lsas)
+{
+	struct bench_stream s[2];
+	int num;
+	int ret;
+	int i;
+
+	num = BENCH_LSAS;
+	if (lsas != NULL) {
+		num = atoi(lsas);
+		if (num < 1) {
+			fprintf(stderr, "bench_sync: need at least 1 LSA\n");
+			return 1;
+		}
+	}
+
+	gnutls_global_init();
+
+	memset(myid, 0xee, NODE_ID_LEN);
+	memset(remoteid, 0x01, NODE_ID_LEN);
+
+	for (i = 0; i < BENCH_ORIGINS; i++) {
+		ret = gnutls_x509_privkey_init(&keys[i]);
+		if (ret < 0) {
+			fprintf(stderr, "gnutls_x509_privkey_init: ");
+			gnutls_perror(ret);
+			return 1;
+		}
+
+		ret = gnutls_x509_privkey_generate(keys[i], GNUTLS_PK_RSA,
+						   2048, 0);
+		if (ret < 0) {
+			fprintf(stderr, "gnutls_x509_privkey_generate: ");
+			gnutls_perror(ret);
+			return 1;
+		}
+
+		if (x509_get_privkey_id(ids[i], keys[i]) < 0)
+			return 1;
+	}
+
+	if (bench_stream_init(&s[0], num, 1) < 0) {
+		fprintf(stderr, "bench_sync: error allocating memory\n");
+		return 1;
+	}
+
+	if (bench_stream_init(&s[1], num, 1 + num) < 0) {
+		fprintf(stderr, "bench_sync: error allocating memory\n");
+		free(s[0].buf);
+		return 1;
+	}
+
+	printf("%d LSAs, %zu bytes:\n", num, s[0].len);
+
+	iv_init();
+
+	ret = 0;
+	if (bench_inline(&s[0], num) < 0 || bench_pipelined(&s[1], num) < 0)
+		ret = 1;
+
+	iv_deinit();
+
+	free(s[0].buf);
+	free(s[1].buf);
+
+	for (i = 0; i < BENCH_ORIGINS; i++)
+		gnutls_x509_privkey_deinit(keys[i]);
+
+	gnutls_global_deinit();
+
+	return ret;
+}
@@ -0,0 +1,1109 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <iv.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "bench.h"
+#include "conf.h"
+#include "tconn.h"
+#include "tconn_connect.h"
+#include "tconn_listen.h"
+#include "tls_prio.h"
+#include "udp_chan.h"
+#include "util.h"
+#include "x509.h"
+
+/*
+ * Pushes bulk traffic through a pair of tconns connected to each
+ * other over loopback TCP, for the given number of seconds, and
+ * reports the goodput seen by the receiving side.  The sender
+ * submits records of BENCH_FRAMES frames of BENCH_FRAME_LEN bytes
+ * each, as the tun reader does for full-sized packets, and keeps
+ * BENCH_BACKLOG bytes waiting in the egress queue, as a sender that
+ * is faster than the link would, but without causing tail drops.
+ *
+ * Meanwhile, every BENCH_PROBE_MS, the sender sends a timestamped
+ * probe frame in the control class, as keepalives are, and one in
+ * the interactive class, and the receiver reports the latency and
+ * the RFC 3550 interarrival jitter of each, which shows how well
+ * these are isolated from the bulk load.
+ *
+ * The handshake storm pass repeats the userspace TLS pass while
+ * BENCH_STORM other tconn pairs continuously handshake, each pair
+ * reconnecting as soon as its handshake has completed, to show how
+ * much the handshakes disturb an established session.
+ *
+ * This is done once with userspace TLS, once with kernel TLS, and
+ * once over a udp_chan keyed from the TLS session, which carries one
+ * frame per datagram and has no backpressure, so that its goodput
+ * shows how many datagrams were lost.  "make bench-netem" runs this
+ * under a range of netem loss rates on the loopback interface.
+ *
+ * Finally, the reconnect pass connects BENCH_PEERS tconn_connects to
+ * a single tconn_listen_socket, disconnects all of them at once, and
+ * reports how long it takes until all of them are connected again,
+ * and how much CPU time that took.  This is done with the peers
+ * forgetting their sessions, so that every reconnect is a full
+ * handshake, with the peers resuming their sessions, and twice after
+ * the listen socket was torn down and set up again, as when the hub
+ * restarts: once with its session ticket key kept in a file, and once
+ * without, so that the peers' tickets are no longer accepted.  The
+ * time until all peers are back includes the two second wait before
+ * tconn_connect retries.  The hub has a 4096 bit RSA key, and each
+ * peer has an ECDSA key, so that generating them doesn't take longer
+ * than the benchmark itself.
+ */
+#define BENCH_SECONDS		5
+#define BENCH_FRAME_LEN		1500
+#define BENCH_FRAMES		10
+#define BENCH_BURST		16
+#define BENCH_BACKLOG		(TCONN_TXQ_DEFAULT_LIMIT / 2)
+#define BENCH_PROBE_MS		10
+#define BENCH_STORM		16
+#define BENCH_PEERS		1000
+
+#define FRAME_BULK		0x00
+#define FRAME_PROBE		0x01
+#define PROBE_LEN		9
+
+#define BENCH_MODE_TLS		0
+#define BENCH_MODE_KTLS		1
+#define BENCH_MODE_UDP		2
+#define BENCH_MODE_STORM	3
+
+struct bench_conn {
+	struct bench_pair	*bp;
+	struct iv_fd		fd;
+	struct tconn		tconn;
+	struct udp_chan		uc;
+	int			up;
+	uint64_t		tx_frames;
+	uint64_t		rx_frames;
+	uint64_t		rx_bytes;
+	uint64_t		probes[TCONN_NUM_CLASSES];
+	uint64_t		probe_us_total[TCONN_NUM_CLASSES];
+	uint64_t		probe_us_max[TCONN_NUM_CLASSES];
+	uint64_t		probe_us_last[TCONN_NUM_CLASSES];
+	uint64_t		probe_jitter[TCONN_NUM_CLASSES];
+};
+
+struct bench_pair {
+	struct bench_conn	client;
+	struct bench_conn	server;
+	int			seconds;
+	int			mode;
+	uint64_t		start;
+	struct iv_task		tx_task;
+	struct iv_timer		probe_timer;
+	struct iv_timer		stop_timer;
+	struct bench_pair	*parent;
+	struct iv_task		restart_task;
+	int			handshakes;
+	struct bench_pair	*storm[BENCH_STORM];
+	uint8_t			rec[BENCH_FRAMES * (3 + BENCH_FRAME_LEN)];
+};
+
+static gnutls_x509_privkey_t bench_key;
+static gnutls_x509_crt_t bench_crt;
+
+static int bench_socketpair(int *fds)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	int lfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = 0;
+
+	addrlen = sizeof(addr);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+		perror("bench_socketpair");
+		close(lfd);
+		return -1;
+	}
+
+	fds[0] = socket(AF_INET, SOCK_STREAM, 0);
+	if (fds[0] < 0) {
+		perror("socket");
+		close(lfd);
+		return -1;
+	}
+
+	if (connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		close(fds[0]);
+		close(lfd);
+		return -1;
+	}
+
+	fds[1] = accept(lfd, NULL, NULL);
+	if (fds[1] < 0) {
+		perror("accept");
+		close(fds[0]);
+		close(lfd);
+		return -1;
+	}
+
+	close(lfd);
+
+	return 0;
+}
+
+static int verify_key_ids(void *_bc, const uint8_t *ids, int num)
+{
+	return 0;
+}
+
+static void record_received(void *_bc, const uint8_t *rec, int len);
+
+static int bench_udp_start(struct bench_pair *bp)
+{
+	uint8_t keys[UDP_CHAN_KEYING_LEN];
+	struct sockaddr_storage addr;
+	struct sockaddr_in *a4;
+
+	if (tconn_export_keys(&bp->client.tconn, UDP_CHAN_LABEL,
+			      keys, sizeof(keys)) < 0) {
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	a4 = (struct sockaddr_in *)&addr;
+	a4->sin_family = AF_INET;
+	a4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	bp->client.uc.cookie = &bp->client;
+	bp->client.uc.record_received = record_received;
+	if (udp_chan_start(&bp->client.uc, keys, &addr) < 0)
+		return -1;
+
+	bp->server.uc.cookie = &bp->server;
+	bp->server.uc.record_received = record_received;
+	if (udp_chan_start(&bp->server.uc, keys, NULL) < 0) {
+		udp_chan_stop(&bp->client.uc);
+		return -1;
+	}
+
+	udp_chan_set_peer_port(&bp->client.uc,
+			       udp_chan_get_port(&bp->server.uc));
+
+	return 0;
+}
+
+static int bench_storm_start(struct bench_pair *bp);
+
+static int handshake_done(void *_bc, char *desc)
+{
+	struct bench_conn *bc = _bc;
+	struct bench_pair *bp = bc->bp;
+
+	bc->up = 1;
+	if (bc == &bp->client && bp->parent == NULL)
+		printf("%s\n", desc);
+
+	if (bp->client.up && bp->server.up) {
+		if (bp->parent != NULL) {
+			iv_task_register(&bp->restart_task);
+			return 0;
+		}
+
+		if (bp->mode == BENCH_MODE_UDP && bench_udp_start(bp) < 0)
+			abort();
+
+		if (bp->mode == BENCH_MODE_STORM && bench_storm_start(bp) < 0)
+			abort();
+
+		bp->start = now_us();
+
+		iv_task_register(&bp->tx_task);
+
+		iv_validate_now();
+		if (bp->mode != BENCH_MODE_UDP) {
+			bp->probe_timer.expires = iv_now;
+			iv_timer_register(&bp->probe_timer);
+		}
+
+		bp->stop_timer.expires = iv_now;
+		bp->stop_timer.expires.tv_sec += bp->seconds;
+		iv_timer_register(&bp->stop_timer);
+	}
+
+	return 0;
+}
+
+static void probe_received(struct bench_conn *bc, const uint8_t *p)
+{
+	uint64_t sent;
+	uint64_t us;
+	int class;
+	int i;
+
+	class = p[0];
+	if (class >= TCONN_NUM_CLASSES)
+		return;
+
+	sent = 0;
+	for (i = 1; i < PROBE_LEN; i++)
+		sent = (sent << 8) | p[i];
+
+	us = now_us() - sent;
+
+	/*
+	 * As in RFC 3550, the jitter is kept scaled up by a factor 16.
+	 */
+	if (bc->probes[class]) {
+		uint64_t d;
+
+		if (us > bc->probe_us_last[class])
+			d = us - bc->probe_us_last[class];
+		else
+			d = bc->probe_us_last[class] - us;
+
+		bc->probe_jitter[class] += d;
+		bc->probe_jitter[class] -= (bc->probe_jitter[class] + 8) >> 4;
+	}
+	bc->probe_us_last[class] = us;
+
+	bc->probes[class]++;
+	bc->probe_us_total[class] += us;
+	if (us > bc->probe_us_max[class])
+		bc->probe_us_max[class] = us;
+}
+
+static void record_received(void *_bc, const uint8_t *rec, int len)
+{
+	struct bench_conn *bc = _bc;
+
+	bc->rx_bytes += len;
+
+	while (len >= 3) {
+		int flen;
+
+		flen = 3 + ((rec[1] << 8) | rec[2]);
+		if (flen > len)
+			break;
+
+		if (rec[0] == FRAME_BULK)
+			bc->rx_frames++;
+		else if (rec[0] == FRAME_PROBE && flen == 3 + PROBE_LEN)
+			probe_received(bc, rec + 3);
+
+		rec += flen;
+		len -= flen;
+	}
+}
+
+static void connection_lost(void *_bc)
+{
+	fprintf(stderr, "bench_tconn: connection lost\n");
+	abort();
+}
+
+static int txq_backlog(struct tconn *tc)
+{
+	struct tconn_txq_stats st[TCONN_NUM_CLASSES];
+	int backlog;
+	int i;
+
+	tconn_get_txq_stats(tc, st);
+
+	backlog = 0;
+	for (i = 0; i < TCONN_NUM_CLASSES; i++)
+		backlog += st[i].backlog;
+
+	return backlog;
+}
+
+static void send_probe(struct tconn *tc, int class)
+{
+	uint8_t rec[3 + PROBE_LEN];
+	uint64_t now;
+	int i;
+
+	rec[0] = FRAME_PROBE;
+	rec[1] = 0x00;
+	rec[2] = PROBE_LEN;
+	rec[3] = class;
+
+	now = now_us();
+	for (i = PROBE_LEN - 1; i >= 1; i--) {
+		rec[3 + i] = now & 0xff;
+		now >>= 8;
+	}
+
+	if (tconn_record_send(tc, class, rec, sizeof(rec)) < 0) {
+		fprintf(stderr, "bench_tconn: tconn_record_send failed\n");
+		abort();
+	}
+}
+
+static void probe_timer_expired(void *_bp)
+{
+	struct bench_pair *bp = _bp;
+
+	send_probe(&bp->client.tconn, TCONN_CLASS_CONTROL);
+	send_probe(&bp->client.tconn, TCONN_CLASS_INTERACTIVE);
+
+	timespec_add_ms(&bp->probe_timer.expires,
+			BENCH_PROBE_MS, BENCH_PROBE_MS);
+	iv_timer_register(&bp->probe_timer);
+}
+
+static void tx_task_handler(void *_bp)
+{
+	struct bench_pair *bp = _bp;
+	struct tconn *tc = &bp->client.tconn;
+	int i;
+
+	if (bp->mode == BENCH_MODE_UDP) {
+		for (i = 0; i < BENCH_BURST; i++) {
+			udp_chan_send(&bp->client.uc, bp->rec,
+				      3 + BENCH_FRAME_LEN);
+		}
+		udp_chan_flush(&bp->client.uc);
+		bp->client.tx_frames += BENCH_BURST;
+
+		iv_task_register(&bp->tx_task);
+
+		return;
+	}
+
+	for (i = 0; i < BENCH_BURST && txq_backlog(tc) < BENCH_BACKLOG; i++) {
+		if (tconn_record_send(tc, TCONN_CLASS_BULK,
+				      bp->rec, sizeof(bp->rec)) < 0) {
+			fprintf(stderr, "bench_tconn: tconn_record_send "
+					"failed\n");
+			abort();
+		}
+		bp->client.tx_frames += BENCH_FRAMES;
+	}
+
+	iv_task_register(&bp->tx_task);
+}
+
+static void bench_conn_destroy(struct bench_conn *bc)
+{
+	if (bc->bp->mode == BENCH_MODE_UDP)
+		udp_chan_stop(&bc->uc);
+	tconn_destroy(&bc->tconn);
+	iv_fd_unregister(&bc->fd);
+	close(bc->fd.fd);
+}
+
+static void bench_storm_stop(struct bench_pair *bp);
+
+static void stop_timer_expired(void *_bp)
+{
+	struct bench_pair *bp = _bp;
+	struct tconn_txq_stats st[TCONN_NUM_CLASSES];
+	uint64_t usec;
+	int i;
+
+	usec = now_us() - bp->start;
+
+	tconn_get_txq_stats(&bp->client.tconn, st);
+
+	printf("%llu bytes in %llu us: %.1f MB/s, %llu frames sent, "
+	       "%llu received, %llu tail drops, %llu codel drops\n",
+	       (unsigned long long)bp->server.rx_bytes,
+	       (unsigned long long)usec,
+	       (double)bp->server.rx_bytes / usec,
+	       (unsigned long long)bp->client.tx_frames,
+	       (unsigned long long)bp->server.rx_frames,
+	       (unsigned long long)st[TCONN_CLASS_BULK].tail_drops,
+	       (unsigned long long)st[TCONN_CLASS_BULK].codel_drops);
+
+	for (i = 0; i < TCONN_NUM_CLASSES; i++) {
+		uint64_t n = bp->server.probes[i];
+
+		if (!n)
+			continue;
+
+		printf("  class %d probes: %llu, latency avg %llu us, "
+		       "max %llu us, jitter %llu us\n", i,
+		       (unsigned long long)n,
+		       (unsigned long long)(bp->server.probe_us_total[i] / n),
+		       (unsigned long long)bp->server.probe_us_max[i],
+		       (unsigned long long)(bp->server.probe_jitter[i] >> 4));
+	}
+
+	if (bp->mode == BENCH_MODE_STORM) {
+		printf("  %d handshakes completed by %d other pairs\n",
+		       bp->handshakes, BENCH_STORM);
+		bench_storm_stop(bp);
+	}
+
+	if (iv_timer_registered(&bp->probe_timer))
+		iv_timer_unregister(&bp->probe_timer);
+
+	if (iv_task_registered(&bp->tx_task))
+		iv_task_unregister(&bp->tx_task);
+
+	bench_conn_destroy(&bp->client);
+	bench_conn_destroy(&bp->server);
+}
+
+static void bench_conn_init(struct bench_pair *bp, struct bench_conn *bc,
+			    int fd, int role)
+{
+	bc->bp = bp;
+
+	IV_FD_INIT(&bc->fd);
+	bc->fd.fd = fd;
+	iv_fd_register(&bc->fd);
+
+	bc->tconn.fd = &bc->fd;
+	bc->tconn.role = role;
+	bc->tconn.mykey = bench_key;
+	bc->tconn.numcrts = 1;
+	bc->tconn.mycrts = &bench_crt;
+	bc->tconn.cookie = bc;
+	bc->tconn.ktls = (bp->mode == BENCH_MODE_KTLS);
+	bc->tconn.txq_limit = 0;
+	bc->tconn.ciphers = NULL;
+	bc->tconn.session_data = NULL;
+	bc->tconn.ticket_key = NULL;
+	bc->tconn.verify_key_ids = verify_key_ids;
+	bc->tconn.handshake_done = handshake_done;
+	bc->tconn.record_received = record_received;
+	bc->tconn.connection_lost = connection_lost;
+
+	bc->up = 0;
+	bc->tx_frames = 0;
+	bc->rx_frames = 0;
+	bc->rx_bytes = 0;
+	memset(bc->probes, 0, sizeof(bc->probes));
+	memset(bc->probe_us_total, 0, sizeof(bc->probe_us_total));
+	memset(bc->probe_us_max, 0, sizeof(bc->probe_us_max));
+	memset(bc->probe_us_last, 0, sizeof(bc->probe_us_last));
+	memset(bc->probe_jitter, 0, sizeof(bc->probe_jitter));
+}
+
+static int bench_pair_start(struct bench_pair *bp)
+{
+	int fds[2];
+
+	if (bench_socketpair(fds) < 0)
+		return -1;
+
+	bench_conn_init(bp, &bp->client, fds[0], TCONN_ROLE_CLIENT);
+	bench_conn_init(bp, &bp->server, fds[1], TCONN_ROLE_SERVER);
+
+	if (tconn_start(&bp->server.tconn) < 0 ||
+	    tconn_start(&bp->client.tconn) < 0) {
+		fprintf(stderr, "bench_tconn: tconn_start failed\n");
+		abort();
+	}
+
+	return 0;
+}
+
+static void restart_task_handler(void *_bp)
+{
+	struct bench_pair *bp = _bp;
+
+	bp->parent->handshakes++;
+
+	bench_conn_destroy(&bp->client);
+	bench_conn_destroy(&bp->server);
+
+	if (bench_pair_start(bp) < 0)
+		abort();
+}
+
+static int bench_storm_start(struct bench_pair *bp)
+{
+	int i;
+
+	for (i = 0; i < BENCH_STORM; i++) {
+		struct bench_pair *sp;
+
+		sp = malloc(sizeof(*sp));
+		if (sp == NULL) {
+			fprintf(stderr, "bench_tconn: error allocating "
+					"memory\n");
+			return -1;
+		}
+
+		sp->mode = BENCH_MODE_TLS;
+		sp->parent = bp;
+
+		IV_TASK_INIT(&sp->restart_task);
+		sp->restart_task.cookie = sp;
+		sp->restart_task.handler = restart_task_handler;
+
+		if (bench_pair_start(sp) < 0) {
+			free(sp);
+			return -1;
+		}
+
+		bp->storm[i] = sp;
+	}
+
+	return 0;
+}
+
+static void bench_storm_stop(struct bench_pair *bp)
+{
+	int i;
+
+	for (i = 0; i < BENCH_STORM; i++) {
+		struct bench_pair *sp = bp->storm[i];
+
+		if (iv_task_registered(&sp->restart_task))
+			iv_task_unregister(&sp->restart_task);
+
+		bench_conn_destroy(&sp->client);
+		bench_conn_destroy(&sp->server);
+
+		free(sp);
+	}
+}
+
+static int bench_tconn_run(int seconds, int mode)
+{
+	struct bench_pair *bp;
+	int i;
+
+	bp = malloc(sizeof(*bp));
+	if (bp == NULL) {
+		fprintf(stderr, "bench_tconn: error allocating memory\n");
+		return -1;
+	}
+
+	bp->seconds = seconds;
+	bp->mode = mode;
+	bp->parent = NULL;
+	bp->handshakes = 0;
+
+	IV_TASK_INIT(&bp->tx_task);
+	bp->tx_task.cookie = bp;
+	bp->tx_task.handler = tx_task_handler;
+
+	IV_TIMER_INIT(&bp->probe_timer);
+	bp->probe_timer.cookie = bp;
+	bp->probe_timer.handler = probe_timer_expired;
+
+	IV_TIMER_INIT(&bp->stop_timer);
+	bp->stop_timer.cookie = bp;
+	bp->stop_timer.handler = stop_timer_expired;
+
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		uint8_t *f = bp->rec + i * (3 + BENCH_FRAME_LEN);
+
+		f[0] = 0;
+		f[1] = BENCH_FRAME_LEN >> 8;
+		f[2] = BENCH_FRAME_LEN & 0xff;
+		memset(f + 3, 0x5a, BENCH_FRAME_LEN);
+	}
+
+	if (bench_pair_start(bp) < 0) {
+		free(bp);
+		return -1;
+	}
+
+	iv_main();
+
+	free(bp);
+
+	return 0;
+}
+
+#define RECONNECT_INITIAL	0
+#define RECONNECT_FULL		1
+#define RECONNECT_RESUME	2
+#define RECONNECT_RESTART	3
+#define RECONNECT_RESTART_NOKEY	4
+#define RECONNECT_DONE		5
+
+static const char *reconnect_desc[] = {
+	[RECONNECT_INITIAL]		= "initial connect",
+	[RECONNECT_FULL]		= "full handshakes",
+	[RECONNECT_RESUME]		= "resumed sessions",
+	[RECONNECT_RESTART]		= "hub restart, ticket key kept",
+	[RECONNECT_RESTART_NOKEY]	= "hub restart, ticket key lost",
+};
+
+struct bench_peer {
+	struct bench_hub		*hub;
+	char				name[16];
+	gnutls_x509_privkey_t		key;
+	gnutls_x509_crt_t		crt;
+	uint8_t				id[NODE_ID_LEN];
+	struct tconn_connect		tc;
+	struct tconn_listen_entry	tle;
+	int				down;
+	int				pending;
+	struct iv_task			forget_task;
+};
+
+struct bench_hub {
+	uint8_t				id[NODE_ID_LEN];
+	char				port[8];
+	char				ticket_key_file[32];
+	struct tconn_listen_socket	tls;
+	int				pass;
+	int				pending;
+	uint64_t			start;
+	uint64_t			start_cpu;
+	struct iv_task			pass_task;
+	struct bench_peer		peers[BENCH_PEERS];
+};
+
+static uint64_t cpu_us(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL +
+	       ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static void peer_forget_session(void *_p)
+{
+	struct bench_peer *p = _p;
+
+	tconn_connect_forget_session(&p->tc);
+}
+
+static void peer_set_state(void *_p, const uint8_t *id, int up)
+{
+	struct bench_peer *p = _p;
+
+	/*
+	 * tconn_connect saves the session after telling us that the
+	 * connection is down, so forget it a bit later.
+	 */
+	if (!up) {
+		p->down = 1;
+		if (p->hub->pass == RECONNECT_FULL)
+			iv_task_register(&p->forget_task);
+	}
+}
+
+/*
+ * With TLS 1.3, the peer considers itself connected before the hub
+ * has seen its Finished message, so only count the peer as being
+ * back once the hub's first record has arrived.
+ */
+static void peer_record_received(void *_p, const uint8_t *rec, int len)
+{
+	struct bench_peer *p = _p;
+	struct bench_hub *hub = p->hub;
+
+	if (p->pending && p->down) {
+		p->pending = 0;
+		if (!--hub->pending)
+			iv_task_register(&hub->pass_task);
+	}
+}
+
+static void hub_record_received(void *_p, const uint8_t *rec, int len)
+{
+}
+
+/*
+ * Like dvpn, send the peer something as soon as it is connected,
+ * which is when it will get to see its session ticket.
+ */
+static void hub_set_state(void *_p, const uint8_t *id, int up)
+{
+	static uint8_t keepalive[] = { 0x00, 0x00, 0x00 };
+	struct bench_peer *p = _p;
+
+	if (up) {
+		tconn_listen_entry_record_send(&p->tle, TCONN_CLASS_CONTROL,
+					       keepalive, sizeof(keepalive));
+	}
+}
+
+static int bench_hub_listen(struct bench_hub *hub)
+{
+	struct sockaddr_in *a4;
+	socklen_t addrlen;
+	int i;
+
+	if (tconn_listen_socket_register(&hub->tls))
+		return -1;
+
+	/*
+	 * Bind to the same port again if the hub is restarted.
+	 */
+	a4 = (struct sockaddr_in *)&hub->tls.listen_address;
+	addrlen = sizeof(*a4);
+	if (getsockname(hub->tls.listen_fd.fd, (struct sockaddr *)a4,
+			&addrlen) < 0) {
+		perror("getsockname");
+		return -1;
+	}
+	snprintf(hub->port, sizeof(hub->port), "%d", ntohs(a4->sin_port));
+
+	for (i = 0; i < BENCH_PEERS; i++) {
+		if (tconn_listen_entry_register(&hub->peers[i].tle))
+			return -1;
+	}
+
+	return 0;
+}
+
+static void bench_reconnect_all(struct bench_hub *hub)
+{
+	int i;
+
+	for (i = 0; i < BENCH_PEERS; i++) {
+		hub->peers[i].down = 0;
+		hub->peers[i].pending = 1;
+	}
+
+	hub->pending = BENCH_PEERS;
+	hub->start = now_us();
+	hub->start_cpu = cpu_us();
+
+	if (hub->pass == RECONNECT_RESTART ||
+	    hub->pass == RECONNECT_RESTART_NOKEY) {
+		tconn_listen_socket_unregister(&hub->tls);
+		if (hub->pass == RECONNECT_RESTART_NOKEY)
+			hub->tls.ticket_key_file = NULL;
+		if (bench_hub_listen(hub) < 0)
+			abort();
+		return;
+	}
+
+	for (i = 0; i < BENCH_PEERS; i++) {
+		struct bench_peer *p = &hub->peers[i];
+
+		tconn_listen_entry_unregister(&p->tle);
+		if (tconn_listen_entry_register(&p->tle))
+			abort();
+	}
+}
+
+static void pass_task_handler(void *_hub)
+{
+	struct bench_hub *hub = _hub;
+	uint64_t cpu;
+	uint64_t usec;
+	int i;
+
+	usec = now_us() - hub->start;
+	cpu = cpu_us() - hub->start_cpu;
+
+	printf("%s: %d peers up after %llu ms, using %llu ms of CPU "
+	       "time\n", reconnect_desc[hub->pass], BENCH_PEERS,
+	       (unsigned long long)(usec / 1000),
+	       (unsigned long long)(cpu / 1000));
+	fflush(stdout);
+
+	hub->pass++;
+	if (hub->pass != RECONNECT_DONE) {
+		bench_reconnect_all(hub);
+		return;
+	}
+
+	for (i = 0; i < BENCH_PEERS; i++) {
+		struct bench_peer *p = &hub->peers[i];
+
+		if (iv_task_registered(&p->forget_task))
+			iv_task_unregister(&p->forget_task);
+		tconn_connect_destroy(&p->tc);
+	}
+
+	tconn_listen_socket_unregister(&hub->tls);
+}
+
+static int bench_peer_init(struct bench_hub *hub, struct bench_peer *p,
+			   int index)
+{
+	int ret;
+
+	p->hub = hub;
+	snprintf(p->name, sizeof(p->name), "peer%d", index);
+
+	ret = gnutls_x509_privkey_init(&p->key);
+	if (ret < 0) {
+		fprintf(stderr, "gnutls_x509_privkey_init: ");
+		gnutls_perror(ret);
+		return -1;
+	}
+
+	ret = gnutls_x509_privkey_generate(p->key, GNUTLS_PK_ECDSA,
+			GNUTLS_CURVE_TO_BITS(GNUTLS_ECC_CURVE_SECP256R1), 0);
+	if (ret < 0) {
+		fprintf(stderr, "gnutls_x509_privkey_generate: ");
+		gnutls_perror(ret);
+		gnutls_x509_privkey_deinit(p->key);
+		return -1;
+	}
+
+	if (x509_generate_self_signed_cert(&p->crt, p->key) < 0 ||
+	    x509_get_privkey_id(p->id, p->key) < 0) {
+		gnutls_x509_privkey_deinit(p->key);
+		return -1;
+	}
+
+	p->tc.name = p->name;
+	p->tc.hostname = "127.0.0.1";
+	p->tc.port = hub->port;
+	p->tc.mykey = p->key;
+	p->tc.numcrts = 1;
+	p->tc.mycrts = &p->crt;
+	p->tc.fingerprint = hub->id;
+	p->tc.ktls = 0;
+	p->tc.txq_limit = 0;
+	p->tc.ciphers = NULL;
+	p->tc.cookie = p;
+	p->tc.set_state = peer_set_state;
+	p->tc.record_received = peer_record_received;
+
+	p->tle.tls = &hub->tls;
+	p->tle.name = p->name;
+	p->tle.fingerprint = p->id;
+	p->tle.ciphers = NULL;
+	p->tle.cookie = p;
+	p->tle.set_state = hub_set_state;
+	p->tle.record_received = hub_record_received;
+
+	IV_TASK_INIT(&p->forget_task);
+	p->forget_task.cookie = p;
+	p->forget_task.handler = peer_forget_session;
+
+	return 0;
+}
+
+static int bench_reconnect(void)
+{
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	struct bench_hub *hub;
+	struct sockaddr_in *a4;
+	struct rlimit rl;
+	int fd;
+	int ret;
+	int i;
+
+	/*
+	 * Each peer needs a socket on both ends.
+	 */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 &&
+	    rl.rlim_cur < 3 * BENCH_PEERS) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	hub = calloc(1, sizeof(*hub));
+	if (hub == NULL) {
+		fprintf(stderr, "bench_tconn: error allocating memory\n");
+		return -1;
+	}
+
+	ret = gnutls_x509_privkey_init(&key);
+	if (ret < 0) {
+		fprintf(stderr, "gnutls_x509_privkey_init: ");
+		gnutls_perror(ret);
+		free(hub);
+		return -1;
+	}
+
+	ret = gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, 4096, 0);
+	if (ret < 0) {
+		fprintf(stderr, "gnutls_x509_privkey_generate: ");
+		gnutls_perror(ret);
+		goto err_key;
+	}
+
+	if (x509_generate_self_signed_cert(&crt, key) < 0)
+		goto err_key;
+
+	if (x509_get_privkey_id(hub->id, key) < 0)
+		goto err_crt;
+
+	strcpy(hub->ticket_key_file, "/tmp/bench-tconn.XXXXXX");
+	fd = mkstemp(hub->ticket_key_file);
+	if (fd < 0) {
+		perror("mkstemp");
+		goto err_crt;
+	}
+	close(fd);
+
+	a4 = (struct sockaddr_in *)&hub->tls.listen_address;
+	a4->sin_family = AF_INET;
+	a4->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	a4->sin_port = 0;
+	hub->tls.mykey = key;
+	hub->tls.numcrts = 1;
+	hub->tls.mycrts = &crt;
+	hub->tls.ktls = 0;
+	hub->tls.txq_limit = 0;
+	hub->tls.ciphers = NULL;
+	hub->tls.handshake_limit = 0;
+	hub->tls.ticket_key_file = hub->ticket_key_file;
+
+	for (i = 0; i < BENCH_PEERS; i++) {
+		if (bench_peer_init(hub, &hub->peers[i], i) < 0)
+			goto err_peers;
+	}
+
+	IV_TASK_INIT(&hub->pass_task);
+	hub->pass_task.cookie = hub;
+	hub->pass_task.handler = pass_task_handler;
+
+	if (bench_hub_listen(hub) < 0)
+		abort();
+
+	hub->pass = RECONNECT_INITIAL;
+	hub->pending = BENCH_PEERS;
+	hub->start = now_us();
+	hub->start_cpu = cpu_us();
+	for (i = 0; i < BENCH_PEERS; i++) {
+		hub->peers[i].down = 1;
+		hub->peers[i].pending = 1;
+		tconn_connect_start(&hub->peers[i].tc);
+	}
+
+	iv_main();
+
+	ret = 0;
+	goto out;
+
+err_peers:
+	ret = -1;
+
+out:
+	while (--i >= 0) {
+		gnutls_x509_crt_deinit(hub->peers[i].crt);
+		gnutls_x509_privkey_deinit(hub->peers[i].key);
+	}
+
+	unlink(hub->ticket_key_file);
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+	free(hub);
+
+	return ret;
+
+err_crt:
+	gnutls_x509_crt_deinit(crt);
+
+err_key:
+	gnutls_x509_privkey_deinit(key);
+	free(hub);
+
+	return -1;
+}
+
+int bench_tconn(const char *arg)
+{
+	int seconds;
+	int ret;
+
+	seconds = BENCH_SECONDS;
+	if (arg != NULL) {
+		seconds = atoi(arg);
+		if (seconds <= 0) {
+			fprintf(stderr, "bench_tconn: invalid number of "
+					"seconds %s\n", arg);
+			return 1;
+		}
+	}
+
+	gnutls_global_init();
+
+	ret = gnutls_x509_privkey_init(&bench_key);
+	if (ret < 0) {
+		fprintf(stderr, "gnutls_x509_privkey_init: ");
+		gnutls_perror(ret);
+		return 1;
+	}
+
+	ret = gnutls_x509_privkey_generate(bench_key, GNUTLS_PK_RSA, 2048, 0);
+	if (ret < 0) {
+		fprintf(stderr, "gnutls_x509_privkey_generate: ");
+		gnutls_perror(ret);
+		return 1;
+	}
+
+	if (x509_generate_self_signed_cert(&bench_crt, bench_key) < 0)
+		return 1;
+
+	tls_prio_bench(NULL);
+
+	iv_init();
+
+	printf("userspace TLS: ");
+	fflush(stdout);
+	ret = bench_tconn_run(seconds, BENCH_MODE_TLS);
+
+	/*
+	 * If the kernel doesn't support kTLS for the negotiated cipher,
+	 * tconn says so and this run uses userspace TLS as well.
+	 */
+	if (!ret) {
+		printf("kernel TLS: ");
+		fflush(stdout);
+		ret = bench_tconn_run(seconds, BENCH_MODE_KTLS);
+	}
+
+	if (!ret) {
+		printf("UDP: ");
+		fflush(stdout);
+		ret = bench_tconn_run(seconds, BENCH_MODE_UDP);
+	}
+
+	if (!ret) {
+		printf("userspace TLS, handshake storm: ");
+		fflush(stdout);
+		ret = bench_tconn_run(seconds, BENCH_MODE_STORM);
+	}
+
+	if (!ret) {
+		printf("reconnecting %d peers:\n", BENCH_PEERS);
+		fflush(stdout);
+		ret = bench_reconnect();
+	}
+
+	iv_deinit();
+
+	gnutls_x509_crt_deinit(bench_crt);
+	gnutls_x509_privkey_deinit(bench_key);
+
+	gnutls_global_deinit();
+
+	return !!ret;
+}
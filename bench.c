@@ -0,0 +1,259 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <time.h>
+#include "bench.h"
+#include "lsa_type.h"
+
+uint64_t now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static int bench_peer_add(struct bench_graph_node *n, int peer,
+			  uint16_t metric, int degree)
+{
+	int i;
+
+	for (i = 0; i < n->num_peers; i++) {
+		if (n->peers[i].node == peer)
+			return 0;
+	}
+
+	if (n->num_peers == n->max_peers) {
+		struct bench_graph_peer *p;
+		int max;
+
+		max = n->max_peers ? 2 * n->max_peers : degree;
+
+		p = realloc(n->peers, max * sizeof(*p));
+		if (p == NULL)
+			return -1;
+
+		n->peers = p;
+		n->max_peers = max;
+	}
+
+	n->peers[n->num_peers].node = peer;
+	n->peers[n->num_peers].metric = metric;
+	n->num_peers++;
+
+	return 0;
+}
+
+int bench_graph_init(struct bench_graph *g, int num_nodes, int degree)
+{
+	int i;
+
+	g->num_nodes = num_nodes;
+
+	g->nodes = calloc(num_nodes, sizeof(*g->nodes));
+	if (g->nodes == NULL)
+		return -1;
+
+	for (i = 0; i < num_nodes; i++) {
+		int j;
+
+		for (j = 0; j < NODE_ID_LEN; j++)
+			g->nodes[i].id[j] = random();
+		g->nodes[i].version = 1;
+	}
+
+	for (i = 0; i < num_nodes * degree / 2; i++) {
+		uint16_t metric;
+		int a;
+		int b;
+
+		a = i % num_nodes;
+		if (i < num_nodes)
+			b = (a + 1) % num_nodes;
+		else
+			b = random() % num_nodes;
+		if (a == b)
+			b = (a + 1) % num_nodes;
+
+		metric = 1 + random() % 100;
+		if (bench_peer_add(&g->nodes[a], b, metric, degree) < 0 ||
+		    bench_peer_add(&g->nodes[b], a, metric, degree) < 0) {
+			bench_graph_deinit(g);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int bench_graph_alloc_lsas(struct bench_graph *g, int num)
+{
+	int i;
+
+	for (i = 0; i < g->num_nodes; i++) {
+		g->nodes[i].lsas = calloc(num, sizeof(struct lsa *));
+		if (g->nodes[i].lsas == NULL)
+			return -1;
+	}
+
+	return 0;
+}
+
+void bench_graph_deinit(struct bench_graph *g)
+{
+	int i;
+
+	for (i = 0; i < g->num_nodes; i++) {
+		free(g->nodes[i].peers);
+		free(g->nodes[i].lsas);
+	}
+	free(g->nodes);
+}
+
+/*
+ * Changes the metric of one randomly chosen link out of a randomly
+ * chosen node other than us, and returns that node.
+ */
+struct bench_graph_node *bench_graph_change_metric(struct bench_graph *g)
+{
+	struct bench_graph_node *n;
+
+	n = &g->nodes[1 + random() % (g->num_nodes - 1)];
+	n->peers[random() % n->num_peers].metric = 1 + random() % 100;
+	n->version++;
+
+	return n;
+}
+
+int bench_tree_init(struct bench_tree *t, struct bench_graph *g, int root)
+{
+	int *queue;
+	int head;
+	int tail;
+	int i;
+
+	t->root = root;
+	t->parent = malloc(g->num_nodes * sizeof(int));
+	t->depth = malloc(g->num_nodes * sizeof(int));
+	queue = malloc(g->num_nodes * sizeof(int));
+	if (t->parent == NULL || t->depth == NULL || queue == NULL) {
+		free(t->parent);
+		free(t->depth);
+		free(queue);
+		t->parent = NULL;
+		t->depth = NULL;
+		return -1;
+	}
+
+	for (i = 0; i < g->num_nodes; i++)
+		t->depth[i] = -1;
+
+	t->parent[root] = root;
+	t->depth[root] = 0;
+	queue[0] = root;
+
+	head = 0;
+	tail = 1;
+	while (head < tail) {
+		int n = queue[head++];
+
+		for (i = 0; i < g->nodes[n].num_peers; i++) {
+			int p = g->nodes[n].peers[i].node;
+
+			if (p != 0 && t->depth[p] < 0) {
+				t->parent[p] = n;
+				t->depth[p] = t->depth[n] + 1;
+				queue[tail++] = p;
+			}
+		}
+	}
+
+	free(queue);
+
+	return 0;
+}
+
+void bench_tree_deinit(struct bench_tree *t)
+{
+	free(t->parent);
+	free(t->depth);
+}
+
+struct lsa *bench_node_lsa(struct bench_graph *g, int i, struct bench_tree *t)
+{
+	struct bench_graph_node *n = &g->nodes[i];
+	int from_us = (t != NULL && t->root == 0);
+	int depth = (t != NULL) ? t->depth[i] + !from_us : 0;
+	uint8_t path[depth * NODE_ID_LEN];
+	struct lsa_builder b;
+	uint32_t t32[2];
+	struct lsa *lsa;
+	int j;
+
+	if (t != NULL) {
+		for (j = i; j != t->root; j = t->parent[j]) {
+			memcpy(path + (t->depth[j] - from_us) * NODE_ID_LEN,
+			       g->nodes[j].id, NODE_ID_LEN);
+		}
+		if (!from_us)
+			memcpy(path, g->nodes[j].id, NODE_ID_LEN);
+	}
+
+	lsa_builder_init(&b, n->id);
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_ADV_PATH, 0,
+			     NULL, 0, path, depth * NODE_ID_LEN);
+
+	t32[0] = 0;
+	t32[1] = htonl(n->version);
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_VERSION, 1,
+			     NULL, 0, t32, sizeof(t32));
+
+	for (j = 0; j < n->num_peers; j++) {
+		uint16_t metric;
+		uint8_t peer_flags;
+		int set;
+
+		set = lsa_builder_add_attr_set(&b, LSA_BUILDER_ROOT,
+					LSA_ATTR_TYPE_PEER, 1,
+					g->nodes[n->peers[j].node].id,
+					NODE_ID_LEN);
+
+		metric = htons(n->peers[j].metric);
+		lsa_builder_add_attr(&b, set, LSA_PEER_ATTR_TYPE_METRIC, 1,
+				     NULL, 0, &metric, sizeof(metric));
+
+		peer_flags = LSA_PEER_FLAGS_CUSTOMER | LSA_PEER_FLAGS_TRANSIT;
+		lsa_builder_add_attr(&b, set, LSA_PEER_ATTR_TYPE_PEER_FLAGS, 1,
+				     NULL, 0, &peer_flags, sizeof(peer_flags));
+	}
+
+	lsa = lsa_builder_finish(&b);
+	if (lsa == NULL)
+		abort();
+
+	lsa_builder_deinit(&b);
+
+	return lsa;
+}
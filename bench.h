@@ -0,0 +1,85 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __BENCH_H
+#define __BENCH_H
+
+#include <stdint.h>
+#include "lsa.h"
+
+uint64_t now_us(void);
+
+/*
+ * A randomly generated graph in which every node peers with @degree
+ * other nodes on average.  Node 0 is us.  Links come in pairs, and
+ * the first link out of every node goes to the next node, so that
+ * the graph is connected.  A node can only advertise one PEER
+ * attribute per peer, so duplicate links are dropped.
+ *
+ * bench_graph_alloc_lsas() gives every node room for @num LSAs in
+ * ->lsas, which bench_graph_deinit() frees, but without dropping
+ * the references to the LSAs themselves.
+ */
+struct bench_graph_peer {
+	int			node;
+	uint16_t		metric;
+};
+
+struct bench_graph_node {
+	uint8_t			id[NODE_ID_LEN];
+	int			num_peers;
+	int			max_peers;
+	struct bench_graph_peer	*peers;
+	uint32_t		version;
+	struct lsa		**lsas;
+};
+
+struct bench_graph {
+	int			num_nodes;
+	struct bench_graph_node	*nodes;
+};
+
+int bench_graph_init(struct bench_graph *g, int num_nodes, int degree);
+int bench_graph_alloc_lsas(struct bench_graph *g, int num);
+void bench_graph_deinit(struct bench_graph *g);
+struct bench_graph_node *bench_graph_change_metric(struct bench_graph *g);
+
+/*
+ * The shortest hop count paths from @root that do not pass through
+ * us, or from us if @root is 0.  ->depth is -1 for nodes that can't
+ * be reached that way.
+ */
+struct bench_tree {
+	int			root;
+	int			*parent;
+	int			*depth;
+};
+
+int bench_tree_init(struct bench_tree *t, struct bench_graph *g, int root);
+void bench_tree_deinit(struct bench_tree *t);
+
+/*
+ * Builds the LSA of node @i as received over the tree @t, with an
+ * ADV_PATH running from @t's root, or from our peer if @t is rooted
+ * at us, to the node itself, or our own LSA if @t is NULL.
+ */
+struct lsa *bench_node_lsa(struct bench_graph *g, int i, struct bench_tree *t);
+
+
+#endif
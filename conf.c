@@ -27,6 +27,7 @@
 #include <strings.h>
 #include <sys/utsname.h>
 #include "conf.h"
+#include "tls_prio.h"
 #include "util.h"
 
 struct local_conf {
@@ -161,6 +162,23 @@ static int parse_config_default(struct local_conf *lc, struct ini_cfgobj *co)
 		lc->conf->role_key = strdup("/etc/pki/tls/dvpn/role.key");
 	}
 
+	ret = ini_get_config_valueobj("default", "TicketKeyFile", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		char *file;
+
+		file = ini_get_string_config_value(vo, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving TicketKeyFile "
+					"value\n");
+			return -1;
+		}
+
+		lc->conf->ticket_key = file;
+	} else {
+		lc->conf->ticket_key = strdup("/var/lib/dvpn/ticket.key");
+	}
+
 	ret = ini_get_config_valueobj("default", "DefaultPort", co,
 				      INI_GET_FIRST_VALUE, &vo);
 	if (ret == 0 && vo != NULL) {
@@ -175,6 +193,105 @@ static int parse_config_default(struct local_conf *lc, struct ini_cfgobj *co)
 		lc->default_port = port;
 	}
 
+	ret = ini_get_config_valueobj("default", "KernelTLS", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		lc->conf->kernel_tls = ini_get_bool_config_value(vo, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving KernelTLS value\n");
+			return -1;
+		}
+	}
+
+	ret = ini_get_config_valueobj("default", "LinkStateRouting", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		lc->conf->link_state_routing =
+			ini_get_bool_config_value(vo, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving LinkStateRouting "
+					"value\n");
+			return -1;
+		}
+	}
+
+	ret = ini_get_config_valueobj("default", "Workers", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int workers;
+
+		workers = ini_get_int_config_value(vo, 1, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving Workers value\n");
+			return -1;
+		}
+
+		if (workers < 0 || workers > 256) {
+			fprintf(stderr, "Workers must be in [0..256]\n");
+			return -1;
+		}
+
+		lc->conf->workers = workers;
+	}
+
+	ret = ini_get_config_valueobj("default", "TxQueueLimit", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int limit;
+
+		limit = ini_get_int_config_value(vo, 1, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving TxQueueLimit value\n");
+			return -1;
+		}
+
+		if (limit < 0) {
+			fprintf(stderr, "TxQueueLimit must be non-negative\n");
+			return -1;
+		}
+
+		lc->conf->tx_queue_limit = limit;
+	}
+
+	ret = ini_get_config_valueobj("default", "HandshakeLimit", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int limit;
+
+		limit = ini_get_int_config_value(vo, 1, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving HandshakeLimit "
+					"value\n");
+			return -1;
+		}
+
+		if (limit < 1) {
+			fprintf(stderr, "HandshakeLimit must be positive\n");
+			return -1;
+		}
+
+		lc->conf->handshake_limit = limit;
+	}
+
+	ret = ini_get_config_valueobj("default", "Ciphers", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		char *ciphers;
+
+		ciphers = ini_get_string_config_value(vo, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving Ciphers value\n");
+			return -1;
+		}
+
+		if (tls_prio_check_ciphers(ciphers) < 0) {
+			free(ciphers);
+			return -1;
+		}
+
+		lc->conf->ciphers = ciphers;
+	}
+
 	return 0;
 }
 
@@ -312,10 +429,24 @@ static enum conf_peer_type parse_peer_type(const char *pt)
 	return CONF_PEER_TYPE_INVALID;
 }
 
+static enum conf_transport parse_transport(const char *t)
+{
+	if (!strcasecmp(t, "tcp"))
+		return CONF_TRANSPORT_TCP;
+
+	if (!strcasecmp(t, "udp"))
+		return CONF_TRANSPORT_UDP;
+
+	fprintf(stderr, "error parsing transport '%s'\n", t);
+
+	return CONF_TRANSPORT_INVALID;
+}
+
 static int
 add_connect_peer(struct local_conf *lc, const char *peer, const char *connect,
 		 const uint8_t *fp, enum conf_peer_type peer_type,
-		 const char *itf, int cost)
+		 const char *itf, int cost, enum conf_transport transport,
+		 const char *ciphers)
 {
 	struct conf_connect_entry *cce;
 	char *delim;
@@ -368,6 +499,10 @@ add_connect_peer(struct local_conf *lc, const char *peer, const char *connect,
 	cce->peer_type = peer_type;
 	cce->tunitf = strdup(itf ? : "dvpn%d");
 	cce->cost = cost;
+	cce->transport = transport;
+	if (ciphers == NULL)
+		ciphers = lc->conf->ciphers;
+	cce->ciphers = (ciphers != NULL) ? strdup(ciphers) : NULL;
 
 	return 0;
 }
@@ -493,7 +628,8 @@ get_listening_socket(struct local_conf *lc, const char *listen)
 static int
 add_listen_peer(struct local_conf *lc, const char *peer, const char *listen,
 		const uint8_t *fp, enum conf_peer_type peer_type,
-		const char *itf, int cost)
+		const char *itf, int cost, enum conf_transport transport,
+		const char *ciphers)
 {
 	struct conf_listening_socket *cls;
 	struct conf_listen_entry *cle;
@@ -515,6 +651,8 @@ add_listen_peer(struct local_conf *lc, const char *peer, const char *listen,
 	cle->peer_type = peer_type;
 	cle->tunitf = strdup(itf ? : "dvpn%d");
 	cle->cost = cost;
+	cle->transport = transport;
+	cle->ciphers = (ciphers != NULL) ? strdup(ciphers) : NULL;
 
 	return 0;
 }
@@ -532,6 +670,9 @@ static int parse_config_peer(struct local_conf *lc,
 	struct value_obj *vo;
 	int ret;
 	int cost;
+	const char *trans;
+	enum conf_transport transport;
+	const char *ciphers;
 
 	connect = get_const_value(co, peer, "Connect");
 	listen = get_const_value(co, peer, "Listen");
@@ -584,12 +725,25 @@ static int parse_config_peer(struct local_conf *lc,
 		cost = 0;
 	}
 
+	trans = get_const_value(co, peer, "Transport");
+	if (trans != NULL) {
+		transport = parse_transport(trans);
+		if (transport == CONF_TRANSPORT_INVALID)
+			return -1;
+	} else {
+		transport = CONF_TRANSPORT_TCP;
+	}
+
+	ciphers = get_const_value(co, peer, "Ciphers");
+	if (ciphers != NULL && tls_prio_check_ciphers(ciphers) < 0)
+		return -1;
+
 	if (connect != NULL) {
-		return add_connect_peer(lc, peer, connect, f,
-					peer_type, itf, cost);
+		return add_connect_peer(lc, peer, connect, f, peer_type,
+					itf, cost, transport, ciphers);
 	} else {
-		return add_listen_peer(lc, peer, listen, f,
-				       peer_type, itf, cost);
+		return add_listen_peer(lc, peer, listen, f, peer_type,
+				       itf, cost, transport, ciphers);
 	}
 
 	return 0;
@@ -611,7 +765,14 @@ struct conf *parse_config(const char *file)
 	}
 
 	conf->private_key = NULL;
+	conf->ticket_key = NULL;
 	conf->node_name = NULL;
+	conf->kernel_tls = 0;
+	conf->link_state_routing = 0;
+	conf->workers = 0;
+	conf->tx_queue_limit = 0;
+	conf->handshake_limit = 0;
+	conf->ciphers = NULL;
 	INIT_IV_AVL_TREE(&conf->connect_entries, compare_connect_entries);
 	INIT_IV_AVL_TREE(&conf->listening_sockets, compare_listening_sockets);
 
@@ -665,6 +826,10 @@ void free_config(struct conf *conf)
 
 	free(conf->role_key);
 
+	free(conf->ticket_key);
+
+	free(conf->ciphers);
+
 	iv_avl_tree_for_each_safe (an, an2, &conf->connect_entries) {
 		struct conf_connect_entry *cce;
 
@@ -675,6 +840,7 @@ void free_config(struct conf *conf)
 		free(cce->hostname);
 		free(cce->port);
 		free(cce->tunitf);
+		free(cce->ciphers);
 		free(cce);
 	}
 
@@ -695,6 +861,7 @@ void free_config(struct conf *conf)
 			iv_avl_tree_delete(&cls->listen_entries, &cle->an);
 			free(cle->name);
 			free(cle->tunitf);
+			free(cle->ciphers);
 			free(cle);
 		}
 
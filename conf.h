@@ -24,15 +24,24 @@
 #include <stdint.h>
 #include <sys/socket.h>
 #include "dgp_connect.h"
+#include "dp_worker.h"
 #include "dgp_listen.h"
 #include "tconn_connect.h"
 #include "tconn_listen.h"
 #include "tun.h"
+#include "udp_chan.h"
 
 struct conf {
 	char			*node_name;
 	char			*private_key;
 	char			*role_key;
+	char			*ticket_key;
+	int			kernel_tls;
+	int			link_state_routing;
+	int			workers;
+	int			tx_queue_limit;
+	int			handshake_limit;
+	char			*ciphers;
 	struct iv_avl_tree	connect_entries;
 	struct iv_avl_tree	listening_sockets;
 };
@@ -46,12 +55,27 @@ enum conf_peer_type {
 	CONF_PEER_TYPE_IPEER,
 };
 
+enum conf_transport {
+	CONF_TRANSPORT_INVALID,
+	CONF_TRANSPORT_TCP,
+	CONF_TRANSPORT_UDP,
+};
+
 struct direct_peer {
 	struct iv_avl_node	an;
 	uint8_t			addr[16];
 	char			*itfname;
 };
 
+#define RECORD_BATCH_MAX	16384
+
+struct record_batch {
+	int			enabled;
+	int			gso;
+	int			bytes;
+	uint8_t			buf[RECORD_BATCH_MAX];
+};
+
 struct conf_connect_entry {
 	struct iv_avl_node	an;
 
@@ -62,14 +86,20 @@ struct conf_connect_entry {
 	enum conf_peer_type	peer_type;
 	char			*tunitf;
 	int			cost;
+	enum conf_transport	transport;
+	char			*ciphers;
 
 	int			registered;
+	struct dp_worker	*dw;
 	struct tun_interface	tun;
 	struct tconn_connect	tc;
 	int			tconn_up;
 	uint8_t			peerid[NODE_ID_LEN];
 	struct direct_peer	dp;
 	struct dgp_connect	dc;
+	struct record_batch	batch;
+	int			udp_up;
+	struct udp_chan		uc;
 };
 
 struct conf_listening_socket {
@@ -79,6 +109,7 @@ struct conf_listening_socket {
 	struct iv_avl_tree		listen_entries;
 
 	int				registered;
+	struct dp_worker		*dw;
 	struct tconn_listen_socket	tls;
 };
 
@@ -90,8 +121,11 @@ struct conf_listen_entry {
 	enum conf_peer_type		peer_type;
 	char				*tunitf;
 	int				cost;
+	enum conf_transport		transport;
+	char				*ciphers;
 
 	int				registered;
+	struct dp_worker		*dw;
 	struct tun_interface		tun;
 	struct tconn_listen_entry	tle;
 	int				tconn_up;
@@ -99,6 +133,9 @@ struct conf_listen_entry {
 	struct direct_peer		dp;
 	struct dgp_listen_socket	dls;
 	struct dgp_listen_entry		dle;
+	struct record_batch		batch;
+	int				udp_up;
+	struct udp_chan			uc;
 };
 
 struct conf *parse_config(const char *file);
@@ -24,6 +24,14 @@
 #include "confdiff.h"
 #include "util.h"
 
+static int strcmp_null(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return a != b;
+
+	return strcmp(a, b);
+}
+
 static void cce_add(void *_req, struct iv_avl_node *_a)
 {
 	struct confdiff_request *req = _req;
@@ -51,7 +59,8 @@ static void cce_mod(void *_req, struct iv_avl_node *_a, struct iv_avl_node *_b)
 	if (!strcmp(a->hostname, b->hostname) && !strcmp(a->port, b->port) &&
 	    !memcmp(a->fingerprint, b->fingerprint, NODE_ID_LEN) &&
 	    a->peer_type == b->peer_type && !strcmp(a->tunitf, b->tunitf) &&
-	    a->cost == b->cost) {
+	    a->cost == b->cost && a->transport == b->transport &&
+	    !strcmp_null(a->ciphers, b->ciphers)) {
 		return;
 	}
 
@@ -130,7 +139,9 @@ static void cle_mod(void *_op, struct iv_avl_node *_a, struct iv_avl_node *_b)
 	b = iv_container_of(_b, struct conf_listen_entry, an);
 
 	if (!memcmp(a->fingerprint, b->fingerprint, NODE_ID_LEN) &&
-	    a->peer_type == b->peer_type && !strcmp(a->tunitf, b->tunitf)) {
+	    a->peer_type == b->peer_type && !strcmp(a->tunitf, b->tunitf) &&
+	    a->transport == b->transport &&
+	    !strcmp_null(a->ciphers, b->ciphers)) {
 		return;
 	}
 
@@ -38,9 +38,9 @@ void cspf_node_add(struct spf_context *ctx, struct cspf_node *node)
 
 void cspf_node_del(struct spf_context *ctx, struct cspf_node *node)
 {
+	spf_edge_del(&node->a, &node->ab);
 	spf_node_del(ctx, &node->a);
 	spf_node_del(ctx, &node->b);
-	spf_edge_del(&node->a, &node->ab);
 }
 
 void cspf_edge_add(struct spf_context *ctx, struct cspf_edge *edge,
@@ -116,6 +116,11 @@ void cspf_run(struct spf_context *ctx, struct cspf_node *source)
 	spf_run(ctx, &source->a);
 }
 
+void cspf_update(struct spf_context *ctx, struct cspf_node *source)
+{
+	spf_update(ctx, &source->a);
+}
+
 void *cspf_node_parent(struct cspf_node *node)
 {
 	struct spf_node *parent;
@@ -46,6 +46,7 @@ void cspf_edge_del(struct spf_context *ctx, struct cspf_edge *edge,
 		   struct cspf_node *from, struct cspf_node *to,
 		   enum conf_peer_type to_type);
 void cspf_run(struct spf_context *ctx, struct cspf_node *source);
+void cspf_update(struct spf_context *ctx, struct cspf_node *source);
 void *cspf_node_parent(struct cspf_node *node);
 int cspf_node_cost(struct cspf_node *node);
 
@@ -48,7 +48,15 @@ static void handle_dgp_read(void *_dc)
 {
 	struct dgp_connect *dc = _dc;
 
-	if (dgp_reader_read(&dc->dr, dc->fd.fd) < 0)
+	if (dgp_reader_read(&dc->dr) < 0)
+		io_error(dc);
+}
+
+static void handle_dgp_write(void *_dc)
+{
+	struct dgp_connect *dc = _dc;
+
+	if (dgp_writer_write(&dc->dw) < 0)
 		io_error(dc);
 }
 
@@ -59,11 +67,9 @@ static void connect_success(struct dgp_connect *dc, int fd)
 	iv_timer_unregister(&dc->timeout);
 
 	iv_fd_set_handler_in(&dc->fd, handle_dgp_read);
-	iv_fd_set_handler_out(&dc->fd, NULL);
+	iv_fd_set_handler_out(&dc->fd, handle_dgp_write);
 
 	dgp_reader_register(&dc->dr);
-
-	dc->dw.fd = dc->fd.fd;
 	dgp_writer_register(&dc->dw);
 }
 
@@ -217,12 +223,14 @@ void dgp_connect_start(struct dgp_connect *dc)
 	IV_FD_INIT(&dc->fd);
 	dc->fd.cookie = dc;
 
+	dc->dr.fd = &dc->fd;
 	dc->dr.myid = dc->myid;
 	dc->dr.remoteid = dc->remoteid;
 	dc->dr.rib = dc->loc_rib;
 	dc->dr.cookie = dc;
 	dc->dr.io_error = dr_dw_io_error;
 
+	dc->dw.fd = &dc->fd;
 	dc->dw.myid = dc->myid;
 	dc->dw.remoteid = dc->remoteid;
 	dc->dw.rib = dc->loc_rib;
@@ -72,7 +72,15 @@ static void handle_dgp_read(void *_conn)
 {
 	struct conn *conn = _conn;
 
-	if (dgp_reader_read(&conn->dr, conn->fd.fd) < 0)
+	if (dgp_reader_read(&conn->dr) < 0)
+		conn_kill(conn);
+}
+
+static void handle_dgp_write(void *_conn)
+{
+	struct conn *conn = _conn;
+
+	if (dgp_writer_write(&conn->dw) < 0)
 		conn_kill(conn);
 }
 
@@ -138,8 +146,10 @@ static void got_connection(void *_dls)
 	conn->fd.fd = fd;
 	conn->fd.cookie = conn;
 	conn->fd.handler_in = handle_dgp_read;
+	conn->fd.handler_out = handle_dgp_write;
 	iv_fd_register(&conn->fd);
 
+	conn->dr.fd = &conn->fd;
 	conn->dr.myid = dls->myid;
 	conn->dr.remoteid = (dle != NULL) ? dle->remoteid : NULL;
 	conn->dr.rib = dls->loc_rib;
@@ -147,7 +157,7 @@ static void got_connection(void *_dls)
 	conn->dr.io_error = dr_dw_io_error;
 	dgp_reader_register(&conn->dr);
 
-	conn->dw.fd = fd;
+	conn->dw.fd = &conn->fd;
 	conn->dw.myid = dls->myid;
 	conn->dw.remoteid = (dle != NULL) ? dle->remoteid : NULL;
 	conn->dw.rib = dls->loc_rib;
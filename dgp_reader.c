@@ -20,13 +20,83 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <iv.h>
+#include <iv_list.h>
+#include <iv_tls.h>
+#include <iv_work.h>
 #include <string.h>
+#include <unistd.h>
 #include "dgp_reader.h"
 #include "lsa_deserialise.h"
+#include "lsa_serialise.h"
+#include "sig_cache.h"
 #include "util.h"
 
 #define KEEPALIVE_TIMEOUT	15
 
+/*
+ * A received LSA waiting to be applied to the adj_rib_in.  While its
+ * signature is being verified, the entry is owned by the batch that
+ * it is part of, and the batch frees it if the reader goes away in
+ * the meantime.
+ *
+ * ->valid is the verdict on the signature that is handed to the
+ * adj_rib_in along with the LSA, or -1 if we have none.  ->sig holds
+ * on to the signature cache entry, if there is one, until the LSA
+ * has been applied.
+ */
+struct dgp_reader_lsa {
+	struct iv_list_head	list;
+	struct lsa		*lsa;
+	int			ready;
+	int			checked;
+	int			result;
+	int			valid;
+	struct sig_cache_entry	*sig;
+	struct sig_check	sc;
+};
+
+struct dgp_reader_batch {
+	struct dgp_reader	*dr;
+	struct iv_list_head	list;
+	struct iv_work_item	work;
+	int			num;
+	struct dgp_reader_lsa	*ent[DGP_READER_BATCH];
+};
+
+static uint64_t skipped;
+
+struct dgp_reader_thr_info {
+	int			num_batches;
+	struct iv_work_pool	pool;
+};
+
+static void dgp_reader_tls_init_thread(void *_tinfo)
+{
+	struct dgp_reader_thr_info *tinfo = _tinfo;
+	long cpus;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	tinfo->num_batches = 0;
+
+	IV_WORK_POOL_INIT(&tinfo->pool);
+	tinfo->pool.max_threads = (cpus > 0) ? cpus : 1;
+	tinfo->pool.cookie = NULL;
+	tinfo->pool.thread_start = NULL;
+	tinfo->pool.thread_stop = NULL;
+}
+
+static struct iv_tls_user dgp_reader_tls_user = {
+	.sizeof_state	= sizeof(struct dgp_reader_thr_info),
+	.init_thread	= dgp_reader_tls_init_thread,
+};
+
+static void dgp_reader_tls_init(void) __attribute__((constructor));
+static void dgp_reader_tls_init(void)
+{
+	iv_tls_user_register(&dgp_reader_tls_user);
+}
+
 static void dgp_reader_keepalive_timeout(void *_dr)
 {
 	struct dgp_reader *dr = _dr;
@@ -57,15 +127,297 @@ void dgp_reader_register(struct dgp_reader *dr)
 	dr->keepalive_timeout.cookie = dr;
 	dr->keepalive_timeout.handler = dgp_reader_keepalive_timeout;
 	iv_timer_register(&dr->keepalive_timeout);
+
+	INIT_IV_LIST_HEAD(&dr->pending);
+	dr->num_pending = 0;
+	INIT_IV_LIST_HEAD(&dr->batches);
+	dr->handler_in = NULL;
+}
+
+static void free_entry(struct dgp_reader_lsa *ent)
+{
+	if (ent->sig != NULL)
+		sig_cache_put(ent->sig);
+	if (ent->checked)
+		sig_check_deinit(&ent->sc);
+	lsa_put(ent->lsa);
+	free(ent);
+}
+
+static void apply_ready(struct dgp_reader *dr)
+{
+	while (!iv_list_empty(&dr->pending)) {
+		struct dgp_reader_lsa *ent;
+
+		ent = iv_container_of(dr->pending.next,
+				      struct dgp_reader_lsa, list);
+		if (!ent->ready)
+			break;
+
+		iv_list_del(&ent->list);
+		dr->num_pending--;
+
+		adj_rib_in_add_lsa(&dr->adj_rib_in, ent->lsa, ent->valid);
+		free_entry(ent);
+	}
+}
+
+static void batch_work(void *_b)
+{
+	struct dgp_reader_batch *b = _b;
+	int i;
+
+	for (i = 0; i < b->num; i++) {
+		struct dgp_reader_lsa *ent = b->ent[i];
+
+		ent->result = sig_check_verify(&ent->sc);
+	}
+}
+
+static int parse(struct dgp_reader *dr);
+
+static void batch_complete(void *_b)
+{
+	struct dgp_reader_batch *b = _b;
+	struct dgp_reader *dr = b->dr;
+	struct dgp_reader_thr_info *tinfo;
+	int i;
+
+	for (i = 0; i < b->num; i++) {
+		struct dgp_reader_lsa *ent = b->ent[i];
+
+		if (ent->result >= 0)
+			ent->sig = sig_cache_insert(ent->sc.key, !ent->result);
+		ent->valid = !ent->result;
+
+		if (dr != NULL)
+			ent->ready = 1;
+		else
+			free_entry(ent);
+	}
+
+	if (dr != NULL)
+		iv_list_del(&b->list);
+	free(b);
+
+	tinfo = iv_tls_user_ptr(&dgp_reader_tls_user);
+	if (!--tinfo->num_batches)
+		iv_work_pool_put(&tinfo->pool);
+
+	if (dr == NULL)
+		return;
+
+	apply_ready(dr);
+
+	if (dr->handler_in != NULL &&
+	    dr->num_pending <= DGP_READER_MAX_PENDING / 2) {
+		if (parse(dr) < 0)
+			dr->io_error(dr->cookie);
+	}
+}
+
+static void batch_submit(struct dgp_reader *dr, struct dgp_reader_batch *b)
+{
+	struct dgp_reader_thr_info *tinfo;
+
+	b->dr = dr;
+	iv_list_add_tail(&b->list, &dr->batches);
+
+	IV_WORK_ITEM_INIT(&b->work);
+	b->work.cookie = b;
+	b->work.work = batch_work;
+	b->work.completion = batch_complete;
+
+	tinfo = iv_tls_user_ptr(&dgp_reader_tls_user);
+	if (!tinfo->num_batches++)
+		iv_work_pool_create(&tinfo->pool);
+
+	iv_work_pool_submit_work(&tinfo->pool, &b->work);
 }
 
-int dgp_reader_read(struct dgp_reader *dr, int fd)
+static int queue_lsa(struct dgp_reader *dr, struct lsa *lsa,
+		     struct dgp_reader_batch **batch)
 {
+	struct dgp_reader_lsa *ent;
+	struct dgp_reader_batch *b;
+
+	ent = malloc(sizeof(*ent));
+	if (ent == NULL) {
+		lsa_put(lsa);
+		return -1;
+	}
+
+	iv_list_add_tail(&ent->list, &dr->pending);
+	dr->num_pending++;
+	ent->lsa = lsa;
+	ent->ready = 1;
+	ent->checked = 0;
+	ent->result = -1;
+	ent->valid = -1;
+	ent->sig = NULL;
+
+	/*
+	 * Unsigned LSAs and LSAs whose signatures we have seen before
+	 * can be applied as soon as the LSAs in front of them have been.
+	 * Unsigned LSAs are then rejected by adj_rib_in itself.
+	 */
+	if (sig_check_init(&ent->sc, lsa) < 0)
+		return 0;
+	ent->checked = 1;
+
+	ent->sig = sig_cache_get(ent->sc.key);
+	if (ent->sig != NULL) {
+		ent->valid = ent->sig->valid;
+		return 0;
+	}
+
+	b = *batch;
+	if (b == NULL) {
+		b = malloc(sizeof(*b));
+		if (b == NULL)
+			return 0;
+		b->num = 0;
+		*batch = b;
+	}
+
+	ent->ready = 0;
+	b->ent[b->num++] = ent;
+
+	if (b->num == DGP_READER_BATCH) {
+		batch_submit(dr, b);
+		*batch = NULL;
+	}
+
+	return 0;
+}
+
+/*
+ * Neighbours readvertise LSAs that we already hold.  A record that is
+ * identical to the serialisation of the LSA that the adj_rib_in holds
+ * for its node id wouldn't change anything, as long as no other LSA
+ * for that node id is waiting to be applied in front of it, and is
+ * dropped before it is deserialised.  Returns the length of the
+ * record if it can be dropped, and 0 otherwise.
+ */
+static int unchanged(struct dgp_reader *dr, uint8_t *buf, int buflen)
+{
+	const uint8_t *id;
+	struct lsa *lsa;
+	struct iv_list_head *ilh;
+	int len;
+
+	len = lsa_deserialise_id(&id, buf, buflen);
+	if (len <= 0 || id == NULL)
+		return 0;
+
+	lsa = adj_rib_in_find_lsa(&dr->adj_rib_in, id);
+	if (lsa == NULL || !lsa_serialise_matches(lsa, buf, len))
+		return 0;
+
+	iv_list_for_each (ilh, &dr->pending) {
+		struct dgp_reader_lsa *ent;
+
+		ent = iv_container_of(ilh, struct dgp_reader_lsa, list);
+		if (!memcmp(ent->lsa->id, id, NODE_ID_LEN))
+			return 0;
+	}
+
+	return len;
+}
+
+static int parse(struct dgp_reader *dr)
+{
+	struct dgp_reader_batch *batch;
 	int ret;
 	int off;
+	int full;
 
+	ret = 0;
+
+	off = 0;
 	do {
-		ret = read(fd, dr->buf + dr->bytes,
+		batch = NULL;
+		full = 0;
+
+		while (off < dr->bytes) {
+			int len;
+			struct lsa *lsa;
+
+			if (dr->num_pending >= DGP_READER_MAX_PENDING) {
+				full = 1;
+				break;
+			}
+
+			if (dr->remoteid != NULL) {
+				len = unchanged(dr, dr->buf + off,
+						dr->bytes - off);
+				if (len > 0) {
+					skipped++;
+					off += len;
+					continue;
+				}
+			}
+
+			len = lsa_deserialise(&lsa, dr->buf + off,
+					      dr->bytes - off);
+			if (len < 0) {
+				ret = -1;
+				break;
+			}
+
+			if (len == 0) {
+				if (off == 0 && dr->bytes == sizeof(dr->buf))
+					ret = -1;
+				break;
+			}
+
+			off += len;
+
+			if (lsa != NULL) {
+				if (dr->remoteid == NULL) {
+					lsa_put(lsa);
+				} else if (queue_lsa(dr, lsa, &batch) < 0) {
+					ret = -1;
+					break;
+				}
+			}
+		}
+
+		if (batch != NULL)
+			batch_submit(dr, batch);
+
+		apply_ready(dr);
+
+		/*
+		 * If none of the pending LSAs needed verifying, they
+		 * have all been applied by now, and there is no batch
+		 * whose completion would resume parsing, so we have to
+		 * carry on ourselves.
+		 */
+	} while (!ret && full && dr->num_pending < DGP_READER_MAX_PENDING);
+
+	dr->bytes -= off;
+	memmove(dr->buf, dr->buf + off, dr->bytes);
+
+	if (full && dr->num_pending >= DGP_READER_MAX_PENDING) {
+		if (dr->handler_in == NULL) {
+			dr->handler_in = dr->fd->handler_in;
+			iv_fd_set_handler_in(dr->fd, NULL);
+		}
+	} else if (dr->handler_in != NULL) {
+		iv_fd_set_handler_in(dr->fd, dr->handler_in);
+		dr->handler_in = NULL;
+	}
+
+	return ret;
+}
+
+int dgp_reader_read(struct dgp_reader *dr)
+{
+	int ret;
+
+	do {
+		ret = read(dr->fd->fd, dr->buf + dr->bytes,
 			   sizeof(dr->buf) - dr->bytes);
 	} while (ret < 0 && errno == EINTR);
 
@@ -87,39 +439,38 @@ int dgp_reader_read(struct dgp_reader *dr, int fd)
 			1000 * KEEPALIVE_TIMEOUT, 1000 * KEEPALIVE_TIMEOUT);
 	iv_timer_register(&dr->keepalive_timeout);
 
-	off = 0;
-	while (off < dr->bytes) {
-		int len;
-		struct lsa *lsa;
-
-		len = lsa_deserialise(&lsa, dr->buf + off, dr->bytes - off);
-		if (len < 0)
-			return -1;
+	return parse(dr);
+}
 
-		if (len == 0) {
-			if (off == 0 && dr->bytes == sizeof(dr->buf))
-				return -1;
-			break;
-		}
+void dgp_reader_print_stats(FILE *fp)
+{
+	fprintf(fp, "dgp reader: %llu unchanged LSAs skipped\n",
+		(unsigned long long)skipped);
+}
 
-		if (lsa != NULL) {
-			if (dr->remoteid != NULL)
-				adj_rib_in_add_lsa(&dr->adj_rib_in, lsa);
+void dgp_reader_unregister(struct dgp_reader *dr)
+{
+	struct iv_list_head *ilh;
+	struct iv_list_head *ilh2;
 
-			lsa_put(lsa);
-		}
+	iv_list_for_each_safe (ilh, ilh2, &dr->batches) {
+		struct dgp_reader_batch *b;
 
-		off += len;
+		b = iv_container_of(ilh, struct dgp_reader_batch, list);
+		iv_list_del(&b->list);
+		b->dr = NULL;
 	}
 
-	dr->bytes -= off;
-	memmove(dr->buf, dr->buf + off, dr->bytes);
+	iv_list_for_each_safe (ilh, ilh2, &dr->pending) {
+		struct dgp_reader_lsa *ent;
 
-	return 0;
-}
+		ent = iv_container_of(ilh, struct dgp_reader_lsa, list);
+		iv_list_del(&ent->list);
+		if (ent->ready)
+			free_entry(ent);
+	}
+	dr->num_pending = 0;
 
-void dgp_reader_unregister(struct dgp_reader *dr)
-{
 	if (dr->remoteid != NULL) {
 		adj_rib_in_truncate(&dr->adj_rib_in);
 		rib_listener_to_loc_deinit(&dr->to_loc);
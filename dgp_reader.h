@@ -21,12 +21,25 @@
 #define __DGP_READER_H
 
 #include <iv.h>
+#include <iv_list.h>
 #include "adj_rib_in.h"
 #include "loc_rib.h"
 #include "rib_listener.h"
 #include "rib_listener_to_loc.h"
 
+/*
+ * Signatures of received LSAs that aren't in the signature cache yet
+ * are verified in batches of DGP_READER_BATCH on a work pool, while
+ * LSAs are still applied to the adj_rib_in in the order in which they
+ * were received.  If more than DGP_READER_MAX_PENDING LSAs are waiting
+ * to be applied, we stop reading from the file descriptor until that
+ * number has dropped to half of that.
+ */
+#define DGP_READER_BATCH	32
+#define DGP_READER_MAX_PENDING	1024
+
 struct dgp_reader {
+	struct iv_fd		*fd;
 	const uint8_t		*myid;
 	const uint8_t		*remoteid;
 	struct loc_rib		*rib;
@@ -38,11 +51,16 @@ struct dgp_reader {
 	struct adj_rib_in		adj_rib_in;
 	struct rib_listener_to_loc	to_loc;
 	struct iv_timer			keepalive_timeout;
+	struct iv_list_head		pending;
+	int				num_pending;
+	struct iv_list_head		batches;
+	void				(*handler_in)(void *cookie);
 };
 
 void dgp_reader_register(struct dgp_reader *dr);
-int dgp_reader_read(struct dgp_reader *dr, int fd);
+int dgp_reader_read(struct dgp_reader *dr);
 void dgp_reader_unregister(struct dgp_reader *dr);
+void dgp_reader_print_stats(FILE *fp);
 
 
 #endif
@@ -17,9 +17,28 @@
  * Boston, MA 02110-1301, USA.
  */
 
+/*
+ * Updates for the neighbour are queued per node id, and an update
+ * that is still queued when a newer one for the same node id comes in
+ * is replaced by it, so a node whose LSA changes many times while the
+ * socket is full is only sent once.  The queue is flushed from an
+ * iv_task, so that all updates resulting from one loc_rib change go
+ * out together, and the serialised LSAs are collected in ->buf and
+ * written with one write() call per buffer.  Once a record has made
+ * it into ->buf, it is sent as it is.
+ *
+ * The initial dump of the loc_rib is not queued, but streamed from
+ * the loc_rib in node id order whenever the queue is empty, and
+ * updates carrying an LSA for node ids that the dump hasn't reached
+ * yet are left to the dump.  If more than DGP_WRITER_MAX_QUEUED bytes
+ * of LSAs are queued, we resynchronise by dropping the queued LSAs
+ * and dumping the loc_rib again.  Withdrawals are never dropped, as
+ * the dump can't recreate them.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <netinet/tcp.h>
+#include <errno.h>
 #include <string.h>
 #include "dgp_writer.h"
 #include "lsa_path.h"
@@ -29,6 +48,24 @@
 
 #define KEEPALIVE_INTERVAL	10
 
+struct dgp_writer_update {
+	struct iv_avl_node	an;
+	struct iv_list_head	list;
+	uint8_t			id[NODE_ID_LEN];
+	struct lsa		*lsa;
+};
+
+static int compare_updates(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct dgp_writer_update *a;
+	struct dgp_writer_update *b;
+
+	a = iv_container_of(_a, struct dgp_writer_update, an);
+	b = iv_container_of(_b, struct dgp_writer_update, an);
+
+	return memcmp(a->id, b->id, NODE_ID_LEN);
+}
+
 static struct lsa *map(struct dgp_writer *dw, struct lsa *lsa)
 {
 	struct lsa_attr *attr;
@@ -46,51 +83,157 @@ static struct lsa *map(struct dgp_writer *dw, struct lsa *lsa)
 	return lsa;
 }
 
-static int
+static size_t update_bytes(struct lsa *lsa)
+{
+	if (lsa != NULL)
+		return lsa->bytes;
+
+	return MAX_SERIALISED_INT_LEN + NODE_ID_LEN;
+}
+
+static struct dgp_writer_update *
+find_update(struct dgp_writer *dw, const uint8_t *id)
+{
+	struct iv_avl_node *an;
+
+	an = dw->updates.root;
+	while (an != NULL) {
+		struct dgp_writer_update *u;
+		int ret;
+
+		u = iv_container_of(an, struct dgp_writer_update, an);
+
+		ret = memcmp(id, u->id, NODE_ID_LEN);
+		if (ret == 0)
+			return u;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static void free_update(struct dgp_writer *dw, struct dgp_writer_update *u)
+{
+	iv_avl_tree_delete(&dw->updates, &u->an);
+	iv_list_del(&u->list);
+	dw->queued -= update_bytes(u->lsa);
+	if (u->lsa != NULL)
+		lsa_put(u->lsa);
+	free(u);
+}
+
+static int dumped(struct dgp_writer *dw, const uint8_t *id)
+{
+	if (!dw->dumping)
+		return 1;
+
+	return dw->dump_started &&
+	       memcmp(id, dw->dump_last, NODE_ID_LEN) <= 0;
+}
+
+static struct loc_rib_id *dump_next(struct dgp_writer *dw)
+{
+	struct loc_rib_id *next;
+	struct iv_avl_node *an;
+
+	next = NULL;
+
+	an = dw->rib->ids.root;
+	while (an != NULL) {
+		struct loc_rib_id *rid;
+
+		rid = iv_container_of(an, struct loc_rib_id, an);
+
+		if (!dw->dump_started ||
+		    memcmp(rid->id, dw->dump_last, NODE_ID_LEN) > 0) {
+			next = rid;
+			an = an->left;
+		} else {
+			an = an->right;
+		}
+	}
+
+	return next;
+}
+
+static void resync(struct dgp_writer *dw)
+{
+	struct iv_list_head *ilh;
+	struct iv_list_head *ilh2;
+
+	iv_list_for_each_safe (ilh, ilh2, &dw->queue) {
+		struct dgp_writer_update *u;
+
+		u = iv_container_of(ilh, struct dgp_writer_update, list);
+		if (u->lsa != NULL)
+			free_update(dw, u);
+	}
+
+	dw->dumping = 1;
+	dw->dump_started = 0;
+}
+
+static void schedule(struct dgp_writer *dw)
+{
+	if (dw->fd->handler_out == NULL && !iv_task_registered(&dw->flush))
+		iv_task_register(&dw->flush);
+}
+
+static void
 dgp_writer_output_lsa(struct dgp_writer *dw, struct lsa *old, struct lsa *new)
 {
-	size_t serlen;
-	size_t buflen;
-	uint8_t *buf;
-	size_t len;
-	struct lsa dummy;
+	struct dgp_writer_update *u;
+	const uint8_t *id;
 	struct lsa *lsa;
 
 	lsa = map(dw, new);
 	if (lsa == NULL) {
 		if (map(dw, old) == NULL)
-			return 0;
+			return;
+		id = old->id;
+	} else {
+		id = lsa->id;
+	}
 
-		memcpy(&dummy.id, old->id, NODE_ID_LEN);
-		INIT_IV_AVL_TREE(&dummy.root.attrs, NULL);
+	u = find_update(dw, id);
 
-		lsa = &dummy;
+	if (lsa != NULL && !dumped(dw, id)) {
+		if (u != NULL)
+			free_update(dw, u);
+		return;
 	}
 
-	serlen = lsa_serialise_length(lsa, 0, dw->myid);
-	if (serlen > 65536 - 128)
-		abort();
+	if (u == NULL) {
+		u = malloc(sizeof(*u));
+		if (u == NULL) {
+			fprintf(stderr, "dgp_writer_output_lsa: memory "
+					"allocation failure\n");
+			dw->io_error(dw->cookie);
+			return;
+		}
 
-	buflen = serlen + 128;
-	buf = alloca(buflen);
+		memcpy(u->id, id, NODE_ID_LEN);
+		u->lsa = NULL;
+		iv_avl_tree_insert(&dw->updates, &u->an);
+		iv_list_add_tail(&u->list, &dw->queue);
+		dw->queued += update_bytes(NULL);
+	}
 
-	len = lsa_serialise(buf, buflen, serlen, lsa, 0, dw->myid);
-	if (len > buflen)
-		abort();
+	dw->queued -= update_bytes(u->lsa);
+	if (u->lsa != NULL)
+		lsa_put(u->lsa);
 
-	if (write(dw->fd, buf, len) != len) {
-		dw->io_error(dw->cookie);
-		return 1;
-	}
+	u->lsa = (lsa != NULL) ? lsa_get(lsa) : NULL;
+	dw->queued += update_bytes(u->lsa);
 
-	iv_timer_unregister(&dw->keepalive_timer);
-	iv_validate_now();
-	dw->keepalive_timer.expires = iv_now;
-	timespec_add_ms(&dw->keepalive_timer.expires,
-			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
-	iv_timer_register(&dw->keepalive_timer);
+	if (dw->queued > DGP_WRITER_MAX_QUEUED)
+		resync(dw);
 
-	return 0;
+	schedule(dw);
 }
 
 static void dgp_writer_lsa_add(void *_dw, struct lsa *lsa, uint32_t cost)
@@ -115,50 +258,129 @@ static void dgp_writer_lsa_del(void *_dw, struct lsa *lsa, uint32_t cost)
 	dgp_writer_output_lsa(dw, lsa, NULL);
 }
 
-static void cork_fd(int fd, int state)
+/*
+ * Appends the serialisation of the LSA, or of an empty LSA for the
+ * given node id if lsa is NULL, to ->buf, if there is room for it.
+ */
+static int append_lsa(struct dgp_writer *dw, const uint8_t *id,
+		      struct lsa *lsa)
 {
-	if (setsockopt(fd, SOL_TCP, TCP_CORK, &state, sizeof(state)) < 0) {
-		perror("setsockopt(SOL_TCP, TCP_CORK)");
-		abort();
-	}
-}
+	struct lsa dummy;
+	struct lsa_body dummy_body;
+	size_t serlen;
+	size_t buflen;
 
-static int dgp_writer_send_keepalive(struct dgp_writer *dw)
-{
-	if (write(dw->fd, "", 1) != 1) {
-		dw->io_error(dw->cookie);
-		return 1;
+	if (lsa == NULL) {
+		memcpy(&dummy.id, id, NODE_ID_LEN);
+		dummy.path.num = 0;
+		dummy.path.off = 0;
+		memset(&dummy_body, 0, sizeof(dummy_body));
+		dummy.body = &dummy_body;
+
+		lsa = &dummy;
 	}
 
-	return 0;
+	serlen = lsa_serialise_length(lsa, 0, dw->myid);
+	if (serlen > sizeof(dw->buf) - 128)
+		abort();
+
+	buflen = sizeof(dw->buf) - dw->bytes;
+	if (serlen + MAX_SERIALISED_INT_LEN > buflen)
+		return 0;
+
+	dw->bytes += lsa_serialise(dw->buf + dw->bytes, buflen,
+				   serlen, lsa, 0, dw->myid);
+
+	return 1;
 }
 
-static void dgp_writer_rib_dump(struct dgp_writer *dw)
+static void fill(struct dgp_writer *dw)
 {
-	struct iv_avl_node *an;
+	while (!iv_list_empty(&dw->queue)) {
+		struct dgp_writer_update *u;
 
-	if (iv_avl_tree_empty(&dw->rib->ids)) {
-		dgp_writer_send_keepalive(dw);
-		return;
-	}
+		u = iv_container_of(dw->queue.next,
+				    struct dgp_writer_update, list);
+		if (!append_lsa(dw, u->id, u->lsa))
+			return;
 
-	cork_fd(dw->fd, 1);
+		free_update(dw, u);
+	}
 
-	iv_avl_tree_for_each (an, &dw->rib->ids) {
+	while (dw->dumping) {
 		struct loc_rib_id *rid;
+		struct lsa *lsa;
 
-		rid = iv_container_of(an, struct loc_rib_id, an);
-		if (rid->best == NULL)
-			continue;
+		rid = dump_next(dw);
+		if (rid == NULL) {
+			if (dw->bytes == sizeof(dw->buf))
+				return;
 
-		if (dgp_writer_output_lsa(dw, NULL, rid->best))
+			dw->buf[dw->bytes++] = 0;
+			dw->dumping = 0;
+			break;
+		}
+
+		lsa = map(dw, rid->best);
+		if (lsa != NULL && !append_lsa(dw, rid->id, lsa))
 			return;
+
+		memcpy(dw->dump_last, rid->id, NODE_ID_LEN);
+		dw->dump_started = 1;
 	}
+}
 
-	if (dgp_writer_send_keepalive(dw))
-		return;
+int dgp_writer_write(struct dgp_writer *dw)
+{
+	while (1) {
+		int ret;
+
+		fill(dw);
+		if (!dw->bytes)
+			break;
+
+		do {
+			ret = write(dw->fd->fd, dw->buf, dw->bytes);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				break;
+			perror("dgp_writer_write");
+			return -1;
+		}
+
+		dw->bytes -= ret;
+		memmove(dw->buf, dw->buf + ret, dw->bytes);
+
+		iv_timer_unregister(&dw->keepalive_timer);
+		iv_validate_now();
+		dw->keepalive_timer.expires = iv_now;
+		timespec_add_ms(&dw->keepalive_timer.expires,
+				900 * KEEPALIVE_INTERVAL,
+				1100 * KEEPALIVE_INTERVAL);
+		iv_timer_register(&dw->keepalive_timer);
+
+		if (dw->bytes)
+			break;
+	}
+
+	if (dw->bytes) {
+		if (dw->fd->handler_out == NULL)
+			iv_fd_set_handler_out(dw->fd, dw->handler_out);
+	} else if (dw->fd->handler_out != NULL) {
+		iv_fd_set_handler_out(dw->fd, NULL);
+	}
 
-	cork_fd(dw->fd, 0);
+	return 0;
+}
+
+static void dgp_writer_flush(void *_dw)
+{
+	struct dgp_writer *dw = _dw;
+
+	if (dgp_writer_write(dw) < 0)
+		dw->io_error(dw->cookie);
 }
 
 static void dgp_writer_keepalive_timer(void *_dw)
@@ -171,7 +393,10 @@ static void dgp_writer_keepalive_timer(void *_dw)
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&dw->keepalive_timer);
 
-	dgp_writer_send_keepalive(dw);
+	if (dw->bytes < sizeof(dw->buf)) {
+		dw->buf[dw->bytes++] = 0;
+		schedule(dw);
+	}
 }
 
 void dgp_writer_register(struct dgp_writer *dw)
@@ -191,11 +416,36 @@ void dgp_writer_register(struct dgp_writer *dw)
 	dw->keepalive_timer.handler = dgp_writer_keepalive_timer;
 	iv_timer_register(&dw->keepalive_timer);
 
-	dgp_writer_rib_dump(dw);
+	IV_TASK_INIT(&dw->flush);
+	dw->flush.cookie = dw;
+	dw->flush.handler = dgp_writer_flush;
+
+	dw->handler_out = dw->fd->handler_out;
+	iv_fd_set_handler_out(dw->fd, NULL);
+
+	INIT_IV_AVL_TREE(&dw->updates, compare_updates);
+	INIT_IV_LIST_HEAD(&dw->queue);
+	dw->queued = 0;
+	dw->dumping = 1;
+	dw->dump_started = 0;
+	dw->bytes = 0;
+
+	schedule(dw);
 }
 
 void dgp_writer_unregister(struct dgp_writer *dw)
 {
 	loc_rib_listener_unregister(dw->rib, &dw->from_loc);
 	iv_timer_unregister(&dw->keepalive_timer);
+
+	if (iv_task_registered(&dw->flush))
+		iv_task_unregister(&dw->flush);
+
+	while (!iv_list_empty(&dw->queue)) {
+		struct dgp_writer_update *u;
+
+		u = iv_container_of(dw->queue.next,
+				    struct dgp_writer_update, list);
+		free_update(dw, u);
+	}
 }
@@ -21,11 +21,22 @@
 #define __DGP_WRITER_H
 
 #include <iv.h>
+#include <iv_avl.h>
+#include <iv_list.h>
 #include "loc_rib.h"
 #include "rib_listener.h"
 
+/*
+ * The handler_out of ->fd, which the writer saves when it is
+ * registered and only enables while it has output pending, should
+ * call dgp_writer_write().  If more than DGP_WRITER_MAX_QUEUED bytes
+ * of LSAs are waiting to be sent, the writer resynchronises by
+ * dumping the loc_rib again instead.
+ */
+#define DGP_WRITER_MAX_QUEUED	1048576
+
 struct dgp_writer {
-	int			fd;
+	struct iv_fd		*fd;
 	const uint8_t		*myid;
 	const uint8_t		*remoteid;
 	struct loc_rib		*rib;
@@ -34,9 +45,20 @@ struct dgp_writer {
 
 	struct rib_listener	from_loc;
 	struct iv_timer		keepalive_timer;
+	struct iv_task		flush;
+	void			(*handler_out)(void *cookie);
+	struct iv_avl_tree	updates;
+	struct iv_list_head	queue;
+	size_t			queued;
+	int			dumping;
+	int			dump_started;
+	uint8_t			dump_last[NODE_ID_LEN];
+	int			bytes;
+	uint8_t			buf[65536];
 };
 
 void dgp_writer_register(struct dgp_writer *dw);
+int dgp_writer_write(struct dgp_writer *dw);
 void dgp_writer_unregister(struct dgp_writer *dw);
 
 
@@ -0,0 +1,294 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * Data plane worker threads.  Each worker runs its own ivykis event
+ * loop, and owns the tun interfaces and TLS connections of the peers
+ * that have been assigned to it.  A peer's TLS session is a single
+ * ordered stream, so all of a peer's traffic is handled by the same
+ * worker, and we spread the load by spreading peers across workers.
+ *
+ * We don't shard per flow over IFF_MULTI_QUEUE tun queues, as every
+ * packet read from any of those queues would still have to be handed
+ * to the one thread that encrypts for the peer's session, and that
+ * cross-thread handoff would cost more than the tun read it saves.
+ * A single busy peer is therefore limited to one core.
+ *
+ * The control plane (loc_rib, dgp, interface configuration) stays on
+ * the main thread.  Workers hand state changes to the main thread with
+ * dp_main_post(), and the main thread runs data plane operations on a
+ * worker with dp_worker_call(), which waits for the call to complete.
+ *
+ * With zero workers, everything runs on the main thread, and both of
+ * these degenerate into direct function calls.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iv.h>
+#include <iv_event.h>
+#include <iv_list.h>
+#include <iv_thread.h>
+#include <pthread.h>
+#include <string.h>
+#include "dp_worker.h"
+
+static struct dp_worker dp_main;
+static struct dp_worker *workers;
+static int num_workers;
+
+static void dp_worker_run_calls(void *_w)
+{
+	struct dp_worker *w = _w;
+
+	pthread_mutex_lock(&w->lock);
+	while (!iv_list_empty(&w->calls)) {
+		struct dp_call *call;
+
+		call = iv_container_of(w->calls.next, struct dp_call, list);
+		iv_list_del(&call->list);
+
+		pthread_mutex_unlock(&w->lock);
+		call->handler(call);
+		pthread_mutex_lock(&w->lock);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void dp_worker_post(struct dp_worker *w, struct dp_call *call)
+{
+	pthread_mutex_lock(&w->lock);
+	iv_list_add_tail(&call->list, &w->calls);
+	pthread_mutex_unlock(&w->lock);
+
+	iv_event_post(&w->ev);
+}
+
+static void dp_worker_init(struct dp_worker *w, int index)
+{
+	w->index = index;
+	w->num_peers = 0;
+	memset(&w->stats, 0, sizeof(w->stats));
+
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	w->running = 0;
+	INIT_IV_LIST_HEAD(&w->calls);
+
+	IV_EVENT_INIT(&w->ev);
+	w->ev.cookie = w;
+	w->ev.handler = dp_worker_run_calls;
+}
+
+static void dp_worker_thread(void *_w)
+{
+	struct dp_worker *w = _w;
+
+	w->thread = pthread_self();
+	iv_event_register(&w->ev);
+
+	pthread_mutex_lock(&w->lock);
+	w->running = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	iv_main();
+}
+
+void dp_workers_start(int num)
+{
+	int i;
+
+	dp_worker_init(&dp_main, 0);
+	dp_main.thread = pthread_self();
+	dp_main.running = 1;
+	iv_event_register(&dp_main.ev);
+
+	num_workers = num;
+	if (!num_workers)
+		return;
+
+	workers = calloc(num_workers, sizeof(*workers));
+	if (workers == NULL) {
+		fprintf(stderr, "dp_workers_start: error allocating "
+				"memory for %d workers\n", num_workers);
+		abort();
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		struct dp_worker *w = &workers[i];
+		char name[32];
+
+		dp_worker_init(w, i + 1);
+
+		snprintf(name, sizeof(name), "dp_worker/%d", w->index);
+		if (iv_thread_create(name, dp_worker_thread, w) < 0) {
+			fprintf(stderr, "dp_workers_start: error "
+					"creating worker thread\n");
+			abort();
+		}
+
+		pthread_mutex_lock(&w->lock);
+		while (!w->running)
+			pthread_cond_wait(&w->cond, &w->lock);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+static int dp_worker_quit(void *_w)
+{
+	struct dp_worker *w = _w;
+
+	iv_event_unregister(&w->ev);
+
+	return 0;
+}
+
+void dp_workers_stop(void)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++)
+		dp_worker_call(&workers[i], dp_worker_quit, &workers[i]);
+
+	dp_main_flush();
+	iv_event_unregister(&dp_main.ev);
+}
+
+struct dp_worker *dp_worker_assign(void)
+{
+	struct dp_worker *w;
+	int i;
+
+	if (!num_workers) {
+		dp_main.num_peers++;
+		return &dp_main;
+	}
+
+	w = &workers[0];
+	for (i = 1; i < num_workers; i++) {
+		if (workers[i].num_peers < w->num_peers)
+			w = &workers[i];
+	}
+
+	w->num_peers++;
+
+	return w;
+}
+
+void dp_worker_release(struct dp_worker *w)
+{
+	w->num_peers--;
+}
+
+struct dp_sync_call {
+	struct dp_call		call;
+	struct dp_worker	*w;
+	int			(*handler)(void *cookie);
+	void			*cookie;
+	int			ret;
+	int			done;
+};
+
+static void dp_sync_call_handler(struct dp_call *call)
+{
+	struct dp_sync_call *sc;
+	int ret;
+
+	sc = iv_container_of(call, struct dp_sync_call, call);
+
+	ret = sc->handler(sc->cookie);
+
+	pthread_mutex_lock(&sc->w->lock);
+	sc->ret = ret;
+	sc->done = 1;
+	pthread_cond_broadcast(&sc->w->cond);
+	pthread_mutex_unlock(&sc->w->lock);
+}
+
+int dp_worker_call(struct dp_worker *w, int (*handler)(void *), void *cookie)
+{
+	struct dp_sync_call sc;
+
+	if (pthread_equal(w->thread, pthread_self()))
+		return handler(cookie);
+
+	sc.call.handler = dp_sync_call_handler;
+	sc.w = w;
+	sc.handler = handler;
+	sc.cookie = cookie;
+	sc.done = 0;
+
+	dp_worker_post(w, &sc.call);
+
+	pthread_mutex_lock(&w->lock);
+	while (!sc.done)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	return sc.ret;
+}
+
+void dp_main_post(struct dp_call *call)
+{
+	if (pthread_equal(dp_main.thread, pthread_self()))
+		call->handler(call);
+	else
+		dp_worker_post(&dp_main, call);
+}
+
+void dp_main_flush(void)
+{
+	dp_worker_run_calls(&dp_main);
+}
+
+static void print_worker_stats(FILE *fp, struct dp_worker *w)
+{
+	struct dp_worker_stats *st = &w->stats;
+
+	if (w == &dp_main)
+		fprintf(fp, "main: ");
+	else
+		fprintf(fp, "worker %d: ", w->index);
+
+	fprintf(fp, "%d peers, tun rx %llu packets / %llu bytes, "
+		    "tun tx %llu packets / %llu bytes, "
+		    "%llu records sent, %llu records received, "
+		    "%llu datagrams sent, %llu datagrams received\n",
+		w->num_peers,
+		(unsigned long long)st->tun_rx_packets,
+		(unsigned long long)st->tun_rx_bytes,
+		(unsigned long long)st->tun_tx_packets,
+		(unsigned long long)st->tun_tx_bytes,
+		(unsigned long long)st->records_tx,
+		(unsigned long long)st->records_rx,
+		(unsigned long long)st->udp_tx,
+		(unsigned long long)st->udp_rx);
+}
+
+void dp_workers_print_stats(FILE *fp)
+{
+	int i;
+
+	if (!num_workers)
+		print_worker_stats(fp, &dp_main);
+
+	for (i = 0; i < num_workers; i++)
+		print_worker_stats(fp, &workers[i]);
+}
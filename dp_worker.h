@@ -0,0 +1,68 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __DP_WORKER_H
+#define __DP_WORKER_H
+
+#include <iv_event.h>
+#include <iv_list.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+struct dp_worker_stats {
+	uint64_t		tun_rx_packets;
+	uint64_t		tun_rx_bytes;
+	uint64_t		tun_tx_packets;
+	uint64_t		tun_tx_bytes;
+	uint64_t		records_tx;
+	uint64_t		records_rx;
+	uint64_t		udp_tx;
+	uint64_t		udp_rx;
+};
+
+struct dp_worker {
+	int			index;
+	int			num_peers;
+	struct dp_worker_stats	stats;
+
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			running;
+	struct iv_list_head	calls;
+	struct iv_event		ev;
+};
+
+struct dp_call {
+	struct iv_list_head	list;
+	void			(*handler)(struct dp_call *call);
+};
+
+void dp_workers_start(int num);
+void dp_workers_stop(void);
+struct dp_worker *dp_worker_assign(void);
+void dp_worker_release(struct dp_worker *w);
+int dp_worker_call(struct dp_worker *w, int (*handler)(void *), void *cookie);
+void dp_main_post(struct dp_call *call);
+void dp_main_flush(void);
+void dp_workers_print_stats(FILE *fp);
+
+
+#endif
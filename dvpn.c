@@ -27,22 +27,29 @@
 #include <string.h>
 #include "conf.h"
 #include "confdiff.h"
+#include "dp_worker.h"
 #include "itf.h"
 #include "loc_rib_print.h"
 #include "lsa.h"
 #include "lsa_path.h"
 #include "lsa_serialise.h"
 #include "lsa_type.h"
+#include "pubkey_cache.h"
 #include "rt_builder.h"
+#include "sig_cache.h"
 #include "tconn_connect.h"
 #include "tconn_listen.h"
+#include "tls_prio.h"
 #include "tun.h"
 #include "util.h"
 #include "x509.h"
 
+static const char *config = "/etc/dvpn.ini";
+static struct conf *conf;
 static gnutls_x509_privkey_t privkey;
 static gnutls_x509_privkey_t rolekey;
 static uint8_t keyid[NODE_ID_LEN];
+static uint8_t mylladdr[16];
 static int numcrts;
 static gnutls_x509_crt_t crt[2];
 static struct loc_rib loc_rib;
@@ -134,23 +141,24 @@ conf_peer_type_to_lsa_peer_flags(enum conf_peer_type type)
 	}
 }
 
-static void lsa_add_version(struct lsa *lsa, uint64_t version)
+static void lsa_add_version(struct lsa_builder *b, uint64_t version)
 {
 	uint32_t t32[2];
 
 	t32[0] = htonl((version >> 32) & 0xffffffff);
 	t32[1] = htonl(version & 0xffffffff);
-	lsa_add_attr(lsa, LSA_ATTR_TYPE_VERSION, 1, NULL, 0, t32, sizeof(t32));
+	lsa_builder_add_attr(b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_VERSION, 1,
+			     NULL, 0, t32, sizeof(t32));
 }
 
-static void lsa_update_version(struct lsa *lsa)
+static void lsa_update_version(struct lsa_builder *b, struct lsa *old)
 {
 	struct lsa_attr *attr;
 	uint32_t *data;
 	uint64_t curver;
 	uint64_t t64;
 
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_VERSION, NULL, 0);
+	attr = lsa_find_attr(old, LSA_ATTR_TYPE_VERSION, NULL, 0);
 	if (attr == NULL)
 		abort();
 
@@ -160,25 +168,28 @@ static void lsa_update_version(struct lsa *lsa)
 	curver <<= 32;
 	curver |= ntohl(data[1]);
 
-	lsa_del_attr(lsa, attr);
+	if (lsa_builder_del_attr(b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_VERSION,
+				 NULL, 0) < 0) {
+		abort();
+	}
 
 	t64 = time(NULL);
 	t64 <<= 8;
 	if (t64 <= curver)
 		t64 = curver + 1;
 
-	lsa_add_version(lsa, t64);
+	lsa_add_version(b, t64);
 }
 
-static void lsa_initial_version(struct lsa *lsa)
+static void lsa_initial_version(struct lsa_builder *b)
 {
 	uint64_t t64;
 
 	t64 = time(NULL);
-	lsa_add_version(lsa, (t64 + 1) << 8);
+	lsa_add_version(b, (t64 + 1) << 8);
 }
 
-static void lsa_add_pubkey(struct lsa *lsa)
+static void lsa_add_pubkey(struct lsa_builder *b)
 {
 	uint8_t buf[65536];
 	int len;
@@ -187,34 +198,33 @@ static void lsa_add_pubkey(struct lsa *lsa)
 	if (len < 0)
 		abort();
 
-	lsa_add_attr(lsa, LSA_ATTR_TYPE_PUBKEY, 1, NULL, 0, buf, len);
+	lsa_builder_add_attr(b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_PUBKEY, 1,
+			     NULL, 0, buf, len);
 }
 
-static void lsa_sign(struct lsa *lsa)
+static void lsa_sign(struct lsa_builder *b)
 {
-	struct lsa_attr *attr;
-	size_t serlen;
-	size_t buflen;
-	void *buf;
+	struct lsa *lsa;
+	const uint8_t *buf;
 	size_t len;
 	gnutls_privkey_t pk;
 	int ret;
 	gnutls_datum_t data;
 	gnutls_datum_t sig;
 
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_SIGNATURE, NULL, 0);
-	if (attr != NULL)
-		lsa_del_attr(lsa, attr);
+	lsa_builder_del_attr(b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_SIGNATURE,
+			     NULL, 0);
 
-	serlen = lsa_serialise_length(lsa, 1, NULL);
-	if (serlen > 65536 - 128)
+	/*
+	 * LSAs are immutable, so serialise the signed attributes from
+	 * a temporary LSA built from what we have so far.
+	 */
+	lsa = lsa_builder_finish(b);
+	if (lsa == NULL)
 		abort();
 
-	buflen = serlen + 128;
-	buf = alloca(buflen);
-
-	len = lsa_serialise(buf, buflen, serlen, lsa, 1, NULL);
-	if (len > buflen)
+	buf = lsa_serialise_signed(lsa, &len);
+	if (buf == NULL)
 		abort();
 
 	ret = gnutls_privkey_init(&pk);
@@ -225,7 +235,7 @@ static void lsa_sign(struct lsa *lsa)
 	if (ret < 0)
 		abort();
 
-	data.data = buf;
+	data.data = (void *)buf;
 	data.size = len;
 	ret = gnutls_privkey_sign_data(pk, GNUTLS_DIG_SHA256, 0, &data, &sig);
 	if (ret < 0)
@@ -233,95 +243,489 @@ static void lsa_sign(struct lsa *lsa)
 
 	gnutls_privkey_deinit(pk);
 
-	lsa_add_attr(lsa, LSA_ATTR_TYPE_SIGNATURE, 0, NULL, 0,
-		     sig.data, sig.size);
+	lsa_put(lsa);
+
+	lsa_builder_add_attr(b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_SIGNATURE, 0,
+			     NULL, 0, sig.data, sig.size);
 
 	gnutls_free(sig.data);
 }
 
+static void mylsa_init(void)
+{
+	struct lsa_builder b;
+
+	lsa_builder_init(&b, keyid);
+	lsa_builder_add_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_ADV_PATH, 0,
+			     NULL, 0, NULL, 0);
+	if (conf->node_name != NULL) {
+		lsa_builder_add_attr(&b, LSA_BUILDER_ROOT,
+				     LSA_ATTR_TYPE_NODE_NAME, 1, NULL, 0,
+				     conf->node_name, strlen(conf->node_name));
+	}
+	lsa_initial_version(&b);
+	lsa_add_pubkey(&b);
+	lsa_sign(&b);
+
+	me = lsa_builder_finish(&b);
+	if (me == NULL)
+		abort();
+
+	lsa_builder_deinit(&b);
+}
+
+static void mylsa_replace(struct lsa_builder *b)
+{
+	struct lsa *newme;
+
+	lsa_update_version(b, me);
+
+	lsa_sign(b);
+
+	newme = lsa_builder_finish(b);
+	if (newme == NULL)
+		abort();
+
+	lsa_builder_deinit(b);
+
+	loc_rib_mod_lsa(&loc_rib, me, newme);
+
+	lsa_put(me);
+	me = newme;
+}
+
 static void
 mylsa_add_peer(const uint8_t *id, enum conf_peer_type type, int cost)
 {
-	struct lsa *newme;
-	struct lsa_attr_set *set;
+	struct lsa_builder b;
+	int set;
 	uint16_t metric;
 	uint8_t peer_flags;
 
-	newme = lsa_clone(me);
+	if (lsa_builder_init_from_lsa(&b, me) < 0)
+		abort();
 
-	set = lsa_add_attr_set(newme, LSA_ATTR_TYPE_PEER, 1, id, NODE_ID_LEN);
+	set = lsa_builder_add_attr_set(&b, LSA_BUILDER_ROOT,
+				       LSA_ATTR_TYPE_PEER, 1, id, NODE_ID_LEN);
 
 	metric = htons(cost);
-	lsa_attr_set_add_attr(newme, set, LSA_PEER_ATTR_TYPE_METRIC, 1,
-			      NULL, 0, &metric, sizeof(metric));
+	lsa_builder_add_attr(&b, set, LSA_PEER_ATTR_TYPE_METRIC, 1,
+			     NULL, 0, &metric, sizeof(metric));
 
 	peer_flags = conf_peer_type_to_lsa_peer_flags(type);
-	lsa_attr_set_add_attr(newme, set, LSA_PEER_ATTR_TYPE_PEER_FLAGS, 1,
-			      NULL, 0, &peer_flags, sizeof(peer_flags));
+	lsa_builder_add_attr(&b, set, LSA_PEER_ATTR_TYPE_PEER_FLAGS, 1,
+			     NULL, 0, &peer_flags, sizeof(peer_flags));
 
-	lsa_update_version(newme);
+	mylsa_replace(&b);
+}
 
-	lsa_sign(newme);
+static void mylsa_del_peer(const uint8_t *id)
+{
+	struct lsa_builder b;
 
-	loc_rib_mod_lsa(&loc_rib, me, newme);
+	if (lsa_builder_init_from_lsa(&b, me) < 0)
+		abort();
 
-	lsa_put(me);
-	me = newme;
+	if (lsa_builder_del_attr(&b, LSA_BUILDER_ROOT, LSA_ATTR_TYPE_PEER,
+				 id, NODE_ID_LEN) < 0) {
+		abort();
+	}
+
+	mylsa_replace(&b);
 }
 
-static void mylsa_del_peer(const uint8_t *id)
+/*
+ * Tunnel records carry one or more [type, len_hi, len_lo, payload]
+ * frames, where type 0x00 frames carry packets.  We always accept
+ * records with multiple frames, but we only send them once the peer
+ * has told us that it can deal with them, by including
+ * RECORD_FEATURE_MULTI_PACKET in a RECORD_TYPE_FEATURES frame.  Peers
+ * that don't know about RECORD_TYPE_FEATURES records silently ignore
+ * them, and will thus keep getting one packet per record.
+ */
+#define RECORD_TYPE_DATA		0x00
+#define RECORD_TYPE_FEATURES		0x01
+#define RECORD_TYPE_GSO_DATA		0x02
+#define RECORD_TYPE_UDP_PORT		0x03
+
+#define RECORD_FEATURE_MULTI_PACKET	0x01
+#define RECORD_FEATURE_GSO		0x02
+
+/*
+ * RECORD_TYPE_GSO_DATA frames carry a TSO/GSO super-packet, preceded
+ * by its virtio_net_hdr fields in network byte order, and are only
+ * sent to peers that advertise RECORD_FEATURE_GSO, which they do if
+ * their tun interface can take such packets.  We only enable offloads
+ * on our tun interface once our peer has advertised this feature, so
+ * that the kernel segments packets for peers that don't support it.
+ *
+ * The packet has to fit in a single frame, so we limit the size of
+ * the super-packets that the kernel builds for our tun interfaces.
+ */
+#define GSO_HDR_LEN			10
+#define GSO_MAX_SIZE			(65535 - GSO_HDR_LEN)
+
+/*
+ * Peers configured for the UDP transport announce the port of their
+ * udp_chan in a RECORD_TYPE_UDP_PORT frame.  The connecting side then
+ * starts sending datagrams to that port, and the listening side learns
+ * its peer's address from those.  Peers that don't use the UDP
+ * transport ignore this frame, and all traffic stays on TLS.
+ */
+static void record_udp_port(uint8_t *buf, int port)
 {
-	struct lsa *newme;
+	buf[0] = RECORD_TYPE_UDP_PORT;
+	buf[1] = 0x00;
+	buf[2] = 0x02;
+	buf[3] = port >> 8;
+	buf[4] = port & 0xff;
+}
+
+static void record_features(uint8_t *buf, struct tun_interface *tun)
+{
+	buf[0] = RECORD_TYPE_FEATURES;
+	buf[1] = 0x00;
+	buf[2] = 0x01;
+	buf[3] = RECORD_FEATURE_MULTI_PACKET;
+	if (tun->vnet_hdr)
+		buf[3] |= RECORD_FEATURE_GSO;
+}
+
+static void record_batch_reset(struct record_batch *batch)
+{
+	batch->enabled = 0;
+	batch->gso = 0;
+	batch->bytes = 0;
+}
 
-	newme = lsa_clone(me);
+static int record_batch_room(struct record_batch *batch, int len)
+{
+	return batch->bytes + len + 3 <= sizeof(batch->buf);
+}
 
-	lsa_del_attr_bykey(newme, LSA_ATTR_TYPE_PEER, id, NODE_ID_LEN);
+static void record_batch_add(struct record_batch *batch, uint8_t *buf, int len)
+{
+	uint8_t *dst;
 
-	lsa_update_version(newme);
+	dst = batch->buf + batch->bytes;
+	dst[0] = RECORD_TYPE_DATA;
+	dst[1] = len >> 8;
+	dst[2] = len & 0xff;
+	memcpy(dst + 3, buf, len);
 
-	lsa_sign(newme);
+	batch->bytes += len + 3;
+}
 
-	loc_rib_mod_lsa(&loc_rib, me, newme);
+static int gso_frame_build(struct record_batch *batch,
+			   const struct virtio_net_hdr *vh,
+			   uint8_t **pbuf, int len)
+{
+	uint8_t *buf;
+
+	if (!batch->gso || len > GSO_MAX_SIZE)
+		return -1;
+
+	buf = *pbuf - GSO_HDR_LEN - 3;
+	buf[0] = RECORD_TYPE_GSO_DATA;
+	buf[1] = (len + GSO_HDR_LEN) >> 8;
+	buf[2] = (len + GSO_HDR_LEN) & 0xff;
+	buf[3] = vh->flags;
+	buf[4] = vh->gso_type;
+	buf[5] = vh->hdr_len >> 8;
+	buf[6] = vh->hdr_len & 0xff;
+	buf[7] = vh->gso_size >> 8;
+	buf[8] = vh->gso_size & 0xff;
+	buf[9] = vh->csum_start >> 8;
+	buf[10] = vh->csum_start & 0xff;
+	buf[11] = vh->csum_offset >> 8;
+	buf[12] = vh->csum_offset & 0xff;
+
+	*pbuf = buf;
+
+	return len + GSO_HDR_LEN + 3;
+}
 
-	lsa_put(me);
-	me = newme;
+static void gso_frame_received(struct dp_worker *dw, struct tun_interface *tun,
+			       const uint8_t *buf, int len)
+{
+	struct virtio_net_hdr vh;
+
+	vh.flags = buf[0];
+	vh.gso_type = buf[1];
+	vh.hdr_len = (buf[2] << 8) | buf[3];
+	vh.gso_size = (buf[4] << 8) | buf[5];
+	vh.csum_start = (buf[6] << 8) | buf[7];
+	vh.csum_offset = (buf[8] << 8) | buf[9];
+
+	dw->stats.tun_tx_packets++;
+	dw->stats.tun_tx_bytes += len - GSO_HDR_LEN;
+	tun_interface_send_gso_packet(tun, &vh, buf + GSO_HDR_LEN,
+				      len - GSO_HDR_LEN);
+}
+
+static void record_received(struct dp_worker *dw, struct tun_interface *tun,
+			    struct record_batch *batch, struct udp_chan *uc,
+			    const uint8_t *rec, int len)
+{
+	dw->stats.records_rx++;
+
+	while (len >= 3) {
+		int rlen;
+
+		rlen = (rec[1] << 8) | rec[2];
+		if (rlen + 3 > len)
+			return;
+
+		if (rec[0] == RECORD_TYPE_DATA && rlen) {
+			dw->stats.tun_tx_packets++;
+			dw->stats.tun_tx_bytes += rlen;
+			tun_interface_send_packet(tun, rec + 3, rlen);
+		} else if (rec[0] == RECORD_TYPE_FEATURES && rlen >= 1) {
+			batch->enabled =
+				!!(rec[3] & RECORD_FEATURE_MULTI_PACKET);
+			/*
+			 * Super-packets don't fit in datagrams.
+			 */
+			batch->gso = !!(rec[3] & RECORD_FEATURE_GSO) &&
+				     uc == NULL;
+			if (tun_interface_set_offload(tun, batch->gso) < 0)
+				batch->gso = 0;
+		} else if (rec[0] == RECORD_TYPE_GSO_DATA &&
+			   rlen > GSO_HDR_LEN) {
+			gso_frame_received(dw, tun, rec + 3, rlen);
+		} else if (rec[0] == RECORD_TYPE_UDP_PORT && rlen >= 2 &&
+			   uc != NULL) {
+			udp_chan_set_peer_port(uc, (rec[3] << 8) | rec[4]);
+		}
+
+		rec += rlen + 3;
+		len -= rlen + 3;
+	}
+}
+
+/*
+ * DGP sessions run over TCP port 173 inside the tunnel, and are kept
+ * on the TLS connection even if the UDP transport is in use, so that
+ * routing doesn't depend on datagrams making it through.  Since DGP
+ * only ever runs between the link-local addresses derived from our
+ * key IDs, anything else that uses port 173, be it a local process
+ * talking to some remote port 173 or transit traffic, is not DGP.
+ */
+static int is_dgp_packet(const uint8_t *buf, int len)
+{
+	if (len < 44 || (buf[0] >> 4) != 6 || buf[6] != IPPROTO_TCP)
+		return 0;
+
+	if (memcmp(buf + 8, mylladdr, 16))
+		return 0;
+
+	return (buf[40] == 0 && buf[41] == 173) ||
+	       (buf[42] == 0 && buf[43] == 173);
+}
+
+/*
+ * Packets are classified by their DSCP, except that DGP traffic is
+ * always control traffic.  The control class has strict priority, so
+ * it is reserved for our own traffic, and packets that are marked as
+ * network control (CS6 and CS7) are treated as interactive traffic,
+ * along with CS4, CS5, AF4x, VOICE-ADMIT and EF.
+ */
+static int packet_class(const uint8_t *buf, int len)
+{
+	int dscp;
+
+	if (is_dgp_packet(buf, len))
+		return TCONN_CLASS_CONTROL;
+
+	if (len >= 40 && (buf[0] >> 4) == 6)
+		dscp = ((buf[0] & 0x0f) << 2) | (buf[1] >> 6);
+	else if (len >= 20 && (buf[0] >> 4) == 4)
+		dscp = buf[1] >> 2;
+	else
+		return TCONN_CLASS_BULK;
+
+	if (dscp >= 32)
+		return TCONN_CLASS_INTERACTIVE;
+
+	return TCONN_CLASS_BULK;
+}
+
+static int udp_frame_send(struct dp_worker *dw, struct udp_chan *uc,
+			  uint8_t *buf, int len)
+{
+	if (is_dgp_packet(buf, len) || !udp_chan_usable(uc))
+		return -1;
+
+	buf -= 3;
+	buf[0] = RECORD_TYPE_DATA;
+	buf[1] = len >> 8;
+	buf[2] = len & 0xff;
+
+	if (udp_chan_send(uc, buf, len + 3) < 0)
+		return -1;
+
+	dw->stats.udp_tx++;
+
+	return 0;
+}
+
+/*
+ * Peer state changes are seen on the data plane thread that owns the
+ * peer, and are then applied to the control plane on the main thread.
+ */
+struct peer_state_change {
+	struct dp_call		call;
+	void			*entry;
+	int			up;
+	uint8_t			id[NODE_ID_LEN];
+	int			rtt;
+	int			maxseg;
+};
+
+static void post_state_change(void (*handler)(struct dp_call *),
+			      void *entry, const uint8_t *id, int up,
+			      int rtt, int maxseg)
+{
+	struct peer_state_change *psc;
+
+	psc = malloc(sizeof(*psc));
+	if (psc == NULL) {
+		fprintf(stderr, "error allocating memory for "
+				"peer state change\n");
+		abort();
+	}
+
+	psc->call.handler = handler;
+	psc->entry = entry;
+	psc->up = up;
+	memcpy(psc->id, id, NODE_ID_LEN);
+	psc->rtt = rtt;
+	psc->maxseg = maxseg;
+
+	dp_main_post(&psc->call);
+}
+
+static int peer_mtu(int maxseg)
+{
+	int mtu;
+
+	if (maxseg < 0)
+		abort();
+
+	mtu = maxseg - 5 - 8 - 3 - 16;
+	if (mtu < 1280)
+		mtu = 1280;
+	else if (mtu > 1500)
+		mtu = 1500;
+
+	return mtu;
+}
+
+static void cce_record_send(struct conf_connect_entry *cce, int class,
+			    const uint8_t *rec, int len)
+{
+	cce->dw->stats.records_tx++;
+	tconn_connect_record_send(&cce->tc, class, rec, len);
+}
+
+static void cce_flush_batch(struct conf_connect_entry *cce)
+{
+	if (cce->batch.bytes) {
+		cce_record_send(cce, TCONN_CLASS_BULK, cce->batch.buf,
+				cce->batch.bytes);
+		cce->batch.bytes = 0;
+	}
 }
 
 static void cce_tun_got_packet(void *_cce, uint8_t *buf, int len)
 {
 	struct conf_connect_entry *cce = _cce;
-	uint8_t sndbuf[len + 3];
+	int class;
+
+	cce->dw->stats.tun_rx_packets++;
+	cce->dw->stats.tun_rx_bytes += len;
+
+	if (cce->udp_up && !udp_frame_send(cce->dw, &cce->uc, buf, len))
+		return;
 
-	sndbuf[0] = 0x00;
-	sndbuf[1] = len >> 8;
-	sndbuf[2] = len & 0xff;
-	memcpy(sndbuf + 3, buf, len);
+	class = packet_class(buf, len);
+	if (class == TCONN_CLASS_BULK && cce->batch.enabled) {
+		if (!record_batch_room(&cce->batch, len))
+			cce_flush_batch(cce);
 
-	tconn_connect_record_send(&cce->tc, sndbuf, len + 3);
+		if (record_batch_room(&cce->batch, len)) {
+			record_batch_add(&cce->batch, buf, len);
+			return;
+		}
+	}
+
+	buf -= 3;
+	buf[0] = RECORD_TYPE_DATA;
+	buf[1] = len >> 8;
+	buf[2] = len & 0xff;
+
+	cce_record_send(cce, class, buf, len + 3);
 }
 
-static void cce_set_state(void *_cce, const uint8_t *id, int up)
+static void cce_tun_got_gso_packet(void *_cce,
+				  const struct virtio_net_hdr *vh,
+				  uint8_t *buf, int len)
+{
+	struct conf_connect_entry *cce = _cce;
+	int class;
+
+	cce->dw->stats.tun_rx_packets++;
+	cce->dw->stats.tun_rx_bytes += len;
+
+	class = packet_class(buf, len);
+
+	len = gso_frame_build(&cce->batch, vh, &buf, len);
+	if (len < 0)
+		return;
+
+	cce_flush_batch(cce);
+	cce_record_send(cce, class, buf, len);
+}
+
+static void cce_tun_got_packet_batch_done(void *_cce)
 {
 	struct conf_connect_entry *cce = _cce;
+
+	cce_flush_batch(cce);
+	if (cce->udp_up)
+		udp_chan_flush(&cce->uc);
+}
+
+static void cce_state_changed(struct dp_call *call)
+{
+	struct peer_state_change *psc;
+	struct conf_connect_entry *cce;
 	char *tunitf;
 
+	psc = iv_container_of(call, struct peer_state_change, call);
+	cce = psc->entry;
+
+	if (!cce->registered) {
+		free(psc);
+		return;
+	}
+
 	tunitf = tun_interface_get_name(&cce->tun);
 
-	cce->tconn_up = up;
+	cce->tconn_up = psc->up;
 
-	if (up) {
-		int maxseg;
+	if (psc->up) {
 		int mtu;
 		uint8_t addr[16];
 
-		memcpy(cce->peerid, id, NODE_ID_LEN);
+		memcpy(cce->peerid, psc->id, NODE_ID_LEN);
 
 		if (cce->peer_type != CONF_PEER_TYPE_DBONLY) {
 			int cost;
 
 			cost = cce->cost;
 			if (cost == 0) {
-				cost = tconn_connect_get_rtt(&cce->tc);
+				cost = psc->rtt;
 				if (cost < 1)
 					cost = 1;
 			}
@@ -329,15 +733,7 @@ static void cce_set_state(void *_cce, const uint8_t *id, int up)
 			mylsa_add_peer(cce->peerid, cce->peer_type, cost);
 		}
 
-		maxseg = tconn_connect_get_maxseg(&cce->tc);
-		if (maxseg < 0)
-			abort();
-
-		mtu = maxseg - 5 - 8 - 3 - 16;
-		if (mtu < 1280)
-			mtu = 1280;
-		else if (mtu > 1500)
-			mtu = 1500;
+		mtu = peer_mtu(psc->maxseg);
 
 		fprintf(stderr, "%s: setting interface MTU to %d\n",
 			cce->name, mtu);
@@ -351,7 +747,7 @@ static void cce_set_state(void *_cce, const uint8_t *id, int up)
 		v6_global_addr_from_key_id(addr, keyid);
 		itf_add_addr_v6(tunitf, addr, 128);
 
-		v6_global_addr_from_key_id(cce->dp.addr, id);
+		v6_global_addr_from_key_id(cce->dp.addr, psc->id);
 		if (iv_avl_tree_insert(&direct_peers, &cce->dp.an))
 			abort();
 
@@ -366,61 +762,185 @@ static void cce_set_state(void *_cce, const uint8_t *id, int up)
 		if (cce->peer_type != CONF_PEER_TYPE_DBONLY)
 			mylsa_del_peer(cce->peerid);
 	}
+
+	free(psc);
 }
 
-static void cce_record_received(void *_cce, const uint8_t *rec, int len)
+static void cce_udp_record_received(void *_cce, const uint8_t *rec, int len)
 {
 	struct conf_connect_entry *cce = _cce;
-	int rlen;
 
-	if (len <= 3)
+	cce->dw->stats.udp_rx++;
+	record_received(cce->dw, &cce->tun, &cce->batch, &cce->uc, rec, len);
+}
+
+static void cce_start_udp(struct conf_connect_entry *cce)
+{
+	uint8_t keys[UDP_CHAN_KEYING_LEN];
+	struct sockaddr_storage addr;
+	uint8_t rec[5];
+
+	if (tconn_connect_export_keys(&cce->tc, UDP_CHAN_LABEL,
+				      keys, sizeof(keys)) < 0) {
 		return;
+	}
 
-	if (rec[0] != 0x00)
+	if (tconn_connect_get_peer_address(&cce->tc, &addr) < 0)
 		return;
 
-	rlen = (rec[1] << 8) | rec[2];
-	if (rlen + 3 != len)
+	cce->uc.cookie = cce;
+	cce->uc.record_received = cce_udp_record_received;
+	if (udp_chan_start(&cce->uc, keys, &addr) < 0)
 		return;
 
-	tun_interface_send_packet(&cce->tun, rec + 3, rlen);
+	cce->udp_up = 1;
+
+	record_udp_port(rec, udp_chan_get_port(&cce->uc));
+	cce_record_send(cce, TCONN_CLASS_CONTROL, rec, sizeof(rec));
+}
+
+static void cce_set_state(void *_cce, const uint8_t *id, int up)
+{
+	struct conf_connect_entry *cce = _cce;
+
+	record_batch_reset(&cce->batch);
+	tun_interface_set_offload(&cce->tun, 0);
+	if (cce->udp_up) {
+		udp_chan_stop(&cce->uc);
+		cce->udp_up = 0;
+	}
+
+	if (up) {
+		uint8_t features[4];
+
+		post_state_change(cce_state_changed, cce, id, 1,
+				  tconn_connect_get_rtt(&cce->tc),
+				  tconn_connect_get_maxseg(&cce->tc));
+
+		record_features(features, &cce->tun);
+		cce_record_send(cce, TCONN_CLASS_CONTROL,
+				features, sizeof(features));
+
+		if (cce->transport == CONF_TRANSPORT_UDP)
+			cce_start_udp(cce);
+	} else {
+		post_state_change(cce_state_changed, cce, id, 0, -1, -1);
+	}
+}
+
+static void cce_record_received(void *_cce, const uint8_t *rec, int len)
+{
+	struct conf_connect_entry *cce = _cce;
+
+	record_received(cce->dw, &cce->tun, &cce->batch,
+			cce->udp_up ? &cce->uc : NULL, rec, len);
+}
+
+static void cle_record_send(struct conf_listen_entry *cle, int class,
+			    const uint8_t *rec, int len)
+{
+	cle->dw->stats.records_tx++;
+	tconn_listen_entry_record_send(&cle->tle, class, rec, len);
+}
+
+static void cle_flush_batch(struct conf_listen_entry *cle)
+{
+	if (cle->batch.bytes) {
+		cle_record_send(cle, TCONN_CLASS_BULK, cle->batch.buf,
+				cle->batch.bytes);
+		cle->batch.bytes = 0;
+	}
 }
 
 static void cle_tun_got_packet(void *_cle, uint8_t *buf, int len)
 {
 	struct conf_listen_entry *cle = _cle;
-	uint8_t sndbuf[len + 3];
+	int class;
+
+	cle->dw->stats.tun_rx_packets++;
+	cle->dw->stats.tun_rx_bytes += len;
+
+	if (cle->udp_up && !udp_frame_send(cle->dw, &cle->uc, buf, len))
+		return;
 
-	sndbuf[0] = 0x00;
-	sndbuf[1] = len >> 8;
-	sndbuf[2] = len & 0xff;
-	memcpy(sndbuf + 3, buf, len);
+	class = packet_class(buf, len);
+	if (class == TCONN_CLASS_BULK && cle->batch.enabled) {
+		if (!record_batch_room(&cle->batch, len))
+			cle_flush_batch(cle);
 
-	tconn_listen_entry_record_send(&cle->tle, sndbuf, len + 3);
+		if (record_batch_room(&cle->batch, len)) {
+			record_batch_add(&cle->batch, buf, len);
+			return;
+		}
+	}
+
+	buf -= 3;
+	buf[0] = RECORD_TYPE_DATA;
+	buf[1] = len >> 8;
+	buf[2] = len & 0xff;
+
+	cle_record_send(cle, class, buf, len + 3);
 }
 
-static void cle_set_state(void *_cle, const uint8_t *id, int up)
+static void cle_tun_got_gso_packet(void *_cle,
+				  const struct virtio_net_hdr *vh,
+				  uint8_t *buf, int len)
+{
+	struct conf_listen_entry *cle = _cle;
+	int class;
+
+	cle->dw->stats.tun_rx_packets++;
+	cle->dw->stats.tun_rx_bytes += len;
+
+	class = packet_class(buf, len);
+
+	len = gso_frame_build(&cle->batch, vh, &buf, len);
+	if (len < 0)
+		return;
+
+	cle_flush_batch(cle);
+	cle_record_send(cle, class, buf, len);
+}
+
+static void cle_tun_got_packet_batch_done(void *_cle)
 {
 	struct conf_listen_entry *cle = _cle;
+
+	cle_flush_batch(cle);
+	if (cle->udp_up)
+		udp_chan_flush(&cle->uc);
+}
+
+static void cle_state_changed(struct dp_call *call)
+{
+	struct peer_state_change *psc;
+	struct conf_listen_entry *cle;
 	char *tunitf;
 
+	psc = iv_container_of(call, struct peer_state_change, call);
+	cle = psc->entry;
+
+	if (!cle->registered) {
+		free(psc);
+		return;
+	}
+
 	tunitf = tun_interface_get_name(&cle->tun);
 
-	cle->tconn_up = up;
+	cle->tconn_up = psc->up;
 
-	if (up) {
-		int maxseg;
+	if (psc->up) {
 		int mtu;
 		uint8_t addr[16];
 
-		memcpy(cle->peerid, id, NODE_ID_LEN);
+		memcpy(cle->peerid, psc->id, NODE_ID_LEN);
 
 		if (cle->peer_type != CONF_PEER_TYPE_DBONLY) {
 			int cost;
 
 			cost = cle->cost;
 			if (cost == 0) {
-				cost = tconn_listen_entry_get_rtt(&cle->tle);
+				cost = psc->rtt;
 				if (cost < 1)
 					cost = 1;
 			}
@@ -428,15 +948,7 @@ static void cle_set_state(void *_cle, const uint8_t *id, int up)
 			mylsa_add_peer(cle->peerid, cle->peer_type, cost);
 		}
 
-		maxseg = tconn_listen_entry_get_maxseg(&cle->tle);
-		if (maxseg < 0)
-			abort();
-
-		mtu = maxseg - 5 - 8 - 3 - 16;
-		if (mtu < 1280)
-			mtu = 1280;
-		else if (mtu > 1500)
-			mtu = 1500;
+		mtu = peer_mtu(psc->maxseg);
 
 		fprintf(stderr, "%s: setting interface MTU to %d\n",
 			cle->name, mtu);
@@ -450,7 +962,7 @@ static void cle_set_state(void *_cle, const uint8_t *id, int up)
 		v6_global_addr_from_key_id(addr, keyid);
 		itf_add_addr_v6(tunitf, addr, 128);
 
-		v6_global_addr_from_key_id(cle->dp.addr, id);
+		v6_global_addr_from_key_id(cle->dp.addr, psc->id);
 		if (iv_avl_tree_insert(&direct_peers, &cle->dp.an))
 			abort();
 
@@ -467,38 +979,89 @@ static void cle_set_state(void *_cle, const uint8_t *id, int up)
 		if (cle->peer_type != CONF_PEER_TYPE_DBONLY)
 			mylsa_del_peer(cle->peerid);
 	}
+
+	free(psc);
 }
 
-static void cle_record_received(void *_cle, const uint8_t *rec, int len)
+static void cle_udp_record_received(void *_cle, const uint8_t *rec, int len)
 {
 	struct conf_listen_entry *cle = _cle;
-	int rlen;
 
-	if (len <= 3)
-		return;
+	cle->dw->stats.udp_rx++;
+	record_received(cle->dw, &cle->tun, &cle->batch, &cle->uc, rec, len);
+}
 
-	if (rec[0] != 0x00)
+static void cle_start_udp(struct conf_listen_entry *cle)
+{
+	uint8_t keys[UDP_CHAN_KEYING_LEN];
+	uint8_t rec[5];
+
+	if (tconn_listen_entry_export_keys(&cle->tle, UDP_CHAN_LABEL,
+					   keys, sizeof(keys)) < 0) {
 		return;
+	}
 
-	rlen = (rec[1] << 8) | rec[2];
-	if (rlen + 3 != len)
+	cle->uc.cookie = cle;
+	cle->uc.record_received = cle_udp_record_received;
+	if (udp_chan_start(&cle->uc, keys, NULL) < 0)
 		return;
 
-	tun_interface_send_packet(&cle->tun, rec + 3, rlen);
+	cle->udp_up = 1;
+
+	record_udp_port(rec, udp_chan_get_port(&cle->uc));
+	cle_record_send(cle, TCONN_CLASS_CONTROL, rec, sizeof(rec));
 }
 
-static int start_conf_connect_entry(struct conf_connect_entry *cce)
+static void cle_set_state(void *_cle, const uint8_t *id, int up)
+{
+	struct conf_listen_entry *cle = _cle;
+
+	record_batch_reset(&cle->batch);
+	tun_interface_set_offload(&cle->tun, 0);
+	if (cle->udp_up) {
+		udp_chan_stop(&cle->uc);
+		cle->udp_up = 0;
+	}
+
+	if (up) {
+		uint8_t features[4];
+
+		post_state_change(cle_state_changed, cle, id, 1,
+				  tconn_listen_entry_get_rtt(&cle->tle),
+				  tconn_listen_entry_get_maxseg(&cle->tle));
+
+		record_features(features, &cle->tun);
+		cle_record_send(cle, TCONN_CLASS_CONTROL,
+				features, sizeof(features));
+
+		if (cle->transport == CONF_TRANSPORT_UDP)
+			cle_start_udp(cle);
+	} else {
+		post_state_change(cle_state_changed, cle, id, 0, -1, -1);
+	}
+}
+
+static void cle_record_received(void *_cle, const uint8_t *rec, int len)
+{
+	struct conf_listen_entry *cle = _cle;
+
+	record_received(cle->dw, &cle->tun, &cle->batch,
+			cle->udp_up ? &cle->uc : NULL, rec, len);
+}
+
+static int cce_start_data(void *_cce)
 {
+	struct conf_connect_entry *cce = _cce;
+
 	cce->tun.itfname = cce->tunitf;
 	cce->tun.cookie = cce;
+	cce->tun.vnet_hdr = 1;
 	cce->tun.got_packet = cce_tun_got_packet;
+	cce->tun.got_gso_packet = cce_tun_got_gso_packet;
+	cce->tun.got_packet_batch_done = cce_tun_got_packet_batch_done;
 	if (tun_interface_register(&cce->tun) < 0)
 		return 1;
 
-	cce->registered = 1;
-
-	itf_set_state(tun_interface_get_name(&cce->tun), 0);
-
 	cce->tc.name = cce->name;
 	cce->tc.hostname = cce->hostname;
 	cce->tc.port = cce->port;
@@ -506,11 +1069,46 @@ static int start_conf_connect_entry(struct conf_connect_entry *cce)
 	cce->tc.numcrts = numcrts;
 	cce->tc.mycrts = crt;
 	cce->tc.fingerprint = cce->fingerprint;
+	cce->tc.ktls = conf->kernel_tls;
+	cce->tc.txq_limit = conf->tx_queue_limit;
+	cce->tc.ciphers = cce->ciphers;
 	cce->tc.cookie = cce;
 	cce->tc.set_state = cce_set_state;
 	cce->tc.record_received = cce_record_received;
 	tconn_connect_start(&cce->tc);
 
+	return 0;
+}
+
+static int cce_stop_data(void *_cce)
+{
+	struct conf_connect_entry *cce = _cce;
+
+	if (cce->udp_up) {
+		udp_chan_stop(&cce->uc);
+		cce->udp_up = 0;
+	}
+
+	tconn_connect_destroy(&cce->tc);
+
+	tun_interface_unregister(&cce->tun);
+
+	return 0;
+}
+
+static int start_conf_connect_entry(struct conf_connect_entry *cce)
+{
+	cce->dw = dp_worker_assign();
+	if (dp_worker_call(cce->dw, cce_start_data, cce)) {
+		dp_worker_release(cce->dw);
+		return 1;
+	}
+
+	cce->registered = 1;
+
+	itf_set_state(tun_interface_get_name(&cce->tun), 0);
+	itf_set_gso_max_size(tun_interface_get_name(&cce->tun), GSO_MAX_SIZE);
+
 	cce->dp.itfname = tun_interface_get_name(&cce->tun);
 
 	cce->dc.myid = keyid;
@@ -525,38 +1123,71 @@ static void stop_conf_connect_entry(struct conf_connect_entry *cce)
 {
 	cce->registered = 0;
 
+	dp_worker_call(cce->dw, cce_stop_data, cce);
+	dp_worker_release(cce->dw);
+
+	dp_main_flush();
+
 	if (cce->tconn_up) {
 		dgp_connect_stop(&cce->dc);
 		iv_avl_tree_delete(&direct_peers, &cce->dp.an);
 		mylsa_del_peer(cce->peerid);
 	}
-
-	tconn_connect_destroy(&cce->tc);
-
-	tun_interface_unregister(&cce->tun);
 }
 
-static int start_conf_listen_entry(struct conf_listening_socket *cls,
-				   struct conf_listen_entry *cle)
+static int cle_start_data(void *_cle)
 {
+	struct conf_listen_entry *cle = _cle;
+
 	cle->tun.itfname = cle->tunitf;
 	cle->tun.cookie = cle;
+	cle->tun.vnet_hdr = 1;
 	cle->tun.got_packet = cle_tun_got_packet;
+	cle->tun.got_gso_packet = cle_tun_got_gso_packet;
+	cle->tun.got_packet_batch_done = cle_tun_got_packet_batch_done;
 	if (tun_interface_register(&cle->tun) < 0)
 		return 1;
 
-	cle->registered = 1;
-
-	itf_set_state(tun_interface_get_name(&cle->tun), 0);
-
-	cle->tle.tls = &cls->tls;
 	cle->tle.name = cle->name;
 	cle->tle.fingerprint = cle->fingerprint;
+	cle->tle.ciphers = cle->ciphers;
 	cle->tle.cookie = cle;
 	cle->tle.set_state = cle_set_state;
 	cle->tle.record_received = cle_record_received;
 	tconn_listen_entry_register(&cle->tle);
 
+	return 0;
+}
+
+static int cle_stop_data(void *_cle)
+{
+	struct conf_listen_entry *cle = _cle;
+
+	if (cle->udp_up) {
+		udp_chan_stop(&cle->uc);
+		cle->udp_up = 0;
+	}
+
+	tconn_listen_entry_unregister(&cle->tle);
+
+	tun_interface_unregister(&cle->tun);
+
+	return 0;
+}
+
+static int start_conf_listen_entry(struct conf_listening_socket *cls,
+				   struct conf_listen_entry *cle)
+{
+	cle->dw = cls->dw;
+	cle->tle.tls = &cls->tls;
+	if (dp_worker_call(cle->dw, cle_start_data, cle))
+		return 1;
+
+	cle->registered = 1;
+
+	itf_set_state(tun_interface_get_name(&cle->tun), 0);
+	itf_set_gso_max_size(tun_interface_get_name(&cle->tun), GSO_MAX_SIZE);
+
 	cle->dp.itfname = tun_interface_get_name(&cle->tun);
 
 	cle->dls.myid = keyid;
@@ -574,16 +1205,32 @@ static void stop_conf_listen_entry(struct conf_listen_entry *cle)
 {
 	cle->registered = 0;
 
+	dp_worker_call(cle->dw, cle_stop_data, cle);
+
+	dp_main_flush();
+
 	if (cle->tconn_up) {
 		dgp_listen_entry_unregister(&cle->dle);
 		dgp_listen_socket_unregister(&cle->dls);
 		iv_avl_tree_delete(&direct_peers, &cle->dp.an);
 		mylsa_del_peer(cle->fingerprint);
 	}
+}
 
-	tconn_listen_entry_unregister(&cle->tle);
+static int cls_start_data(void *_cls)
+{
+	struct conf_listening_socket *cls = _cls;
 
-	tun_interface_unregister(&cle->tun);
+	return tconn_listen_socket_register(&cls->tls);
+}
+
+static int cls_stop_data(void *_cls)
+{
+	struct conf_listening_socket *cls = _cls;
+
+	tconn_listen_socket_unregister(&cls->tls);
+
+	return 0;
 }
 
 static int start_conf_listening_socket(struct conf_listening_socket *cls)
@@ -594,8 +1241,17 @@ static int start_conf_listening_socket(struct conf_listening_socket *cls)
 	cls->tls.mykey = privkey;
 	cls->tls.numcrts = numcrts;
 	cls->tls.mycrts = crt;
-	if (tconn_listen_socket_register(&cls->tls))
+	cls->tls.ktls = conf->kernel_tls;
+	cls->tls.txq_limit = conf->tx_queue_limit;
+	cls->tls.ciphers = conf->ciphers;
+	cls->tls.handshake_limit = conf->handshake_limit;
+	cls->tls.ticket_key_file = conf->ticket_key;
+
+	cls->dw = dp_worker_assign();
+	if (dp_worker_call(cls->dw, cls_start_data, cls)) {
+		dp_worker_release(cls->dw);
 		return 1;
+	}
 
 	cls->registered = 1;
 
@@ -624,7 +1280,8 @@ static void stop_conf_listening_socket(struct conf_listening_socket *cls)
 			stop_conf_listen_entry(cle);
 	}
 
-	tconn_listen_socket_unregister(&cls->tls);
+	dp_worker_call(cls->dw, cls_stop_data, cls);
+	dp_worker_release(cls->dw);
 }
 
 static void stop_config(struct conf *conf)
@@ -676,8 +1333,6 @@ err:
 	return 1;
 }
 
-static const char *config = "/etc/dvpn.ini";
-static struct conf *conf;
 static struct iv_signal sighup;
 static struct iv_signal sigint;
 static struct iv_signal sigusr1;
@@ -763,12 +1418,106 @@ static void got_sigint(void *_dummy)
 
 	stop_config(conf);
 
+	dp_workers_stop();
+
 	dgp_listen_socket_unregister(&dls);
 }
 
+struct txq_stats_req {
+	void			*entry;
+	struct tconn_txq_stats	st[TCONN_NUM_CLASSES];
+};
+
+static int cce_get_txq_stats(void *_req)
+{
+	struct txq_stats_req *req = _req;
+	struct conf_connect_entry *cce = req->entry;
+
+	return tconn_connect_get_txq_stats(&cce->tc, req->st);
+}
+
+static int cle_get_txq_stats(void *_req)
+{
+	struct txq_stats_req *req = _req;
+	struct conf_listen_entry *cle = req->entry;
+
+	return tconn_listen_entry_get_txq_stats(&cle->tle, req->st);
+}
+
+static void print_txq_stats(FILE *fp, const char *name,
+			    struct tconn_txq_stats *st)
+{
+	static const char *class_name[TCONN_NUM_CLASSES] = {
+		[TCONN_CLASS_CONTROL]		= "control",
+		[TCONN_CLASS_INTERACTIVE]	= "interactive",
+		[TCONN_CLASS_BULK]		= "bulk",
+	};
+	int i;
+
+	for (i = 0; i < TCONN_NUM_CLASSES; i++) {
+		uint64_t avg;
+
+		avg = st[i].dequeued ?
+			st[i].sojourn_us_total / st[i].dequeued : 0;
+
+		fprintf(fp, "%s: %s tx queue %d bytes, %llu records queued, "
+			    "%llu tail drops, %llu codel drops, "
+			    "delay avg %llu us / max %u us\n",
+			name, class_name[i], st[i].backlog,
+			(unsigned long long)st[i].enqueued,
+			(unsigned long long)st[i].tail_drops,
+			(unsigned long long)st[i].codel_drops,
+			(unsigned long long)avg, st[i].sojourn_us_max);
+	}
+}
+
+static void print_peer_stats(FILE *fp)
+{
+	struct iv_avl_node *an;
+	struct txq_stats_req req;
+
+	iv_avl_tree_for_each (an, &conf->connect_entries) {
+		struct conf_connect_entry *cce;
+
+		cce = iv_container_of(an, struct conf_connect_entry, an);
+		if (!cce->registered)
+			continue;
+
+		req.entry = cce;
+		if (!dp_worker_call(cce->dw, cce_get_txq_stats, &req))
+			print_txq_stats(fp, cce->name, req.st);
+	}
+
+	iv_avl_tree_for_each (an, &conf->listening_sockets) {
+		struct conf_listening_socket *cls;
+		struct iv_avl_node *an2;
+
+		cls = iv_container_of(an, struct conf_listening_socket, an);
+
+		iv_avl_tree_for_each (an2, &cls->listen_entries) {
+			struct conf_listen_entry *cle;
+
+			cle = iv_container_of(an2, struct conf_listen_entry,
+					      an);
+			if (!cle->registered)
+				continue;
+
+			req.entry = cle;
+			if (!dp_worker_call(cle->dw, cle_get_txq_stats, &req))
+				print_txq_stats(fp, cle->name, req.st);
+		}
+	}
+}
+
 static void got_sigusr1(void *_dummy)
 {
 	loc_rib_print(stderr, &loc_rib);
+	dp_workers_print_stats(stderr);
+	lsa_print_stats(stderr);
+	sig_cache_print_stats(stderr);
+	pubkey_cache_print_stats(stderr);
+	dgp_reader_print_stats(stderr);
+	print_peer_stats(stderr);
 }
 
 int dvpn(const char *_config)
@@ -819,6 +1568,8 @@ int dvpn(const char *_config)
 	if (x509_get_privkey_id(keyid, privkey) < 0)
 		return 1;
 
+	v6_linklocal_addr_from_key_id(mylladdr, keyid);
+
 	if (x509_generate_self_signed_cert(&crt[0], privkey) < 0)
 		return 1;
 
@@ -845,6 +1596,12 @@ int dvpn(const char *_config)
 		fprintf(stderr, "\n");
 	}
 
+	/*
+	 * Rank the ciphers by their speed on this machine, to decide
+	 * which ones to prefer for peers without a Ciphers setting.
+	 */
+	tls_prio_bench(NULL);
+
 	iv_init();
 
 	loc_rib.myid = keyid;
@@ -852,6 +1609,7 @@ int dvpn(const char *_config)
 
 	rb.rib = &loc_rib;
 	rb.myid = keyid;
+	rb.spf = conf->link_state_routing;
 	rb.cookie = NULL;
 	rb.rt_add = rt_add;
 	rb.rt_mod = rt_mod;
@@ -867,18 +1625,12 @@ int dvpn(const char *_config)
 	if (dgp_listen_socket_register(&dls))
 		return 1;
 
-	me = lsa_alloc(keyid);
-	lsa_add_attr(me, LSA_ATTR_TYPE_ADV_PATH, 0, NULL, 0, NULL, 0);
-	if (conf->node_name != NULL) {
-		lsa_add_attr(me, LSA_ATTR_TYPE_NODE_NAME, 1, NULL, 0,
-			     conf->node_name, strlen(conf->node_name));
-	}
-	lsa_initial_version(me);
-	lsa_add_pubkey(me);
-	lsa_sign(me);
+	mylsa_init();
 
 	loc_rib_add_lsa(&loc_rib, me);
 
+	dp_workers_start(conf->workers);
+
 	if (start_config(conf))
 		return 1;
 
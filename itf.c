@@ -144,6 +144,24 @@ int itf_set_mtu(const char *itf, int mtu)
 	return spawnvp("ip", args);
 }
 
+int itf_set_gso_max_size(const char *itf, int size)
+{
+	char csize[32];
+	char *args[7];
+
+	sprintf(csize, "%d", size);
+
+	args[0] = "ip";
+	args[1] = "link";
+	args[2] = "set";
+	args[3] = (char *)itf;
+	args[4] = "gso_max_size";
+	args[5] = csize;
+	args[6] = NULL;
+
+	return spawnvp("ip", args);
+}
+
 int itf_set_state(const char *itf, int up)
 {
 	char *args[6];
@@ -25,6 +25,7 @@ int itf_add_route_v6_direct(const uint8_t *addr, const char *itf);
 int itf_chg_route_v6_direct(const uint8_t *addr, const char *itf);
 int itf_del_route_v6_direct(const uint8_t *addr, const char *itf);
 int itf_set_mtu(const char *itf, int mtu);
+int itf_set_gso_max_size(const char *itf, int size);
 int itf_set_state(const char *itf, int up);
 
 
@@ -59,7 +59,7 @@ static uint64_t lsa_get_version(struct lsa *lsa)
 	return version;
 }
 
-static struct lsa *find_recent_lsa(struct loc_rib *rib, uint8_t *id)
+static struct lsa *find_recent_lsa(struct loc_rib *rib, const uint8_t *id)
 {
 	struct loc_rib_id *rid;
 	struct iv_avl_node *an;
@@ -80,42 +80,25 @@ static struct lsa *find_recent_lsa(struct loc_rib *rib, uint8_t *id)
 	return lsa;
 }
 
-static int get_peer_metric_flags(struct lsa *lsa, uint8_t *peer,
+static int get_peer_metric_flags(struct lsa *lsa, const uint8_t *peer,
 				 uint16_t *metric, uint8_t *flags)
 {
-	struct lsa_attr *attr;
-	struct lsa_attr_set *set;
-
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_PEER, peer, NODE_ID_LEN);
-	if (attr == NULL || !attr->attr_signed)
-		return -1;
+	const struct lsa_adj *adj;
 
-	if (!attr->data_is_attr_set)
+	adj = lsa_find_adj(lsa, peer);
+	if (adj == NULL)
 		return -1;
 
-	set = lsa_attr_data(attr);
-
 	if (metric != NULL) {
-		struct lsa_attr *attr2;
-
-		attr2 = lsa_attr_set_find_attr(set, LSA_PEER_ATTR_TYPE_METRIC,
-					       NULL, 0);
-		if (attr2 == NULL || !attr2->attr_signed || attr2->datalen != 2)
+		if (!adj->metric_valid)
 			return -1;
-
-		*metric = ntohs(*((uint16_t *)lsa_attr_data(attr2)));
+		*metric = adj->metric;
 	}
 
 	if (flags != NULL) {
-		struct lsa_attr *attr2;
-
-		attr2 = lsa_attr_set_find_attr(set,
-					       LSA_PEER_ATTR_TYPE_PEER_FLAGS,
-					       NULL, 0);
-		if (attr2 == NULL || !attr2->attr_signed || attr2->datalen != 1)
+		if (!adj->flags_valid)
 			return -1;
-
-		*flags = *((uint8_t *)lsa_attr_data(attr2));
+		*flags = adj->flags;
 	}
 
 	return 0;
@@ -259,21 +242,199 @@ static void recompute_rib(void *_rib)
 	struct loc_rib *rib = _rib;
 	struct iv_avl_node *an;
 
-	iv_avl_tree_for_each (an, &rib->ids) {
+	if (rib->recompute_all) {
+		rib->recompute_all = 0;
+
+		while (!iv_list_empty(&rib->dirty))
+			iv_list_del_init(rib->dirty.next);
+
+		iv_avl_tree_for_each (an, &rib->ids) {
+			struct loc_rib_id *rid;
+
+			rid = iv_container_of(an, struct loc_rib_id, an);
+			recompute_rid(rib, rid);
+		}
+	}
+
+	/*
+	 * Listeners can cause more ids to be marked dirty, so take
+	 * them off the list one at a time.
+	 */
+	while (!iv_list_empty(&rib->dirty)) {
 		struct loc_rib_id *rid;
 
-		rid = iv_container_of(an, struct loc_rib_id, an);
+		rid = iv_container_of(rib->dirty.next, struct loc_rib_id, dirty);
+		iv_list_del_init(&rid->dirty);
+
 		recompute_rid(rib, rid);
 	}
 }
 
+struct loc_rib_dep {
+	struct iv_avl_node	an;
+	uint8_t			id[NODE_ID_LEN];
+	struct iv_list_head	links;
+};
+
+struct loc_rib_dep_link {
+	struct iv_list_head	list;
+	struct loc_rib_dep	*dep;
+	struct loc_rib_lsa_ref	*ref;
+};
+
+static int compare_deps(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct loc_rib_dep *a;
+	struct loc_rib_dep *b;
+
+	a = iv_container_of(_a, struct loc_rib_dep, an);
+	b = iv_container_of(_b, struct loc_rib_dep, an);
+
+	return memcmp(a->id, b->id, NODE_ID_LEN);
+}
+
+static struct loc_rib_dep *find_dep(struct loc_rib *rib, const uint8_t *id)
+{
+	struct iv_avl_node *an;
+
+	an = rib->deps.root;
+	while (an != NULL) {
+		struct loc_rib_dep *dep;
+		int ret;
+
+		dep = iv_container_of(an, struct loc_rib_dep, an);
+
+		ret = memcmp(id, dep->id, NODE_ID_LEN);
+		if (ret == 0)
+			return dep;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static struct loc_rib_dep *get_dep(struct loc_rib *rib, const uint8_t *id)
+{
+	struct loc_rib_dep *dep;
+
+	dep = find_dep(rib, id);
+	if (dep != NULL)
+		return dep;
+
+	dep = malloc(sizeof(*dep));
+	if (dep == NULL)
+		abort();
+
+	memcpy(dep->id, id, NODE_ID_LEN);
+	INIT_IV_LIST_HEAD(&dep->links);
+
+	iv_avl_tree_insert(&rib->deps, &dep->an);
+
+	return dep;
+}
+
+static void ref_link(struct loc_rib *rib, struct loc_rib_lsa_ref *ref)
+{
+	struct lsa_attr *pathattr;
+	uint8_t *path;
+	int i;
+
+	pathattr = lsa_find_attr(ref->lsa, LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
+	if (pathattr == NULL || (pathattr->datalen % NODE_ID_LEN) != 0)
+		abort();
+
+	path = lsa_attr_data(pathattr);
+
+	ref->num_links = pathattr->datalen / NODE_ID_LEN;
+	if (!ref->num_links) {
+		ref->links = NULL;
+		return;
+	}
+
+	ref->links = malloc(ref->num_links * sizeof(*ref->links));
+	if (ref->links == NULL)
+		abort();
+
+	for (i = 0; i < ref->num_links; i++) {
+		struct loc_rib_dep_link *link = &ref->links[i];
+
+		link->dep = get_dep(rib, path + (i * NODE_ID_LEN));
+		link->ref = ref;
+		iv_list_add_tail(&link->list, &link->dep->links);
+	}
+}
+
+static void ref_unlink(struct loc_rib *rib, struct loc_rib_lsa_ref *ref)
+{
+	int i;
+
+	for (i = 0; i < ref->num_links; i++) {
+		struct loc_rib_dep_link *link = &ref->links[i];
+
+		iv_list_del(&link->list);
+		if (iv_list_empty(&link->dep->links)) {
+			iv_avl_tree_delete(&rib->deps, &link->dep->an);
+			free(link->dep);
+		}
+	}
+
+	free(ref->links);
+	ref->num_links = 0;
+	ref->links = NULL;
+}
+
+static void mark_dirty(struct loc_rib *rib, struct loc_rib_id *rid)
+{
+	if (iv_list_empty(&rid->dirty))
+		iv_list_add_tail(&rid->dirty, &rib->dirty);
+}
+
+/*
+ * The LSAs of @rid have changed, which affects the cost of its own
+ * LSAs, and of every stored LSA whose ADV_PATH goes through it.
+ */
+static void node_changed(struct loc_rib *rib, struct loc_rib_id *rid)
+{
+	struct loc_rib_dep *dep;
+
+	if (rib->myid != NULL && !memcmp(rid->id, rib->myid, NODE_ID_LEN))
+		rib->recompute_all = 1;
+
+	if (!rib->recompute_all) {
+		mark_dirty(rib, rid);
+
+		dep = find_dep(rib, rid->id);
+		if (dep != NULL) {
+			struct iv_list_head *ilh;
+
+			iv_list_for_each (ilh, &dep->links) {
+				struct loc_rib_dep_link *link;
+
+				link = iv_container_of(ilh,
+						struct loc_rib_dep_link, list);
+				mark_dirty(rib, link->ref->rid);
+			}
+		}
+	}
+
+	if (!iv_task_registered(&rib->recompute))
+		iv_task_register(&rib->recompute);
+}
+
 void loc_rib_init(struct loc_rib *rib)
 {
 	INIT_IV_AVL_TREE(&rib->ids, compare_ids);
+	INIT_IV_AVL_TREE(&rib->deps, compare_deps);
 
 	IV_TASK_INIT(&rib->recompute);
 	rib->recompute.cookie = rib;
 	rib->recompute.handler = recompute_rib;
+	rib->recompute_all = 0;
+	INIT_IV_LIST_HEAD(&rib->dirty);
 
 	INIT_IV_LIST_HEAD(&rib->listeners);
 }
@@ -295,12 +456,16 @@ void loc_rib_deinit(struct loc_rib *rib)
 			ref = iv_container_of(an, struct loc_rib_lsa_ref, an);
 
 			iv_avl_tree_delete(&rid->lsas, &ref->an);
+			ref_unlink(rib, ref);
 			lsa_put(ref->lsa);
 			free(ref);
 		}
 
 		lsa_put(rid->best);
 
+		if (!iv_list_empty(&rid->dirty))
+			iv_list_del(&rid->dirty);
+
 		iv_avl_tree_delete(&rib->ids, &rid->an);
 		free(rid);
 	}
@@ -309,7 +474,7 @@ void loc_rib_deinit(struct loc_rib *rib)
 		iv_task_unregister(&rib->recompute);
 }
 
-struct loc_rib_id *loc_rib_find_id(struct loc_rib *rib, uint8_t *id)
+struct loc_rib_id *loc_rib_find_id(struct loc_rib *rib, const uint8_t *id)
 {
 	struct iv_avl_node *an;
 
@@ -388,6 +553,7 @@ static struct loc_rib_id *get_id(struct loc_rib *rib, uint8_t *id)
 	INIT_IV_AVL_TREE(&rid->lsas, compare_lsa_refs);
 	rid->best = NULL;
 	rid->bestcost = RIB_COST_INELIGIBLE;
+	INIT_IV_LIST_HEAD(&rid->dirty);
 
 	iv_avl_tree_insert(&rib->ids, &rid->an);
 
@@ -407,17 +573,19 @@ void loc_rib_add_lsa(struct loc_rib *rib, struct lsa *lsa)
 		abort();
 
 	ref->lsa = lsa_get(lsa);
+	ref->cost = RIB_COST_INELIGIBLE;
+	ref->rid = rid;
 	if (iv_avl_tree_insert(&rid->lsas, &ref->an) < 0) {
 		fprintf(stderr, "loc_rib_add_lsa: duplicate LSA inserted!\n");
 		abort();
 	}
+	ref_link(rib, ref);
 
 	ver = lsa_get_version(lsa);
 	if (rid->highest_version_seen < ver)
 		rid->highest_version_seen = ver;
 
-	if (!iv_task_registered(&rib->recompute))
-		iv_task_register(&rib->recompute);
+	node_changed(rib, rid);
 }
 
 static struct loc_rib_lsa_ref *
@@ -459,13 +627,14 @@ void loc_rib_mod_lsa(struct loc_rib *rib, struct lsa *old, struct lsa *new)
 		abort();
 
 	iv_avl_tree_delete(&rid->lsas, &ref->an);
+	ref_unlink(rib, ref);
 	ref->lsa = lsa_get(new);
 	iv_avl_tree_insert(&rid->lsas, &ref->an);
+	ref_link(rib, ref);
 
 	lsa_put(old);
 
-	if (!iv_task_registered(&rib->recompute))
-		iv_task_register(&rib->recompute);
+	node_changed(rib, rid);
 }
 
 void loc_rib_del_lsa(struct loc_rib *rib, struct lsa *lsa)
@@ -482,12 +651,12 @@ void loc_rib_del_lsa(struct loc_rib *rib, struct lsa *lsa)
 		abort();
 
 	iv_avl_tree_delete(&rid->lsas, &ref->an);
+	ref_unlink(rib, ref);
 
 	lsa_put(lsa);
 	free(ref);
 
-	if (!iv_task_registered(&rib->recompute))
-		iv_task_register(&rib->recompute);
+	node_changed(rib, rid);
 }
 
 void loc_rib_listener_register(struct loc_rib *rib, struct rib_listener *rl)
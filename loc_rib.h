@@ -26,11 +26,22 @@
 #include "lsa.h"
 #include "rib_listener.h"
 
+/*
+ * The cost of an LSA depends on the most recent LSAs of the nodes on
+ * its ADV_PATH (and on our own most recent LSA).  To avoid having to
+ * re-evaluate every stored LSA on every change, ->deps indexes the
+ * stored LSAs by the nodes on their ADV_PATHs, and a change to a
+ * node's LSAs marks only that node and the ids whose LSAs go through
+ * it as dirty.  A change to our own LSA invalidates everything.
+ */
 struct loc_rib {
 	uint8_t			*myid;
 
 	struct iv_avl_tree	ids;
+	struct iv_avl_tree	deps;
 	struct iv_task		recompute;
+	int			recompute_all;
+	struct iv_list_head	dirty;
 	struct iv_list_head	listeners;
 };
 
@@ -41,17 +52,21 @@ struct loc_rib_id {
 	struct iv_avl_tree	lsas;
 	struct lsa		*best;
 	uint32_t		bestcost;
+	struct iv_list_head	dirty;
 };
 
 struct loc_rib_lsa_ref {
 	struct iv_avl_node	an;
 	struct lsa		*lsa;
 	uint32_t		cost;
+	struct loc_rib_id	*rid;
+	int			num_links;
+	struct loc_rib_dep_link	*links;
 };
 
 void loc_rib_init(struct loc_rib *rib);
 void loc_rib_deinit(struct loc_rib *rib);
-struct loc_rib_id *loc_rib_find_id(struct loc_rib *rib, uint8_t *id);
+struct loc_rib_id *loc_rib_find_id(struct loc_rib *rib, const uint8_t *id);
 void loc_rib_add_lsa(struct loc_rib *rib, struct lsa *lsa);
 void loc_rib_mod_lsa(struct loc_rib *rib, struct lsa *lsa, struct lsa *newlsa);
 void loc_rib_del_lsa(struct loc_rib *rib, struct lsa *lsa);
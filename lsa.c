@@ -19,154 +19,268 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <iv_list.h>
+#include <arpa/inet.h>
+#include <stddef.h>
 #include <string.h>
 #include "lsa.h"
 #include "lsa_serialise.h"
+#include "lsa_type.h"
 
-static size_t lsa_attr_size(const struct lsa_attr *attr);
+#define ROUND_UP(size)	(((size) + 7) & ~7)
 
-static int
-lsa_attr_compare_keys(struct lsa_attr *a, struct lsa_attr *b)
+static int compare_bodies(struct iv_avl_node *_a, struct iv_avl_node *_b)
 {
-	int len;
+	struct lsa_body *a = iv_container_of(_a, struct lsa_body, an);
+	struct lsa_body *b = iv_container_of(_b, struct lsa_body, an);
 	int ret;
 
-	if (a->type < b->type)
-		return -1;
-	if (a->type > b->type)
-		return 1;
-
-	len = a->keylen;
-	if (len > b->keylen)
-		len = b->keylen;
+	ret = memcmp(a->id, b->id, NODE_ID_LEN);
+	if (ret)
+		return ret;
 
-	ret = memcmp(lsa_attr_key(a), lsa_attr_key(b), len);
-	if (ret < 0)
+	if (a->versionlen < b->versionlen)
 		return -1;
-	if (ret > 0)
+	if (a->versionlen > b->versionlen)
 		return 1;
 
-	if (a->keylen < b->keylen)
-		return -1;
-	if (a->keylen > b->keylen)
-		return 1;
-
-	return 0;
+	return memcmp(a->version, b->version, a->versionlen);
 }
 
-static int compare_attr_keys(struct iv_avl_node *_a, struct iv_avl_node *_b)
+static struct iv_avl_tree bodies = IV_AVL_TREE_INIT(compare_bodies);
+static int num_lsas;
+static int num_bodies;
+static int num_interned;
+static size_t interned_mem;
+static size_t shared_mem;
+
+struct lsa *lsa_get(struct lsa *lsa)
 {
-	struct lsa_attr *a = iv_container_of(_a, struct lsa_attr, an);
-	struct lsa_attr *b = iv_container_of(_b, struct lsa_attr, an);
+	if (lsa != NULL)
+		lsa->refcount++;
 
-	return lsa_attr_compare_keys(a, b);
+	return lsa;
 }
 
-struct lsa *lsa_alloc(const uint8_t *id)
+static void body_put(struct lsa_body *body)
 {
-	struct lsa *lsa;
+	if (body->interned && body->refcount > 1)
+		shared_mem -= body->mem;
 
-	lsa = malloc(sizeof(*lsa));
-	if (lsa == NULL)
-		return NULL;
+	if (--body->refcount)
+		return;
 
-	lsa->refcount = 1;
-	lsa->bytes = MAX_SERIALISED_INT_LEN + NODE_ID_LEN;
-	memcpy(lsa->id, id, NODE_ID_LEN);
-	INIT_IV_AVL_TREE(&lsa->root.attrs, compare_attr_keys);
+	if (body->interned) {
+		iv_avl_tree_delete(&bodies, &body->an);
+		num_interned--;
+		interned_mem -= body->mem;
+	}
 
-	return lsa;
+	free(body->adjs);
+	free(body->wire);
+	free(body->signed_wire);
+	free(body);
+
+	num_bodies--;
 }
 
-struct lsa *lsa_get(struct lsa *lsa)
+void lsa_put(struct lsa *lsa)
 {
-	if (lsa != NULL)
-		lsa->refcount++;
+	if (lsa != NULL && !--lsa->refcount) {
+		body_put(lsa->body);
+		free(lsa);
 
-	return lsa;
+		num_lsas--;
+	}
 }
 
-static void attr_tree_free(struct lsa *lsa, struct iv_avl_node *root)
+int lsa_empty(const struct lsa *lsa)
 {
-	struct lsa_attr *attr = iv_container_of(root, struct lsa_attr, an);
+	return lsa->path.num == 0 && lsa->body->attrs.num == 0;
+}
 
-	lsa->bytes -= lsa_attr_size(attr);
+/*
+ * Bodies are looked up by node id and version, but two bodies with
+ * the same id and version are only merged if they are identical, so
+ * that a bogus copy of an LSA can never be substituted for the real
+ * one, or vice versa.  If a different body with the same id and
+ * version is already interned, this LSA just keeps its own body.
+ *
+ * As the layout of a body only depends on its attributes, and the
+ * padding in it is zeroed, identical bodies are identical in memory.
+ */
+void lsa_intern(struct lsa *lsa)
+{
+	struct lsa_body *body = lsa->body;
+	struct lsa_attr *attr;
+	struct iv_avl_node *an;
 
-	if (attr->an.left != NULL)
-		attr_tree_free(lsa, attr->an.left);
+	if (body->interned)
+		return;
 
-	if (attr->an.right != NULL)
-		attr_tree_free(lsa, attr->an.right);
+	attr = lsa_attr_set_find_attr(&body->attrs, LSA_ATTR_TYPE_VERSION,
+				      NULL, 0);
+	if (attr == NULL || attr->datalen > sizeof(body->version))
+		return;
 
-	if (attr->data_is_attr_set) {
-		struct lsa_attr_set *set;
+	body->versionlen = attr->datalen;
+	memcpy(body->version, lsa_attr_data(attr), attr->datalen);
 
-		set = lsa_attr_data(attr);
-		attr_tree_free(lsa, set->attrs.root);
+	an = bodies.root;
+	while (an != NULL) {
+		struct lsa_body *b;
+		int ret;
+
+		b = iv_container_of(an, struct lsa_body, an);
+
+		ret = compare_bodies(&body->an, an);
+		if (ret == 0) {
+			if (b->mem != body->mem ||
+			    memcmp(&b->attrs, &body->attrs,
+				   body->mem - offsetof(struct lsa_body, attrs)))
+				return;
+
+			b->refcount++;
+			shared_mem += b->mem;
+
+			lsa->body = b;
+			body_put(body);
+
+			return;
+		}
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
 	}
 
-	free(attr);
+	body->interned = 1;
+	iv_avl_tree_insert(&bodies, &body->an);
+
+	num_interned++;
+	interned_mem += body->mem;
 }
 
-void lsa_put(struct lsa *lsa)
+void lsa_print_stats(FILE *fp)
 {
-	if (lsa != NULL && !--lsa->refcount) {
-		if (!iv_avl_tree_empty(&lsa->root.attrs))
-			attr_tree_free(lsa, lsa->root.attrs.root);
-		free(lsa);
+	fprintf(fp, "lsa: %d LSAs, %d bodies, %d interned bodies using "
+		    "%llu bytes, %llu bytes saved by sharing\n",
+		num_lsas, num_bodies, num_interned,
+		(unsigned long long)interned_mem,
+		(unsigned long long)shared_mem);
+}
+
+
+static void decode_adj(struct lsa_adj *adj, struct lsa_attr *peer)
+{
+	struct lsa_attr_set *set;
+	struct lsa_attr *attr;
+
+	memcpy(adj->id, lsa_attr_key(peer), NODE_ID_LEN);
+	adj->metric = 0;
+	adj->flags = 0;
+	adj->metric_valid = 0;
+	adj->flags_valid = 0;
+
+	set = lsa_attr_data(peer);
+
+	attr = lsa_attr_set_find_attr(set, LSA_PEER_ATTR_TYPE_METRIC, NULL, 0);
+	if (attr != NULL && attr->attr_signed && attr->datalen == 2) {
+		adj->metric = ntohs(*((uint16_t *)lsa_attr_data(attr)));
+		adj->metric_valid = 1;
+	}
+
+	attr = lsa_attr_set_find_attr(set, LSA_PEER_ATTR_TYPE_PEER_FLAGS,
+				      NULL, 0);
+	if (attr != NULL && attr->attr_signed && attr->datalen == 1) {
+		adj->flags = *((uint8_t *)lsa_attr_data(attr));
+		adj->flags_valid = 1;
 	}
 }
 
-static void lsa_attr_set_clone(struct lsa *lsa, struct lsa_attr_set *dst,
-			       const struct lsa_attr_set *src)
+static int is_adj(struct lsa_attr *attr)
 {
-	struct iv_avl_node *an;
+	return attr->type == LSA_ATTR_TYPE_PEER && attr->data_is_attr_set &&
+	       attr->attr_signed && attr->keylen == NODE_ID_LEN;
+}
 
-	iv_avl_tree_for_each (an, (struct iv_avl_tree *)&src->attrs) {
-		struct lsa_attr *attr;
+static void lsa_build_adjs(struct lsa *lsa)
+{
+	struct lsa_body *body = lsa->body;
+	struct lsa_attr *attrs;
+	int num;
+	int i;
 
-		attr = iv_container_of(an, struct lsa_attr, an);
+	attrs = lsa_attr_set_attrs(&body->attrs);
 
-		if (attr->data_is_attr_set) {
-			struct lsa_attr_set *s;
-			struct lsa_attr_set *d;
+	num = 0;
+	for (i = 0; i < body->attrs.num; i++) {
+		if (is_adj(&attrs[i]))
+			num++;
+	}
 
-			s = lsa_attr_data(attr);
-			d = lsa_attr_set_add_attr_set(lsa, dst, attr->type,
-					!!(attr->attr_signed),
-					lsa_attr_key(attr), attr->keylen);
+	body->adjs = NULL;
+	if (num) {
+		body->adjs = malloc(num * sizeof(*body->adjs));
+		if (body->adjs == NULL)
+			abort();
+	}
 
-			lsa_attr_set_clone(lsa, d, s);
-		} else {
-			lsa_attr_set_add_attr(lsa, dst, attr->type,
-					!!(attr->attr_signed),
-					lsa_attr_key(attr), attr->keylen,
-					lsa_attr_data(attr), attr->datalen);
-		}
+	/*
+	 * PEER attributes all have NODE_ID_LEN byte keys, so the
+	 * attribute directory has them sorted by peer id.
+	 */
+	num = 0;
+	for (i = 0; i < body->attrs.num; i++) {
+		if (is_adj(&attrs[i]))
+			decode_adj(&body->adjs[num++], &attrs[i]);
 	}
+
+	body->num_adjs = num;
 }
 
-struct lsa *lsa_clone(const struct lsa *lsa)
+int lsa_get_adjs(struct lsa *lsa, const struct lsa_adj **adjs)
 {
-	struct lsa *newlsa;
+	if (lsa->body->num_adjs < 0)
+		lsa_build_adjs(lsa);
 
-	newlsa = lsa_alloc(lsa->id);
-	if (newlsa == NULL)
-		return NULL;
+	*adjs = lsa->body->adjs;
 
-	lsa_attr_set_clone(newlsa, &newlsa->root, &lsa->root);
-
-	return newlsa;
+	return lsa->body->num_adjs;
 }
 
+const struct lsa_adj *lsa_find_adj(struct lsa *lsa, const uint8_t *id)
+{
+	const struct lsa_adj *adjs;
+	int lo;
+	int hi;
+
+	lo = 0;
+	hi = lsa_get_adjs(lsa, &adjs);
+	while (lo < hi) {
+		int mid;
+		int ret;
+
+		mid = (lo + hi) / 2;
+
+		ret = memcmp(id, adjs[mid].id, NODE_ID_LEN);
+		if (ret == 0)
+			return &adjs[mid];
+
+		if (ret < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
 
-#define ROUND_UP(size)	(((size) + 7) & ~7)
 
 void *lsa_attr_key(struct lsa_attr *attr)
 {
 	if (attr->keylen)
-		return attr->buf;
+		return (uint8_t *)attr + attr->keyoff;
 
 	return NULL;
 }
@@ -174,50 +288,88 @@ void *lsa_attr_key(struct lsa_attr *attr)
 void *lsa_attr_data(struct lsa_attr *attr)
 {
 	if (attr->datalen)
-		return attr->buf + ROUND_UP(attr->keylen);
+		return (uint8_t *)attr + attr->dataoff;
 
 	return NULL;
 }
 
+int lsa_compare_keys(int atype, const void *akey, size_t akeylen,
+		     int btype, const void *bkey, size_t bkeylen)
+{
+	size_t len;
+	int ret;
+
+	if (atype < btype)
+		return -1;
+	if (atype > btype)
+		return 1;
+
+	len = akeylen;
+	if (len > bkeylen)
+		len = bkeylen;
+
+	ret = len ? memcmp(akey, bkey, len) : 0;
+	if (ret < 0)
+		return -1;
+	if (ret > 0)
+		return 1;
+
+	if (akeylen < bkeylen)
+		return -1;
+	if (akeylen > bkeylen)
+		return 1;
+
+	return 0;
+}
+
+int lsa_attr_compare_keys(struct lsa_attr *a, struct lsa_attr *b)
+{
+	return lsa_compare_keys(a->type, lsa_attr_key(a), a->keylen,
+				b->type, lsa_attr_key(b), b->keylen);
+}
+
+struct lsa_attr *lsa_attr_set_attrs(struct lsa_attr_set *set)
+{
+	return (struct lsa_attr *)((uint8_t *)set + set->off);
+}
+
 struct lsa_attr *lsa_find_attr(struct lsa *lsa, int type,
 			       const void *key, size_t keylen)
 {
-	return lsa_attr_set_find_attr(&lsa->root, type, key, keylen);
+	if (type == LSA_ATTR_TYPE_ADV_PATH)
+		return lsa_attr_set_find_attr(&lsa->path, type, key, keylen);
+
+	return lsa_attr_set_find_attr(&lsa->body->attrs, type, key, keylen);
 }
 
 struct lsa_attr *lsa_attr_set_find_attr(struct lsa_attr_set *set, int type,
 					const void *key, size_t keylen)
 {
-	struct {
-		struct lsa_attr		skey;
-		uint8_t			kkey[0];
-	} *s;
-	struct iv_avl_node *an;
+	struct lsa_attr *attrs;
+	int lo;
+	int hi;
 
-	if (keylen > 65536)
-		return NULL;
-
-	s = alloca(sizeof(*s) + keylen);
-
-	s->skey.type = type;
-	s->skey.keylen = keylen;
-	memcpy(lsa_attr_key(&s->skey), key, keylen);
+	attrs = lsa_attr_set_attrs(set);
 
-	an = set->attrs.root;
-	while (an != NULL) {
+	lo = 0;
+	hi = set->num;
+	while (lo < hi) {
 		struct lsa_attr *attr;
+		int mid;
 		int ret;
 
-		attr = iv_container_of(an, struct lsa_attr, an);
+		mid = (lo + hi) / 2;
+		attr = &attrs[mid];
 
-		ret = lsa_attr_compare_keys(&s->skey, attr);
+		ret = lsa_compare_keys(type, key, keylen, attr->type,
+				       lsa_attr_key(attr), attr->keylen);
 		if (ret == 0)
 			return attr;
 
 		if (ret < 0)
-			an = an->left;
+			hi = mid;
 		else
-			an = an->right;
+			lo = mid + 1;
 	}
 
 	return NULL;
@@ -249,169 +401,589 @@ static size_t lsa_attr_size(const struct lsa_attr *attr)
 	return size;
 }
 
-int lsa_add_attr(struct lsa *lsa, int type, int sign, const void *key,
-		 size_t keylen, const void *data, size_t datalen)
+
+void lsa_builder_init(struct lsa_builder *b, const uint8_t *id)
 {
-	if (lsa->refcount != 1) {
-		fprintf(stderr, "lsa_add_attr: called on an LSA with "
-				"refcount %d\n", lsa->refcount);
-		abort();
+	memcpy(b->id, id, NODE_ID_LEN);
+	b->ref = 0;
+	b->num = 0;
+	b->size = 0;
+	b->attrs = NULL;
+	b->buflen = 0;
+	b->bufsize = 0;
+	b->buf = NULL;
+}
+
+void lsa_builder_init_ref(struct lsa_builder *b, const uint8_t *id)
+{
+	lsa_builder_init(b, id);
+	b->ref = 1;
+}
+
+void lsa_builder_reserve(struct lsa_builder *b, int attrs, size_t bytes)
+{
+	if (attrs > b->size) {
+		struct lsa_builder_attr *a;
+
+		a = realloc(b->attrs, attrs * sizeof(*a));
+		if (a == NULL)
+			abort();
+
+		b->size = attrs;
+		b->attrs = a;
 	}
 
-	return lsa_attr_set_add_attr(lsa, &lsa->root, type, sign,
-				     key, keylen, data, datalen);
+	if (bytes > b->bufsize) {
+		uint8_t *buf;
+
+		buf = realloc(b->buf, bytes);
+		if (buf == NULL)
+			abort();
+
+		b->bufsize = bytes;
+		b->buf = buf;
+	}
 }
 
-static struct lsa_attr *attr_alloc(int type, size_t keylen, size_t datalen)
+void lsa_builder_deinit(struct lsa_builder *b)
 {
-	struct lsa_attr *attr;
-	size_t size;
+	free(b->attrs);
+	free(b->buf);
+}
 
-	size = sizeof(*attr);
+static size_t builder_copy(struct lsa_builder *b, const void *ptr, size_t len)
+{
+	size_t off;
 
-	if (ROUND_UP(keylen) > SIZE_MAX - size)
+	if (len > SIZE_MAX - b->buflen)
 		abort();
-	size += ROUND_UP(keylen);
 
-	if (datalen > SIZE_MAX - size)
-		abort();
-	size += datalen;
+	if (b->buflen + len > b->bufsize) {
+		size_t size;
 
-	attr = malloc(size);
-	if (attr == NULL)
-		abort();
+		size = b->bufsize ? 2 * b->bufsize : 1024;
+		while (size < b->buflen + len)
+			size *= 2;
+
+		lsa_builder_reserve(b, b->size, size);
+	}
 
+	off = b->buflen;
+	if (len)
+		memcpy(b->buf + off, ptr, len);
+	b->buflen += len;
+
+	return off;
+}
+
+static const uint8_t *
+builder_key(struct lsa_builder *b, struct lsa_builder_attr *attr)
+{
+	return b->ref ? attr->key : b->buf + attr->keyoff;
+}
+
+static const uint8_t *
+builder_data(struct lsa_builder *b, struct lsa_builder_attr *attr)
+{
+	return b->ref ? attr->data : b->buf + attr->dataoff;
+}
+
+static struct lsa_builder_attr *
+builder_add(struct lsa_builder *b, int set, int type, int sign,
+	    const void *key, size_t keylen)
+{
+	struct lsa_builder_attr *attr;
+
+	if (set != LSA_BUILDER_ROOT &&
+	    (set < 0 || set >= b->num || !b->attrs[set].data_is_attr_set))
+		return NULL;
+
+	if (b->num == b->size)
+		lsa_builder_reserve(b, b->size ? 2 * b->size : 16, b->bufsize);
+
+	attr = &b->attrs[b->num++];
+	attr->parent = set;
 	attr->type = type;
 	attr->data_is_attr_set = 0;
-	attr->attr_signed = 0;
+	attr->attr_signed = !!sign;
+	attr->deleted = 0;
 	attr->keylen = keylen;
-	attr->datalen = datalen;
+	attr->datalen = 0;
+	if (b->ref) {
+		attr->key = key;
+		attr->data = NULL;
+	} else {
+		attr->keyoff = builder_copy(b, key, keylen);
+		attr->dataoff = 0;
+	}
 
 	return attr;
 }
 
-int lsa_attr_set_add_attr(struct lsa *lsa, struct lsa_attr_set *set,
-			  int type, int sign, const void *key, size_t keylen,
-			  const void *data, size_t datalen)
+int lsa_builder_add_attr(struct lsa_builder *b, int set, int type, int sign,
+			 const void *key, size_t keylen,
+			 const void *data, size_t datalen)
 {
-	struct lsa_attr *attr;
+	struct lsa_builder_attr *attr;
 
-	if (lsa->refcount != 1) {
-		fprintf(stderr, "lsa_attr_set_add_attr: called on an LSA "
-				"with refcount %d\n", lsa->refcount);
-		abort();
+	attr = builder_add(b, set, type, sign, key, keylen);
+	if (attr == NULL)
+		return -1;
+
+	attr->datalen = datalen;
+	if (b->ref)
+		attr->data = data;
+	else
+		attr->dataoff = builder_copy(b, data, datalen);
+
+	return 0;
+}
+
+int lsa_builder_add_attr_set(struct lsa_builder *b, int set, int type,
+			     int sign, const void *key, size_t keylen)
+{
+	struct lsa_builder_attr *attr;
+
+	attr = builder_add(b, set, type, sign, key, keylen);
+	if (attr == NULL)
+		return -1;
+
+	attr->data_is_attr_set = 1;
+
+	return attr - b->attrs;
+}
+
+int lsa_builder_del_attr(struct lsa_builder *b, int set, int type,
+			 const void *key, size_t keylen)
+{
+	int i;
+
+	for (i = 0; i < b->num; i++) {
+		struct lsa_builder_attr *attr = &b->attrs[i];
+
+		if (attr->parent == set && !attr->deleted &&
+		    !lsa_compare_keys(type, key, keylen, attr->type,
+				      builder_key(b, attr), attr->keylen)) {
+			attr->deleted = 1;
+			return 0;
+		}
 	}
 
-	attr = lsa_attr_set_find_attr(set, type, key, keylen);
-	if (attr != NULL)
-		abort();
+	return -1;
+}
 
-	attr = attr_alloc(type, keylen, datalen);
+static int builder_add_set(struct lsa_builder *b, int parent,
+			   struct lsa_attr_set *set)
+{
+	struct lsa_attr *attrs;
+	int i;
 
-	if (sign)
-		attr->attr_signed = 1;
+	attrs = lsa_attr_set_attrs(set);
+	for (i = 0; i < set->num; i++) {
+		struct lsa_attr *attr = &attrs[i];
+		int ret;
 
-	if (keylen)
-		memcpy(lsa_attr_key(attr), key, keylen);
-	if (datalen)
-		memcpy(lsa_attr_data(attr), data, datalen);
+		if (attr->data_is_attr_set) {
+			int child;
 
-	if (iv_avl_tree_insert(&set->attrs, &attr->an) < 0) {
-		free(attr);
-		return -1;
+			child = lsa_builder_add_attr_set(b, parent, attr->type,
+					attr->attr_signed,
+					lsa_attr_key(attr), attr->keylen);
+			if (child < 0)
+				return -1;
+
+			ret = builder_add_set(b, child, lsa_attr_data(attr));
+		} else {
+			ret = lsa_builder_add_attr(b, parent, attr->type,
+					attr->attr_signed,
+					lsa_attr_key(attr), attr->keylen,
+					lsa_attr_data(attr), attr->datalen);
+		}
+
+		if (ret < 0)
+			return -1;
 	}
 
-	lsa->bytes += lsa_attr_size(attr);
+	return 0;
+}
+
+int lsa_builder_init_from_lsa(struct lsa_builder *b, struct lsa *lsa)
+{
+	lsa_builder_init(b, lsa->id);
+
+	if (builder_add_set(b, LSA_BUILDER_ROOT, &lsa->path) < 0 ||
+	    builder_add_set(b, LSA_BUILDER_ROOT, &lsa->body->attrs) < 0) {
+		lsa_builder_deinit(b);
+		return -1;
+	}
 
 	return 0;
 }
 
-struct lsa_attr_set *lsa_add_attr_set(struct lsa *lsa, int type, int sign,
-				      const void *key, size_t keylen)
+
+struct lsa *lsa_alloc(const uint8_t *id, size_t pathsize, size_t bodysize)
 {
-	if (lsa->refcount != 1) {
-		fprintf(stderr, "lsa_add_attr_set: called on an LSA "
-				"with refcount %d\n", lsa->refcount);
+	struct lsa *lsa;
+	struct lsa_body *body;
+
+	if (pathsize > UINT32_MAX || bodysize > UINT32_MAX)
 		abort();
+
+	lsa = calloc(1, sizeof(*lsa) + pathsize);
+	body = calloc(1, sizeof(*body) + bodysize);
+	if (lsa == NULL || body == NULL) {
+		free(body);
+		free(lsa);
+		return NULL;
 	}
 
-	return lsa_attr_set_add_attr_set(lsa, &lsa->root, type,
-					 sign, key, keylen);
+	body->refcount = 1;
+	memcpy(body->id, id, NODE_ID_LEN);
+	body->mem = sizeof(*body) + bodysize;
+	body->num_adjs = -1;
+	num_bodies++;
+
+	lsa->refcount = 1;
+	lsa->bytes = MAX_SERIALISED_INT_LEN + NODE_ID_LEN;
+	memcpy(lsa->id, id, NODE_ID_LEN);
+	lsa->body = body;
+	num_lsas++;
+
+	return lsa;
+}
+
+size_t lsa_layout_attr_size(size_t keylen, int data_is_attr_set,
+			    size_t datalen)
+{
+	size_t size;
+
+	size = sizeof(struct lsa_attr) + ROUND_UP(keylen);
+	if (data_is_attr_set)
+		size += sizeof(struct lsa_attr_set);
+	else
+		size += ROUND_UP(datalen);
+
+	return size;
+}
+
+void lsa_layout_init(struct lsa_layout *l, struct lsa *lsa,
+		     struct lsa_attr_set *set)
+{
+	l->lsa = lsa;
+	if (set == &lsa->path)
+		l->arena = (uint8_t *)(lsa + 1);
+	else
+		l->arena = (uint8_t *)(lsa->body + 1);
+	l->off = 0;
+}
+
+static void *layout_alloc(struct lsa_layout *l, size_t size)
+{
+	void *ptr;
+
+	ptr = l->arena + l->off;
+	l->off += ROUND_UP(size);
+
+	return ptr;
+}
+
+struct lsa_attr *
+lsa_layout_set(struct lsa_layout *l, struct lsa_attr_set *set, int num)
+{
+	struct lsa_attr *attrs;
+
+	attrs = layout_alloc(l, num * sizeof(*attrs));
+	set->num = num;
+	set->off = (uint8_t *)attrs - (uint8_t *)set;
+
+	return attrs;
 }
 
 struct lsa_attr_set *
-lsa_attr_set_add_attr_set(struct lsa *lsa, struct lsa_attr_set *set,
-			  int type, int sign, const void *key, size_t keylen)
+lsa_layout_attr(struct lsa_layout *l, struct lsa_attr *attr, int type,
+		int sign, const void *key, size_t keylen,
+		int data_is_attr_set, const void *data, size_t datalen)
 {
-	struct lsa_attr *attr;
 	struct lsa_attr_set *child;
+	uint8_t *ptr;
 
-	if (lsa->refcount != 1) {
-		fprintf(stderr, "lsa_attr_set_add_attr_set: called on an "
-				"LSA with refcount %d\n", lsa->refcount);
-		abort();
+	attr->type = type;
+	attr->data_is_attr_set = !!data_is_attr_set;
+	attr->attr_signed = !!sign;
+	attr->keylen = keylen;
+
+	if (keylen) {
+		ptr = layout_alloc(l, keylen);
+		memcpy(ptr, key, keylen);
+		attr->keyoff = ptr - (uint8_t *)attr;
 	}
 
-	attr = lsa_attr_set_find_attr(set, type, key, keylen);
-	if (attr != NULL)
-		abort();
+	child = NULL;
+	if (data_is_attr_set) {
+		child = layout_alloc(l, sizeof(*child));
+		attr->datalen = sizeof(*child);
+		attr->dataoff = (uint8_t *)child - (uint8_t *)attr;
+	} else if (datalen) {
+		ptr = layout_alloc(l, datalen);
+		memcpy(ptr, data, datalen);
+		attr->datalen = datalen;
+		attr->dataoff = ptr - (uint8_t *)attr;
+	}
 
-	attr = attr_alloc(type, keylen, sizeof(struct lsa_attr_set));
-	attr->data_is_attr_set = 1;
-	if (sign)
-		attr->attr_signed = 1;
-	if (keylen)
-		memcpy(lsa_attr_key(attr), key, keylen);
+	l->lsa->bytes += lsa_attr_size(attr);
 
-	if (iv_avl_tree_insert(&set->attrs, &attr->an) < 0) {
-		free(attr);
-		return NULL;
+	return child;
+}
+
+static uint64_t hash_word(uint64_t hash, uint64_t value)
+{
+	hash = (hash ^ value) * 0x9e3779b97f4a7c15ULL;
+
+	return hash ^ (hash >> 29);
+}
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *buf, size_t len)
+{
+	uint64_t value;
+
+	hash = hash_word(hash, len);
+
+	while (len >= sizeof(value)) {
+		memcpy(&value, buf, sizeof(value));
+		hash = hash_word(hash, value);
+		buf += sizeof(value);
+		len -= sizeof(value);
 	}
 
-	child = lsa_attr_data(attr);
-	INIT_IV_AVL_TREE(&child->attrs, compare_attr_keys);
+	if (len) {
+		value = 0;
+		memcpy(&value, buf, len);
+		hash = hash_word(hash, value);
+	}
 
-	lsa->bytes += lsa_attr_size(attr);
+	return hash;
+}
 
-	return child;
+static void hash_set(struct lsa_attr_set *set)
+{
+	struct lsa_attr *attrs;
+	uint64_t hash;
+	int i;
+
+	attrs = lsa_attr_set_attrs(set);
+
+	hash = hash_word(0, set->num);
+	for (i = 0; i < set->num; i++) {
+		struct lsa_attr *attr = &attrs[i];
+		uint64_t h;
+
+		h = hash_word(0, (attr->type << 2) |
+				 (attr->data_is_attr_set << 1) |
+				 attr->attr_signed);
+		h = hash_bytes(h, lsa_attr_key(attr), attr->keylen);
+		if (attr->data_is_attr_set) {
+			struct lsa_attr_set *child = lsa_attr_data(attr);
+
+			hash_set(child);
+			h = hash_word(h, child->hash);
+		} else {
+			h = hash_bytes(h, lsa_attr_data(attr), attr->datalen);
+		}
+
+		attr->hash = h;
+		hash = hash_word(hash, h);
+	}
+
+	set->hash = hash;
 }
 
-void lsa_del_attr(struct lsa *lsa, struct lsa_attr *attr)
+void lsa_layout_finish(struct lsa *lsa)
 {
-	if (lsa->refcount != 1) {
-		fprintf(stderr, "lsa_del_attr: called on an LSA with "
-				"refcount %d\n", lsa->refcount);
-		abort();
+	hash_set(&lsa->path);
+	hash_set(&lsa->body->attrs);
+}
+
+
+/*
+ * The live attributes of each attribute set in the builder are put
+ * on a list by lsa_builder_finish(), with head[0] for the top level
+ * and head[i + 1] for the set at index i.  At the top level, ADV_PATH
+ * attributes go into the LSA itself and all others into the body.
+ */
+#define FILTER_NONE	0
+#define FILTER_PATH	1
+#define FILTER_BODY	2
+
+struct finish_state {
+	struct lsa_builder	*b;
+	int			*head;
+	int			*next;
+	int			*order;
+	int			norder;
+	struct lsa_layout	l;
+};
+
+static int filter_match(struct lsa_builder_attr *attr, int filter)
+{
+	if (filter == FILTER_PATH)
+		return attr->type == LSA_ATTR_TYPE_ADV_PATH;
+	if (filter == FILTER_BODY)
+		return attr->type != LSA_ATTR_TYPE_ADV_PATH;
+	return 1;
+}
+
+static size_t measure_set(struct finish_state *st, int slot, int filter)
+{
+	size_t size;
+	int i;
+
+	size = 0;
+	for (i = st->head[slot]; i >= 0; i = st->next[i]) {
+		struct lsa_builder_attr *attr = &st->b->attrs[i];
+
+		if (!filter_match(attr, filter))
+			continue;
+
+		size += lsa_layout_attr_size(attr->keylen,
+					     attr->data_is_attr_set,
+					     attr->datalen);
+		if (attr->data_is_attr_set)
+			size += measure_set(st, i + 1, FILTER_NONE);
+	}
+
+	return size;
+}
+
+static int compare_builder_attrs(struct lsa_builder *b, int i, int j)
+{
+	struct lsa_builder_attr *a = &b->attrs[i];
+	struct lsa_builder_attr *c = &b->attrs[j];
+
+	return lsa_compare_keys(a->type, builder_key(b, a), a->keylen,
+				c->type, builder_key(b, c), c->keylen);
+}
+
+static int emit_set(struct finish_state *st, struct lsa_attr_set *set,
+		    int slot, int filter)
+{
+	struct lsa_builder *b = st->b;
+	struct lsa_attr *attrs;
+	int *order;
+	int num;
+	int i;
+
+	order = st->order + st->norder;
+
+	/*
+	 * Attributes are nearly always added in order, so this
+	 * insertion sort is usually a single pass.
+	 */
+	num = 0;
+	for (i = st->head[slot]; i >= 0; i = st->next[i]) {
+		int j;
+
+		if (!filter_match(&b->attrs[i], filter))
+			continue;
+
+		for (j = num; j > 0; j--) {
+			int ret;
+
+			ret = compare_builder_attrs(b, order[j - 1], i);
+			if (ret == 0)
+				return -1;
+			if (ret < 0)
+				break;
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+		num++;
 	}
 
-	lsa->bytes -= lsa_attr_size(attr);
-	iv_avl_tree_delete(&lsa->root.attrs, &attr->an);
+	st->norder += num;
 
-	if (attr->data_is_attr_set) {
-		struct lsa_attr_set *set;
+	attrs = lsa_layout_set(&st->l, set, num);
 
-		set = lsa_attr_data(attr);
-		if (!iv_avl_tree_empty(&set->attrs))
-			attr_tree_free(lsa, set->attrs.root);
+	for (i = 0; i < num; i++) {
+		struct lsa_builder_attr *battr = &b->attrs[order[i]];
+		struct lsa_attr_set *child;
+
+		child = lsa_layout_attr(&st->l, &attrs[i], battr->type,
+					battr->attr_signed,
+					builder_key(b, battr), battr->keylen,
+					battr->data_is_attr_set,
+					builder_data(b, battr), battr->datalen);
+
+		if (child != NULL &&
+		    emit_set(st, child, order[i] + 1, FILTER_NONE) < 0) {
+			return -1;
+		}
 	}
 
-	free(attr);
+	st->norder -= num;
+
+	return 0;
 }
 
-void lsa_del_attr_bykey(struct lsa *lsa, int type,
-			const void *key, size_t keylen)
+struct lsa *lsa_builder_finish(struct lsa_builder *b)
 {
-	struct lsa_attr *attr;
+	struct finish_state st;
+	struct lsa *lsa;
+	int *tmp;
+	int i;
 
-	if (lsa->refcount != 1) {
-		fprintf(stderr, "lsa_del_attr_bykey: called on an LSA with "
-				"refcount %d\n", lsa->refcount);
-		abort();
+	tmp = malloc((3 * b->num + 1) * sizeof(int));
+	if (tmp == NULL)
+		return NULL;
+
+	st.b = b;
+	st.head = tmp;
+	st.next = tmp + b->num + 1;
+	st.order = tmp + 2 * b->num + 1;
+	st.norder = 0;
+
+	for (i = 0; i <= b->num; i++)
+		st.head[i] = -1;
+
+	/*
+	 * Link every attribute into the list of children of its
+	 * parent.  Pushing the attributes onto the front of those
+	 * lists in reverse order leaves each list in the order in
+	 * which its attributes were added, whatever order the parents
+	 * were added in.
+	 */
+	for (i = b->num - 1; i >= 0; i--) {
+		struct lsa_builder_attr *attr = &b->attrs[i];
+
+		if (attr->deleted)
+			continue;
+
+		st.next[i] = st.head[attr->parent + 1];
+		st.head[attr->parent + 1] = i;
 	}
 
-	attr = lsa_find_attr(lsa, type, key, keylen);
-	if (attr == NULL)
-		abort();
+	lsa = lsa_alloc(b->id, measure_set(&st, 0, FILTER_PATH),
+			measure_set(&st, 0, FILTER_BODY));
+	if (lsa == NULL)
+		goto out;
+
+	lsa_layout_init(&st.l, lsa, &lsa->path);
+	if (emit_set(&st, &lsa->path, 0, FILTER_PATH) < 0)
+		goto err;
+
+	lsa_layout_init(&st.l, lsa, &lsa->body->attrs);
+	if (emit_set(&st, &lsa->body->attrs, 0, FILTER_BODY) < 0)
+		goto err;
 
-	lsa_del_attr(lsa, attr);
+	lsa_layout_finish(lsa);
+
+	goto out;
+
+err:
+	lsa_put(lsa);
+	lsa = NULL;
+
+out:
+	free(tmp);
+
+	return lsa;
 }
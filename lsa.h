@@ -20,62 +20,205 @@
 #ifndef __LSA_H
 #define __LSA_H
 
+#include <stdio.h>
+#include <stdint.h>
 #include <iv_avl.h>
 
 #define NODE_ID_LEN	32
 
+/*
+ * LSAs are immutable.  They are created by lsa_builder_finish() or by
+ * lsa_deserialise(), which lay out all of an LSA's attributes in a
+ * single allocation, as a directory of struct lsa_attr entries per
+ * attribute set, sorted by type and key, followed by the attribute
+ * keys and data.  The offsets in struct lsa_attr and struct
+ * lsa_attr_set are relative to the struct itself.
+ *
+ * Every attribute and attribute set carries a 64-bit hash of its
+ * contents, including those of any nested attribute sets, so that
+ * attributes or sets with different hashes are known to differ
+ * without looking at their contents.
+ */
 struct lsa_attr_set {
-	struct iv_avl_tree	attrs;
+	int			num;
+	uint32_t		off;
+	uint64_t		hash;
+};
+
+/*
+ * The copies of an LSA that we receive from different neighbours
+ * only differ in their ADV_PATH attribute, so an LSA is split into
+ * a per-copy set that holds just the ADV_PATH attribute, and a body
+ * that holds all other attributes.  Bodies are interned by node id
+ * and version by lsa_intern(), after which all identical copies of
+ * an LSA share the same body.  adj_rib_in only interns LSAs whose
+ * signature it has accepted.
+ *
+ * As ADV_PATH has the lowest attribute type, walking path and then
+ * body->attrs visits all attributes in attribute order.
+ *
+ * The serialised forms of the body are cached in the body by
+ * lsa_serialise() and lsa_serialise_signed() when they are first
+ * needed: wire holds the serialised body attributes, and signed_wire
+ * the complete signed-only serialisation of an LSA with this body and
+ * no signed path attributes, with the body attributes starting at
+ * offset signed_off.
+ */
+struct lsa_body {
+	struct iv_avl_node	an;
+	int			refcount;
+	unsigned		interned:1;
+	uint8_t			id[NODE_ID_LEN];
+	int			versionlen;
+	uint8_t			version[8];
+	size_t			mem;
+	int			num_adjs;
+	struct lsa_adj		*adjs;
+	uint8_t			*wire;
+	size_t			wirelen;
+	uint8_t			*signed_wire;
+	size_t			signed_wirelen;
+	size_t			signed_off;
+	struct lsa_attr_set	attrs;
 };
 
 struct lsa {
 	int			refcount;
 	size_t			bytes;
 	uint8_t			id[NODE_ID_LEN];
-	struct lsa_attr_set	root;
+	struct lsa_body		*body;
+	struct lsa_attr_set	path;
 };
 
-struct lsa *lsa_alloc(const uint8_t *id);
 struct lsa *lsa_get(struct lsa *lsa);
 void lsa_put(struct lsa *lsa);
-struct lsa *lsa_clone(const struct lsa *lsa);
+int lsa_empty(const struct lsa *lsa);
+void lsa_intern(struct lsa *lsa);
+void lsa_print_stats(FILE *fp);
+
+
+/*
+ * The signed PEER attributes of an LSA, decoded into a flat array
+ * sorted by peer id.  The array is built on first use.
+ */
+struct lsa_adj {
+	uint8_t			id[NODE_ID_LEN];
+	uint16_t		metric;
+	uint8_t			flags;
+	unsigned		metric_valid:1;
+	unsigned		flags_valid:1;
+};
+
+int lsa_get_adjs(struct lsa *lsa, const struct lsa_adj **adjs);
+const struct lsa_adj *lsa_find_adj(struct lsa *lsa, const uint8_t *id);
 
 
 struct lsa_attr {
-	struct iv_avl_node	an;
 	int			type;
 	unsigned		data_is_attr_set:1;
 	unsigned		attr_signed:1;
+	uint32_t		keyoff;
+	uint32_t		dataoff;
 	size_t			keylen;
 	size_t			datalen;
-	uint8_t			buf[0];
+	uint64_t		hash;
 };
 
 void *lsa_attr_key(struct lsa_attr *attr);
 void *lsa_attr_data(struct lsa_attr *attr);
+int lsa_compare_keys(int atype, const void *akey, size_t akeylen,
+		     int btype, const void *bkey, size_t bkeylen);
+int lsa_attr_compare_keys(struct lsa_attr *a, struct lsa_attr *b);
+
+struct lsa_attr *lsa_attr_set_attrs(struct lsa_attr_set *set);
 
 struct lsa_attr *lsa_find_attr(struct lsa *lsa, int type,
 			       const void *key, size_t keylen);
 struct lsa_attr *lsa_attr_set_find_attr(struct lsa_attr_set *set, int type,
 					const void *key, size_t keylen);
 
-int lsa_add_attr(struct lsa *lsa, int type, int sign, const void *key,
-		 size_t keylen, const void *data, size_t datalen);
-int lsa_attr_set_add_attr(struct lsa *lsa, struct lsa_attr_set *set,
-			  int type, int sign, const void *key, size_t keylen,
-			  const void *data, size_t datalen);
 
-struct lsa_attr_set *lsa_add_attr_set(struct lsa *lsa, int type, int sign,
-				      const void *key, size_t keylen);
-struct lsa_attr_set *lsa_attr_set_add_attr_set(struct lsa *lsa,
-					       struct lsa_attr_set *set,
-					       int type, int sign,
-					       const void *key, size_t keylen);
+/*
+ * LSAs are put together with an lsa_builder.  Attribute sets within
+ * the builder are referred to by the index returned when adding
+ * them, or by LSA_BUILDER_ROOT for the top level.  The builder keeps
+ * its own copy of all keys and data, unless it was initialised with
+ * lsa_builder_init_ref(), in which case it only keeps pointers to
+ * them, and they then have to stay valid until the builder is
+ * deinitialised.  lsa_builder_finish() can be called more than once.
+ */
+#define LSA_BUILDER_ROOT	-1
 
-void lsa_del_attr(struct lsa *lsa, struct lsa_attr *attr);
+struct lsa_builder_attr {
+	int			parent;
+	int			type;
+	unsigned		data_is_attr_set:1;
+	unsigned		attr_signed:1;
+	unsigned		deleted:1;
+	size_t			keylen;
+	size_t			datalen;
+	size_t			keyoff;
+	size_t			dataoff;
+	const uint8_t		*key;
+	const uint8_t		*data;
+};
+
+struct lsa_builder {
+	uint8_t			id[NODE_ID_LEN];
+	int			ref;
+	int			num;
+	int			size;
+	struct lsa_builder_attr	*attrs;
+	size_t			buflen;
+	size_t			bufsize;
+	uint8_t			*buf;
+};
+
+void lsa_builder_init(struct lsa_builder *b, const uint8_t *id);
+void lsa_builder_init_ref(struct lsa_builder *b, const uint8_t *id);
+int lsa_builder_init_from_lsa(struct lsa_builder *b, struct lsa *lsa);
+void lsa_builder_reserve(struct lsa_builder *b, int attrs, size_t bytes);
+void lsa_builder_deinit(struct lsa_builder *b);
+int lsa_builder_add_attr(struct lsa_builder *b, int set, int type, int sign,
+			 const void *key, size_t keylen,
+			 const void *data, size_t datalen);
+int lsa_builder_add_attr_set(struct lsa_builder *b, int set, int type,
+			     int sign, const void *key, size_t keylen);
+int lsa_builder_del_attr(struct lsa_builder *b, int set, int type,
+			 const void *key, size_t keylen);
+struct lsa *lsa_builder_finish(struct lsa_builder *b);
+
+
+/*
+ * The primitives that lsa_builder_finish() lays out LSAs with, which
+ * lsa_deserialise() uses directly for records whose attributes are
+ * already in order.  lsa_alloc() allocates an LSA with zeroed path
+ * and body arenas of the given sizes, which are the sums of
+ * lsa_layout_attr_size() over the attributes that go into them.
+ * lsa_layout_set() then allocates the directory of an attribute set,
+ * and lsa_layout_attr() fills in one directory entry, and returns the
+ * attribute set that it holds if data_is_attr_set is true, which has
+ * to be laid out before the next entry.  lsa_layout_finish() computes
+ * the attribute hashes once all attributes have been laid out.
+ */
+struct lsa_layout {
+	struct lsa		*lsa;
+	uint8_t			*arena;
+	size_t			off;
+};
 
-void lsa_del_attr_bykey(struct lsa *lsa, int type,
-			const void *key, size_t keylen);
+struct lsa *lsa_alloc(const uint8_t *id, size_t pathsize, size_t bodysize);
+size_t lsa_layout_attr_size(size_t keylen, int data_is_attr_set,
+			    size_t datalen);
+void lsa_layout_init(struct lsa_layout *l, struct lsa *lsa,
+		     struct lsa_attr_set *set);
+struct lsa_attr *
+lsa_layout_set(struct lsa_layout *l, struct lsa_attr_set *set, int num);
+struct lsa_attr_set *
+lsa_layout_attr(struct lsa_layout *l, struct lsa_attr *attr, int type,
+		int sign, const void *key, size_t keylen,
+		int data_is_attr_set, const void *data, size_t datalen);
+void lsa_layout_finish(struct lsa *lsa);
 
 
 #endif
@@ -92,75 +92,242 @@ struct src {
 		(size_t)v;				\
 	})
 
-static int lsa_deserialise_attr_set(struct lsa *lsa, struct lsa_attr_set *dst,
-				    struct src *src, int maxdepth)
+struct attr {
+	int		type;
+	int		flags;
+	size_t		keylen;
+	uint8_t		*key;
+	size_t		datalen;
+	uint8_t		*data;
+};
+
+static int read_attr(struct src *src, struct attr *attr)
+{
+	attr->type = SRC_READ_INT(src);
+
+	attr->flags = SRC_READ_INT(src);
+
+	if (attr->flags & LSA_ATTR_FLAG_HAS_KEY) {
+		attr->keylen = SRC_READ_SIZE_T(src);
+		attr->key = SRC_GET_PTR(src, attr->keylen);
+	} else {
+		attr->keylen = 0;
+		attr->key = NULL;
+	}
+
+	attr->datalen = SRC_READ_SIZE_T(src);
+	attr->data = SRC_GET_PTR(src, attr->datalen);
+
+	return 0;
+
+short_read:
+error:
+	return -1;
+}
+
+/*
+ * lsa_serialise() writes out the attributes of every attribute set
+ * in order, so that is how we normally receive them.  Such records
+ * are validated and measured in a first pass, after which a second
+ * pass lays out the LSA directly, copying every key and data blob
+ * from the receive buffer into its final place in the LSA, without
+ * going through an lsa_builder.  Records with attributes that are
+ * out of order, or that have duplicate attributes, are handed to an
+ * lsa_builder instead, which will sort or reject them.
+ */
+#define SECTION_ALL	-1
+#define SECTION_PATH	0
+#define SECTION_BODY	1
+
+static int attr_section(const struct attr *attr)
+{
+	if (attr->type == LSA_ATTR_TYPE_ADV_PATH)
+		return SECTION_PATH;
+
+	return SECTION_BODY;
+}
+
+static int measure_attr_set(struct src *src, int maxdepth,
+			    size_t *size, int *num, int section)
+{
+	struct attr prev;
+	int i;
+
+	for (i = 0; src->off < src->srclen; i++) {
+		struct attr attr;
+		int s;
+
+		if (read_attr(src, &attr) < 0)
+			return -1;
+
+		if (i && lsa_compare_keys(prev.type, prev.key, prev.keylen,
+					  attr.type, attr.key,
+					  attr.keylen) >= 0) {
+			return 1;
+		}
+		prev = attr;
+
+		s = (section == SECTION_ALL) ? attr_section(&attr) : section;
+		if (num != NULL)
+			num[s]++;
+
+		size[s] += lsa_layout_attr_size(attr.keylen,
+				!!(attr.flags & LSA_ATTR_FLAG_DATA_IS_TLV),
+				attr.datalen);
+
+		if (attr.flags & LSA_ATTR_FLAG_DATA_IS_TLV) {
+			struct src srcdata;
+			int ret;
+
+			if (maxdepth == 0)
+				return -1;
+
+			srcdata.src = attr.data;
+			srcdata.srclen = attr.datalen;
+			srcdata.off = 0;
+
+			ret = measure_attr_set(&srcdata, maxdepth - 1,
+					       size, NULL, s);
+			if (ret)
+				return ret;
+		}
+	}
+
+	return 0;
+}
+
+static int count_attrs(uint8_t *buf, size_t buflen)
+{
+	struct src src;
+	int num;
+
+	src.src = buf;
+	src.srclen = buflen;
+	src.off = 0;
+
+	num = 0;
+	while (src.off < src.srclen) {
+		struct attr attr;
+
+		read_attr(&src, &attr);
+		num++;
+	}
+
+	return num;
+}
+
+static void layout_attr_set(struct lsa_layout *l, struct lsa_attr_set *set,
+			    struct src *src, int num, int section)
 {
+	struct lsa_attr *attrs;
+	int i;
+
+	attrs = lsa_layout_set(l, set, num);
+
+	i = 0;
 	while (src->off < src->srclen) {
-		int type;
-		int flags;
-		size_t keylen;
-		uint8_t *key;
-		size_t datalen;
-		uint8_t *data;
-		int sign;
+		struct attr attr;
+		struct lsa_attr_set *child;
 
-		type = SRC_READ_INT(src);
+		read_attr(src, &attr);
+		if (section != SECTION_ALL && attr_section(&attr) != section)
+			continue;
 
-		flags = SRC_READ_INT(src);
+		child = lsa_layout_attr(l, &attrs[i++], attr.type,
+				!!(attr.flags & LSA_ATTR_FLAG_SIGNED),
+				attr.key, attr.keylen,
+				!!(attr.flags & LSA_ATTR_FLAG_DATA_IS_TLV),
+				attr.data, attr.datalen);
 
-		if (flags & LSA_ATTR_FLAG_HAS_KEY) {
-			keylen = SRC_READ_SIZE_T(src);
-			key = SRC_GET_PTR(src, keylen);
-		} else {
-			keylen = 0;
+		if (child != NULL) {
+			struct src srcdata;
+
+			srcdata.src = attr.data;
+			srcdata.srclen = attr.datalen;
+			srcdata.off = 0;
+
+			layout_attr_set(l, child, &srcdata,
+					count_attrs(attr.data, attr.datalen),
+					SECTION_ALL);
 		}
+	}
+}
+
+static int lsa_deserialise_attr_set(struct lsa_builder *b, int set,
+				    struct src *src, int maxdepth)
+{
+	while (src->off < src->srclen) {
+		struct attr attr;
+		int sign;
 
-		datalen = SRC_READ_SIZE_T(src);
-		data = SRC_GET_PTR(src, datalen);
+		if (read_attr(src, &attr) < 0)
+			return -1;
 
-		sign = !!(flags & LSA_ATTR_FLAG_SIGNED);
+		sign = !!(attr.flags & LSA_ATTR_FLAG_SIGNED);
 
-		if (flags & LSA_ATTR_FLAG_DATA_IS_TLV) {
-			struct lsa_attr_set *set;
+		if (attr.flags & LSA_ATTR_FLAG_DATA_IS_TLV) {
 			struct src srcdata;
+			int child;
 
 			if (maxdepth == 0)
 				return -1;
 
-			set = lsa_attr_set_add_attr_set(lsa, dst, type, sign,
-							key, keylen);
-			if (set == NULL)
+			child = lsa_builder_add_attr_set(b, set, attr.type,
+							 sign, attr.key,
+							 attr.keylen);
+			if (child < 0)
 				return -1;
 
-			srcdata.src = data;
-			srcdata.srclen = datalen;
+			srcdata.src = attr.data;
+			srcdata.srclen = attr.datalen;
 			srcdata.off = 0;
-			if (lsa_deserialise_attr_set(lsa, set, &srcdata,
+			if (lsa_deserialise_attr_set(b, child, &srcdata,
 						     maxdepth - 1) < 0) {
 				return -1;
 			}
 		} else {
-			if (lsa_attr_set_add_attr(lsa, dst, type, sign,
-						  key, keylen,
-						  data, datalen) < 0) {
+			if (lsa_builder_add_attr(b, set, attr.type, sign,
+						 attr.key, attr.keylen,
+						 attr.data, attr.datalen) < 0) {
 				return -1;
 			}
 		}
 	}
 
 	return 0;
+}
 
-short_read:
-error:
-	return -1;
+static struct lsa *lsa_deserialise_builder(const uint8_t *id, struct src *src)
+{
+	struct lsa_builder b;
+	struct lsa *lsa;
+
+	/*
+	 * The builder only references the keys and data in the
+	 * receive buffer, so they are still only copied once.
+	 */
+	lsa_builder_init_ref(&b, id);
+	lsa_builder_reserve(&b, 64, 0);
+
+	lsa = NULL;
+	if (lsa_deserialise_attr_set(&b, LSA_BUILDER_ROOT, src, 8) == 0)
+		lsa = lsa_builder_finish(&b);
+
+	lsa_builder_deinit(&b);
+
+	return lsa;
 }
 
 ssize_t lsa_deserialise(struct lsa **lsap, uint8_t *buf, size_t buflen)
 {
-	struct lsa *lsa = NULL;
+	struct lsa *lsa;
 	struct src src;
 	size_t len;
 	uint8_t id[NODE_ID_LEN];
+	size_t start;
+	size_t size[2];
+	int num[2];
+	int ret;
 
 	src.src = buf;
 	src.srclen = buflen;
@@ -183,23 +350,80 @@ ssize_t lsa_deserialise(struct lsa **lsap, uint8_t *buf, size_t buflen)
 
 	SRC_READ(&src, id, NODE_ID_LEN);
 
-	lsa = lsa_alloc(id);
-	if (lsa == NULL)
+	start = src.off;
+
+	size[SECTION_PATH] = 0;
+	size[SECTION_BODY] = 0;
+	num[SECTION_PATH] = 0;
+	num[SECTION_BODY] = 0;
+
+	ret = measure_attr_set(&src, 8, size, num, SECTION_ALL);
+	if (ret < 0)
 		return -1;
 
-	if (lsa_deserialise_attr_set(lsa, &lsa->root, &src, 8) < 0)
-		goto error;
+	src.off = start;
+
+	if (ret == 0) {
+		struct lsa_layout l;
+
+		lsa = lsa_alloc(id, size[SECTION_PATH], size[SECTION_BODY]);
+		if (lsa == NULL)
+			return -1;
+
+		lsa_layout_init(&l, lsa, &lsa->path);
+		layout_attr_set(&l, &lsa->path, &src,
+				num[SECTION_PATH], SECTION_PATH);
+
+		src.off = start;
+
+		lsa_layout_init(&l, lsa, &lsa->body->attrs);
+		layout_attr_set(&l, &lsa->body->attrs, &src,
+				num[SECTION_BODY], SECTION_BODY);
+
+		lsa_layout_finish(lsa);
+	} else {
+		lsa = lsa_deserialise_builder(id, &src);
+		if (lsa == NULL)
+			return -1;
+	}
 
 	*lsap = lsa;
 
-	return src.off;
+	return len;
 
 short_read:
 	return 0;
 
 error:
-	if (lsa != NULL)
-		lsa_put(lsa);
+	return -1;
+}
+
+ssize_t lsa_deserialise_id(const uint8_t **id, uint8_t *buf, size_t buflen)
+{
+	struct src src;
+	size_t len;
+
+	src.src = buf;
+	src.srclen = buflen;
+	src.off = 0;
+
+	*id = NULL;
+
+	len = SRC_READ_SIZE_T(&src);
+	if (len > SSIZE_MAX - src.off)
+		return -1;
+
+	if (len + src.off > buflen)
+		return 0;
+
+	if (len >= NODE_ID_LEN)
+		*id = buf + src.off;
 
+	return len + src.off;
+
+short_read:
+	return 0;
+
+error:
 	return -1;
 }
@@ -24,5 +24,13 @@
 
 ssize_t lsa_deserialise(struct lsa **lsap, uint8_t *buf, size_t buflen);
 
+/*
+ * Returns the length of the serialised LSA at the start of buf in the
+ * same way as lsa_deserialise() does, and points *id at its node id,
+ * or sets *id to NULL if it doesn't have one, without deserialising
+ * or validating its attributes.
+ */
+ssize_t lsa_deserialise_id(const uint8_t **id, uint8_t *buf, size_t buflen);
+
 
 #endif
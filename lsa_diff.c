@@ -23,8 +23,6 @@
 #include <string.h>
 #include "lsa.h"
 #include "lsa_diff.h"
-#include "lsa_serialise.h"
-#include "util.h"
 
 struct lsa_diff_request {
 	int	diffs;
@@ -42,61 +40,58 @@ static void dummy_attr_del(void *cookie, struct lsa_attr *attr)
 {
 }
 
-static void add(void *_req, struct iv_avl_node *_a)
+static void add(struct lsa_diff_request *req, struct lsa_attr *a)
 {
-	struct lsa_diff_request *req = _req;
-	struct lsa_attr *a;
-
-	a = iv_container_of(_a, struct lsa_attr, an);
-
 	req->diffs++;
 	req->attr_add(req->cookie, a);
 }
 
-static int attr_cmp(struct lsa_attr *a, struct lsa_attr *b)
-{
-	if (a->data_is_attr_set != b->data_is_attr_set)
-		return 1;
-
-	if (!a->data_is_attr_set) {
-		if (a->datalen != b->datalen)
-			return 1;
+static int set_equal(struct lsa_attr_set *a, struct lsa_attr_set *b);
 
-		return memcmp(lsa_attr_data(a), lsa_attr_data(b), a->datalen);
-	} else {
-		size_t alen;
-		size_t blen;
-		uint8_t *abuf;
-		uint8_t *bbuf;
-
-		alen = lsa_attr_serialise_length(a);
-		blen = lsa_attr_serialise_length(b);
-		if (alen != blen)
-			return 1;
-
-		if (alen > 65536 - 16)
-			abort();
+/*
+ * Attributes with different hashes always differ, so the contents
+ * of two attributes only have to be compared if their hashes match.
+ */
+static int attr_equal(struct lsa_attr *a, struct lsa_attr *b)
+{
+	if (a->hash != b->hash)
+		return 0;
 
-		abuf = alloca(alen + 16);
-		lsa_attr_serialise(abuf, alen + 16, a);
+	if (a->data_is_attr_set != b->data_is_attr_set ||
+	    a->attr_signed != b->attr_signed ||
+	    lsa_attr_compare_keys(a, b))
+		return 0;
 
-		bbuf = alloca(blen + 16);
-		lsa_attr_serialise(bbuf, blen + 16, b);
+	if (a->data_is_attr_set)
+		return set_equal(lsa_attr_data(a), lsa_attr_data(b));
 
-		return memcmp(abuf, bbuf, alen);
-	}
+	return a->datalen == b->datalen &&
+	       !memcmp(lsa_attr_data(a), lsa_attr_data(b), a->datalen);
 }
 
-static void mod(void *_req, struct iv_avl_node *_a, struct iv_avl_node *_b)
+static int set_equal(struct lsa_attr_set *a, struct lsa_attr_set *b)
 {
-	struct lsa_diff_request *req = _req;
-	struct lsa_attr *a;
-	struct lsa_attr *b;
+	struct lsa_attr *aattrs;
+	struct lsa_attr *battrs;
+	int i;
+
+	if (a->hash != b->hash || a->num != b->num)
+		return 0;
+
+	aattrs = lsa_attr_set_attrs(a);
+	battrs = lsa_attr_set_attrs(b);
+	for (i = 0; i < a->num; i++) {
+		if (!attr_equal(&aattrs[i], &battrs[i]))
+			return 0;
+	}
 
-	a = iv_container_of(_a, struct lsa_attr, an);
-	b = iv_container_of(_b, struct lsa_attr, an);
+	return 1;
+}
 
-	if (attr_cmp(a, b)) {
+static void mod(struct lsa_diff_request *req, struct lsa_attr *a,
+		struct lsa_attr *b)
+{
+	if (!attr_equal(a, b)) {
 		req->diffs++;
 
 		if (req->attr_mod != NULL) {
@@ -108,25 +103,66 @@ static void mod(void *_req, struct iv_avl_node *_a, struct iv_avl_node *_b)
 	}
 }
 
-static void del(void *_req, struct iv_avl_node *_a)
+static void del(struct lsa_diff_request *req, struct lsa_attr *a)
 {
-	struct lsa_diff_request *req = _req;
-	struct lsa_attr *a;
-
-	a = iv_container_of(_a, struct lsa_attr, an);
-
 	req->diffs++;
 	req->attr_del(req->cookie, a);
 }
 
+/*
+ * Attribute directories are sorted by type and key, so two attribute
+ * sets can be diffed with a single merge pass.
+ */
+static void set_diff(struct lsa_diff_request *req,
+		     struct lsa_attr_set *a, struct lsa_attr_set *b)
+{
+	struct lsa_attr *aattrs;
+	struct lsa_attr *battrs;
+	int anum;
+	int bnum;
+	int i;
+	int j;
+
+	if (a != NULL && b != NULL && set_equal(a, b))
+		return;
+
+	aattrs = (a != NULL) ? lsa_attr_set_attrs(a) : NULL;
+	anum = (a != NULL) ? a->num : 0;
+	battrs = (b != NULL) ? lsa_attr_set_attrs(b) : NULL;
+	bnum = (b != NULL) ? b->num : 0;
+
+	i = 0;
+	j = 0;
+	while (i < anum && j < bnum) {
+		int ret;
+
+		ret = lsa_attr_compare_keys(&aattrs[i], &battrs[j]);
+		if (ret < 0) {
+			del(req, &aattrs[i++]);
+		} else if (ret > 0) {
+			add(req, &battrs[j++]);
+		} else {
+			mod(req, &aattrs[i], &battrs[j]);
+			i++;
+			j++;
+		}
+	}
+
+	while (i < anum)
+		del(req, &aattrs[i++]);
+
+	while (j < bnum)
+		add(req, &battrs[j++]);
+}
+
 int lsa_diff(struct lsa *_a, struct lsa *_b, void *cookie,
 	     void (*attr_add)(void *, struct lsa_attr *),
 	     void (*attr_mod)(void *, struct lsa_attr *, struct lsa_attr *),
 	     void (*attr_del)(void *, struct lsa_attr *))
 {
 	struct lsa_diff_request req;
-	struct iv_avl_tree *a;
-	struct iv_avl_tree *b;
+	struct lsa_attr_set *a;
+	struct lsa_attr_set *b;
 
 	req.diffs = 0;
 	req.cookie = cookie;
@@ -134,10 +170,22 @@ int lsa_diff(struct lsa *_a, struct lsa *_b, void *cookie,
 	req.attr_mod = attr_mod;
 	req.attr_del = attr_del ? : dummy_attr_del;
 
-	a = (_a != NULL) ? &_a->root.attrs : NULL;
-	b = (_b != NULL) ? &_b->root.attrs : NULL;
+	a = (_a != NULL) ? &_a->path : NULL;
+	b = (_b != NULL) ? &_b->path : NULL;
+
+	set_diff(&req, a, b);
+
+	/*
+	 * Copies of an LSA that share an interned body are identical
+	 * apart from their ADV_PATH attribute.
+	 */
+	if (_a != NULL && _b != NULL && _a->body == _b->body)
+		return req.diffs;
+
+	a = (_a != NULL) ? &_a->body->attrs : NULL;
+	b = (_b != NULL) ? &_b->body->attrs : NULL;
 
-	avl_diff(a, b, &req, add, mod, del);
+	set_diff(&req, a, b);
 
 	return req.diffs;
 }
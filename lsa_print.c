@@ -138,8 +138,8 @@ void lsa_attr_print_data(FILE *fp, int parent_type, struct lsa_attr *attr,
 	if (attr->data_is_attr_set) {
 		int type;
 		struct lsa_attr_set *set;
-		int count;
-		struct iv_avl_node *an;
+		struct lsa_attr *attrs;
+		int i;
 
 		if (parent_type == 0)
 			type = attr->type;
@@ -148,13 +148,11 @@ void lsa_attr_print_data(FILE *fp, int parent_type, struct lsa_attr *attr,
 
 		set = lsa_attr_data(attr);
 
-		count = 0;
-		iv_avl_tree_for_each (an, &set->attrs) {
-			struct lsa_attr *child;
+		attrs = lsa_attr_set_attrs(set);
+		for (i = 0; i < set->num; i++) {
+			struct lsa_attr *child = &attrs[i];
 
-			child = iv_container_of(an, struct lsa_attr, an);
-
-			if (count++)
+			if (i)
 				fprintf(fp, " ");
 			lsa_attr_print_type_name(fp, type, child);
 			if (child->keylen)
@@ -214,18 +212,15 @@ void lsa_attr_print_data(FILE *fp, int parent_type, struct lsa_attr *attr,
 		fprintf(fp, "]");
 }
 
-void lsa_print(FILE *fp, struct lsa *lsa, struct loc_rib *name_hints)
+static void lsa_attrs_print(FILE *fp, struct lsa_attr_set *set,
+			    struct loc_rib *name_hints)
 {
-	struct iv_avl_node *an;
-
-	fprintf(fp, "LSA [");
-	print_fingerprint(fp, lsa->id);
-	fprintf(fp, "]\n");
-
-	iv_avl_tree_for_each (an, &lsa->root.attrs) {
-		struct lsa_attr *attr;
+	struct lsa_attr *attrs;
+	int i;
 
-		attr = iv_container_of(an, struct lsa_attr, an);
+	attrs = lsa_attr_set_attrs(set);
+	for (i = 0; i < set->num; i++) {
+		struct lsa_attr *attr = &attrs[i];
 
 		fprintf(fp, "* ");
 		lsa_attr_print_type_name(fp, 0, attr);
@@ -236,3 +231,13 @@ void lsa_print(FILE *fp, struct lsa *lsa, struct loc_rib *name_hints)
 		fprintf(fp, "\n");
 	}
 }
+
+void lsa_print(FILE *fp, struct lsa *lsa, struct loc_rib *name_hints)
+{
+	fprintf(fp, "LSA [");
+	print_fingerprint(fp, lsa->id);
+	fprintf(fp, "]\n");
+
+	lsa_attrs_print(fp, &lsa->path, name_hints);
+	lsa_attrs_print(fp, &lsa->body->attrs, name_hints);
+}
@@ -76,19 +76,22 @@ static void dst_append_int(struct dst *dst, uint64_t value)
 	dst_append(dst, val + i, sizeof(val) - i);
 }
 
-static size_t
-lsa_attr_set_serialise_length(struct lsa_attr_set *set,
-			      int signed_only, const uint8_t *preid);
-
-static void __lsa_attr_serialise(struct dst *dst, struct lsa_attr *attr,
-				 int signed_only, const uint8_t *preid)
+static size_t int_len(uint64_t value)
 {
-	int flags;
+	size_t len;
 
-	if (signed_only && !attr->attr_signed)
-		return;
+	len = 1;
+	while (value >= 0x80) {
+		value >>= 7;
+		len++;
+	}
 
-	dst_append_int(dst, attr->type);
+	return len;
+}
+
+static int attr_flags(const struct lsa_attr *attr)
+{
+	int flags;
 
 	flags = 0;
 	if (attr->keylen)
@@ -98,7 +101,72 @@ static void __lsa_attr_serialise(struct dst *dst, struct lsa_attr *attr,
 	if (attr->attr_signed)
 		flags |= LSA_ATTR_FLAG_SIGNED;
 
-	dst_append_int(dst, flags);
+	return flags;
+}
+
+static size_t attr_set_length(struct lsa_attr_set *set, int signed_only,
+			      const uint8_t *preid);
+
+static size_t attr_data_length(struct lsa_attr *attr, int signed_only,
+			       const uint8_t *preid)
+{
+	if (attr->data_is_attr_set)
+		return attr_set_length(lsa_attr_data(attr), signed_only, NULL);
+
+	if (preid != NULL)
+		return attr->datalen + NODE_ID_LEN;
+
+	return attr->datalen;
+}
+
+static size_t attr_length(struct lsa_attr *attr, int signed_only,
+			  const uint8_t *preid)
+{
+	size_t len;
+	size_t datalen;
+
+	if (signed_only && !attr->attr_signed)
+		return 0;
+
+	len = int_len(attr->type) + int_len(attr_flags(attr));
+	if (attr->keylen)
+		len += int_len(attr->keylen) + attr->keylen;
+
+	datalen = attr_data_length(attr, signed_only, preid);
+
+	return len + int_len(datalen) + datalen;
+}
+
+static size_t attr_set_length(struct lsa_attr_set *set, int signed_only,
+			      const uint8_t *preid)
+{
+	struct lsa_attr *attrs;
+	size_t len;
+	int i;
+
+	attrs = lsa_attr_set_attrs(set);
+
+	len = 0;
+	for (i = 0; i < set->num; i++) {
+		struct lsa_attr *attr = &attrs[i];
+
+		if (attr->type == LSA_ATTR_TYPE_ADV_PATH)
+			len += attr_length(attr, signed_only, preid);
+		else
+			len += attr_length(attr, signed_only, NULL);
+	}
+
+	return len;
+}
+
+static void __lsa_attr_serialise(struct dst *dst, struct lsa_attr *attr,
+				 int signed_only, const uint8_t *preid)
+{
+	if (signed_only && !attr->attr_signed)
+		return;
+
+	dst_append_int(dst, attr->type);
+	dst_append_int(dst, attr_flags(attr));
 
 	if (attr->keylen) {
 		dst_append_int(dst, attr->keylen);
@@ -108,19 +176,17 @@ static void __lsa_attr_serialise(struct dst *dst, struct lsa_attr *attr,
 	if (attr->data_is_attr_set) {
 		struct lsa_attr_set *set;
 		size_t len;
-		struct iv_avl_node *an;
+		struct lsa_attr *attrs;
+		int i;
 
 		set = lsa_attr_data(attr);
 
-		len = lsa_attr_set_serialise_length(set, signed_only, NULL);
+		len = attr_set_length(set, signed_only, NULL);
 		dst_append_int(dst, len);
 
-		iv_avl_tree_for_each (an, &set->attrs) {
-			struct lsa_attr *attr2;
-
-			attr2 = iv_container_of(an, struct lsa_attr, an);
-			__lsa_attr_serialise(dst, attr2, signed_only, NULL);
-		}
+		attrs = lsa_attr_set_attrs(set);
+		for (i = 0; i < set->num; i++)
+			__lsa_attr_serialise(dst, &attrs[i], signed_only, NULL);
 	} else if (preid != NULL) {
 		dst_append_int(dst, attr->datalen + NODE_ID_LEN);
 		dst_append(dst, preid, NODE_ID_LEN);
@@ -131,15 +197,15 @@ static void __lsa_attr_serialise(struct dst *dst, struct lsa_attr *attr,
 	}
 }
 
-static void lsa_attrs_serialise(struct dst *dst, struct iv_avl_tree *attrs,
+static void lsa_attrs_serialise(struct dst *dst, struct lsa_attr_set *set,
 				int signed_only, const uint8_t *preid)
 {
-	struct iv_avl_node *an;
-
-	iv_avl_tree_for_each (an, attrs) {
-		struct lsa_attr *attr;
+	struct lsa_attr *attrs;
+	int i;
 
-		attr = iv_container_of(an, struct lsa_attr, an);
+	attrs = lsa_attr_set_attrs(set);
+	for (i = 0; i < set->num; i++) {
+		struct lsa_attr *attr = &attrs[i];
 
 		if (attr->type == LSA_ATTR_TYPE_ADV_PATH)
 			__lsa_attr_serialise(dst, attr, signed_only, preid);
@@ -148,32 +214,120 @@ static void lsa_attrs_serialise(struct dst *dst, struct iv_avl_tree *attrs,
 	}
 }
 
-static size_t
-lsa_attr_set_serialise_length(struct lsa_attr_set *set,
-			      int signed_only, const uint8_t *preid)
+/*
+ * The serialised attributes of an LSA body are the same for every
+ * copy of the LSA and for every neighbour that we send it to, so
+ * they are serialised only once, when they are first needed, and
+ * cached in the body.  Only the length prefix, node id and ADV_PATH
+ * attribute, into which the id of the sending node is spliced, are
+ * serialised every time.
+ */
+static uint8_t *body_wire(struct lsa_body *body, size_t *len)
 {
-	struct dst dst;
+	if (body->wire == NULL && body->attrs.num) {
+		struct dst dst;
+		size_t wirelen;
+		uint8_t *buf;
 
-	dst.dst = NULL;
-	dst.dstlen = 0;
-	dst.off = 0;
+		wirelen = attr_set_length(&body->attrs, 0, NULL);
 
-	lsa_attrs_serialise(&dst, &set->attrs, signed_only, preid);
+		buf = malloc(wirelen);
+		if (buf == NULL)
+			return NULL;
 
-	return dst.off;
+		dst.dst = buf;
+		dst.dstlen = wirelen;
+		dst.off = 0;
+		lsa_attrs_serialise(&dst, &body->attrs, 0, NULL);
+
+		body->wire = buf;
+		body->wirelen = wirelen;
+	}
+
+	*len = body->wirelen;
+
+	return body->wire;
+}
+
+static int path_has_signed_attrs(struct lsa *lsa)
+{
+	struct lsa_attr *attrs;
+	int i;
+
+	attrs = lsa_attr_set_attrs(&lsa->path);
+	for (i = 0; i < lsa->path.num; i++) {
+		if (attrs[i].attr_signed)
+			return 1;
+	}
+
+	return 0;
+}
+
+const uint8_t *lsa_serialise_signed(struct lsa *lsa, size_t *len)
+{
+	struct lsa_body *body = lsa->body;
+
+	if (path_has_signed_attrs(lsa))
+		return NULL;
+
+	if (body->signed_wire == NULL) {
+		struct dst dst;
+		size_t serlen;
+		uint8_t *buf;
+
+		serlen = NODE_ID_LEN + attr_set_length(&body->attrs, 1, NULL);
+
+		buf = malloc(int_len(serlen) + serlen);
+		if (buf == NULL)
+			return NULL;
+
+		dst.dst = buf;
+		dst.dstlen = int_len(serlen) + serlen;
+		dst.off = 0;
+		dst_append_int(&dst, serlen);
+		dst_append(&dst, body->id, NODE_ID_LEN);
+		body->signed_off = dst.off;
+		lsa_attrs_serialise(&dst, &body->attrs, 1, NULL);
+
+		body->signed_wire = buf;
+		body->signed_wirelen = dst.off;
+	}
+
+	*len = body->signed_wirelen;
+
+	return body->signed_wire;
+}
+
+static size_t body_length(struct lsa_body *body, int signed_only)
+{
+	size_t len;
+
+	if (signed_only) {
+		if (body->signed_wire != NULL)
+			return body->signed_wirelen - body->signed_off;
+	} else {
+		if (body_wire(body, &len) != NULL)
+			return len;
+	}
+
+	return attr_set_length(&body->attrs, signed_only, NULL);
 }
 
 size_t lsa_serialise_length(struct lsa *lsa, int signed_only,
 			    const uint8_t *preid)
 {
 	return NODE_ID_LEN +
-		lsa_attr_set_serialise_length(&lsa->root, signed_only, preid);
+		attr_set_length(&lsa->path, signed_only, preid) +
+		body_length(lsa->body, signed_only);
 }
 
 size_t lsa_serialise(uint8_t *buf, size_t buflen, size_t serlen,
 		     struct lsa *lsa, int signed_only, const uint8_t *preid)
 {
+	struct lsa_body *body = lsa->body;
 	struct dst dst;
+	uint8_t *wire;
+	size_t len;
 
 	dst.dst = buf;
 	dst.dstlen = buflen;
@@ -184,7 +338,16 @@ size_t lsa_serialise(uint8_t *buf, size_t buflen, size_t serlen,
 
 	dst_append(&dst, lsa->id, NODE_ID_LEN);
 
-	lsa_attrs_serialise(&dst, &lsa->root.attrs, signed_only, preid);
+	lsa_attrs_serialise(&dst, &lsa->path, signed_only, preid);
+
+	if (signed_only && body->signed_wire != NULL) {
+		dst_append(&dst, body->signed_wire + body->signed_off,
+			   body->signed_wirelen - body->signed_off);
+	} else if (!signed_only && (wire = body_wire(body, &len)) != NULL) {
+		dst_append(&dst, wire, len);
+	} else {
+		lsa_attrs_serialise(&dst, &body->attrs, signed_only, NULL);
+	}
 
 	if (serlen != dst.off) {
 		fprintf(stderr, "lsa_serialise: lsa size %lu versus "
@@ -196,20 +359,35 @@ size_t lsa_serialise(uint8_t *buf, size_t buflen, size_t serlen,
 	return dst.off;
 }
 
-size_t lsa_attr_serialise_length(struct lsa_attr *attr)
-{
-	return lsa_attr_serialise(NULL, 0, attr);
-}
-
-size_t lsa_attr_serialise(uint8_t *buf, size_t buflen, struct lsa_attr *attr)
+int lsa_serialise_matches(struct lsa *lsa, const uint8_t *buf, size_t buflen)
 {
 	struct dst dst;
+	uint8_t *wire;
+	size_t wirelen;
+	size_t serlen;
+	size_t hdrlen;
+	uint8_t *hdr;
 
-	dst.dst = buf;
-	dst.dstlen = buflen;
-	dst.off = 0;
+	wire = body_wire(lsa->body, &wirelen);
+	if (wire == NULL)
+		return 0;
 
-	__lsa_attr_serialise(&dst, attr, 0, NULL);
+	serlen = NODE_ID_LEN + attr_set_length(&lsa->path, 0, NULL) + wirelen;
+	if (int_len(serlen) + serlen != buflen)
+		return 0;
 
-	return dst.off;
+	hdrlen = buflen - wirelen;
+	if (hdrlen > 65536)
+		return 0;
+
+	hdr = alloca(hdrlen);
+
+	dst.dst = hdr;
+	dst.dstlen = hdrlen;
+	dst.off = 0;
+	dst_append_int(&dst, serlen);
+	dst_append(&dst, lsa->id, NODE_ID_LEN);
+	lsa_attrs_serialise(&dst, &lsa->path, 0, NULL);
+
+	return !memcmp(hdr, buf, hdrlen) && !memcmp(wire, buf + hdrlen, wirelen);
 }
@@ -29,8 +29,18 @@ size_t lsa_serialise_length(struct lsa *lsa, int signed_only,
 size_t lsa_serialise(uint8_t *buf, size_t buflen, size_t serlen,
 		     struct lsa *lsa, int signed_only, const uint8_t *preid);
 
-size_t lsa_attr_serialise_length(struct lsa_attr *attr);
-size_t lsa_attr_serialise(uint8_t *buf, size_t buflen, struct lsa_attr *attr);
+/*
+ * Returns the signed-only serialisation of the LSA (the form that is
+ * signed and verified) from a cache in the LSA body, or NULL if the
+ * LSA has signed path attributes or the cache can't be allocated.
+ */
+const uint8_t *lsa_serialise_signed(struct lsa *lsa, size_t *len);
+
+/*
+ * Returns whether buf holds exactly what lsa_serialise() would
+ * serialise the LSA to, without a preid.
+ */
+int lsa_serialise_matches(struct lsa *lsa, const uint8_t *buf, size_t buflen);
 
 
 #endif
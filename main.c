@@ -22,6 +22,14 @@
 #include <getopt.h>
 #include <string.h>
 
+int bench_ciphers(void);
+int bench_convergence(const char *nodes);
+int bench_flood(void);
+int bench_loc_rib(const char *nodes);
+int bench_lsa(const char *peers);
+int bench_spf(const char *nodes);
+int bench_sync(const char *lsas);
+int bench_tconn(const char *seconds);
 int dbmon(const char *config);
 int dvpn(const char *config);
 int gencert(const char *nodekeyfile, const char *rolekeyfile);
@@ -33,6 +41,14 @@ int show_key_id_hex(const char *file);
 
 enum {
 	TOOL_UNKNOWN = 0,
+	TOOL_BENCH_CIPHERS,
+	TOOL_BENCH_CONVERGENCE,
+	TOOL_BENCH_FLOOD,
+	TOOL_BENCH_LOC_RIB,
+	TOOL_BENCH_LSA,
+	TOOL_BENCH_SPF,
+	TOOL_BENCH_SYNC,
+	TOOL_BENCH_TCONN,
 	TOOL_DBMON,
 	TOOL_DVPN,
 	TOOL_GENCERT,
@@ -58,6 +74,14 @@ static void set_tool(int newtool)
 static void usage(const char *argv0)
 {
 	fprintf(stderr, "usage: %s [-c <config.ini>]\n", argv0);
+	fprintf(stderr, "       %s --bench-ciphers\n", argv0);
+	fprintf(stderr, "       %s --bench-convergence [<nodes>]\n", argv0);
+	fprintf(stderr, "       %s --bench-flood\n", argv0);
+	fprintf(stderr, "       %s --bench-loc-rib [<nodes>]\n", argv0);
+	fprintf(stderr, "       %s --bench-lsa [<peers>]\n", argv0);
+	fprintf(stderr, "       %s --bench-spf [<nodes>]\n", argv0);
+	fprintf(stderr, "       %s --bench-sync [<lsas>]\n", argv0);
+	fprintf(stderr, "       %s --bench-tconn [<seconds>]\n", argv0);
 	fprintf(stderr, "       %s --dbmon [-c <config.ini>]\n", argv0);
 	fprintf(stderr, "       %s --gencert <key.pem>\n", argv0);
 	fprintf(stderr, "       %s --help\n", argv0);
@@ -131,6 +155,14 @@ static void try_determine_tool(char *argv0)
 int main(int argc, char *argv[])
 {
 	static struct option long_options[] = {
+		{ "bench-ciphers", no_argument, 0, 'b' },
+		{ "bench-convergence", no_argument, 0, 'C' },
+		{ "bench-flood", no_argument, 0, 'f' },
+		{ "bench-loc-rib", no_argument, 0, 'L' },
+		{ "bench-lsa", no_argument, 0, 'l' },
+		{ "bench-spf", no_argument, 0, 'B' },
+		{ "bench-sync", no_argument, 0, 'y' },
+		{ "bench-tconn", no_argument, 0, 't' },
 		{ "config-file", required_argument, 0, 'c' },
 		{ "dbmon", no_argument, 0, 'd' },
 		{ "gencert", no_argument, 0, 'g' },
@@ -152,6 +184,38 @@ int main(int argc, char *argv[])
 			break;
 
 		switch (c) {
+		case 'b':
+			set_tool(TOOL_BENCH_CIPHERS);
+			break;
+
+		case 'B':
+			set_tool(TOOL_BENCH_SPF);
+			break;
+
+		case 'C':
+			set_tool(TOOL_BENCH_CONVERGENCE);
+			break;
+
+		case 'f':
+			set_tool(TOOL_BENCH_FLOOD);
+			break;
+
+		case 'l':
+			set_tool(TOOL_BENCH_LSA);
+			break;
+
+		case 'L':
+			set_tool(TOOL_BENCH_LOC_RIB);
+			break;
+
+		case 't':
+			set_tool(TOOL_BENCH_TCONN);
+			break;
+
+		case 'y':
+			set_tool(TOOL_BENCH_SYNC);
+			break;
+
 		case 'c':
 			config = optarg;
 			break;
@@ -201,6 +265,22 @@ int main(int argc, char *argv[])
 		try_determine_tool(argv[0]);
 
 	switch (tool) {
+	case TOOL_BENCH_CIPHERS:
+		return bench_ciphers();
+	case TOOL_BENCH_CONVERGENCE:
+		return bench_convergence(argv[optind]);
+	case TOOL_BENCH_FLOOD:
+		return bench_flood();
+	case TOOL_BENCH_LOC_RIB:
+		return bench_loc_rib(argv[optind]);
+	case TOOL_BENCH_LSA:
+		return bench_lsa(argv[optind]);
+	case TOOL_BENCH_SPF:
+		return bench_spf(argv[optind]);
+	case TOOL_BENCH_SYNC:
+		return bench_sync(argv[optind]);
+	case TOOL_BENCH_TCONN:
+		return bench_tconn(argv[optind]);
 	case TOOL_DBMON:
 		return dbmon(config);
 	case TOOL_DVPN:
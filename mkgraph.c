@@ -38,7 +38,7 @@ static struct rib_listener rib_listener;
 static struct dgp_connect dc;
 static struct iv_signal sigint;
 
-static void get_node_name(char *buf, size_t buflen, uint8_t *id)
+static void get_node_name(char *buf, size_t buflen, const uint8_t *id)
 {
 	struct loc_rib_id *rid;
 	char hexid[2 * NODE_ID_LEN + 16];
@@ -74,7 +74,7 @@ static void get_node_name(char *buf, size_t buflen, uint8_t *id)
 	strncpy(buf, hexid, buflen);
 }
 
-static void print_edge(FILE *fp, struct lsa *from, uint8_t *to)
+static void print_edge(FILE *fp, struct lsa *from, const uint8_t *to)
 {
 	char fromname[128];
 	char toname[128];
@@ -101,25 +101,17 @@ static void dump_graph(void *_dummy)
 
 	iv_avl_tree_for_each (an, &loc_rib.ids) {
 		struct lsa *from;
-		struct iv_avl_node *an2;
+		const struct lsa_adj *adjs;
+		int num_adjs;
+		int i;
 
 		from = iv_container_of(an, struct loc_rib_id, an)->best;
 		if (from == NULL)
 			continue;
 
-		iv_avl_tree_for_each (an2, &from->root.attrs) {
-			struct lsa_attr *peer;
-
-			peer = iv_container_of(an2, struct lsa_attr, an);
-			if (peer->type != LSA_ATTR_TYPE_PEER)
-				continue;
-			if (!peer->data_is_attr_set || !peer->attr_signed)
-				continue;
-			if (peer->keylen != NODE_ID_LEN)
-				continue;
-
-			print_edge(fp, from, lsa_attr_key(peer));
-		}
+		num_adjs = lsa_get_adjs(from, &adjs);
+		for (i = 0; i < num_adjs; i++)
+			print_edge(fp, from, adjs[i].id);
 	}
 
 	fprintf(fp, "}\n");
@@ -0,0 +1,245 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+#include <gnutls/x509.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <pthread.h>
+#include <string.h>
+#include "pubkey_cache.h"
+#include "x509.h"
+
+static int compare_entries(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct pubkey_cache_entry *a;
+	struct pubkey_cache_entry *b;
+
+	a = iv_container_of(_a, struct pubkey_cache_entry, an);
+	b = iv_container_of(_b, struct pubkey_cache_entry, an);
+
+	return memcmp(a->id, b->id, NODE_ID_LEN);
+}
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct iv_avl_tree entries = IV_AVL_TREE_INIT(compare_entries);
+static struct iv_list_head lru = IV_LIST_HEAD_INIT(lru);
+static int num_entries;
+static uint64_t hits;
+static uint64_t misses;
+
+static struct pubkey_cache_entry *find_entry(const uint8_t *id)
+{
+	struct iv_avl_node *an;
+
+	an = entries.root;
+	while (an != NULL) {
+		struct pubkey_cache_entry *pk;
+		int ret;
+
+		pk = iv_container_of(an, struct pubkey_cache_entry, an);
+
+		ret = memcmp(id, pk->id, NODE_ID_LEN);
+		if (ret == 0)
+			return pk;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static struct pubkey_cache_entry *get_entry(const uint8_t *id)
+{
+	struct pubkey_cache_entry *pk;
+
+	pk = find_entry(id);
+	if (pk != NULL && !pk->refcount++)
+		iv_list_del(&pk->list);
+
+	return pk;
+}
+
+static void evict(void)
+{
+	while (num_entries > PUBKEY_CACHE_SIZE && !iv_list_empty(&lru)) {
+		struct pubkey_cache_entry *pk;
+
+		pk = iv_container_of(lru.next, struct pubkey_cache_entry, list);
+		iv_list_del(&pk->list);
+		iv_avl_tree_delete(&entries, &pk->an);
+		num_entries--;
+
+		gnutls_pubkey_deinit(pk->pubkey);
+		free(pk);
+	}
+}
+
+/*
+ * Parsing is done without holding the lock.  If another thread
+ * inserted the same id in the meantime, we use its entry instead.
+ */
+static struct pubkey_cache_entry *insert(const uint8_t *id,
+					 gnutls_pubkey_t pubkey)
+{
+	struct pubkey_cache_entry *pk;
+
+	pthread_mutex_lock(&lock);
+
+	pk = get_entry(id);
+	if (pk != NULL) {
+		pthread_mutex_unlock(&lock);
+		gnutls_pubkey_deinit(pubkey);
+		return pk;
+	}
+
+	pk = malloc(sizeof(*pk));
+	if (pk == NULL) {
+		pthread_mutex_unlock(&lock);
+		gnutls_pubkey_deinit(pubkey);
+		return NULL;
+	}
+
+	pk->refcount = 1;
+	memcpy(pk->id, id, NODE_ID_LEN);
+	pk->pubkey = pubkey;
+	iv_avl_tree_insert(&entries, &pk->an);
+	num_entries++;
+
+	evict();
+
+	pthread_mutex_unlock(&lock);
+
+	return pk;
+}
+
+static struct pubkey_cache_entry *lookup(const uint8_t *id)
+{
+	struct pubkey_cache_entry *pk;
+
+	pthread_mutex_lock(&lock);
+
+	pk = get_entry(id);
+	if (pk != NULL)
+		hits++;
+	else
+		misses++;
+
+	pthread_mutex_unlock(&lock);
+
+	return pk;
+}
+
+struct pubkey_cache_entry *pubkey_cache_get(const uint8_t *id,
+					    const gnutls_datum_t *der)
+{
+	struct pubkey_cache_entry *pk;
+	gnutls_pubkey_t pubkey;
+	uint8_t pkid[NODE_ID_LEN];
+	int ret;
+
+	pk = lookup(id);
+	if (pk != NULL)
+		return pk;
+
+	ret = gnutls_pubkey_init(&pubkey);
+	if (ret < 0) {
+		gnutls_perror(ret);
+		return NULL;
+	}
+
+	ret = gnutls_pubkey_import(pubkey, der, GNUTLS_X509_FMT_DER);
+	if (ret < 0) {
+		gnutls_perror(ret);
+		gnutls_pubkey_deinit(pubkey);
+		return NULL;
+	}
+
+	if (get_pubkey_id(pkid, pubkey) < 0 ||
+	    memcmp(id, pkid, NODE_ID_LEN)) {
+		gnutls_pubkey_deinit(pubkey);
+		return NULL;
+	}
+
+	return insert(id, pubkey);
+}
+
+struct pubkey_cache_entry *pubkey_cache_get_crt(gnutls_x509_crt_t crt)
+{
+	struct pubkey_cache_entry *pk;
+	gnutls_pubkey_t pubkey;
+	uint8_t id[NODE_ID_LEN];
+	size_t len;
+	int ret;
+
+	len = sizeof(id);
+
+	ret = gnutls_x509_crt_get_key_id(crt, GNUTLS_KEYID_USE_SHA256,
+					 id, &len);
+	if (ret < 0) {
+		gnutls_perror(ret);
+		return NULL;
+	}
+
+	pk = lookup(id);
+	if (pk != NULL)
+		return pk;
+
+	ret = gnutls_pubkey_init(&pubkey);
+	if (ret < 0) {
+		gnutls_perror(ret);
+		return NULL;
+	}
+
+	ret = gnutls_pubkey_import_x509(pubkey, crt, 0);
+	if (ret < 0) {
+		gnutls_perror(ret);
+		gnutls_pubkey_deinit(pubkey);
+		return NULL;
+	}
+
+	return insert(id, pubkey);
+}
+
+void pubkey_cache_put(struct pubkey_cache_entry *pk)
+{
+	pthread_mutex_lock(&lock);
+
+	if (!--pk->refcount) {
+		iv_list_add_tail(&pk->list, &lru);
+		evict();
+	}
+
+	pthread_mutex_unlock(&lock);
+}
+
+void pubkey_cache_print_stats(FILE *fp)
+{
+	pthread_mutex_lock(&lock);
+	fprintf(fp, "public key cache: %d entries, %llu hits, %llu misses\n",
+		num_entries, (unsigned long long)hits,
+		(unsigned long long)misses);
+	pthread_mutex_unlock(&lock);
+}
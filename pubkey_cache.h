@@ -0,0 +1,57 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __PUBKEY_CACHE_H
+#define __PUBKEY_CACHE_H
+
+#include <stdio.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/abstract.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include "util.h"
+
+/*
+ * Parsed public keys, keyed by node id.  As a node id is the SHA-256
+ * hash of the node's DER encoded public key, the key for a given id
+ * never changes, and we only need to parse and hash it once.
+ *
+ * Entries are refcounted.  Entries that aren't referenced are kept
+ * around on an LRU list, and are evicted once there are more than
+ * PUBKEY_CACHE_SIZE entries.  These functions can be called from
+ * any thread.
+ */
+#define PUBKEY_CACHE_SIZE	1024
+
+struct pubkey_cache_entry {
+	struct iv_avl_node	an;
+	struct iv_list_head	list;
+	int			refcount;
+	uint8_t			id[NODE_ID_LEN];
+	gnutls_pubkey_t		pubkey;
+};
+
+struct pubkey_cache_entry *pubkey_cache_get(const uint8_t *id,
+					    const gnutls_datum_t *der);
+struct pubkey_cache_entry *pubkey_cache_get_crt(gnutls_x509_crt_t crt);
+void pubkey_cache_put(struct pubkey_cache_entry *pk);
+void pubkey_cache_print_stats(FILE *fp);
+
+
+#endif
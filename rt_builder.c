@@ -19,7 +19,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include "cspf.h"
 #include "loc_rib.h"
 #include "lsa_type.h"
 #include "rt_builder.h"
@@ -157,16 +159,503 @@ static void lsa_del(void *_rb, struct lsa *a, uint32_t cost)
 		rt_del(rb, a);
 }
 
+
+struct rt_spf_node {
+	struct iv_avl_node	an;
+	uint8_t			id[NODE_ID_LEN];
+	struct lsa		*lsa;
+	struct cspf_node	cn;
+	struct iv_list_head	edges;
+	int			dirty;
+	struct rt_spf_node	*next_dirty;
+	struct rt_spf_node	*hop;
+	int			have_route;
+	uint8_t			nh[NODE_ID_LEN];
+};
+
+struct rt_spf_edge {
+	struct iv_list_head	list;
+	struct rt_spf_node	*to;
+	enum conf_peer_type	type;
+	struct cspf_edge	ce;
+};
+
+static int compare_spf_nodes(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct rt_spf_node *a;
+	struct rt_spf_node *b;
+
+	a = iv_container_of(_a, struct rt_spf_node, an);
+	b = iv_container_of(_b, struct rt_spf_node, an);
+
+	return memcmp(a->id, b->id, NODE_ID_LEN);
+}
+
+static struct rt_spf_node *
+find_spf_node(struct rt_builder *rb, const uint8_t *id)
+{
+	struct iv_avl_node *an;
+
+	an = rb->nodes.root;
+	while (an != NULL) {
+		struct rt_spf_node *node;
+		int ret;
+
+		node = iv_container_of(an, struct rt_spf_node, an);
+
+		ret = memcmp(id, node->id, NODE_ID_LEN);
+		if (ret == 0)
+			return node;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+/*
+ * Classify the peering between two nodes the way lsa_path_cost()
+ * does: going up to a transit and going down to a customer both need
+ * the two sides to agree on their relationship, and any other
+ * mutually advertised peering can only be crossed once, at the top
+ * of the path.  Zero metrics are rounded up, as zero cost edges
+ * between nodes could loop the shortest path tree.
+ */
+static enum conf_peer_type
+edge_type(struct rt_spf_node *from, struct rt_spf_node *to, int *cost)
+{
+	const struct lsa_adj *a;
+	const struct lsa_adj *b;
+	int up;
+	int down;
+
+	a = lsa_find_adj(from->lsa, to->id);
+	if (a == NULL || !a->metric_valid || !a->flags_valid)
+		return CONF_PEER_TYPE_INVALID;
+
+	b = lsa_find_adj(to->lsa, from->id);
+	if (b == NULL || !b->flags_valid)
+		return CONF_PEER_TYPE_INVALID;
+
+	*cost = a->metric ? a->metric : 1;
+
+	up = (a->flags & LSA_PEER_FLAGS_TRANSIT) &&
+	     (b->flags & LSA_PEER_FLAGS_CUSTOMER);
+	down = (a->flags & LSA_PEER_FLAGS_CUSTOMER) &&
+	       (b->flags & LSA_PEER_FLAGS_TRANSIT);
+
+	if (up && down)
+		return CONF_PEER_TYPE_IPEER;
+	if (up)
+		return CONF_PEER_TYPE_TRANSIT;
+	if (down)
+		return CONF_PEER_TYPE_CUSTOMER;
+
+	return CONF_PEER_TYPE_EPEER;
+}
+
+static void add_edge(struct rt_builder *rb, struct rt_spf_node *from,
+		     struct rt_spf_node *to)
+{
+	enum conf_peer_type type;
+	struct rt_spf_edge *edge;
+	int cost;
+
+	type = edge_type(from, to, &cost);
+	if (type == CONF_PEER_TYPE_INVALID)
+		return;
+
+	edge = malloc(sizeof(*edge));
+	if (edge == NULL)
+		abort();
+
+	edge->to = to;
+	edge->type = type;
+	iv_list_add_tail(&edge->list, &from->edges);
+	cspf_edge_add(&rb->ctx, &edge->ce, &from->cn, &to->cn, type, cost);
+}
+
+static void del_edge(struct rt_builder *rb, struct rt_spf_node *from,
+		     struct rt_spf_edge *edge)
+{
+	cspf_edge_del(&rb->ctx, &edge->ce, &from->cn, &edge->to->cn,
+		      edge->type);
+	iv_list_del(&edge->list);
+	free(edge);
+}
+
+static void add_edges(struct rt_builder *rb, struct rt_spf_node *node)
+{
+	const struct lsa_adj *adjs;
+	int num_adjs;
+	int i;
+
+	num_adjs = lsa_get_adjs(node->lsa, &adjs);
+	for (i = 0; i < num_adjs; i++) {
+		struct rt_spf_node *peer;
+
+		peer = find_spf_node(rb, adjs[i].id);
+		if (peer == NULL || peer == node)
+			continue;
+
+		add_edge(rb, node, peer);
+		add_edge(rb, peer, node);
+	}
+}
+
+/*
+ * An edge needs both sides to advertise each other, so all edges
+ * towards @node are found by following the peerings in its own LSA.
+ */
+static void del_edges(struct rt_builder *rb, struct rt_spf_node *node)
+{
+	const struct lsa_adj *adjs;
+	int num_adjs;
+	int i;
+
+	while (!iv_list_empty(&node->edges)) {
+		struct rt_spf_edge *edge;
+
+		edge = iv_container_of(node->edges.next,
+				       struct rt_spf_edge, list);
+		del_edge(rb, node, edge);
+	}
+
+	num_adjs = lsa_get_adjs(node->lsa, &adjs);
+	for (i = 0; i < num_adjs; i++) {
+		struct rt_spf_node *peer;
+		struct iv_list_head *ilh;
+
+		peer = find_spf_node(rb, adjs[i].id);
+		if (peer == NULL)
+			continue;
+
+		iv_list_for_each (ilh, &peer->edges) {
+			struct rt_spf_edge *edge;
+
+			edge = iv_container_of(ilh, struct rt_spf_edge, list);
+			if (edge->to == node) {
+				del_edge(rb, peer, edge);
+				break;
+			}
+		}
+	}
+}
+
+static int same_adjs(struct lsa *a, struct lsa *b)
+{
+	const struct lsa_adj *aadjs;
+	const struct lsa_adj *badjs;
+	int num;
+	int i;
+
+	num = lsa_get_adjs(a, &aadjs);
+	if (lsa_get_adjs(b, &badjs) != num)
+		return 0;
+
+	for (i = 0; i < num; i++) {
+		const struct lsa_adj *x = &aadjs[i];
+		const struct lsa_adj *y = &badjs[i];
+
+		if (memcmp(x->id, y->id, NODE_ID_LEN) ||
+		    x->metric_valid != y->metric_valid ||
+		    x->flags_valid != y->flags_valid ||
+		    x->metric != y->metric || x->flags != y->flags) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint8_t *spf_route_nh(struct rt_spf_node *node, uint8_t *nh,
+			     uint8_t *addr)
+{
+	if (!memcmp(nh, node->id, NODE_ID_LEN))
+		return NULL;
+
+	v6_global_addr_from_key_id(addr, nh);
+
+	return addr;
+}
+
+static void spf_route_del(struct rt_builder *rb, struct rt_spf_node *node)
+{
+	uint8_t dest[16];
+	uint8_t nh[16];
+
+	if (!node->have_route)
+		return;
+
+	v6_global_addr_from_key_id(dest, node->id);
+	rb->rt_del(rb->cookie, dest, spf_route_nh(node, node->nh, nh));
+
+	node->have_route = 0;
+}
+
+static void spf_route_set(struct rt_builder *rb, struct rt_spf_node *node,
+			  struct rt_spf_node *hop)
+{
+	uint8_t dest[16];
+	uint8_t nhold[16];
+	uint8_t nhnew[16];
+
+	if (hop == NULL) {
+		spf_route_del(rb, node);
+		return;
+	}
+
+	if (node->have_route && !memcmp(node->nh, hop->id, NODE_ID_LEN))
+		return;
+
+	v6_global_addr_from_key_id(dest, node->id);
+
+	if (!node->have_route) {
+		rb->rt_add(rb->cookie, dest,
+			   spf_route_nh(node, hop->id, nhnew));
+	} else {
+		rb->rt_mod(rb->cookie, dest,
+			   spf_route_nh(node, node->nh, nhold),
+			   spf_route_nh(node, hop->id, nhnew));
+	}
+
+	node->have_route = 1;
+	memcpy(node->nh, hop->id, NODE_ID_LEN);
+}
+
+/*
+ * The first hop of a node that isn't dirty is still what it was
+ * after the previous run.
+ */
+static struct rt_spf_node *first_hop(struct rt_spf_node *node,
+				     struct rt_spf_node *source)
+{
+	struct rt_spf_node *parent;
+
+	if (!node->dirty)
+		return node->hop;
+
+	node->dirty = 0;
+	node->hop = NULL;
+
+	if (node == source || cspf_node_cost(&node->cn) == INT_MAX)
+		return NULL;
+
+	parent = cspf_node_parent(&node->cn);
+	if (parent == source)
+		node->hop = node;
+	else if (parent != NULL)
+		node->hop = first_hop(parent, source);
+
+	return node->hop;
+}
+
+static void mark_dirty(struct rt_spf_node *node, struct rt_spf_node **tail)
+{
+	node->dirty = 1;
+	node->next_dirty = NULL;
+	(*tail)->next_dirty = node;
+	*tail = node;
+}
+
+/*
+ * The children of a node in the constrained SPF tree are reached
+ * over edges from either of its two spf nodes, and may themselves
+ * be reached through either of theirs.
+ */
+static void mark_children(struct rt_spf_node *node, struct rt_spf_node **tail)
+{
+	struct spf_node *sn[2] = { &node->cn.a, &node->cn.b };
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct iv_list_head *lh;
+
+		iv_list_for_each (lh, &sn[i]->edges) {
+			struct spf_edge *edge;
+			struct rt_spf_node *child;
+
+			edge = iv_container_of(lh, struct spf_edge, list);
+			if (edge->to->parent != sn[i])
+				continue;
+
+			child = edge->to->cookie;
+			if (child != node && !child->dirty &&
+			    cspf_node_parent(&child->cn) == node) {
+				mark_dirty(child, tail);
+			}
+		}
+	}
+}
+
+static void run_spf(void *_rb)
+{
+	struct rt_builder *rb = _rb;
+	struct rt_spf_node *source;
+	struct rt_spf_node head;
+	struct rt_spf_node *tail;
+	struct rt_spf_node *node;
+	struct iv_list_head *lh;
+
+	source = find_spf_node(rb, rb->myid);
+	if (source == NULL) {
+		struct iv_avl_node *an;
+
+		iv_avl_tree_for_each (an, &rb->nodes) {
+			node = iv_container_of(an, struct rt_spf_node, an);
+			spf_route_del(rb, node);
+		}
+
+		return;
+	}
+
+	cspf_update(&rb->ctx, &source->cn);
+
+	/*
+	 * Only the nodes whose parent or cost has changed, and the
+	 * subtrees below them, can have a different first hop.
+	 */
+	head.next_dirty = NULL;
+	tail = &head;
+
+	iv_list_for_each (lh, &rb->ctx.changed) {
+		struct spf_node *sn;
+
+		sn = iv_container_of(lh, struct spf_node, changed);
+
+		node = sn->cookie;
+		if (!node->dirty)
+			mark_dirty(node, &tail);
+	}
+
+	for (node = head.next_dirty; node != NULL; node = node->next_dirty)
+		mark_children(node, &tail);
+
+	for (node = head.next_dirty; node != NULL; node = node->next_dirty)
+		spf_route_set(rb, node, first_hop(node, source));
+}
+
+static void schedule_spf(struct rt_builder *rb)
+{
+	if (!iv_task_registered(&rb->run_spf))
+		iv_task_register(&rb->run_spf);
+}
+
+static void spf_lsa_add(void *_rb, struct lsa *a, uint32_t cost)
+{
+	struct rt_builder *rb = _rb;
+	struct rt_spf_node *node;
+
+	node = malloc(sizeof(*node));
+	if (node == NULL)
+		abort();
+
+	memcpy(node->id, a->id, NODE_ID_LEN);
+	node->lsa = lsa_get(a);
+	node->cn.id = node->id;
+	node->cn.cookie = node;
+	INIT_IV_LIST_HEAD(&node->edges);
+	node->dirty = 0;
+	node->hop = NULL;
+	node->have_route = 0;
+
+	iv_avl_tree_insert(&rb->nodes, &node->an);
+	cspf_node_add(&rb->ctx, &node->cn);
+	add_edges(rb, node);
+
+	schedule_spf(rb);
+}
+
+static void spf_lsa_mod(void *_rb, struct lsa *a, uint32_t acost,
+			struct lsa *b, uint32_t bcost)
+{
+	struct rt_builder *rb = _rb;
+	struct rt_spf_node *node;
+
+	/*
+	 * The path vector cost of an LSA changes far more often than
+	 * the peerings that it advertises.
+	 */
+	node = find_spf_node(rb, b->id);
+	if (node == NULL || node->lsa == b)
+		return;
+
+	if (same_adjs(node->lsa, b)) {
+		lsa_put(node->lsa);
+		node->lsa = lsa_get(b);
+		return;
+	}
+
+	del_edges(rb, node);
+	lsa_put(node->lsa);
+	node->lsa = lsa_get(b);
+	add_edges(rb, node);
+
+	schedule_spf(rb);
+}
+
+static void spf_lsa_del(void *_rb, struct lsa *a, uint32_t cost)
+{
+	struct rt_builder *rb = _rb;
+	struct rt_spf_node *node;
+
+	node = find_spf_node(rb, a->id);
+	if (node == NULL)
+		return;
+
+	spf_route_del(rb, node);
+
+	del_edges(rb, node);
+	cspf_node_del(&rb->ctx, &node->cn);
+	iv_avl_tree_delete(&rb->nodes, &node->an);
+	lsa_put(node->lsa);
+	free(node);
+
+	schedule_spf(rb);
+}
+
 void rt_builder_init(struct rt_builder *rb)
 {
 	rb->rl.cookie = rb;
-	rb->rl.lsa_add = lsa_add;
-	rb->rl.lsa_mod = lsa_mod;
-	rb->rl.lsa_del = lsa_del;
+	if (rb->spf) {
+		rb->rl.lsa_add = spf_lsa_add;
+		rb->rl.lsa_mod = spf_lsa_mod;
+		rb->rl.lsa_del = spf_lsa_del;
+	} else {
+		rb->rl.lsa_add = lsa_add;
+		rb->rl.lsa_mod = lsa_mod;
+		rb->rl.lsa_del = lsa_del;
+	}
 	loc_rib_listener_register(rb->rib, &rb->rl);
+
+	spf_init(&rb->ctx);
+	INIT_IV_AVL_TREE(&rb->nodes, compare_spf_nodes);
+
+	IV_TASK_INIT(&rb->run_spf);
+	rb->run_spf.cookie = rb;
+	rb->run_spf.handler = run_spf;
 }
 
 void rt_builder_deinit(struct rt_builder *rb)
 {
 	loc_rib_listener_unregister(rb->rib, &rb->rl);
+
+	if (iv_task_registered(&rb->run_spf))
+		iv_task_unregister(&rb->run_spf);
+
+	while (!iv_avl_tree_empty(&rb->nodes)) {
+		struct rt_spf_node *node;
+
+		node = iv_container_of(iv_avl_tree_min(&rb->nodes),
+				       struct rt_spf_node, an);
+
+		del_edges(rb, node);
+		cspf_node_del(&rb->ctx, &node->cn);
+		iv_avl_tree_delete(&rb->nodes, &node->an);
+		lsa_put(node->lsa);
+		free(node);
+	}
 }
@@ -20,11 +20,22 @@
 #ifndef __RT_BUILDER_H
 #define __RT_BUILDER_H
 
+#include <iv.h>
+#include <iv_avl.h>
 #include "rib_listener.h"
+#include "spf.h"
 
+/*
+ * By default, the route to each destination follows the ADV_PATH of
+ * its best LSA in the loc_rib.  With ->spf set, the LSAs are instead
+ * used as a link state database: a constrained SPF is run over the
+ * peerings that they advertise, and routes point at the first hop of
+ * the shortest valley-free path to each destination.
+ */
 struct rt_builder {
 	struct loc_rib	*rib;
 	uint8_t		*myid;
+	int		spf;
 	void		*cookie;
 	void		(*rt_add)(void *cookie, uint8_t *dest, uint8_t *nh);
 	void		(*rt_mod)(void *cookie, uint8_t *dest, uint8_t *oldnh,
@@ -32,6 +43,9 @@ struct rt_builder {
 	void		(*rt_del)(void *cookie, uint8_t *dest, uint8_t *nh);
 
 	struct rib_listener	rl;
+	struct spf_context	ctx;
+	struct iv_avl_tree	nodes;
+	struct iv_task		run_spf;
 };
 
 void rt_builder_init(struct rt_builder *rb);
@@ -0,0 +1,242 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <gnutls/abstract.h>
+#include <nettle/sha2.h>
+#include <string.h>
+#include "lsa.h"
+#include "lsa_serialise.h"
+#include "lsa_type.h"
+#include "pubkey_cache.h"
+#include "sig_cache.h"
+
+static int compare_entries(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct sig_cache_entry *a;
+	struct sig_cache_entry *b;
+
+	a = iv_container_of(_a, struct sig_cache_entry, an);
+	b = iv_container_of(_b, struct sig_cache_entry, an);
+
+	return memcmp(a->key, b->key, SIG_CACHE_KEY_LEN);
+}
+
+static struct iv_avl_tree entries = IV_AVL_TREE_INIT(compare_entries);
+static struct iv_list_head lru = IV_LIST_HEAD_INIT(lru);
+static int num_entries;
+static uint64_t hits;
+static uint64_t misses;
+
+static struct sig_cache_entry *find_entry(const uint8_t *key)
+{
+	struct iv_avl_node *an;
+
+	an = entries.root;
+	while (an != NULL) {
+		struct sig_cache_entry *ent;
+		int ret;
+
+		ent = iv_container_of(an, struct sig_cache_entry, an);
+
+		ret = memcmp(key, ent->key, SIG_CACHE_KEY_LEN);
+		if (ret == 0)
+			return ent;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static void evict(void)
+{
+	while (num_entries > SIG_CACHE_SIZE && !iv_list_empty(&lru)) {
+		struct sig_cache_entry *ent;
+
+		ent = iv_container_of(lru.next, struct sig_cache_entry, list);
+		iv_list_del(&ent->list);
+		iv_avl_tree_delete(&entries, &ent->an);
+		num_entries--;
+
+		free(ent);
+	}
+}
+
+struct sig_cache_entry *sig_cache_get(const uint8_t *key)
+{
+	struct sig_cache_entry *ent;
+
+	ent = find_entry(key);
+	if (ent == NULL) {
+		misses++;
+		return NULL;
+	}
+
+	hits++;
+
+	if (!ent->refcount++)
+		iv_list_del(&ent->list);
+
+	return ent;
+}
+
+int sig_cache_contains(const uint8_t *key)
+{
+	return find_entry(key) != NULL;
+}
+
+struct sig_cache_entry *sig_cache_insert(const uint8_t *key, int valid)
+{
+	struct sig_cache_entry *ent;
+
+	ent = find_entry(key);
+	if (ent != NULL) {
+		if (!ent->refcount++)
+			iv_list_del(&ent->list);
+		ent->valid = valid;
+		return ent;
+	}
+
+	ent = malloc(sizeof(*ent));
+	if (ent == NULL)
+		return NULL;
+
+	ent->refcount = 1;
+	memcpy(ent->key, key, SIG_CACHE_KEY_LEN);
+	ent->valid = valid;
+	iv_avl_tree_insert(&entries, &ent->an);
+	num_entries++;
+
+	evict();
+
+	return ent;
+}
+
+void sig_cache_put(struct sig_cache_entry *ent)
+{
+	if (!--ent->refcount) {
+		iv_list_add_tail(&ent->list, &lru);
+		evict();
+	}
+}
+
+void sig_cache_print_stats(FILE *fp)
+{
+	fprintf(fp, "signature cache: %d entries, %llu hits, %llu misses\n",
+		num_entries, (unsigned long long)hits,
+		(unsigned long long)misses);
+}
+
+int sig_check_init(struct sig_check *sc, struct lsa *lsa)
+{
+	struct lsa_attr *attr;
+	struct sha256_ctx ctx;
+	size_t serlen;
+	size_t buflen;
+	uint8_t *buf;
+	const uint8_t *data;
+	size_t len;
+
+	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_PUBKEY, NULL, 0);
+	if (attr == NULL)
+		return -1;
+
+	memcpy(sc->id, lsa->id, NODE_ID_LEN);
+	sc->pubkey.data = lsa_attr_data(attr);
+	sc->pubkey.size = attr->datalen;
+
+	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_SIGNATURE, NULL, 0);
+	if (attr == NULL)
+		return -1;
+
+	sc->sig.data = lsa_attr_data(attr);
+	sc->sig.size = attr->datalen;
+
+	/*
+	 * The signed-only serialisation is normally cached in the LSA
+	 * body, and then shared by every LSA with the same body.
+	 */
+	sc->buf = NULL;
+
+	data = lsa_serialise_signed(lsa, &len);
+	if (data == NULL) {
+		serlen = lsa_serialise_length(lsa, 1, NULL);
+		if (serlen > 65536 - 128)
+			abort();
+
+		buflen = serlen + 128;
+		buf = malloc(buflen);
+		if (buf == NULL)
+			return -1;
+
+		len = lsa_serialise(buf, buflen, serlen, lsa, 1, NULL);
+		if (len > buflen)
+			abort();
+
+		sc->buf = buf;
+		data = buf;
+	}
+
+	sc->data.data = (void *)data;
+	sc->data.size = len;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, NODE_ID_LEN, lsa->id);
+	sha256_update(&ctx, sc->data.size, sc->data.data);
+	sha256_update(&ctx, sc->sig.size, sc->sig.data);
+	sha256_digest(&ctx, SIG_CACHE_KEY_LEN, sc->key);
+
+	return 0;
+}
+
+int sig_check_verify(struct sig_check *sc)
+{
+	struct pubkey_cache_entry *pk;
+	int ret;
+
+	pk = pubkey_cache_get(sc->id, &sc->pubkey);
+	if (pk == NULL)
+		return -1;
+
+	ret = gnutls_pubkey_verify_data2(pk->pubkey, GNUTLS_SIGN_RSA_SHA256,
+					 0, &sc->data, &sc->sig);
+	if (ret < 0)
+		gnutls_perror(ret);
+
+	pubkey_cache_put(pk);
+
+	if (ret == GNUTLS_E_PK_SIG_VERIFY_FAILED)
+		return 1;
+
+	return (ret < 0) ? -1 : 0;
+}
+
+void sig_check_deinit(struct sig_check *sc)
+{
+	free(sc->buf);
+	sc->buf = NULL;
+	sc->data.data = NULL;
+}
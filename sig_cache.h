@@ -0,0 +1,88 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __SIG_CACHE_H
+#define __SIG_CACHE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <gnutls/gnutls.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include "lsa.h"
+
+/*
+ * A cache of LSA signature verification results, shared by all
+ * adj_rib_ins, so that an LSA that is flooded to us by several peers,
+ * or that is compared against its successor, is only verified once.
+ *
+ * Entries are keyed by a SHA-256 digest over the node id, the signed
+ * part of the LSA (which includes its version) and the signature, so
+ * a hit means that this exact signature was checked over this exact
+ * data.
+ *
+ * Entries are refcounted, and every adj_rib_in holds a reference to
+ * the entry of each LSA that it holds, so the entries of the LSDB
+ * are never evicted, however large it grows.  Entries that aren't
+ * referenced are kept around on an LRU list, and are evicted once
+ * there are more than SIG_CACHE_SIZE entries.
+ */
+#define SIG_CACHE_KEY_LEN	32
+#define SIG_CACHE_SIZE		4096
+
+struct sig_cache_entry {
+	struct iv_avl_node	an;
+	struct iv_list_head	list;
+	int			refcount;
+	uint8_t			key[SIG_CACHE_KEY_LEN];
+	int			valid;
+};
+
+struct sig_cache_entry *sig_cache_get(const uint8_t *key);
+int sig_cache_contains(const uint8_t *key);
+struct sig_cache_entry *sig_cache_insert(const uint8_t *key, int valid);
+void sig_cache_put(struct sig_cache_entry *ent);
+void sig_cache_print_stats(FILE *fp);
+
+/*
+ * Everything needed to verify the signature of an LSA, and its cache
+ * key.  sig_check_init() fails if the LSA is unsigned.  The public
+ * key is looked up in the public key cache by node id, and parsed
+ * (and checked against the node id) on a miss.  sig_check_verify() only
+ * looks at the sig_check itself, and can be run on any thread as
+ * long as the LSA is kept alive and unmodified.  It returns 0 if the
+ * signature is valid, 1 if it doesn't match, and -1 if it couldn't be
+ * checked, for example because the public key couldn't be imported.
+ * Only the first two results may be cached.
+ */
+struct sig_check {
+	uint8_t			key[SIG_CACHE_KEY_LEN];
+	uint8_t			id[NODE_ID_LEN];
+	gnutls_datum_t		pubkey;
+	gnutls_datum_t		data;
+	gnutls_datum_t		sig;
+	void			*buf;
+};
+
+int sig_check_init(struct sig_check *sc, struct lsa *lsa);
+int sig_check_verify(struct sig_check *sc);
+void sig_check_deinit(struct sig_check *sc);
+
+
+#endif
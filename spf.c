@@ -29,92 +29,210 @@ void spf_init(struct spf_context *ctx)
 {
 	INIT_IV_LIST_HEAD(&ctx->nodes);
 	ctx->num_nodes = 0;
+	ctx->source = NULL;
+	INIT_IV_LIST_HEAD(&ctx->dirty);
+	INIT_IV_LIST_HEAD(&ctx->changed);
+	ctx->heap = NULL;
+	ctx->affected = NULL;
+}
+
+static void mark_dirty(struct spf_node *node)
+{
+	if (iv_list_empty(&node->dirty))
+		iv_list_add_tail(&node->dirty, &node->ctx->dirty);
+}
+
+static void mark_changed(struct spf_node *node)
+{
+	if (iv_list_empty(&node->changed))
+		iv_list_add_tail(&node->changed, &node->ctx->changed);
+}
+
+static void clear_changed(struct spf_context *ctx)
+{
+	while (!iv_list_empty(&ctx->changed))
+		iv_list_del_init(ctx->changed.next);
 }
 
 void spf_node_add(struct spf_context *ctx, struct spf_node *node)
 {
+	int i;
+
+	node->ctx = ctx;
 	iv_list_add_tail(&node->list, &ctx->nodes);
 	INIT_IV_LIST_HEAD(&node->edges);
+	INIT_IV_LIST_HEAD(&node->in_edges);
+	INIT_IV_LIST_HEAD(&node->dirty);
+	INIT_IV_LIST_HEAD(&node->changed);
+	node->lost_parent = 0;
+	node->new_edges = 0;
+	node->affected = 0;
+	node->in_heap = 0;
+	node->parent = NULL;
+	node->cost = INT_MAX;
+
+	node->idkey = 0;
+	for (i = 0; i < sizeof(node->idkey); i++)
+		node->idkey = (node->idkey << 8) | node->id[i];
 
 	ctx->num_nodes++;
 }
 
+/*
+ * All edges from and to @node must have been deleted before the
+ * node itself is deleted.
+ */
 void spf_node_del(struct spf_context *ctx, struct spf_node *node)
 {
 	iv_list_del(&node->list);
+	if (!iv_list_empty(&node->dirty))
+		iv_list_del(&node->dirty);
+	if (!iv_list_empty(&node->changed))
+		iv_list_del(&node->changed);
+
+	if (ctx->source == node)
+		ctx->source = NULL;
 
 	ctx->num_nodes--;
 }
 
 void spf_edge_add(struct spf_node *from, struct spf_edge *edge)
 {
+	edge->from = from;
 	iv_list_add_tail(&edge->list, &from->edges);
+	iv_list_add_tail(&edge->in_list, &edge->to->in_edges);
+
+	if (from->ctx->source != NULL) {
+		from->new_edges = 1;
+		mark_dirty(from);
+	}
 }
 
 void spf_edge_del(struct spf_node *from, struct spf_edge *edge)
 {
+	struct spf_node *to = edge->to;
+
 	iv_list_del(&edge->list);
+	iv_list_del(&edge->in_list);
+
+	if (from->ctx->source != NULL && to->parent == from) {
+		to->lost_parent = 1;
+		mark_dirty(to);
+	}
 }
 
-static void push_down(struct spf_node **heap, int heapsize)
+static struct spf_node *heap_meld(struct spf_node *a, struct spf_node *b)
 {
-	int index;
+	struct spf_node *temp;
 
-	index = 0;
-	while (1) {
-		int min;
-		int child;
-		struct spf_node *temp;
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
 
-		min = index;
+	if (b->cost < a->cost) {
+		temp = a;
+		a = b;
+		b = temp;
+	}
 
-		child = 2 * index + 1;
-		if (child < heapsize && heap[min]->cost > heap[child]->cost)
-			min = child;
+	b->heap_prev = a;
+	b->heap_next = a->heap_child;
+	if (b->heap_next != NULL)
+		b->heap_next->heap_prev = b;
+	a->heap_child = b;
 
-		child = 2 * index + 2;
-		if (child < heapsize && heap[min]->cost > heap[child]->cost)
-			min = child;
+	return a;
+}
 
-		if (index == min)
-			break;
+static void heap_insert(struct spf_context *ctx, struct spf_node *node)
+{
+	node->in_heap = 1;
+	node->heap_child = NULL;
+	node->heap_next = NULL;
+	node->heap_prev = NULL;
 
-		temp = heap[index];
-		heap[index] = heap[min];
-		heap[min] = temp;
+	ctx->heap = heap_meld(ctx->heap, node);
+}
 
-		heap[index]->heapidx = index;
-		heap[min]->heapidx = min;
+static void heap_decrease(struct spf_context *ctx, struct spf_node *node)
+{
+	if (node == ctx->heap)
+		return;
 
-		index = min;
-	}
+	if (node->heap_prev->heap_child == node)
+		node->heap_prev->heap_child = node->heap_next;
+	else
+		node->heap_prev->heap_next = node->heap_next;
+
+	if (node->heap_next != NULL)
+		node->heap_next->heap_prev = node->heap_prev;
+
+	node->heap_next = NULL;
+	node->heap_prev = NULL;
+
+	ctx->heap = heap_meld(ctx->heap, node);
 }
 
-static void pull_up(struct spf_node **heap, int index)
+static struct spf_node *heap_extract_min(struct spf_context *ctx)
 {
-	while (index) {
-		int parent;
-		struct spf_node *temp;
-
-		parent = (index - 1) / 2;
-		if (heap[parent]->cost <= heap[index]->cost)
-			break;
+	struct spf_node *min;
+	struct spf_node *child;
+	struct spf_node *pairs;
+	struct spf_node *root;
+
+	min = ctx->heap;
+	min->in_heap = 0;
+
+	/*
+	 * Meld the children of the old root in pairs from left to
+	 * right, and then meld the pairs together from right to left.
+	 */
+	pairs = NULL;
+
+	child = min->heap_child;
+	while (child != NULL) {
+		struct spf_node *a;
+		struct spf_node *b;
+
+		a = child;
+		b = a->heap_next;
+		child = (b != NULL) ? b->heap_next : NULL;
+
+		a->heap_next = NULL;
+		a->heap_prev = NULL;
+		if (b != NULL) {
+			b->heap_next = NULL;
+			b->heap_prev = NULL;
+		}
 
-		temp = heap[index];
-		heap[index] = heap[parent];
-		heap[parent] = temp;
+		a = heap_meld(a, b);
+		a->heap_next = pairs;
+		pairs = a;
+	}
 
-		heap[index]->heapidx = index;
-		heap[parent]->heapidx = parent;
+	root = NULL;
+	while (pairs != NULL) {
+		struct spf_node *next;
 
-		index = parent;
+		next = pairs->heap_next;
+		pairs->heap_next = NULL;
+		root = heap_meld(root, pairs);
+		pairs = next;
 	}
+
+	ctx->heap = root;
+
+	return min;
 }
 
 static int nl(struct spf_node *a, struct spf_node *b)
 {
 	int ret;
 
+	if (a->idkey != b->idkey)
+		return a->idkey < b->idkey;
+
 	ret = memcmp(a->id, b->id, NODE_ID_LEN);
 	if (ret == 0)
 		abort();
@@ -125,11 +243,101 @@ static int nl(struct spf_node *a, struct spf_node *b)
 	return 0;
 }
 
+static void relax(struct spf_context *ctx, struct spf_node *from,
+		  struct spf_edge *edge)
+{
+	struct spf_node *to;
+	int cost;
+
+	to = edge->to;
+
+	cost = from->cost + edge->cost;
+	if (cost < to->cost) {
+		to->parent = from;
+		to->cost = cost;
+		mark_changed(to);
+
+		if (!to->in_heap)
+			heap_insert(ctx, to);
+		else
+			heap_decrease(ctx, to);
+	} else if (cost == to->cost && to->parent != NULL &&
+		   to->parent != from && nl(from, to->parent)) {
+		to->parent = from;
+		mark_changed(to);
+	}
+}
+
+/*
+ * Among the equal cost predecessors of @node whose cost is final,
+ * pick the one with the lowest id, so that the resulting tree does
+ * not depend on the order in which the nodes were visited.
+ */
+static void pick_parent(struct spf_node *node)
+{
+	struct iv_list_head *lh;
+
+	if (node->parent == NULL)
+		return;
+
+	iv_list_for_each (lh, &node->in_edges) {
+		struct spf_edge *edge;
+		struct spf_node *from;
+
+		edge = iv_container_of(lh, struct spf_edge, in_list);
+
+		from = edge->from;
+		if (from == node->parent || from->in_heap ||
+		    from->cost == INT_MAX) {
+			continue;
+		}
+
+		if (from->cost + edge->cost == node->cost &&
+		    nl(from, node->parent)) {
+			node->parent = from;
+			mark_changed(node);
+		}
+	}
+}
+
+static void run_heap(struct spf_context *ctx)
+{
+	while (ctx->heap != NULL) {
+		struct spf_node *from;
+		struct iv_list_head *lh;
+
+		from = heap_extract_min(ctx);
+
+		pick_parent(from);
+
+		iv_list_for_each (lh, &from->edges) {
+			struct spf_edge *edge;
+
+			edge = iv_container_of(lh, struct spf_edge, list);
+			relax(ctx, from, edge);
+		}
+	}
+}
+
+static void clear_dirty(struct spf_context *ctx)
+{
+	while (!iv_list_empty(&ctx->dirty)) {
+		struct spf_node *node;
+
+		node = iv_container_of(ctx->dirty.next, struct spf_node, dirty);
+		iv_list_del_init(&node->dirty);
+
+		node->lost_parent = 0;
+		node->new_edges = 0;
+	}
+}
+
 void spf_run(struct spf_context *ctx, struct spf_node *source)
 {
 	struct iv_list_head *lh;
-	struct spf_node *heap[ctx->num_nodes];
-	int heapsize;
+
+	clear_dirty(ctx);
+	clear_changed(ctx);
 
 	iv_list_for_each (lh, &ctx->nodes) {
 		struct spf_node *node;
@@ -137,50 +345,120 @@ void spf_run(struct spf_context *ctx, struct spf_node *source)
 		node = iv_container_of(lh, struct spf_node, list);
 		node->parent = NULL;
 		node->cost = INT_MAX;
-		node->heapidx = -1;
+		node->in_heap = 0;
+		mark_changed(node);
 	}
 
+	ctx->source = source;
+
 	source->cost = 0;
-	source->heapidx = 0;
+	ctx->heap = NULL;
+	heap_insert(ctx, source);
 
-	heap[0] = source;
-	heapsize = 1;
+	run_heap(ctx);
+}
 
-	while (heapsize) {
-		struct spf_node *from;
+static void mark_affected(struct spf_context *ctx, struct spf_node *node,
+			  struct spf_node **tail)
+{
+	node->affected = 1;
+	node->next_affected = NULL;
+
+	if (*tail != NULL)
+		(*tail)->next_affected = node;
+	else
+		ctx->affected = node;
+	*tail = node;
+}
 
-		from = heap[0];
-		from->heapidx = -1;
+void spf_update(struct spf_context *ctx, struct spf_node *source)
+{
+	struct spf_node *tail;
+	struct spf_node *node;
+	struct iv_list_head *lh;
 
-		if (--heapsize) {
-			heap[0] = heap[heapsize];
-			heap[0]->heapidx = 0;
-			push_down(heap, heapsize);
-		}
+	if (ctx->source != source) {
+		spf_run(ctx, source);
+		return;
+	}
 
-		iv_list_for_each (lh, &from->edges) {
+	clear_changed(ctx);
+
+	/*
+	 * Every node that was reached over an edge that has since been
+	 * deleted, and everything below it in the tree, has to find a
+	 * new path.
+	 */
+	ctx->affected = NULL;
+	tail = NULL;
+
+	iv_list_for_each (lh, &ctx->dirty) {
+		node = iv_container_of(lh, struct spf_node, dirty);
+		if (node->lost_parent && node->cost != INT_MAX)
+			mark_affected(ctx, node, &tail);
+	}
+
+	for (node = ctx->affected; node != NULL; node = node->next_affected) {
+		iv_list_for_each (lh, &node->edges) {
 			struct spf_edge *edge;
 			struct spf_node *to;
-			int cost;
 
 			edge = iv_container_of(lh, struct spf_edge, list);
 
 			to = edge->to;
+			if (to->parent == node && !to->affected)
+				mark_affected(ctx, to, &tail);
+		}
+	}
 
-			cost = from->cost + edge->cost;
-			if (cost < to->cost) {
-				if (to->cost == INT_MAX) {
-					to->heapidx = heapsize;
-					heap[heapsize] = to;
-					heapsize++;
-				}
-
-				to->parent = from;
-				to->cost = cost;
-				pull_up(heap, to->heapidx);
-			} else if (cost == to->cost && nl(from, to->parent)) {
-				to->parent = from;
-			}
+	for (node = ctx->affected; node != NULL; node = node->next_affected) {
+		node->parent = NULL;
+		node->cost = INT_MAX;
+		mark_changed(node);
+	}
+
+	/*
+	 * Seed the heap with the best paths into the affected nodes
+	 * from the rest of the tree, and with the targets of the new
+	 * edges leaving nodes that are still reachable.
+	 */
+	ctx->heap = NULL;
+
+	for (node = ctx->affected; node != NULL; node = node->next_affected) {
+		iv_list_for_each (lh, &node->in_edges) {
+			struct spf_edge *edge;
+			struct spf_node *from;
+
+			edge = iv_container_of(lh, struct spf_edge, in_list);
+
+			from = edge->from;
+			if (!from->affected && from->cost != INT_MAX)
+				relax(ctx, from, edge);
 		}
 	}
+
+	iv_list_for_each (lh, &ctx->dirty) {
+		struct iv_list_head *lh2;
+
+		node = iv_container_of(lh, struct spf_node, dirty);
+		if (!node->new_edges || node->affected ||
+		    node->cost == INT_MAX) {
+			continue;
+		}
+
+		iv_list_for_each (lh2, &node->edges) {
+			struct spf_edge *edge;
+
+			edge = iv_container_of(lh2, struct spf_edge, list);
+			relax(ctx, node, edge);
+		}
+	}
+
+	for (node = ctx->affected; node != NULL; node = node->next_affected)
+		node->affected = 0;
+	ctx->affected = NULL;
+
+	clear_dirty(ctx);
+
+	run_heap(ctx);
 }
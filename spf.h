@@ -21,28 +21,66 @@
 #define __SPF_H
 
 #include <iv_list.h>
+#include <stdint.h>
 
+/*
+ * After an initial spf_run(), spf_update() recomputes the shortest
+ * path tree incrementally: only the subtrees below removed edges are
+ * recomputed from scratch, and the effects of added edges are
+ * propagated from the nodes they leave from.
+ *
+ * Edge costs must be positive, except on edges that can't be part of
+ * a cycle, or ties between equal cost paths could loop the tree.
+ *
+ * The priority queue is a pairing heap threaded through the nodes
+ * themselves, so that a run needs no memory beyond the nodes and
+ * edges, however large the graph is.
+ *
+ * The nodes whose parent or cost may have been changed by the last
+ * spf_run() or spf_update() are kept on ->changed, linked through
+ * their ->changed member, until the next run, so that users of the
+ * tree only need to look at those nodes and the subtrees below them.
+ */
 struct spf_context {
 	struct iv_list_head	nodes;
 	int			num_nodes;
+	struct spf_node		*source;
+	struct iv_list_head	dirty;
+	struct iv_list_head	changed;
+	struct spf_node		*heap;
+	struct spf_node		*affected;
 };
 
 struct spf_node {
 	uint8_t			*id;
 	void			*cookie;
 
+	struct spf_context	*ctx;
 	struct iv_list_head	list;
 	struct iv_list_head	edges;
+	struct iv_list_head	in_edges;
+	struct iv_list_head	dirty;
+	struct iv_list_head	changed;
+	unsigned		lost_parent:1;
+	unsigned		new_edges:1;
+	unsigned		affected:1;
+	unsigned		in_heap:1;
+	uint64_t		idkey;
 	struct spf_node		*parent;
 	int			cost;
-	int			heapidx;
+	struct spf_node		*heap_child;
+	struct spf_node		*heap_next;
+	struct spf_node		*heap_prev;
+	struct spf_node		*next_affected;
 };
 
 struct spf_edge {
 	struct spf_node		*to;
 	int			cost;
 
+	struct spf_node		*from;
 	struct iv_list_head	list;
+	struct iv_list_head	in_list;
 };
 
 void spf_init(struct spf_context *ctx);
@@ -51,6 +89,7 @@ void spf_node_del(struct spf_context *ctx, struct spf_node *node);
 void spf_edge_add(struct spf_node *from, struct spf_edge *edge);
 void spf_edge_del(struct spf_node *from, struct spf_edge *edge);
 void spf_run(struct spf_context *ctx, struct spf_node *source);
+void spf_update(struct spf_context *ctx, struct spf_node *source);
 
 
 #endif
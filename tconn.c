@@ -33,17 +33,41 @@
 #include <gnutls/abstract.h>
 #include <gnutls/x509.h>
 #include <iv.h>
+#include <iv_tls.h>
+#include <iv_work.h>
+#include <linux/tls.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "pubkey_cache.h"
 #include "tconn.h"
+#include "tls_prio.h"
 #include "util.h"
-#include "x509.h"
 
 #define STATE_HANDSHAKE		1
 #define STATE_RUNNING		2
 #define STATE_TX_CONGESTION	3
 #define STATE_DEAD		4
 
+#define KTLS_OFF		0
+#define KTLS_PENDING		1
+#define KTLS_ACTIVE		2
+
+#define TLS_CONTENT_ALERT	21
+#define TLS_CONTENT_DATA	23
+
+/*
+ * Maximum TLS record payload, and an upper bound on the per-record
+ * header, explicit nonce, MAC and padding overhead.
+ */
+#define TCONN_MAX_RECORD	16384
+#define TCONN_RECORD_OVERHEAD	128
+
+#define TCONN_NOTSENT_LOWAT	131072
+
 static int verify_state_pollin(struct tconn *tc)
 {
 	/*
@@ -76,16 +100,6 @@ static int verify_state_pollout(struct tconn *tc)
 	if (!tc->tx_bytes)
 		return 0;
 
-	/*
-	 * We shouldn't schedule POLLOUT until we have seen a partial
-	 * write (or EAGAIN) on this socket, but we don't keep track of
-	 * having seen partial writes, so we will sometimes get false
-	 * positive errors here, where verify_state() will complain that
-	 * a POLLOUT handler should be registered while there isn't, and
-	 * the reason for that being that we haven't seen a partial
-	 * write yet.
-	 */
-
 	return 1;
 }
 
@@ -114,7 +128,7 @@ static int verify_state_tx_task(struct tconn *tc)
 		return 1;
 	}
 
-	if (tc->state == STATE_TX_CONGESTION &&
+	if (tc->state == STATE_TX_CONGESTION && tc->ktls_tx != KTLS_ACTIVE &&
 	    (tc->io_error || tc->tx_bytes < sizeof(tc->tx_buf))) {
 		return 1;
 	}
@@ -179,26 +193,127 @@ static void got_io_error(struct tconn *tc)
 	if (!iv_task_registered(&tc->tx_task) &&
 	    ((tc->state == STATE_HANDSHAKE &&
 	      gnutls_record_get_direction(tc->sess) == 1) ||
-	     tc->state == STATE_TX_CONGESTION)) {
+	     (tc->state == STATE_TX_CONGESTION &&
+	      tc->ktls_tx != KTLS_ACTIVE))) {
 		iv_task_register(&tc->tx_task);
 	}
 }
 
+/*
+ * While we are waiting to hand the receive direction over to the
+ * kernel, we never read past the end of the current TLS record, so
+ * that once gnutls has consumed a record, the socket is positioned
+ * at a record boundary and there is nothing left buffered in userspace.
+ */
+static int tconn_rx_record_limit(struct tconn *tc)
+{
+	if (tc->rx_rec_left > sizeof(tc->rx_buf))
+		return sizeof(tc->rx_buf);
+
+	if (tc->rx_rec_left)
+		return tc->rx_rec_left;
+
+	return sizeof(tc->rx_rec_hdr) - tc->rx_rec_hdr_bytes;
+}
+
+static void tconn_rx_record_advance(struct tconn *tc, int bytes)
+{
+	if (tc->rx_rec_left) {
+		tc->rx_rec_left -= bytes;
+		return;
+	}
+
+	memcpy(tc->rx_rec_hdr + tc->rx_rec_hdr_bytes, tc->rx_buf, bytes);
+
+	tc->rx_rec_hdr_bytes += bytes;
+	if (tc->rx_rec_hdr_bytes == sizeof(tc->rx_rec_hdr)) {
+		tc->rx_rec_left = (tc->rx_rec_hdr[3] << 8) | tc->rx_rec_hdr[4];
+		tc->rx_rec_hdr_bytes = 0;
+	}
+}
+
+static void tconn_connection_abort(struct tconn *tc, int notify_err);
+static void tconn_rx_frames(struct tconn *tc, const uint8_t *buf, int len);
+
+static void tconn_ktls_recv(struct tconn *tc)
+{
+	uint8_t cbuf[CMSG_SPACE(sizeof(uint8_t))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	int ret;
+
+	iov.iov_base = tc->rx_buf;
+	iov.iov_len = sizeof(tc->rx_buf);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do {
+		ret = recvmsg(tc->fd->fd, &msg, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0 && errno == EAGAIN) {
+		verify_state(tc);
+		return;
+	}
+
+	if (ret <= 0) {
+		if (ret < 0)
+			perror("tconn_ktls_recv: recvmsg");
+		tconn_connection_abort(tc, 1);
+		return;
+	}
+
+	/*
+	 * Non-data records (i.e. alerts, as we don't renegotiate)
+	 * are delivered with a control message indicating their type.
+	 */
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_TLS &&
+	    cmsg->cmsg_type == TLS_GET_RECORD_TYPE &&
+	    *CMSG_DATA(cmsg) != TLS_CONTENT_DATA) {
+		if (*CMSG_DATA(cmsg) != TLS_CONTENT_ALERT) {
+			fprintf(stderr, "tconn_ktls_recv: unexpected record "
+					"type %d\n", *CMSG_DATA(cmsg));
+		}
+		tconn_connection_abort(tc, 1);
+		return;
+	}
+
+	verify_state(tc);
+
+	tconn_rx_frames(tc, tc->rx_buf, ret);
+}
+
 static void tconn_fd_handler_in(void *_tc)
 {
 	struct tconn *tc = _tc;
+	int len;
 	int ret;
 
 	verify_state(tc);
 
+	if (tc->ktls_rx == KTLS_ACTIVE) {
+		tconn_ktls_recv(tc);
+		return;
+	}
+
 	if (tc->rx_start != tc->rx_end)
 		abort();
 
 	tc->rx_start = 0;
 	tc->rx_end = 0;
 
+	len = sizeof(tc->rx_buf);
+	if (tc->ktls_rx == KTLS_PENDING)
+		len = tconn_rx_record_limit(tc);
+
 	do {
-		ret = recv(tc->fd->fd, tc->rx_buf, sizeof(tc->rx_buf), 0);
+		ret = recv(tc->fd->fd, tc->rx_buf, len, 0);
 	} while (ret < 0 && errno == EINTR);
 
 	if (ret <= 0) {
@@ -226,6 +341,8 @@ static void tconn_fd_handler_in(void *_tc)
 	}
 
 	tc->rx_end = ret;
+	if (tc->ktls_rx == KTLS_PENDING)
+		tconn_rx_record_advance(tc, ret);
 
 	verify_state(tc);
 }
@@ -250,7 +367,7 @@ tconn_gtls_pull_func(gnutls_transport_ptr_t _tc, void *buf, size_t len)
 		memcpy(buf, tc->rx_buf + tc->rx_start, tocopy);
 
 		tc->rx_start += tocopy;
-		if (tc->rx_start == tc->rx_end)
+		if (tc->rx_start == tc->rx_end && tc->hs_job == NULL)
 			iv_fd_set_handler_in(tc->fd, tconn_fd_handler_in);
 
 		return tocopy;
@@ -264,143 +381,679 @@ tconn_gtls_pull_func(gnutls_transport_ptr_t _tc, void *buf, size_t len)
 	return -1;
 }
 
-static void tconn_fd_handler_out(void *_tc)
+static int tconn_tx_queue_iov(struct tconn *tc, struct iovec *iov)
 {
-	struct tconn *tc = _tc;
+	int head;
+	int tail;
+
+	if (!tc->tx_bytes)
+		return 0;
+
+	head = tc->tx_start;
+	tail = tc->tx_start + tc->tx_bytes;
+
+	iov[0].iov_base = tc->tx_buf + head;
+	if (tail <= sizeof(tc->tx_buf)) {
+		iov[0].iov_len = tc->tx_bytes;
+		return 1;
+	}
+
+	iov[0].iov_len = sizeof(tc->tx_buf) - head;
+	iov[1].iov_base = tc->tx_buf;
+	iov[1].iov_len = tail - sizeof(tc->tx_buf);
+
+	return 2;
+}
+
+static void tconn_tx_queue_consume(struct tconn *tc, int bytes)
+{
+	tc->tx_bytes -= bytes;
+	if (tc->tx_bytes) {
+		tc->tx_start += bytes;
+		if (tc->tx_start >= sizeof(tc->tx_buf))
+			tc->tx_start -= sizeof(tc->tx_buf);
+	} else {
+		tc->tx_start = 0;
+	}
+}
+
+static int tconn_tx_queue_append(struct tconn *tc, const void *buf, int len)
+{
+	int tail;
+	int space;
+	int tocopy;
+
+	space = sizeof(tc->tx_buf) - tc->tx_bytes;
+	if (len > space)
+		len = space;
+
+	tail = tc->tx_start + tc->tx_bytes;
+	if (tail >= sizeof(tc->tx_buf))
+		tail -= sizeof(tc->tx_buf);
+
+	tocopy = sizeof(tc->tx_buf) - tail;
+	if (tocopy > len)
+		tocopy = len;
+
+	memcpy(tc->tx_buf + tail, buf, tocopy);
+	if (tocopy < len)
+		memcpy(tc->tx_buf, buf + tocopy, len - tocopy);
+
+	tc->tx_bytes += len;
+
+	return len;
+}
+
+static int tconn_sendmsg(struct tconn *tc, struct iovec *iov, int iovcnt)
+{
+	struct msghdr msg;
 	int ret;
 
-	verify_state(tc);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
 
 	do {
-		ret = send(tc->fd->fd, tc->tx_buf, tc->tx_bytes, 0);
+		ret = sendmsg(tc->fd->fd, &msg, MSG_NOSIGNAL);
 	} while (ret < 0 && errno == EINTR);
 
+	return ret;
+}
+
+static void gtls_perror(const char *str, int error)
+{
+	fprintf(stderr, "%s: %s\n", str, gnutls_strerror(error));
+}
+
+static int tconn_ktls_set_crypto(struct tconn *tc, int dir)
+{
+	union {
+		struct tls12_crypto_info_aes_gcm_128		gcm128;
+		struct tls12_crypto_info_aes_gcm_256		gcm256;
+		struct tls12_crypto_info_chacha20_poly1305	chacha;
+	} ci;
+	gnutls_datum_t mac_key;
+	gnutls_datum_t iv;
+	gnutls_datum_t key;
+	uint8_t seq[8];
+	int len;
+	int ret;
+
+	ret = gnutls_record_get_state(tc->sess, dir == TLS_RX,
+				      &mac_key, &iv, &key, seq);
+	if (ret) {
+		gtls_perror("gnutls_record_get_state", ret);
+		return -1;
+	}
+
+	/*
+	 * For TLS 1.2 AES-GCM, gnutls uses the record sequence number
+	 * as the explicit part of the nonce.
+	 */
+	memset(&ci, 0, sizeof(ci));
+	switch (gnutls_cipher_get(tc->sess)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		ci.gcm128.info.version = TLS_1_2_VERSION;
+		ci.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(ci.gcm128.iv, seq, sizeof(ci.gcm128.iv));
+		memcpy(ci.gcm128.key, key.data, sizeof(ci.gcm128.key));
+		memcpy(ci.gcm128.salt, iv.data, sizeof(ci.gcm128.salt));
+		memcpy(ci.gcm128.rec_seq, seq, sizeof(ci.gcm128.rec_seq));
+		len = sizeof(ci.gcm128);
+		break;
+
+	case GNUTLS_CIPHER_AES_256_GCM:
+		ci.gcm256.info.version = TLS_1_2_VERSION;
+		ci.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(ci.gcm256.iv, seq, sizeof(ci.gcm256.iv));
+		memcpy(ci.gcm256.key, key.data, sizeof(ci.gcm256.key));
+		memcpy(ci.gcm256.salt, iv.data, sizeof(ci.gcm256.salt));
+		memcpy(ci.gcm256.rec_seq, seq, sizeof(ci.gcm256.rec_seq));
+		len = sizeof(ci.gcm256);
+		break;
+
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		ci.chacha.info.version = TLS_1_2_VERSION;
+		ci.chacha.info.cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+		memcpy(ci.chacha.iv, iv.data, sizeof(ci.chacha.iv));
+		memcpy(ci.chacha.key, key.data, sizeof(ci.chacha.key));
+		memcpy(ci.chacha.rec_seq, seq, sizeof(ci.chacha.rec_seq));
+		len = sizeof(ci.chacha);
+		break;
+
+	default:
+		return -1;
+	}
+
+	ret = setsockopt(tc->fd->fd, SOL_TLS, dir, &ci, len);
+	memset(&ci, 0, sizeof(ci));
+
 	if (ret < 0) {
-		if (errno != EAGAIN) {
-			tc->io_error = errno;
-			got_io_error(tc);
-		}
+		perror(dir == TLS_TX ? "setsockopt(SOL_TLS, TLS_TX)" :
+				       "setsockopt(SOL_TLS, TLS_RX)");
+		return -1;
+	}
 
-		verify_state(tc);
+	return 0;
+}
 
+static int tconn_ktls_supported(struct tconn *tc)
+{
+	if (gnutls_protocol_get_version(tc->sess) != GNUTLS_TLS1_2)
+		return 0;
+
+	switch (gnutls_cipher_get(tc->sess)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+	case GNUTLS_CIPHER_AES_256_GCM:
+	case GNUTLS_CIPHER_CHACHA20_POLY1305:
+		break;
+	default:
+		return 0;
+	}
+
+	if (setsockopt(tc->fd->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0)
+		return 0;
+
+	return 1;
+}
+
+/*
+ * The kernel may split what we send across TLS records in ways that
+ * userspace gnutls never does, and peers running older code expect
+ * every record to consist of whole frames.  Peers that reassemble
+ * frames across records offer this ALPN protocol, and we only hand
+ * our transmit direction over to the kernel if our peer did so.
+ * Receiving with kTLS doesn't depend on what the peer does.
+ */
+static const gnutls_datum_t tconn_alpn_frames = {
+	.data	= (unsigned char *)"dvpn-frames",
+	.size	= sizeof("dvpn-frames") - 1,
+};
+
+static int tconn_peer_reassembles_frames(struct tconn *tc)
+{
+	gnutls_datum_t proto;
+
+	if (gnutls_alpn_get_selected_protocol(tc->sess, &proto))
+		return 0;
+
+	return proto.size == tconn_alpn_frames.size &&
+	       !memcmp(proto.data, tconn_alpn_frames.data, proto.size);
+}
+
+/*
+ * Each direction is handed over to the kernel as soon as it is
+ * quiescent: for transmit, once gnutls has no partially sent record
+ * and our transmit queue is empty, and for receive, once gnutls has
+ * consumed everything up to a record boundary.  If the kernel or the
+ * negotiated cipher doesn't support this, we stay in userspace.
+ */
+static void tconn_ktls_try(struct tconn *tc)
+{
+	if (tc->state != STATE_RUNNING || tc->io_error)
 		return;
+
+	if (tc->ktls_tx == KTLS_PENDING && !tc->tx_bytes) {
+		if (tconn_ktls_set_crypto(tc, TLS_TX) == 0)
+			tc->ktls_tx = KTLS_ACTIVE;
+		else
+			tc->ktls_tx = KTLS_OFF;
 	}
 
-	if (tc->tx_bytes == sizeof(tc->tx_buf)) {
-		if ((tc->state == STATE_HANDSHAKE &&
-		     gnutls_record_get_direction(tc->sess) == 1) ||
-		    tc->state == STATE_TX_CONGESTION) {
-			iv_task_register(&tc->tx_task);
-		}
+	if (tc->ktls_rx == KTLS_PENDING && !tc->rx_rec_left &&
+	    !tc->rx_rec_hdr_bytes && tc->rx_start == tc->rx_end &&
+	    !tc->rx_eof && !gnutls_record_check_pending(tc->sess)) {
+		if (tconn_ktls_set_crypto(tc, TLS_RX) == 0)
+			tc->ktls_rx = KTLS_ACTIVE;
+		else
+			tc->ktls_rx = KTLS_OFF;
 	}
+}
 
-	tc->tx_bytes -= ret;
-	if (tc->tx_bytes)
-		memmove(tc->tx_buf, tc->tx_buf + ret, tc->tx_bytes);
-	else
-		iv_fd_set_handler_out(tc->fd, NULL);
+/*
+ * Egress queue.  Records are queued per traffic class.  Control
+ * records have strict priority, and the remaining classes share the
+ * link by deficit round robin.  Each class is managed with CoDel
+ * (RFC 8289): once records have been spending more than
+ * CODEL_TARGET_US in the queue for at least CODEL_INTERVAL_US, we
+ * start dropping records at dequeue time, at a rate that increases
+ * with the square root of the number of drops, until the queueing
+ * delay is back under the target.
+ */
+#define CODEL_TARGET_US		5000
+#define CODEL_INTERVAL_US	100000
+#define CODEL_MIN_BACKLOG	1500
 
-	verify_state(tc);
+#define DRR_QUANTUM		1514
+
+static const int class_quantum[TCONN_NUM_CLASSES] = {
+	[TCONN_CLASS_CONTROL]		= 0,
+	[TCONN_CLASS_INTERACTIVE]	= 2 * DRR_QUANTUM,
+	[TCONN_CLASS_BULK]		= DRR_QUANTUM,
+};
+
+struct tconn_txq_entry {
+	struct iv_list_head	list;
+	uint64_t		enqueued;
+	int			len;
+	uint8_t			data[0];
+};
+
+static int tconn_record_xmit(struct tconn *tc, const uint8_t *rec, int len);
+
+static uint64_t tconn_now_us(void)
+{
+	iv_validate_now();
+
+	return (uint64_t)iv_now.tv_sec * 1000000 + iv_now.tv_nsec / 1000;
 }
 
-static ssize_t
-tconn_gtls_push_func(gnutls_transport_ptr_t _tc, const void *buf, size_t len)
+static void tconn_txq_init(struct tconn *tc)
 {
-	struct tconn *tc = _tc;
-	int copied;
-	int tocopy;
+	int i;
 
-	if (tc->io_error) {
-		gnutls_transport_set_errno(tc->sess, tc->io_error);
-		return -1;
+	for (i = 0; i < TCONN_NUM_CLASSES; i++) {
+		struct tconn_txq_class *cl = &tc->txq[i];
+
+		INIT_IV_LIST_HEAD(&cl->queue);
+		cl->bytes = 0;
+		cl->deficit = 0;
+		cl->codel_dropping = 0;
+		cl->codel_count = 0;
+		cl->codel_lastcount = 0;
+		cl->codel_first_above = 0;
+		cl->codel_drop_next = 0;
+		memset(&cl->stats, 0, sizeof(cl->stats));
 	}
 
-	if (tc->tx_bytes == sizeof(tc->tx_buf)) {
-		gnutls_transport_set_errno(tc->sess, EAGAIN);
-		return -1;
+	tc->txq_bytes = 0;
+	tc->txq_drr_next = TCONN_CLASS_CONTROL + 1;
+}
+
+static void tconn_txq_enqueue(struct tconn *tc, int class,
+			      const uint8_t *rec, int len)
+{
+	struct tconn_txq_class *cl = &tc->txq[class];
+	struct tconn_txq_entry *e;
+	int limit;
+
+	limit = tc->txq_limit ? : TCONN_TXQ_DEFAULT_LIMIT;
+	if (tc->txq_bytes + len > limit) {
+		cl->stats.tail_drops++;
+		return;
 	}
 
-	copied = 0;
+	e = malloc(sizeof(*e) + len);
+	if (e == NULL) {
+		cl->stats.tail_drops++;
+		return;
+	}
 
-again:
-	tocopy = sizeof(tc->tx_buf) - tc->tx_bytes;
-	if (tocopy > len)
-		tocopy = len;
+	e->enqueued = tconn_now_us();
+	e->len = len;
+	memcpy(e->data, rec, len);
 
-	memcpy(tc->tx_buf + tc->tx_bytes, buf, tocopy);
-	tc->tx_bytes += tocopy;
-	copied += tocopy;
-	buf += tocopy;
-	len -= tocopy;
+	/*
+	 * A class that becomes backlogged starts its round with a full
+	 * quantum, and gives up whatever deficit it had left once its
+	 * queue has drained again (see tconn_txq_dequeue()).
+	 */
+	if (iv_list_empty(&cl->queue))
+		cl->deficit = class_quantum[class];
 
-	if (tc->fd->handler_out == NULL && tc->tx_bytes == sizeof(tc->tx_buf)) {
-		int ret;
+	iv_list_add_tail(&e->list, &cl->queue);
+	cl->bytes += len;
+	tc->txq_bytes += len;
+	cl->stats.enqueued++;
+}
 
-		do {
-			ret = send(tc->fd->fd, tc->tx_buf, tc->tx_bytes, 0);
-		} while (ret < 0 && errno == EINTR);
+static void tconn_txq_free(struct tconn *tc)
+{
+	int i;
 
-		if (ret < 0 && errno != EAGAIN) {
-			tc->io_error = errno;
-			gnutls_transport_set_errno(tc->sess, errno);
-			return -1;
+	for (i = 0; i < TCONN_NUM_CLASSES; i++) {
+		struct tconn_txq_class *cl = &tc->txq[i];
+
+		while (!iv_list_empty(&cl->queue)) {
+			struct tconn_txq_entry *e;
+
+			e = iv_container_of(cl->queue.next,
+					    struct tconn_txq_entry, list);
+			iv_list_del(&e->list);
+			free(e);
 		}
 
-		if (ret > 0) {
-			tc->tx_bytes -= ret;
-			if (tc->tx_bytes) {
-				memmove(tc->tx_buf, tc->tx_buf + ret,
-					tc->tx_bytes);
+		cl->bytes = 0;
+	}
+
+	tc->txq_bytes = 0;
+}
+
+static struct tconn_txq_entry *
+tconn_txq_pop(struct tconn *tc, struct tconn_txq_class *cl,
+	      uint64_t now, int *ok_to_drop)
+{
+	struct tconn_txq_entry *e;
+	uint64_t sojourn;
+
+	*ok_to_drop = 0;
+
+	if (iv_list_empty(&cl->queue)) {
+		cl->codel_first_above = 0;
+		return NULL;
+	}
+
+	e = iv_container_of(cl->queue.next, struct tconn_txq_entry, list);
+	iv_list_del(&e->list);
+	cl->bytes -= e->len;
+	tc->txq_bytes -= e->len;
+
+	sojourn = now - e->enqueued;
+	cl->stats.sojourn_us_total += sojourn;
+	if (sojourn > cl->stats.sojourn_us_max)
+		cl->stats.sojourn_us_max = sojourn;
+
+	if (sojourn < CODEL_TARGET_US || cl->bytes < CODEL_MIN_BACKLOG) {
+		cl->codel_first_above = 0;
+	} else if (cl->codel_first_above == 0) {
+		cl->codel_first_above = now + CODEL_INTERVAL_US;
+	} else if (now >= cl->codel_first_above) {
+		*ok_to_drop = 1;
+	}
+
+	return e;
+}
+
+static void tconn_txq_drop(struct tconn_txq_class *cl,
+			   struct tconn_txq_entry *e)
+{
+	cl->stats.codel_drops++;
+	free(e);
+}
+
+static uint32_t isqrt(uint64_t x)
+{
+	uint64_t r;
+	uint64_t bit;
+
+	r = 0;
+	for (bit = 1ULL << 62; bit > x; bit >>= 2)
+		;
+
+	while (bit) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+		bit >>= 2;
+	}
+
+	return r;
+}
+
+static uint64_t codel_control_law(uint64_t t, int count)
+{
+	return t + ((uint64_t)CODEL_INTERVAL_US << 8) /
+			isqrt((uint64_t)count << 16);
+}
+
+static struct tconn_txq_entry *
+tconn_txq_codel_dequeue(struct tconn *tc, struct tconn_txq_class *cl)
+{
+	struct tconn_txq_entry *e;
+	uint64_t now;
+	int ok_to_drop;
+
+	now = tconn_now_us();
+
+	e = tconn_txq_pop(tc, cl, now, &ok_to_drop);
+	if (e == NULL) {
+		cl->codel_dropping = 0;
+		return NULL;
+	}
+
+	if (cl->codel_dropping) {
+		if (!ok_to_drop) {
+			cl->codel_dropping = 0;
+		} else {
+			while (now >= cl->codel_drop_next &&
+			       cl->codel_dropping) {
+				tconn_txq_drop(cl, e);
+				cl->codel_count++;
+
+				e = tconn_txq_pop(tc, cl, now, &ok_to_drop);
+				if (e == NULL || !ok_to_drop) {
+					cl->codel_dropping = 0;
+				} else {
+					cl->codel_drop_next = codel_control_law(
+						cl->codel_drop_next,
+						cl->codel_count);
+				}
 			}
 		}
+	} else if (ok_to_drop) {
+		int delta;
 
-		if (tc->tx_bytes)
-			iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
+		tconn_txq_drop(cl, e);
+		e = tconn_txq_pop(tc, cl, now, &ok_to_drop);
 
-		if (len && tc->tx_bytes < sizeof(tc->tx_buf))
-			goto again;
+		cl->codel_dropping = 1;
+
+		delta = cl->codel_count - cl->codel_lastcount;
+		if (delta > 1 &&
+		    now - cl->codel_drop_next < 16 * CODEL_INTERVAL_US) {
+			cl->codel_count = delta;
+		} else {
+			cl->codel_count = 1;
+		}
+		cl->codel_drop_next = codel_control_law(now, cl->codel_count);
+		cl->codel_lastcount = cl->codel_count;
+	}
+
+	if (e != NULL)
+		cl->stats.dequeued++;
+
+	return e;
+}
+
+/*
+ * Puts a record that CoDel let through back at the head of its queue,
+ * for when it doesn't fit in its class's deficit after all.
+ */
+static void tconn_txq_requeue(struct tconn *tc, struct tconn_txq_class *cl,
+			      struct tconn_txq_entry *e)
+{
+	iv_list_add(&e->list, &cl->queue);
+	cl->bytes += e->len;
+	tc->txq_bytes += e->len;
+	cl->stats.dequeued--;
+}
+
+static struct tconn_txq_entry *tconn_txq_dequeue(struct tconn *tc)
+{
+	struct tconn_txq_class *cl;
+	struct tconn_txq_entry *e;
+
+	cl = &tc->txq[TCONN_CLASS_CONTROL];
+	if (!iv_list_empty(&cl->queue)) {
+		e = tconn_txq_codel_dequeue(tc, cl);
+		if (e != NULL)
+			return e;
+	}
+
+	/*
+	 * Deficit round robin: the class whose turn it is sends records
+	 * for as long as the record at the head of its queue fits in its
+	 * deficit, and once it doesn't, the class gets another quantum
+	 * and the turn passes to the next class.  CoDel may drop the
+	 * head record and hand us a larger one from behind it, which is
+	 * then put back to wait for the class's next turn.
+	 */
+	while (tc->txq_bytes) {
+		cl = &tc->txq[tc->txq_drr_next];
+
+		if (!iv_list_empty(&cl->queue)) {
+			e = iv_container_of(cl->queue.next,
+					    struct tconn_txq_entry, list);
+			if (e->len <= cl->deficit) {
+				e = tconn_txq_codel_dequeue(tc, cl);
+				if (e != NULL && e->len <= cl->deficit) {
+					cl->deficit -= e->len;
+					if (iv_list_empty(&cl->queue))
+						cl->deficit = 0;
+					return e;
+				}
+				if (e != NULL) {
+					tconn_txq_requeue(tc, cl, e);
+					cl->deficit +=
+					    class_quantum[tc->txq_drr_next];
+				}
+			} else {
+				cl->deficit += class_quantum[tc->txq_drr_next];
+			}
+		}
+
+		if (iv_list_empty(&cl->queue))
+			cl->deficit = 0;
+
+		tc->txq_drr_next++;
+		if (tc->txq_drr_next == TCONN_NUM_CLASSES)
+			tc->txq_drr_next = TCONN_CLASS_CONTROL + 1;
 	}
 
-	return copied;
+	return NULL;
 }
 
-static int tconn_tx_flush(struct tconn *tc)
+/*
+ * Called whenever we leave STATE_TX_CONGESTION, to send queued records
+ * until either the queue is empty or the socket is congested again.
+ * Returns -1 if the connection was lost, in which case the tconn may
+ * no longer be touched.
+ */
+static int tconn_txq_drain(struct tconn *tc)
 {
+	while (tc->state == STATE_RUNNING) {
+		struct tconn_txq_entry *e;
+		int ret;
+
+		e = tconn_txq_dequeue(tc);
+		if (e == NULL)
+			break;
+
+		ret = tconn_record_xmit(tc, e->data, e->len);
+		free(e);
+
+		if (ret < 0) {
+			tc->connection_lost(tc->cookie);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void tconn_fd_handler_out(void *_tc)
+{
+	struct tconn *tc = _tc;
+	struct iovec iov[2];
 	int ret;
 
-	if (tc->io_error)
-		return 1;
+	verify_state(tc);
 
-	if (tc->fd->handler_out != NULL || tc->tx_bytes == 0)
-		return 0;
+	ret = tconn_sendmsg(tc, iov, tconn_tx_queue_iov(tc, iov));
+	if (ret < 0) {
+		if (errno != EAGAIN) {
+			tc->io_error = errno;
+			got_io_error(tc);
+		}
+
+		verify_state(tc);
+
+		return;
+	}
+
+	if (tc->tx_bytes == sizeof(tc->tx_buf) && tc->ktls_tx != KTLS_ACTIVE) {
+		if ((tc->state == STATE_HANDSHAKE &&
+		     gnutls_record_get_direction(tc->sess) == 1) ||
+		    tc->state == STATE_TX_CONGESTION) {
+			iv_task_register(&tc->tx_task);
+		}
+	}
+
+	tconn_tx_queue_consume(tc, ret);
+	if (!tc->tx_bytes) {
+		iv_fd_set_handler_out(tc->fd, NULL);
+		if (tc->ktls_tx == KTLS_ACTIVE) {
+			tc->state = STATE_RUNNING;
+			if (tconn_txq_drain(tc) < 0)
+				return;
+		} else if (tc->ktls_tx == KTLS_PENDING) {
+			tconn_ktls_try(tc);
+		}
+	}
+
+	verify_state(tc);
+}
+
+/*
+ * gnutls hands us its record buffers as a list of iovecs.  If nothing
+ * is queued, we try to push these out to the socket directly, and we
+ * only copy whatever the socket didn't accept into our transmit queue.
+ * Whenever the transmit queue is non-empty, we have POLLOUT scheduled.
+ */
+static ssize_t tconn_gtls_vec_push_func(gnutls_transport_ptr_t _tc,
+					const giovec_t *iov, int iovcnt)
+{
+	struct tconn *tc = _tc;
+	int sent;
+	int skip;
+	int queued;
+	int i;
+
+	if (tc->io_error) {
+		gnutls_transport_set_errno(tc->sess, tc->io_error);
+		return -1;
+	}
 
-	do {
-		ret = send(tc->fd->fd, tc->tx_buf, tc->tx_bytes, 0);
-	} while (ret < 0 && errno == EINTR);
+	if (tc->tx_bytes == sizeof(tc->tx_buf)) {
+		gnutls_transport_set_errno(tc->sess, EAGAIN);
+		return -1;
+	}
 
-	if (ret < 0) {
-		if (errno == EAGAIN) {
-			iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
-			return 0;
+	sent = 0;
+	if (!tc->tx_bytes) {
+		sent = tconn_sendmsg(tc, (struct iovec *)iov, iovcnt);
+		if (sent < 0) {
+			if (errno != EAGAIN) {
+				tc->io_error = errno;
+				gnutls_transport_set_errno(tc->sess, errno);
+				return -1;
+			}
+			sent = 0;
 		}
+	}
 
-		tc->io_error = errno;
+	skip = sent;
+	queued = 0;
+	for (i = 0; i < iovcnt && tc->tx_bytes < sizeof(tc->tx_buf); i++) {
+		const uint8_t *base = iov[i].iov_base;
+		int len = iov[i].iov_len;
 
-		return 1;
-	}
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
 
-	tc->tx_bytes -= ret;
-	if (tc->tx_bytes) {
-		memmove(tc->tx_buf, tc->tx_buf + ret, tc->tx_bytes);
-		iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
+		queued += tconn_tx_queue_append(tc, base + skip, len - skip);
+		skip = 0;
 	}
 
-	return 0;
-}
+	if (tc->tx_bytes && tc->fd->handler_out == NULL && tc->hs_job == NULL)
+		iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
 
-static void gtls_perror(const char *str, int error)
-{
-	fprintf(stderr, "%s: %s\n", str, gnutls_strerror(error));
+	return sent + queued;
 }
 
 static void tconn_connection_abort(struct tconn *tc, int notify_err)
@@ -420,16 +1073,13 @@ static void tconn_connection_abort(struct tconn *tc, int notify_err)
 		tc->connection_lost(tc->cookie);
 }
 
-static int tconn_do_handshake(struct tconn *tc, int notify_err)
+static int tconn_verify_cert(gnutls_session_t sess);
+
+static int tconn_handshake_result(struct tconn *tc, int ret, int notify_err)
 {
 	char *desc;
-	int ret;
 	int i;
 
-	ret = gnutls_handshake(tc->sess);
-	if ((!ret || ret == GNUTLS_E_AGAIN) && tconn_tx_flush(tc))
-		ret = gnutls_handshake(tc->sess);
-
 	if (ret) {
 		if (ret != GNUTLS_E_AGAIN) {
 			gtls_perror("gnutls_handshake", ret);
@@ -440,10 +1090,43 @@ static int tconn_do_handshake(struct tconn *tc, int notify_err)
 		return 0;
 	}
 
+	/*
+	 * No certificates are exchanged when a session is resumed, so
+	 * verify the key IDs in the certificates that were presented
+	 * when the session was first established.
+	 */
+	if (gnutls_session_is_resumed(tc->sess) &&
+	    tconn_verify_cert(tc->sess)) {
+		fprintf(stderr, "tconn: key ID verification failed for "
+				"resumed session\n");
+		tconn_connection_abort(tc, notify_err);
+		return -1;
+	}
+
+	if (!tc->num_peer_ids ||
+	    tc->verify_key_ids(tc->cookie, tc->peer_ids, tc->num_peer_ids)) {
+		tconn_connection_abort(tc, notify_err);
+		return -1;
+	}
+
 	gnutls_record_disable_padding(tc->sess);
 
 	tc->state = STATE_RUNNING;
 
+	if (tc->ktls_tx == KTLS_PENDING && !tconn_ktls_supported(tc)) {
+		fprintf(stderr, "tconn: kernel TLS not available, "
+				"using userspace TLS\n");
+		tc->ktls_tx = KTLS_OFF;
+		tc->ktls_rx = KTLS_OFF;
+	}
+
+	if (tc->ktls_tx == KTLS_PENDING && !tconn_peer_reassembles_frames(tc)) {
+		fprintf(stderr, "tconn: peer doesn't reassemble frames, "
+				"using userspace TLS for transmit\n");
+		tc->ktls_tx = KTLS_OFF;
+	}
+	tconn_ktls_try(tc);
+
 	if (gnutls_record_check_pending(tc->sess) ||
 	    tc->rx_start != tc->rx_end || tc->rx_eof)
 		iv_task_register(&tc->rx_task);
@@ -456,13 +1139,213 @@ static int tconn_do_handshake(struct tconn *tc, int notify_err)
 		abort();
 	}
 
+	/*
+	 * Keep the amount of unsent data in the socket small, so that
+	 * congestion builds up in our egress queue, where we can
+	 * prioritise control traffic, rather than in the socket buffer.
+	 */
+	i = TCONN_NOTSENT_LOWAT;
+	if (setsockopt(tc->fd->fd, SOL_TCP, TCP_NOTSENT_LOWAT,
+		       &i, sizeof(i)) < 0) {
+		perror("setsockopt(SOL_TCP, TCP_NOTSENT_LOWAT)");
+	}
+
 	desc = gnutls_session_get_desc(tc->sess);
-	tc->handshake_done(tc->cookie, desc);
+	ret = tc->handshake_done(tc->cookie, desc);
 	gnutls_free(desc);
 
+	if (ret) {
+		tconn_connection_abort(tc, notify_err);
+		return -1;
+	}
+
 	return 0;
 }
 
+static int tconn_do_handshake(struct tconn *tc, int notify_err)
+{
+	return tconn_handshake_result(tc, gnutls_handshake(tc->sess),
+				      notify_err);
+}
+
+/*
+ * Handshake offload.  After the first flight, handshake steps, which
+ * include the expensive public key operations and the parsing and
+ * hashing of the peer's certificates, are run on a per-thread work
+ * pool, so that they don't hold up the event loop and the other
+ * connections that it serves.
+ *
+ * While a step is in flight, the session and our buffers belong to
+ * the pool thread: we don't poll the socket, no tasks are registered,
+ * and the transport functions don't touch any ivykis state.  Once the
+ * step completes, the completion handler restores the poll state and
+ * processes the result on the event loop thread, just as if the step
+ * had been run inline.
+ */
+#define HS_JOB_QUEUED		0
+#define HS_JOB_RUNNING		1
+#define HS_JOB_DONE		2
+#define HS_JOB_CANCELLED	3
+
+struct tconn_hs_job {
+	struct tconn		*tc;
+	struct iv_work_item	work;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	int			state;
+	int			ret;
+};
+
+struct tconn_hs_thr_info {
+	int			num_jobs;
+	struct iv_work_pool	pool;
+};
+
+static void tconn_hs_tls_init_thread(void *_tinfo)
+{
+	struct tconn_hs_thr_info *tinfo = _tinfo;
+	long cpus;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	tinfo->num_jobs = 0;
+
+	IV_WORK_POOL_INIT(&tinfo->pool);
+	tinfo->pool.max_threads = (cpus > 0) ? cpus : 1;
+	tinfo->pool.cookie = NULL;
+	tinfo->pool.thread_start = NULL;
+	tinfo->pool.thread_stop = NULL;
+}
+
+static struct iv_tls_user tconn_hs_tls_user = {
+	.sizeof_state	= sizeof(struct tconn_hs_thr_info),
+	.init_thread	= tconn_hs_tls_init_thread,
+};
+
+static void tconn_hs_tls_init(void) __attribute__((constructor));
+static void tconn_hs_tls_init(void)
+{
+	iv_tls_user_register(&tconn_hs_tls_user);
+}
+
+static void tconn_hs_job_work(void *_job)
+{
+	struct tconn_hs_job *job = _job;
+	int ret;
+
+	pthread_mutex_lock(&job->lock);
+	if (job->state == HS_JOB_CANCELLED) {
+		pthread_mutex_unlock(&job->lock);
+		return;
+	}
+	job->state = HS_JOB_RUNNING;
+	pthread_mutex_unlock(&job->lock);
+
+	ret = gnutls_handshake(job->tc->sess);
+
+	pthread_mutex_lock(&job->lock);
+	job->ret = ret;
+	job->state = HS_JOB_DONE;
+	pthread_cond_broadcast(&job->cond);
+	pthread_mutex_unlock(&job->lock);
+}
+
+static void tconn_hs_job_free(struct tconn_hs_job *job)
+{
+	struct tconn_hs_thr_info *tinfo;
+
+	pthread_mutex_destroy(&job->lock);
+	pthread_cond_destroy(&job->cond);
+	free(job);
+
+	tinfo = iv_tls_user_ptr(&tconn_hs_tls_user);
+	if (!--tinfo->num_jobs)
+		iv_work_pool_put(&tinfo->pool);
+}
+
+static void tconn_hs_job_complete(void *_job)
+{
+	struct tconn_hs_job *job = _job;
+	struct tconn *tc = job->tc;
+	int ret = job->ret;
+
+	tconn_hs_job_free(job);
+
+	if (tc == NULL)
+		return;
+
+	tc->hs_job = NULL;
+
+	if (!tc->io_error) {
+		if (tc->rx_start == tc->rx_end && !tc->rx_eof)
+			iv_fd_set_handler_in(tc->fd, tconn_fd_handler_in);
+		if (tc->tx_bytes)
+			iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
+	}
+
+	tconn_handshake_result(tc, ret, 1);
+}
+
+static void tconn_handshake_submit(struct tconn *tc)
+{
+	struct tconn_hs_thr_info *tinfo;
+	struct tconn_hs_job *job;
+
+	job = malloc(sizeof(*job));
+	if (job == NULL) {
+		tconn_do_handshake(tc, 1);
+		return;
+	}
+
+	iv_fd_set_handler_in(tc->fd, NULL);
+	iv_fd_set_handler_out(tc->fd, NULL);
+
+	if (iv_task_registered(&tc->rx_task))
+		iv_task_unregister(&tc->rx_task);
+
+	if (iv_task_registered(&tc->tx_task))
+		iv_task_unregister(&tc->tx_task);
+
+	job->tc = tc;
+	IV_WORK_ITEM_INIT(&job->work);
+	job->work.cookie = job;
+	job->work.work = tconn_hs_job_work;
+	job->work.completion = tconn_hs_job_complete;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+	job->state = HS_JOB_QUEUED;
+	job->ret = 0;
+
+	tc->hs_job = job;
+
+	tinfo = iv_tls_user_ptr(&tconn_hs_tls_user);
+	if (!tinfo->num_jobs++)
+		iv_work_pool_create(&tinfo->pool);
+
+	iv_work_pool_submit_work(&tinfo->pool, &job->work);
+}
+
+/*
+ * If the connection is torn down while a handshake step is in
+ * flight, we either cancel the step if it hasn't started yet, or
+ * wait for it to finish, after which the job is detached from the
+ * connection and freed by its completion handler.
+ */
+static void tconn_handshake_cancel(struct tconn *tc)
+{
+	struct tconn_hs_job *job = tc->hs_job;
+
+	pthread_mutex_lock(&job->lock);
+	if (job->state == HS_JOB_QUEUED)
+		job->state = HS_JOB_CANCELLED;
+	while (job->state == HS_JOB_RUNNING)
+		pthread_cond_wait(&job->cond, &job->lock);
+	job->tc = NULL;
+	pthread_mutex_unlock(&job->lock);
+
+	tc->hs_job = NULL;
+}
+
 static void tconn_do_record_recv(struct tconn *tc)
 {
 	uint8_t buf[32768];
@@ -471,6 +1354,14 @@ static void tconn_do_record_recv(struct tconn *tc)
 	ret = gnutls_record_recv(tc->sess, buf, sizeof(buf));
 
 	if (ret == GNUTLS_E_AGAIN) {
+		/*
+		 * gnutls also returns GNUTLS_E_AGAIN after processing a
+		 * post-handshake message, such as a TLS 1.3 session
+		 * ticket, even if there is more input waiting.
+		 */
+		if (gnutls_record_check_pending(tc->sess) ||
+		    tc->rx_start != tc->rx_end || tc->rx_eof)
+			iv_task_register(&tc->rx_task);
 		verify_state(tc);
 		return;
 	}
@@ -485,14 +1376,65 @@ static void tconn_do_record_recv(struct tconn *tc)
 	if (gnutls_record_check_pending(tc->sess) ||
 	    tc->rx_start != tc->rx_end || tc->rx_eof)
 		iv_task_register(&tc->rx_task);
+	else if (tc->ktls_rx == KTLS_PENDING)
+		tconn_ktls_try(tc);
 
 	verify_state(tc);
 
 	if (ret == GNUTLS_E_REHANDSHAKE) {
 		fprintf(stderr, "received HelloRequest\n");
 	} else {
-		tc->record_received(tc->cookie, buf, ret);
+		tconn_rx_frames(tc, buf, ret);
+	}
+}
+
+static int frame_len(const uint8_t *f)
+{
+	return 3 + ((f[1] << 8) | f[2]);
+}
+
+/*
+ * Frames may span TLS records (and, with kTLS, record boundaries
+ * aren't visible to us at all), so we hand complete frames up to
+ * our user, and hang on to any trailing partial frame.
+ */
+static void tconn_rx_frames(struct tconn *tc, const uint8_t *buf, int len)
+{
+	int off;
+
+	while (tc->rx_frame_bytes && len) {
+		int need;
+
+		if (tc->rx_frame_bytes < 3)
+			need = 3 - tc->rx_frame_bytes;
+		else
+			need = frame_len(tc->rx_frame) - tc->rx_frame_bytes;
+
+		if (need > len)
+			need = len;
+
+		memcpy(tc->rx_frame + tc->rx_frame_bytes, buf, need);
+		tc->rx_frame_bytes += need;
+		buf += need;
+		len -= need;
+
+		if (tc->rx_frame_bytes >= 3 &&
+		    tc->rx_frame_bytes == frame_len(tc->rx_frame)) {
+			tc->record_received(tc->cookie, tc->rx_frame,
+					    tc->rx_frame_bytes);
+			tc->rx_frame_bytes = 0;
+		}
 	}
+
+	off = 0;
+	while (len - off >= 3 && len - off >= frame_len(buf + off))
+		off += frame_len(buf + off);
+
+	if (off)
+		tc->record_received(tc->cookie, buf, off);
+
+	memcpy(tc->rx_frame, buf + off, len - off);
+	tc->rx_frame_bytes = len - off;
 }
 
 static void tconn_do_record_send(struct tconn *tc)
@@ -500,8 +1442,6 @@ static void tconn_do_record_send(struct tconn *tc)
 	int ret;
 
 	ret = gnutls_record_send(tc->sess, NULL, 0);
-	if ((ret > 0 || ret == GNUTLS_E_AGAIN) && tconn_tx_flush(tc))
-		ret = gnutls_record_send(tc->sess, NULL, 0);
 
 	if (ret == GNUTLS_E_AGAIN) {
 		verify_state(tc);
@@ -518,6 +1458,10 @@ static void tconn_do_record_send(struct tconn *tc)
 
 	if (tc->state == STATE_TX_CONGESTION) {
 		tc->state = STATE_RUNNING;
+		if (tconn_txq_drain(tc) < 0)
+			return;
+		if (tc->ktls_tx == KTLS_PENDING)
+			tconn_ktls_try(tc);
 		verify_state(tc);
 	} else {
 		fprintf(stderr, "handle_record_send: called in state %d\n",
@@ -533,7 +1477,7 @@ static void tconn_rx_task_handler(void *_tc)
 	if (tc->state == STATE_HANDSHAKE &&
 	    gnutls_record_get_direction(tc->sess) == 0 &&
 	    (tc->io_error || tc->rx_start != tc->rx_end || tc->rx_eof)) {
-		tconn_do_handshake(tc, 1);
+		tconn_handshake_submit(tc);
 		return;
 	}
 
@@ -554,7 +1498,7 @@ static void tconn_tx_task_handler(void *_tc)
 	if (tc->state == STATE_HANDSHAKE &&
 	    gnutls_record_get_direction(tc->sess) == 1 &&
 	    (tc->io_error || tc->tx_bytes < sizeof(tc->tx_buf))) {
-		tconn_do_handshake(tc, 1);
+		tconn_handshake_submit(tc);
 		return;
 	}
 
@@ -595,6 +1539,12 @@ static int cert_refers_to_nodeid(gnutls_x509_crt_t cert, uint8_t *nodeid)
 	return 1;
 }
 
+/*
+ * This runs on the handshake pool, so it only extracts the key IDs
+ * from the peer's certificates, and ->verify_key_ids() is called from
+ * the event loop once the handshake has completed.  No application
+ * data is exchanged before then.
+ */
 static int tconn_verify_cert(gnutls_session_t sess)
 {
 	struct tconn *tc = gnutls_transport_get_ptr(sess);
@@ -602,7 +1552,6 @@ static int tconn_verify_cert(gnutls_session_t sess)
 	unsigned int num_certs;
 	uint8_t *nodeids;
 	gnutls_x509_crt_t cert;
-	gnutls_pubkey_t key;
 	int i;
 	int ret;
 	int j;
@@ -623,11 +1572,6 @@ static int tconn_verify_cert(gnutls_session_t sess)
 		goto err_free_ids;
 	}
 
-	ret = gnutls_pubkey_init(&key);
-	if (ret) {
-		gtls_perror("gnutls_pubkey_init", ret);
-		goto err_free_crt;
-	}
 
 	/*
 	 * TBD: @@@
@@ -636,44 +1580,38 @@ static int tconn_verify_cert(gnutls_session_t sess)
 	 * - check validity in case of non self signed certificate
 	 */
 	for (i = 0, j = 0 ; i < num_certs; i++) {
-		uint8_t id[NODE_ID_LEN];
+		struct pubkey_cache_entry *pk;
 
 		ret = gnutls_x509_crt_import(cert, &certs[i],
 					     GNUTLS_X509_FMT_DER);
 		if (ret) {
 			gtls_perror("gnutls_x509_crt_import", ret);
-			goto err_free_key;
-		}
-
-		ret = gnutls_pubkey_import_x509(key, cert, 0);
-		if (ret) {
-			gtls_perror("gnutls_pubkey_import_x509", ret);
-			goto err_free_key;
+			goto err_free_crt;
 		}
 
-		ret = get_pubkey_id(id, key);
-		if (ret) {
-			gtls_perror("get_pubkey_id", ret);
-			goto err_free_key;
+		pk = pubkey_cache_get_crt(cert);
+		if (pk == NULL) {
+			fprintf(stderr, "tconn_verify_cert: error getting "
+					"public key\n");
+			goto err_free_crt;
 		}
 
 		if (i == 0 || cert_refers_to_nodeid(cert, nodeids)) {
-			memcpy(nodeids + (j * NODE_ID_LEN), id, NODE_ID_LEN);
+			memcpy(nodeids + (j * NODE_ID_LEN), pk->id,
+			       NODE_ID_LEN);
 			j++;
 		}
+
+		pubkey_cache_put(pk);
 	}
 
 	gnutls_x509_crt_deinit(cert);
-	gnutls_pubkey_deinit(key);
-
-	ret = tc->verify_key_ids(tc->cookie, nodeids, j);
-
-	free(nodeids);
 
-	return ret;
+	free(tc->peer_ids);
+	tc->peer_ids = nodeids;
+	tc->num_peer_ids = j;
 
-err_free_key:
-	gnutls_pubkey_deinit(key);
+	return 0;
 
 err_free_crt:
 	gnutls_x509_crt_deinit(cert);
@@ -728,14 +1666,16 @@ err:
 
 int tconn_start(struct tconn *tc)
 {
-	static char prio[] =
-		"NONE:+CIPHER-ALL:+ECDHE-RSA:+MAC-ALL:+COMP-NULL:"
-		"+VERS-TLS1.2:+SIGN-ALL:+CURVE-SECP256R1:%SAFE_RENEGOTIATION";
+	char *prio;
 	unsigned int flags;
 	int ret;
 	const char *err;
 
-	flags = GNUTLS_NONBLOCK | GNUTLS_NO_EXTENSIONS;
+	prio = tls_prio_get(tc->ciphers, tc->ktls);
+	if (prio == NULL)
+		goto err;
+
+	flags = GNUTLS_NONBLOCK;
 	if (tc->role == TCONN_ROLE_SERVER)
 		flags |= GNUTLS_SERVER;
 	else
@@ -744,6 +1684,7 @@ int tconn_start(struct tconn *tc)
 	ret = gnutls_init(&tc->sess, flags);
 	if (ret) {
 		gtls_perror("gnutls_init", ret);
+		free(prio);
 		goto err;
 	}
 
@@ -751,6 +1692,20 @@ int tconn_start(struct tconn *tc)
 		gnutls_certificate_server_set_request(tc->sess,
 						      GNUTLS_CERT_REQUIRE);
 		gnutls_certificate_send_x509_rdn_sequence(tc->sess, 1);
+
+		if (tc->ticket_key != NULL) {
+			ret = gnutls_session_ticket_enable_server(tc->sess,
+							tc->ticket_key);
+			if (ret)
+				gtls_perror("gnutls_session_ticket_enable_server",
+					    ret);
+		}
+	} else if (tc->session_data != NULL) {
+		ret = gnutls_session_set_data(tc->sess,
+					      tc->session_data->data,
+					      tc->session_data->size);
+		if (ret)
+			gtls_perror("gnutls_session_set_data", ret);
 	}
 
 	ret = gnutls_priority_set_direct(tc->sess, prio, &err);
@@ -764,12 +1719,20 @@ int tconn_start(struct tconn *tc)
 			fprintf(stderr, " ");
 		fprintf(stderr, "^ error in priority string\n");
 
+		free(prio);
 		goto err_deinit;
 	}
 
+	free(prio);
+
+	ret = gnutls_alpn_set_protocols(tc->sess, &tconn_alpn_frames, 1, 0);
+	if (ret)
+		gtls_perror("gnutls_alpn_set_protocols", ret);
+
 	gnutls_transport_set_ptr(tc->sess, tc);
 	gnutls_transport_set_pull_function(tc->sess, tconn_gtls_pull_func);
-	gnutls_transport_set_push_function(tc->sess, tconn_gtls_push_func);
+	gnutls_transport_set_vec_push_function(tc->sess,
+					       tconn_gtls_vec_push_func);
 
 	tc->fd->cookie = tc;
 	iv_fd_set_handler_in(tc->fd, tconn_fd_handler_in);
@@ -784,12 +1747,25 @@ int tconn_start(struct tconn *tc)
 	tc->rx_start = 0;
 	tc->rx_end = 0;
 	tc->rx_eof = 0;
+	tc->rx_rec_hdr_bytes = 0;
+	tc->rx_rec_left = 0;
+	tc->rx_frame_bytes = 0;
 
 	IV_TASK_INIT(&tc->tx_task);
 	tc->tx_task.cookie = tc;
 	tc->tx_task.handler = tconn_tx_task_handler;
+	tc->tx_start = 0;
 	tc->tx_bytes = 0;
 
+	tconn_txq_init(tc);
+
+	tc->hs_job = NULL;
+	tc->peer_ids = NULL;
+	tc->num_peer_ids = 0;
+
+	tc->ktls_tx = tc->ktls ? KTLS_PENDING : KTLS_OFF;
+	tc->ktls_rx = tc->ktls_tx;
+
 	ret = tconn_start_handshake(tc);
 	if (ret)
 		goto err_deinit;
@@ -805,7 +1781,10 @@ err:
 
 void tconn_destroy(struct tconn *tc)
 {
-	verify_state(tc);
+	if (tc->hs_job != NULL)
+		tconn_handshake_cancel(tc);
+	else
+		verify_state(tc);
 
 	iv_fd_set_handler_in(tc->fd, NULL);
 	iv_fd_set_handler_out(tc->fd, NULL);
@@ -819,37 +1798,180 @@ void tconn_destroy(struct tconn *tc)
 
 	if (iv_task_registered(&tc->tx_task))
 		iv_task_unregister(&tc->tx_task);
+
+	tconn_txq_free(tc);
+
+	free(tc->peer_ids);
 }
 
-int tconn_record_send(struct tconn *tc, const uint8_t *rec, int len)
+/*
+ * The kernel may split what we pass it across several TLS records
+ * under memory pressure, which is fine as our peer reassembles frames.
+ * Whatever the socket doesn't take goes onto the transmit queue, and
+ * until that has drained, records go onto the egress queue as in the
+ * userspace case.
+ */
+static int tconn_ktls_record_send(struct tconn *tc, const uint8_t *rec, int len)
 {
+	struct iovec iov;
 	int ret;
 
+	iov.iov_base = (void *)rec;
+	iov.iov_len = len;
+
+	ret = tconn_sendmsg(tc, &iov, 1);
+	if (ret < 0) {
+		if (errno != EAGAIN) {
+			perror("tconn_ktls_record_send: sendmsg");
+			tconn_connection_abort(tc, 0);
+			return -1;
+		}
+		ret = 0;
+	}
+
+	if (ret < len) {
+		tconn_tx_queue_append(tc, rec + ret, len - ret);
+		iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
+		tc->state = STATE_TX_CONGESTION;
+	}
+
 	verify_state(tc);
 
-	if (tc->state == STATE_TX_CONGESTION) {
-		return 0;
-	} else if (tc->state != STATE_RUNNING) {
-		fprintf(stderr, "got packet in [%d]\n", tc->state);
+	return 0;
+}
+
+int tconn_export_keys(struct tconn *tc, const char *label,
+		      uint8_t *buf, int len)
+{
+	int ret;
+
+	ret = gnutls_prf_rfc5705(tc->sess, strlen(label), label,
+				 0, NULL, len, (char *)buf);
+	if (ret < 0) {
+		gtls_perror("gnutls_prf_rfc5705", ret);
 		return -1;
 	}
 
-	ret = gnutls_record_send(tc->sess, rec, len);
-	if ((ret > 0 || ret == GNUTLS_E_AGAIN) && tconn_tx_flush(tc))
-		ret = gnutls_record_send(tc->sess, NULL, 0);
+	return 0;
+}
+
+gnutls_cipher_algorithm_t tconn_get_cipher(struct tconn *tc)
+{
+	return gnutls_cipher_get(tc->sess);
+}
+
+int tconn_get_session_data(struct tconn *tc, gnutls_datum_t *data)
+{
+	int ret;
 
-	if (ret < 0 && ret != GNUTLS_E_AGAIN) {
-		gtls_perror("gnutls_record_send", ret);
-		tconn_connection_abort(tc, 0);
+	if (tc->role != TCONN_ROLE_CLIENT || tc->state == STATE_HANDSHAKE)
+		return -1;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+	/*
+	 * TLS 1.3 session tickets are sent after the handshake, and
+	 * until one has arrived, there is nothing to resume.
+	 */
+	if (gnutls_protocol_get_version(tc->sess) == GNUTLS_TLS1_3 &&
+	    !(gnutls_session_get_flags(tc->sess) & GNUTLS_SFLAGS_SESSION_TICKET))
+		return -1;
+#endif
+
+	ret = gnutls_session_get_data2(tc->sess, data);
+	if (ret) {
+		gtls_perror("gnutls_session_get_data2", ret);
 		return -1;
 	}
 
-	if (ret == GNUTLS_E_AGAIN)
-		tc->state = STATE_TX_CONGESTION;
+	return 0;
+}
 
-	// @@@ handle fewer bytes having been sent than passed in
+static int tconn_record_xmit(struct tconn *tc, const uint8_t *rec, int len)
+{
+	int ret;
+
+	if (tc->ktls_tx == KTLS_ACTIVE)
+		return tconn_ktls_record_send(tc, rec, len);
+
+	if (len <= TCONN_MAX_RECORD) {
+		ret = gnutls_record_send(tc->sess, rec, len);
+
+		if (ret < 0 && ret != GNUTLS_E_AGAIN) {
+			gtls_perror("gnutls_record_send", ret);
+			tconn_connection_abort(tc, 0);
+			return -1;
+		}
+
+		if (ret == GNUTLS_E_AGAIN)
+			tc->state = STATE_TX_CONGESTION;
+
+		verify_state(tc);
+
+		return 0;
+	}
+
+	/*
+	 * Frames that don't fit in a single TLS record are split across
+	 * several records, and as our peer reassembles frames, either all
+	 * of those records have to go out or none of them.  Our transport
+	 * function never fails while the transmit queue has room, so drop
+	 * the frame if the queue can't take all of its records.
+	 */
+	if (sizeof(tc->tx_buf) - tc->tx_bytes <
+	    len + (len / TCONN_MAX_RECORD + 1) * TCONN_RECORD_OVERHEAD) {
+		tc->txq[TCONN_CLASS_BULK].stats.tail_drops++;
+		return 0;
+	}
+
+	while (len) {
+		int chunk;
+
+		chunk = len;
+		if (chunk > TCONN_MAX_RECORD)
+			chunk = TCONN_MAX_RECORD;
+
+		ret = gnutls_record_send(tc->sess, rec, chunk);
+		if (ret != chunk) {
+			if (ret < 0)
+				gtls_perror("gnutls_record_send", ret);
+			tconn_connection_abort(tc, 0);
+			return -1;
+		}
+
+		rec += chunk;
+		len -= chunk;
+	}
 
 	verify_state(tc);
 
 	return 0;
 }
+
+int tconn_record_send(struct tconn *tc, int class,
+		      const uint8_t *rec, int len)
+{
+	verify_state(tc);
+
+	if (class < 0 || class >= TCONN_NUM_CLASSES)
+		class = TCONN_CLASS_BULK;
+
+	if (tc->state == STATE_TX_CONGESTION) {
+		tconn_txq_enqueue(tc, class, rec, len);
+		return 0;
+	} else if (tc->state != STATE_RUNNING) {
+		fprintf(stderr, "got packet in [%d]\n", tc->state);
+		return -1;
+	}
+
+	return tconn_record_xmit(tc, rec, len);
+}
+
+void tconn_get_txq_stats(struct tconn *tc, struct tconn_txq_stats *st)
+{
+	int i;
+
+	for (i = 0; i < TCONN_NUM_CLASSES; i++) {
+		st[i] = tc->txq[i].stats;
+		st[i].backlog = tc->txq[i].bytes;
+	}
+}
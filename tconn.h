@@ -22,8 +22,42 @@
 
 #include <gnutls/gnutls.h>
 #include <iv.h>
+#include <iv_list.h>
 #include <stdint.h>
 
+/*
+ * Traffic classes for the egress queue.  Control records (keepalives,
+ * routing protocol traffic) have strict priority over the others, and
+ * the interactive and bulk classes are scheduled by deficit round
+ * robin, with interactive traffic getting the larger share.
+ */
+#define TCONN_CLASS_CONTROL	0
+#define TCONN_CLASS_INTERACTIVE	1
+#define TCONN_CLASS_BULK	2
+#define TCONN_NUM_CLASSES	3
+
+struct tconn_txq_stats {
+	uint64_t		enqueued;
+	uint64_t		dequeued;
+	uint64_t		tail_drops;
+	uint64_t		codel_drops;
+	uint64_t		sojourn_us_total;
+	uint32_t		sojourn_us_max;
+	int			backlog;
+};
+
+struct tconn_txq_class {
+	struct iv_list_head	queue;
+	int			bytes;
+	int			deficit;
+	int			codel_dropping;
+	int			codel_count;
+	int			codel_lastcount;
+	uint64_t		codel_first_above;
+	uint64_t		codel_drop_next;
+	struct tconn_txq_stats	stats;
+};
+
 struct tconn {
 	struct iv_fd		*fd;
 	int			role;
@@ -31,9 +65,14 @@ struct tconn {
 	int			numcrts;
 	gnutls_x509_crt_t	*mycrts;
 	void			*cookie;
+	int			ktls;
+	int			txq_limit;
+	const char		*ciphers;
+	const gnutls_datum_t	*session_data;
+	const gnutls_datum_t	*ticket_key;
 	int			(*verify_key_ids)(void *cookie,
 						  const uint8_t *ids, int num);
-	void			(*handshake_done)(void *cookie, char *desc);
+	int			(*handshake_done)(void *cookie, char *desc);
 	void			(*record_received)(void *cookie,
 						   const uint8_t *rec, int len);
 	void			(*connection_lost)(void *cookie);
@@ -48,17 +87,76 @@ struct tconn {
 	int			rx_start;
 	int			rx_end;
 	int			rx_eof;
+	uint8_t			rx_rec_hdr[5];
+	int			rx_rec_hdr_bytes;
+	int			rx_rec_left;
+	uint8_t			rx_frame[3 + 65535];
+	int			rx_frame_bytes;
 	struct iv_task		tx_task;
-	uint8_t			tx_buf[32768];
+	uint8_t			tx_buf[131072];
+	int			tx_start;
 	int			tx_bytes;
+	int			ktls_tx;
+	int			ktls_rx;
+	struct tconn_txq_class	txq[TCONN_NUM_CLASSES];
+	int			txq_bytes;
+	int			txq_drr_next;
+	struct tconn_hs_job	*hs_job;
+	uint8_t			*peer_ids;
+	int			num_peer_ids;
 };
 
 #define TCONN_ROLE_SERVER	0
 #define TCONN_ROLE_CLIENT	1
 
+/*
+ * Records that are sent while the socket is congested are queued in
+ * their traffic class, up to a total of ->txq_limit bytes
+ * (TCONN_TXQ_DEFAULT_LIMIT if zero), and are sent once the congestion
+ * clears, with CoDel dropping records that have spent too long in the
+ * queue.  tconn_get_txq_stats() fills in TCONN_NUM_CLASSES entries.
+ */
+#define TCONN_TXQ_DEFAULT_LIMIT	262144
+
+/*
+ * ->ciphers restricts the session to the given list of ciphers, in
+ * the given order.  If it is NULL, all supported ciphers are offered,
+ * fastest first (see tls_prio.h).  If ->handshake_done() returns
+ * nonzero, the connection is aborted.
+ */
+
+/*
+ * Records handed to tconn_record_send() must consist of one or more
+ * complete [type, len_hi, len_lo, payload] frames.  Once the session
+ * keys have been handed to the kernel (kTLS), TLS record boundaries
+ * are no longer visible to us, and so record_received() is called
+ * with runs of complete frames rather than with the original records.
+ *
+ * Frames may be up to 65535 bytes long, and are split across multiple
+ * TLS records if they don't fit in one.  If the transmit queue can't
+ * take all of those records, the frame is dropped as a whole.
+ */
+
+/*
+ * Session resumption.  A server with a ->ticket_key (of
+ * TCONN_TICKET_KEY_LEN bytes) issues session tickets, and a client
+ * that is given ->session_data saved from an earlier session with
+ * tconn_get_session_data() will try to resume that session, skipping
+ * the public key operations of a full handshake.  The peer's key IDs
+ * are verified against the certificates of the original session when
+ * a session is resumed, just as they are during a full handshake.
+ */
+#define TCONN_TICKET_KEY_LEN	64
+
 int tconn_start(struct tconn *tc);
 void tconn_destroy(struct tconn *tc);
-int tconn_record_send(struct tconn *tc, const uint8_t *rec, int len);
+int tconn_export_keys(struct tconn *tc, const char *label,
+		      uint8_t *buf, int len);
+int tconn_record_send(struct tconn *tc, int class,
+		      const uint8_t *rec, int len);
+gnutls_cipher_algorithm_t tconn_get_cipher(struct tconn *tc);
+int tconn_get_session_data(struct tconn *tc, gnutls_datum_t *data);
+void tconn_get_txq_stats(struct tconn *tc, struct tconn_txq_stats *st);
 
 
 #endif
@@ -75,10 +75,47 @@ static int verify_key_ids(void *_tc, const uint8_t *ids, int num)
 	return 1;
 }
 
+/*
+ * We keep the session of our last successful connection around, so
+ * that we can resume it when reconnecting.  The session is saved as
+ * soon as it can be resumed, which with TLS 1.3 is once the server's
+ * session ticket has arrived, since gnutls refuses to hand out the
+ * session once the connection has been torn down without a proper
+ * closure, which is how a restarting hub drops its connections.  If
+ * a handshake fails, we forget the session, in case resuming it is
+ * what is failing.
+ */
+static void forget_session(struct tconn_connect *tc)
+{
+	if (tc->session_data.data != NULL) {
+		gnutls_free(tc->session_data.data);
+		tc->session_data.data = NULL;
+		tc->session_data.size = 0;
+	}
+}
+
+static void save_session(struct tconn_connect *tc)
+{
+	gnutls_datum_t data;
+
+	if (tc->session_saved)
+		return;
+
+	if (tconn_get_session_data(&tc->tconn, &data) == 0) {
+		forget_session(tc);
+		tc->session_data = data;
+		tc->session_saved = 1;
+	}
+}
+
 static void schedule_retry(struct tconn_connect *tc, int waittime)
 {
-	if (tc->state == STATE_CONNECTED)
+	if (tc->state == STATE_CONNECTED) {
 		tc->set_state(tc->cookie, tc->id, 0);
+		save_session(tc);
+	} else if (tc->state == STATE_TLS_HANDSHAKE) {
+		forget_session(tc);
+	}
 
 	if (tc->state == STATE_TLS_HANDSHAKE || tc->state == STATE_CONNECTED) {
 		tconn_destroy(&tc->tconn);
@@ -113,7 +150,8 @@ static void send_keepalive(void *_tc)
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&tc->keepalive_timer);
 
-	if (tconn_record_send(&tc->tconn, keepalive, 3)) {
+	if (tconn_record_send(&tc->tconn, TCONN_CLASS_CONTROL,
+			      keepalive, 3)) {
 		fprintf(stderr, "%s: error sending keepalive, disconnecting "
 				"and retrying in %d seconds\n",
 			tc->name, SHORT_RETRY_WAIT_TIME);
@@ -121,7 +159,7 @@ static void send_keepalive(void *_tc)
 	}
 }
 
-static void handshake_done(void *_tc, char *desc)
+static int handshake_done(void *_tc, char *desc)
 {
 	struct tconn_connect *tc = _tc;
 
@@ -129,6 +167,9 @@ static void handshake_done(void *_tc, char *desc)
 
 	tc->state = STATE_CONNECTED;
 
+	tc->session_saved = 0;
+	save_session(tc);
+
 	iv_validate_now();
 
 	iv_timer_unregister(&tc->rx_timeout);
@@ -146,6 +187,8 @@ static void handshake_done(void *_tc, char *desc)
 	iv_timer_register(&tc->keepalive_timer);
 
 	tc->set_state(tc->cookie, tc->id, 1);
+
+	return 0;
 }
 
 static void record_received(void *_tc, const uint8_t *rec, int len)
@@ -160,6 +203,8 @@ static void record_received(void *_tc, const uint8_t *rec, int len)
 			1000 * KEEPALIVE_TIMEOUT, 1000 * KEEPALIVE_TIMEOUT);
 	iv_timer_register(&tc->rx_timeout);
 
+	save_session(tc);
+
 	tc->record_received(tc->cookie, rec, len);
 }
 
@@ -198,6 +243,14 @@ static void connect_success(struct tconn_connect *tc)
 	tc->tconn.mykey = tc->mykey;
 	tc->tconn.numcrts = tc->numcrts;
 	tc->tconn.mycrts = tc->mycrts;
+	tc->tconn.ktls = tc->ktls;
+	tc->tconn.txq_limit = tc->txq_limit;
+	tc->tconn.ciphers = tc->ciphers;
+	if (tc->session_data.data != NULL)
+		tc->tconn.session_data = &tc->session_data;
+	else
+		tc->tconn.session_data = NULL;
+	tc->tconn.ticket_key = NULL;
 	tc->tconn.cookie = tc;
 	tc->tconn.verify_key_ids = verify_key_ids;
 	tc->tconn.handshake_done = handshake_done;
@@ -397,6 +450,7 @@ static void rx_timeout_expired(void *_tc)
 			waittime = SHORT_RETRY_WAIT_TIME;
 		} else if (tc->state == STATE_TLS_HANDSHAKE) {
 			fprintf(stderr, "TLS handshake timed out");
+			forget_session(tc);
 			tconn_destroy(&tc->tconn);
 			iv_fd_unregister(&tc->tconnfd);
 			close(tc->tconnfd.fd);
@@ -404,6 +458,7 @@ static void rx_timeout_expired(void *_tc)
 		} else if (tc->state == STATE_CONNECTED) {
 			fprintf(stderr, "receive timeout");
 			tc->set_state(tc->cookie, tc->id, 0);
+			save_session(tc);
 			tconn_destroy(&tc->tconn);
 			iv_fd_unregister(&tc->tconnfd);
 			close(tc->tconnfd.fd);
@@ -435,6 +490,8 @@ static void rx_timeout_expired(void *_tc)
 void tconn_connect_start(struct tconn_connect *tc)
 {
 	tc->state = STATE_RESOLVE;
+	tc->session_data.data = NULL;
+	tc->session_data.size = 0;
 
 	IV_TIMER_INIT(&tc->rx_timeout);
 	tc->rx_timeout.cookie = tc;
@@ -477,6 +534,13 @@ void tconn_connect_destroy(struct tconn_connect *tc)
 	} else {
 		abort();
 	}
+
+	forget_session(tc);
+}
+
+void tconn_connect_forget_session(struct tconn_connect *tc)
+{
+	forget_session(tc);
 }
 
 int tconn_connect_get_rtt(struct tconn_connect *tc)
@@ -513,7 +577,44 @@ int tconn_connect_get_maxseg(struct tconn_connect *tc)
 	return mseg;
 }
 
-void tconn_connect_record_send(struct tconn_connect *tc,
+int tconn_connect_get_peer_address(struct tconn_connect *tc,
+				   struct sockaddr_storage *addr)
+{
+	socklen_t len;
+
+	if (tc->state != STATE_CONNECTED)
+		return -1;
+
+	len = sizeof(*addr);
+	if (getpeername(tc->tconnfd.fd, (struct sockaddr *)addr, &len) < 0) {
+		perror("getpeername");
+		return -1;
+	}
+
+	return 0;
+}
+
+int tconn_connect_export_keys(struct tconn_connect *tc, const char *label,
+			      uint8_t *buf, int len)
+{
+	if (tc->state != STATE_CONNECTED)
+		return -1;
+
+	return tconn_export_keys(&tc->tconn, label, buf, len);
+}
+
+int tconn_connect_get_txq_stats(struct tconn_connect *tc,
+				struct tconn_txq_stats *st)
+{
+	if (tc->state != STATE_CONNECTED)
+		return -1;
+
+	tconn_get_txq_stats(&tc->tconn, st);
+
+	return 0;
+}
+
+void tconn_connect_record_send(struct tconn_connect *tc, int class,
 			       const uint8_t *rec, int len)
 {
 	if (tc->state != STATE_CONNECTED)
@@ -527,7 +628,7 @@ void tconn_connect_record_send(struct tconn_connect *tc,
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&tc->keepalive_timer);
 
-	if (tconn_record_send(&tc->tconn, rec, len)) {
+	if (tconn_record_send(&tc->tconn, class, rec, len)) {
 		fprintf(stderr, "%s: error sending TLS record, disconnecting "
 				"and retrying in %d seconds\n",
 			tc->name, SHORT_RETRY_WAIT_TIME);
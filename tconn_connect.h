@@ -34,6 +34,9 @@ struct tconn_connect {
 	int			numcrts;
 	gnutls_x509_crt_t	*mycrts;
 	uint8_t			*fingerprint;
+	int			ktls;
+	int			txq_limit;
+	const char		*ciphers;
 	void			*cookie;
 	void			(*set_state)(void *cookie,
 					     const uint8_t *id, int up);
@@ -42,6 +45,7 @@ struct tconn_connect {
 
 	int			state;
 	struct iv_timer		rx_timeout;
+	gnutls_datum_t		session_data;
 	union {
 		struct {
 			struct addrinfo		hints;
@@ -57,15 +61,23 @@ struct tconn_connect {
 			struct tconn		tconn;
 			uint8_t			id[NODE_ID_LEN];
 			struct iv_timer		keepalive_timer;
+			int			session_saved;
 		};
 	};
 };
 
 void tconn_connect_start(struct tconn_connect *tc);
 void tconn_connect_destroy(struct tconn_connect *tc);
+void tconn_connect_forget_session(struct tconn_connect *tc);
 int tconn_connect_get_rtt(struct tconn_connect *tc);
 int tconn_connect_get_maxseg(struct tconn_connect *tc);
-void tconn_connect_record_send(struct tconn_connect *tc,
+int tconn_connect_get_peer_address(struct tconn_connect *tc,
+				   struct sockaddr_storage *addr);
+int tconn_connect_export_keys(struct tconn_connect *tc, const char *label,
+			      uint8_t *buf, int len);
+int tconn_connect_get_txq_stats(struct tconn_connect *tc,
+				 struct tconn_txq_stats *st);
+void tconn_connect_record_send(struct tconn_connect *tc, int class,
 			       const uint8_t *rec, int len);
 
 
@@ -17,18 +17,25 @@
  * Boston, MA 02110-1301, USA.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
 #include <iv.h>
 #include <netinet/tcp.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include "conf.h"
 #include "itf.h"
 #include "tconn.h"
 #include "tconn_listen.h"
+#include "tls_prio.h"
 #include "util.h"
 #include "x509.h"
 
@@ -59,6 +66,19 @@ static void print_name(FILE *fp, struct client_conn *cc)
 		fprintf(fp, "conn%d", cc->fd.fd);
 }
 
+static void got_connection(void *_ls);
+
+static int handshake_limit(struct tconn_listen_socket *ls)
+{
+	return ls->handshake_limit ? : TCONN_HANDSHAKE_DEFAULT_LIMIT;
+}
+
+static void handshake_finished(struct tconn_listen_socket *ls)
+{
+	if (ls->handshakes-- == handshake_limit(ls))
+		iv_fd_set_handler_in(&ls->listen_fd, got_connection);
+}
+
 static void client_conn_kill(struct client_conn *cc, int notify)
 {
 	if (cc->tle != NULL) {
@@ -70,6 +90,9 @@ static void client_conn_kill(struct client_conn *cc, int notify)
 	if (iv_timer_registered(&cc->rx_timeout))
 		iv_timer_unregister(&cc->rx_timeout);
 
+	if (cc->state == STATE_TLS_HANDSHAKE)
+		handshake_finished(cc->tls);
+
 	tconn_destroy(&cc->tconn);
 	iv_fd_unregister(&cc->fd);
 	close(cc->fd.fd);
@@ -150,18 +173,26 @@ static void send_keepalive(void *_cc)
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&cc->keepalive_timer);
 
-	if (tconn_record_send(&cc->tconn, keepalive, 3)) {
+	if (tconn_record_send(&cc->tconn, TCONN_CLASS_CONTROL,
+			      keepalive, 3)) {
 		fprintf(stderr, "%s: error sending keepalive, disconnecting\n",
 			cc->tle->name);
 		client_conn_kill(cc, 1);
 	}
 }
 
-static void handshake_done(void *_cc, char *desc)
+static int handshake_done(void *_cc, char *desc)
 {
 	struct client_conn *cc = _cc;
 	struct tconn_listen_entry *le = cc->tle;
 
+	if (!tls_prio_cipher_allowed(le->ciphers,
+				     tconn_get_cipher(&cc->tconn))) {
+		fprintf(stderr, "%s: handshake done, but %s uses a cipher "
+				"not permitted for this peer\n", le->name, desc);
+		return 1;
+	}
+
 	if (le->current != NULL) {
 		fprintf(stderr, "%s: handshake done, using %s, disconnecting "
 				"previous client\n", le->name, desc);
@@ -174,6 +205,7 @@ static void handshake_done(void *_cc, char *desc)
 	le->current = cc;
 
 	cc->state = STATE_CONNECTED;
+	handshake_finished(cc->tls);
 
 	iv_validate_now();
 
@@ -192,6 +224,8 @@ static void handshake_done(void *_cc, char *desc)
 	iv_timer_register(&cc->keepalive_timer);
 
 	cc->tle->set_state(cc->tle->cookie, cc->id, 1);
+
+	return 0;
 }
 
 static void record_received(void *_cc, const uint8_t *rec, int len)
@@ -253,6 +287,12 @@ static void got_connection(void *_ls)
 	cc->tle = NULL;
 
 	cc->state = STATE_TLS_HANDSHAKE;
+	if (++ls->handshakes == handshake_limit(ls)) {
+		fprintf(stderr, "conn%d: %d handshakes in progress, "
+				"deferring new connections\n",
+			fd, ls->handshakes);
+		iv_fd_set_handler_in(&ls->listen_fd, NULL);
+	}
 
 	iv_validate_now();
 
@@ -273,6 +313,14 @@ static void got_connection(void *_ls)
 	cc->tconn.mykey = ls->mykey;
 	cc->tconn.numcrts = ls->numcrts;
 	cc->tconn.mycrts = ls->mycrts;
+	cc->tconn.ktls = ls->ktls;
+	cc->tconn.txq_limit = ls->txq_limit;
+	cc->tconn.ciphers = ls->ciphers;
+	cc->tconn.session_data = NULL;
+	if (ls->ticket_key.data != NULL)
+		cc->tconn.ticket_key = &ls->ticket_key;
+	else
+		cc->tconn.ticket_key = NULL;
 	cc->tconn.cookie = cc;
 	cc->tconn.verify_key_ids = verify_key_ids;
 	cc->tconn.handshake_done = handshake_done;
@@ -293,6 +341,155 @@ compare_listen_entries(struct iv_avl_node *_a, struct iv_avl_node *_b)
 	return memcmp(a->fingerprint, b->fingerprint, NODE_ID_LEN);
 }
 
+static void free_ticket_key(struct tconn_listen_socket *tls)
+{
+	if (tls->ticket_key.data != NULL) {
+		gnutls_memset(tls->ticket_key.data, 0, tls->ticket_key.size);
+		gnutls_free(tls->ticket_key.data);
+		tls->ticket_key.data = NULL;
+	}
+	tls->ticket_key.size = 0;
+}
+
+/*
+ * Session tickets are encrypted with a random key that is replaced
+ * every TICKET_KEY_LIFETIME seconds, so that recorded sessions can't
+ * be decrypted with a key that is recovered later on.  If we have a
+ * ->ticket_key_file, the current key is also kept there, so that
+ * peers can still resume their sessions after we restart, which is
+ * exactly when all of them reconnect at once.  The file is created
+ * with mode 0600 and replaced at every rotation, and a key in it that
+ * is older than TICKET_KEY_LIFETIME is never used.  Listening sockets
+ * that share the file pick up each other's rotations.
+ *
+ * Sessions that were established before a rotation can't be resumed,
+ * and peers that try to do so fall back to a full handshake.
+ */
+#define TICKET_KEY_LIFETIME	(6 * 3600)
+#define TICKET_KEY_MAX_SIZE	256
+
+/*
+ * Returns the number of seconds for which the key read from the
+ * ticket key file remains usable, or -1 if there is no usable key.
+ */
+static int read_ticket_key(const char *file, gnutls_datum_t *key)
+{
+	struct stat st;
+	time_t age;
+	int fd;
+	int len;
+
+	fd = open(file, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			perror(file);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror(file);
+		close(fd);
+		return -1;
+	}
+
+	age = time(NULL) - st.st_mtime;
+	if (age < 0 || age >= TICKET_KEY_LIFETIME ||
+	    st.st_size == 0 || st.st_size > TICKET_KEY_MAX_SIZE) {
+		close(fd);
+		return -1;
+	}
+
+	key->data = gnutls_malloc(st.st_size);
+	if (key->data == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	len = read(fd, key->data, st.st_size);
+	close(fd);
+
+	if (len != st.st_size) {
+		fprintf(stderr, "%s: short read\n", file);
+		gnutls_memset(key->data, 0, st.st_size);
+		gnutls_free(key->data);
+		key->data = NULL;
+		return -1;
+	}
+
+	key->size = len;
+
+	return TICKET_KEY_LIFETIME - age;
+}
+
+static void write_ticket_key(const char *file, const gnutls_datum_t *key)
+{
+	char *tmp;
+	int fd;
+
+	if (asprintf(&tmp, "%s.XXXXXX", file) < 0)
+		return;
+
+	/*
+	 * mkstemp() creates the file with mode 0600.
+	 */
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		perror(tmp);
+		free(tmp);
+		return;
+	}
+
+	if (write(fd, key->data, key->size) != key->size || fsync(fd) < 0) {
+		perror(tmp);
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return;
+	}
+
+	close(fd);
+
+	if (rename(tmp, file) < 0) {
+		perror(file);
+		unlink(tmp);
+	}
+
+	free(tmp);
+}
+
+static void rotate_ticket_key(void *_tls)
+{
+	struct tconn_listen_socket *tls = _tls;
+	gnutls_datum_t key;
+	int lifetime;
+	int ret;
+
+	lifetime = -1;
+	if (tls->ticket_key_file != NULL)
+		lifetime = read_ticket_key(tls->ticket_key_file, &key);
+
+	if (lifetime < 0) {
+		ret = gnutls_session_ticket_key_generate(&key);
+		if (ret) {
+			fprintf(stderr, "gnutls_session_ticket_key_generate: "
+					"%s\n", gnutls_strerror(ret));
+			key.data = NULL;
+			key.size = 0;
+		} else if (tls->ticket_key_file != NULL) {
+			write_ticket_key(tls->ticket_key_file, &key);
+		}
+		lifetime = TICKET_KEY_LIFETIME;
+	}
+
+	free_ticket_key(tls);
+	tls->ticket_key = key;
+
+	iv_validate_now();
+	tls->ticket_key_timer.expires = iv_now;
+	tls->ticket_key_timer.expires.tv_sec += lifetime;
+	iv_timer_register(&tls->ticket_key_timer);
+}
+
 int tconn_listen_socket_register(struct tconn_listen_socket *tls)
 {
 	int fd;
@@ -332,6 +529,16 @@ int tconn_listen_socket_register(struct tconn_listen_socket *tls)
 
 	INIT_IV_AVL_TREE(&tls->listen_entries, compare_listen_entries);
 
+	tls->handshakes = 0;
+
+	tls->ticket_key.data = NULL;
+	tls->ticket_key.size = 0;
+
+	IV_TIMER_INIT(&tls->ticket_key_timer);
+	tls->ticket_key_timer.cookie = tls;
+	tls->ticket_key_timer.handler = rotate_ticket_key;
+	rotate_ticket_key(tls);
+
 	return 0;
 }
 
@@ -349,6 +556,9 @@ void tconn_listen_socket_unregister(struct tconn_listen_socket *tls)
 		le = iv_container_of(an, struct tconn_listen_entry, an);
 		tconn_listen_entry_unregister(le);
 	}
+
+	iv_timer_unregister(&tls->ticket_key_timer);
+	free_ticket_key(tls);
 }
 
 int tconn_listen_entry_register(struct tconn_listen_entry *tle)
@@ -407,8 +617,34 @@ int tconn_listen_entry_get_maxseg(struct tconn_listen_entry *tle)
 	return mseg;
 }
 
+int tconn_listen_entry_export_keys(struct tconn_listen_entry *tle,
+				   const char *label, uint8_t *buf, int len)
+{
+	struct client_conn *cc;
+
+	cc = tle->current;
+	if (cc == NULL)
+		return -1;
+
+	return tconn_export_keys(&cc->tconn, label, buf, len);
+}
+
+int tconn_listen_entry_get_txq_stats(struct tconn_listen_entry *tle,
+				     struct tconn_txq_stats *st)
+{
+	struct client_conn *cc;
+
+	cc = tle->current;
+	if (cc == NULL || cc->state != STATE_CONNECTED)
+		return -1;
+
+	tconn_get_txq_stats(&cc->tconn, st);
+
+	return 0;
+}
+
 void tconn_listen_entry_record_send(struct tconn_listen_entry *tle,
-				    const uint8_t *rec, int len)
+				    int class, const uint8_t *rec, int len)
 {
 	struct client_conn *cc;
 
@@ -424,7 +660,7 @@ void tconn_listen_entry_record_send(struct tconn_listen_entry *tle,
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&cc->keepalive_timer);
 
-	if (tconn_record_send(&cc->tconn, rec, len)) {
+	if (tconn_record_send(&cc->tconn, class, rec, len)) {
 		fprintf(stderr, "%s: error sending TLS record, disconnecting\n",
 			tle->name);
 		client_conn_kill(cc, 1);
@@ -28,11 +28,33 @@ struct tconn_listen_socket {
 	gnutls_x509_privkey_t	mykey;
 	int			numcrts;
 	gnutls_x509_crt_t	*mycrts;
+	int			ktls;
+	int			txq_limit;
+	const char		*ciphers;
+	int			handshake_limit;
+	const char		*ticket_key_file;
 
 	struct iv_fd		listen_fd;
 	struct iv_avl_tree	listen_entries;
+	gnutls_datum_t		ticket_key;
+	struct iv_timer		ticket_key_timer;
+	int			handshakes;
 };
 
+/*
+ * At most ->handshake_limit (TCONN_HANDSHAKE_DEFAULT_LIMIT if zero)
+ * incoming connections are allowed to be in the TLS handshake phase
+ * at the same time.  Once the limit is reached, we stop accepting
+ * connections until some of the pending handshakes have finished,
+ * and further connection attempts wait in the listen backlog.
+ */
+#define TCONN_HANDSHAKE_DEFAULT_LIMIT	64
+
+/*
+ * If ->ticket_key_file is set, the session ticket key is kept in that
+ * file, so that sessions can be resumed across restarts.
+ */
+
 int tconn_listen_socket_register(struct tconn_listen_socket *tls);
 void tconn_listen_socket_unregister(struct tconn_listen_socket *tls);
 
@@ -40,6 +62,7 @@ struct tconn_listen_entry {
 	struct tconn_listen_socket	*tls;
 	char				*name;
 	uint8_t				*fingerprint;
+	const char			*ciphers;
 	void				*cookie;
 	void				(*set_state)(void *cookie,
 						     const uint8_t *id, int up);
@@ -55,8 +78,12 @@ int tconn_listen_entry_register(struct tconn_listen_entry *tle);
 void tconn_listen_entry_unregister(struct tconn_listen_entry *tle);
 int tconn_listen_entry_get_rtt(struct tconn_listen_entry *tle);
 int tconn_listen_entry_get_maxseg(struct tconn_listen_entry *tle);
+int tconn_listen_entry_export_keys(struct tconn_listen_entry *tle,
+				   const char *label, uint8_t *buf, int len);
+int tconn_listen_entry_get_txq_stats(struct tconn_listen_entry *tle,
+				     struct tconn_txq_stats *st);
 void tconn_listen_entry_record_send(struct tconn_listen_entry *tle,
-				    const uint8_t *rec, int len);
+				    int class, const uint8_t *rec, int len);
 
 
 #endif
@@ -0,0 +1,302 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "tls_prio.h"
+
+/*
+ * Each candidate is benchmarked by encrypting full-sized TLS records
+ * for BENCH_MS milliseconds.
+ */
+#define BENCH_RECORD_LEN	16384
+#define BENCH_TAG_LEN		16
+#define BENCH_MS		50
+
+#define NUM_CIPHERS		3
+
+struct cipher {
+	const char			*name;
+	gnutls_cipher_algorithm_t	alg;
+	int				avail;
+	double				mbps;
+};
+
+static struct cipher ciphers[NUM_CIPHERS] = {
+	{ "AES-256-GCM", GNUTLS_CIPHER_AES_256_GCM, 1, 0.0, },
+	{ "CHACHA20-POLY1305", GNUTLS_CIPHER_CHACHA20_POLY1305, 1, 0.0, },
+	{ "AES-128-GCM", GNUTLS_CIPHER_AES_128_GCM, 1, 0.0, },
+};
+
+/*
+ * Indices into ciphers[], fastest first.  Until the benchmark has
+ * run (or if none of the candidates could be benchmarked), this is
+ * the order that gnutls itself prefers.
+ */
+static int ranking[NUM_CIPHERS] = { 0, 1, 2, };
+static int num_ranked = NUM_CIPHERS;
+
+static uint64_t elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+		(now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+static double bench_cipher(gnutls_cipher_algorithm_t alg)
+{
+	uint8_t key[32];
+	gnutls_datum_t k;
+	gnutls_aead_cipher_hd_t h;
+	uint8_t *buf;
+	uint8_t nonce[12];
+	uint8_t ad[13];
+	struct timespec start;
+	uint64_t bytes;
+	uint64_t us;
+	uint32_t i;
+
+	k.data = key;
+	k.size = gnutls_cipher_get_key_size(alg);
+	if (k.size > sizeof(key))
+		return -1;
+	gnutls_rnd(GNUTLS_RND_NONCE, key, k.size);
+
+	if (gnutls_aead_cipher_init(&h, alg, &k) < 0)
+		return -1;
+
+	buf = malloc(2 * BENCH_RECORD_LEN + BENCH_TAG_LEN);
+	if (buf == NULL) {
+		gnutls_aead_cipher_deinit(h);
+		return -1;
+	}
+	memset(buf, 0x5a, BENCH_RECORD_LEN);
+	memset(nonce, 0, sizeof(nonce));
+	memset(ad, 0, sizeof(ad));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	bytes = 0;
+	for (i = 0; ; i++) {
+		size_t len;
+
+		nonce[8] = i >> 24;
+		nonce[9] = i >> 16;
+		nonce[10] = i >> 8;
+		nonce[11] = i & 0xff;
+
+		len = BENCH_RECORD_LEN + BENCH_TAG_LEN;
+		if (gnutls_aead_cipher_encrypt(h, nonce, sizeof(nonce),
+					       ad, sizeof(ad), BENCH_TAG_LEN,
+					       buf, BENCH_RECORD_LEN,
+					       buf + BENCH_RECORD_LEN,
+					       &len) < 0) {
+			free(buf);
+			gnutls_aead_cipher_deinit(h);
+			return -1;
+		}
+		bytes += BENCH_RECORD_LEN;
+
+		if ((i & 15) == 15) {
+			us = elapsed_us(&start);
+			if (us >= 1000 * BENCH_MS)
+				break;
+		}
+	}
+
+	free(buf);
+	gnutls_aead_cipher_deinit(h);
+
+	return (double)bytes / us;
+}
+
+void tls_prio_bench(FILE *fp)
+{
+	int i;
+
+	num_ranked = 0;
+	for (i = 0; i < NUM_CIPHERS; i++) {
+		struct cipher *c = &ciphers[i];
+		int j;
+
+		c->mbps = bench_cipher(c->alg);
+		c->avail = c->mbps >= 0;
+		if (!c->avail)
+			continue;
+
+		for (j = num_ranked; j > 0; j--) {
+			if (ciphers[ranking[j - 1]].mbps >= c->mbps)
+				break;
+			ranking[j] = ranking[j - 1];
+		}
+		ranking[j] = i;
+		num_ranked++;
+	}
+
+	if (!num_ranked) {
+		for (i = 0; i < NUM_CIPHERS; i++)
+			ranking[i] = i;
+		num_ranked = NUM_CIPHERS;
+	}
+
+	if (fp == NULL)
+		return;
+
+	for (i = 0; i < num_ranked; i++) {
+		struct cipher *c = &ciphers[ranking[i]];
+
+		fprintf(fp, "%-20s %10.1f MB/s\n", c->name, c->mbps);
+	}
+
+	for (i = 0; i < NUM_CIPHERS; i++) {
+		if (!ciphers[i].avail)
+			fprintf(fp, "%-20s unavailable\n", ciphers[i].name);
+	}
+}
+
+static int parse_ciphers(const char *list, int *ids)
+{
+	const char *p;
+	int num;
+
+	num = 0;
+
+	p = list;
+	while (*p) {
+		int len;
+		int i;
+		int j;
+
+		while (*p == ',' || *p == ':' || isspace((unsigned char)*p))
+			p++;
+		if (!*p)
+			break;
+
+		len = 0;
+		while (p[len] && p[len] != ',' && p[len] != ':' &&
+		       !isspace((unsigned char)p[len]))
+			len++;
+
+		for (i = 0; i < NUM_CIPHERS; i++) {
+			if (strlen(ciphers[i].name) == len &&
+			    !strncasecmp(p, ciphers[i].name, len))
+				break;
+		}
+
+		if (i == NUM_CIPHERS) {
+			fprintf(stderr, "unknown cipher '%.*s', expected one "
+					"of AES-128-GCM, AES-256-GCM or "
+					"CHACHA20-POLY1305\n", len, p);
+			return -1;
+		}
+
+		for (j = 0; j < num; j++) {
+			if (ids[j] == i) {
+				fprintf(stderr, "duplicate cipher '%s' in "
+						"'%s'\n", ciphers[i].name, list);
+				return -1;
+			}
+		}
+		ids[num++] = i;
+
+		p += len;
+	}
+
+	if (!num) {
+		fprintf(stderr, "empty cipher list\n");
+		return -1;
+	}
+
+	return num;
+}
+
+int tls_prio_check_ciphers(const char *list)
+{
+	int ids[NUM_CIPHERS];
+
+	return (parse_ciphers(list, ids) < 0) ? -1 : 0;
+}
+
+int tls_prio_tls13(int ktls)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+	return !ktls;
+#else
+	return 0;
+#endif
+}
+
+char *tls_prio_get(const char *list, int ktls)
+{
+	char buf[512];
+	int ids[NUM_CIPHERS];
+	int num;
+	int off;
+	int i;
+
+	if (list != NULL) {
+		num = parse_ciphers(list, ids);
+		if (num < 0)
+			return NULL;
+	} else {
+		num = num_ranked;
+		memcpy(ids, ranking, num * sizeof(ids[0]));
+	}
+
+	off = snprintf(buf, sizeof(buf), "NONE:%s+VERS-TLS1.2:",
+		       tls_prio_tls13(ktls) ? "+VERS-TLS1.3:" : "");
+
+	for (i = 0; i < num; i++) {
+		off += snprintf(buf + off, sizeof(buf) - off, "+%s:",
+				ciphers[ids[i]].name);
+	}
+
+	snprintf(buf + off, sizeof(buf) - off,
+		 "+ECDHE-RSA:+MAC-ALL:+COMP-NULL:+SIGN-ALL:"
+		 "+CURVE-SECP256R1:%%SAFE_RENEGOTIATION");
+
+	return strdup(buf);
+}
+
+int tls_prio_cipher_allowed(const char *list, gnutls_cipher_algorithm_t cipher)
+{
+	int ids[NUM_CIPHERS];
+	int num;
+	int i;
+
+	if (list == NULL)
+		return 1;
+
+	num = parse_ciphers(list, ids);
+	for (i = 0; i < num; i++) {
+		if (ciphers[ids[i]].alg == cipher)
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __TLS_PRIO_H
+#define __TLS_PRIO_H
+
+#include <stdio.h>
+#include <gnutls/gnutls.h>
+
+/*
+ * TLS priority strings.  The AEAD ciphers we offer are ordered by
+ * their measured throughput on the local CPU, as determined by
+ * tls_prio_bench(), unless a cipher list (a comma or colon separated
+ * list of gnutls cipher names, such as "CHACHA20-POLY1305,AES-128-GCM")
+ * is given, in which case only those ciphers are offered, in that
+ * order.  TLS 1.3 is offered if gnutls supports it and kernel TLS
+ * (which we only support for TLS 1.2) isn't requested, and is then
+ * used if the peer supports it too.
+ *
+ * tls_prio_bench() should be called before any other threads are
+ * started, as the ranking is not protected by a lock.
+ */
+void tls_prio_bench(FILE *fp);
+int tls_prio_check_ciphers(const char *ciphers);
+char *tls_prio_get(const char *ciphers, int ktls);
+int tls_prio_tls13(int ktls);
+int tls_prio_cipher_allowed(const char *ciphers,
+			    gnutls_cipher_algorithm_t cipher);
+
+
+#endif
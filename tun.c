@@ -31,28 +31,67 @@
 #include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include "tun.h"
 
+/*
+ * Maximum number of packets to read from the tun fd per wakeup, so
+ * that a busy tun interface can't starve the rest of the event loop.
+ */
+#define TUN_RX_BUDGET		32
+
+#define TUN_OFFLOADS		(TUN_F_CSUM | TUN_F_TSO4 | \
+				 TUN_F_TSO6 | TUN_F_TSO_ECN)
+
+static void tun_got_vnet_packet(struct tun_interface *ti, uint8_t *buf, int len)
+{
+	struct virtio_net_hdr vh;
+
+	if (len < sizeof(vh))
+		return;
+
+	memcpy(&vh, buf, sizeof(vh));
+	buf += sizeof(vh);
+	len -= sizeof(vh);
+
+	if (vh.gso_type == VIRTIO_NET_HDR_GSO_NONE &&
+	    !(vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+		ti->got_packet(ti->cookie, buf, len);
+	} else if (ti->got_gso_packet != NULL) {
+		ti->got_gso_packet(ti->cookie, &vh, buf, len);
+	}
+}
+
 static void tun_got_packet(void *cookie)
 {
 	struct tun_interface *ti = cookie;
-	uint8_t buf[16384];
+	uint8_t buf[TUN_RX_HEADROOM + sizeof(struct virtio_net_hdr) + 65536];
+	int budget;
 	int ret;
 
-	do {
-		ret = read(ti->fd.fd, buf, sizeof(buf));
-	} while (ret == -1 && errno == EINTR);
-
-	if (ret <= 0) {
-		if (ret < 0 && errno != EAGAIN) {
-			fprintf(stderr, "tun_got_packet: read(2) got "
-					"error: %s\n", strerror(errno));
-			abort();
+	for (budget = TUN_RX_BUDGET; budget; budget--) {
+		do {
+			ret = read(ti->fd.fd, buf + TUN_RX_HEADROOM,
+				   sizeof(buf) - TUN_RX_HEADROOM);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret <= 0) {
+			if (ret < 0 && errno != EAGAIN) {
+				fprintf(stderr, "tun_got_packet: read(2) got "
+						"error: %s\n", strerror(errno));
+				abort();
+			}
+			break;
 		}
-		return;
+
+		if (ti->vnet_hdr)
+			tun_got_vnet_packet(ti, buf + TUN_RX_HEADROOM, ret);
+		else
+			ti->got_packet(ti->cookie, buf + TUN_RX_HEADROOM, ret);
 	}
 
-	ti->got_packet(ti->cookie, buf, ret);
+	if (budget != TUN_RX_BUDGET && ti->got_packet_batch_done != NULL)
+		ti->got_packet_batch_done(ti->cookie);
 }
 
 int tun_interface_register(struct tun_interface *ti)
@@ -71,6 +110,8 @@ int tun_interface_register(struct tun_interface *ti)
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	if (ti->vnet_hdr)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 	if (ti->itfname != NULL)
 		strncpy(ifr.ifr_name, ti->itfname, IFNAMSIZ);
 
@@ -83,6 +124,7 @@ int tun_interface_register(struct tun_interface *ti)
 	}
 
 	memcpy(ti->name, ifr.ifr_name, IFNAMSIZ);
+	ti->offload = 0;
 
 	IV_FD_INIT(&ti->fd);
 	ti->fd.fd = fd;
@@ -104,15 +146,41 @@ char *tun_interface_get_name(struct tun_interface *ti)
 	return ti->name;
 }
 
-int tun_interface_send_packet(struct tun_interface *ti,
-			      const uint8_t *buf, int len)
+static int tun_interface_writev(struct tun_interface *ti,
+				const struct virtio_net_hdr *vh,
+				const uint8_t *buf, int len)
 {
+	struct iovec iov[2];
 	int ret;
 
+	iov[0].iov_base = (void *)vh;
+	iov[0].iov_len = sizeof(*vh);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
 	do {
-		ret = write(ti->fd.fd, buf, len);
+		ret = writev(ti->fd.fd, iov, 2);
 	} while (ret < 0 && errno == EINTR);
 
+	return ret;
+}
+
+int tun_interface_send_packet(struct tun_interface *ti,
+			      const uint8_t *buf, int len)
+{
+	int ret;
+
+	if (ti->vnet_hdr) {
+		struct virtio_net_hdr vh;
+
+		memset(&vh, 0, sizeof(vh));
+		ret = tun_interface_writev(ti, &vh, buf, len);
+	} else {
+		do {
+			ret = write(ti->fd.fd, buf, len);
+		} while (ret < 0 && errno == EINTR);
+	}
+
 	if (ret < 0) {
 		fprintf(stderr, "tun_interface_send_packet: write(2) got "
 				"error: %s\n", strerror(errno));
@@ -120,3 +188,43 @@ int tun_interface_send_packet(struct tun_interface *ti,
 
 	return ret;
 }
+
+int tun_interface_set_offload(struct tun_interface *ti, int enable)
+{
+	unsigned int offloads;
+
+	if (!ti->vnet_hdr)
+		return enable ? -1 : 0;
+
+	if (ti->offload == enable)
+		return 0;
+
+	offloads = enable ? TUN_OFFLOADS : 0;
+	if (ioctl(ti->fd.fd, TUNSETOFFLOAD, offloads) < 0) {
+		fprintf(stderr, "tun_interface_set_offload: ioctl(2) got "
+				"error: %s\n", strerror(errno));
+		return -1;
+	}
+
+	ti->offload = enable;
+
+	return 0;
+}
+
+int tun_interface_send_gso_packet(struct tun_interface *ti,
+				  const struct virtio_net_hdr *vh,
+				  const uint8_t *buf, int len)
+{
+	int ret;
+
+	if (!ti->vnet_hdr)
+		return -1;
+
+	ret = tun_interface_writev(ti, vh, buf, len);
+	if (ret < 0) {
+		fprintf(stderr, "tun_interface_send_gso_packet: writev(2) "
+				"got error: %s\n", strerror(errno));
+	}
+
+	return ret;
+}
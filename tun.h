@@ -22,14 +22,38 @@
 
 #include <iv.h>
 #include <net/if.h>
+#include <linux/virtio_net.h>
 
+/*
+ * Packet buffers passed to ->got_packet() are preceded by at least
+ * TUN_RX_HEADROOM bytes that the callee is free to scribble over, so
+ * that it can prepend a header without having to copy the packet.
+ */
+#define TUN_RX_HEADROOM		16
+
+/*
+ * If ->vnet_hdr is set, the interface is created with IFF_VNET_HDR,
+ * and once offloads are enabled with tun_interface_set_offload(), the
+ * kernel may hand us TSO/GSO super-packets of up to 64 KiB, or
+ * packets that still need their checksum filled in.  Such packets are
+ * passed to ->got_gso_packet() along with their virtio_net_hdr, and
+ * can be handed to the receiving tun interface as-is with
+ * tun_interface_send_gso_packet(), which will then segment them.
+ * Packets without GSO metadata are passed to ->got_packet() as usual.
+ */
 struct tun_interface {
 	const char	*itfname;
+	int		vnet_hdr;
 	void		*cookie;
 	void		(*got_packet)(void *cookie, uint8_t *buf, int len);
+	void		(*got_gso_packet)(void *cookie,
+					  const struct virtio_net_hdr *vh,
+					  uint8_t *buf, int len);
+	void		(*got_packet_batch_done)(void *cookie);
 
 	char		name[IFNAMSIZ];
 	struct iv_fd	fd;
+	int		offload;
 };
 
 int tun_interface_register(struct tun_interface *ti);
@@ -37,6 +61,10 @@ void tun_interface_unregister(struct tun_interface *ti);
 char *tun_interface_get_name(struct tun_interface *ti);
 int tun_interface_send_packet(struct tun_interface *ti,
 			      const uint8_t *buf, int len);
+int tun_interface_set_offload(struct tun_interface *ti, int enable);
+int tun_interface_send_gso_packet(struct tun_interface *ti,
+				  const struct virtio_net_hdr *vh,
+				  const uint8_t *buf, int len);
 
 
 #endif
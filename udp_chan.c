@@ -0,0 +1,440 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iv.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "udp_chan.h"
+#include "util.h"
+
+/*
+ * Datagram format: [8 byte sequence number][AEAD ciphertext][tag],
+ * with the sequence number authenticated as additional data, and the
+ * nonce formed by the per-direction salt followed by the sequence
+ * number.  Empty datagrams serve as keepalives.
+ */
+#define SEQ_LEN			8
+#define TAG_LEN			16
+#define NONCE_LEN		(UDP_CHAN_SALT_LEN + SEQ_LEN)
+
+/*
+ * We only send over the channel while we've recently received an
+ * authenticated datagram from our peer, so that traffic falls back
+ * to the TLS connection if datagrams don't make it through.
+ */
+#define KEEPALIVE_INTERVAL	1
+#define KEEPALIVE_TIMEOUT	5
+
+static void gtls_perror(const char *str, int err)
+{
+	fprintf(stderr, "%s: %s\n", str, gnutls_strerror(err));
+}
+
+static void udp_chan_nonce(uint8_t *nonce, const uint8_t *salt, uint64_t seq)
+{
+	int i;
+
+	memcpy(nonce, salt, UDP_CHAN_SALT_LEN);
+	for (i = 0; i < SEQ_LEN; i++)
+		nonce[UDP_CHAN_SALT_LEN + i] = seq >> (8 * (SEQ_LEN - 1 - i));
+}
+
+static int udp_chan_replay_check(struct udp_chan *uc, uint64_t seq)
+{
+	uint64_t diff;
+
+	if (seq > uc->rx_seq)
+		return 0;
+
+	diff = uc->rx_seq - seq;
+	if (diff >= 64 || (uc->rx_window & (1ULL << diff)))
+		return -1;
+
+	return 0;
+}
+
+static void udp_chan_replay_update(struct udp_chan *uc, uint64_t seq)
+{
+	uint64_t diff;
+
+	if (seq > uc->rx_seq) {
+		diff = seq - uc->rx_seq;
+		if (diff >= 64)
+			uc->rx_window = 0;
+		else
+			uc->rx_window <<= diff;
+		uc->rx_window |= 1;
+		uc->rx_seq = seq;
+	} else {
+		uc->rx_window |= 1ULL << (uc->rx_seq - seq);
+	}
+}
+
+static void udp_chan_got_datagram(struct udp_chan *uc, uint8_t *buf, int len,
+				  const struct sockaddr_in6 *from)
+{
+	uint8_t pt[UDP_CHAN_MAX_DGRAM];
+	size_t ptlen;
+	uint8_t nonce[NONCE_LEN];
+	uint64_t seq;
+	int i;
+	int ret;
+
+	if (len < SEQ_LEN + TAG_LEN)
+		return;
+
+	seq = 0;
+	for (i = 0; i < SEQ_LEN; i++)
+		seq = (seq << 8) | buf[i];
+
+	if (udp_chan_replay_check(uc, seq))
+		return;
+
+	udp_chan_nonce(nonce, uc->rx_salt, seq);
+
+	ptlen = sizeof(pt);
+	ret = gnutls_aead_cipher_decrypt(uc->rx_cipher, nonce, NONCE_LEN,
+					 buf, SEQ_LEN, TAG_LEN,
+					 buf + SEQ_LEN, len - SEQ_LEN,
+					 pt, &ptlen);
+	if (ret < 0)
+		return;
+
+	udp_chan_replay_update(uc, seq);
+
+	uc->peer_known = 1;
+	uc->peer = *from;
+
+	iv_validate_now();
+	uc->last_rx = iv_now;
+
+	if (ptlen)
+		uc->record_received(uc->cookie, pt, ptlen);
+}
+
+static void udp_chan_got_packets(void *_uc)
+{
+	struct udp_chan *uc = _uc;
+	uint8_t buf[UDP_CHAN_BATCH][UDP_CHAN_MAX_DGRAM];
+	struct sockaddr_in6 from[UDP_CHAN_BATCH];
+	struct mmsghdr msgs[UDP_CHAN_BATCH];
+	struct iovec iov[UDP_CHAN_BATCH];
+	int ret;
+	int i;
+
+	for (i = 0; i < UDP_CHAN_BATCH; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = sizeof(buf[i]);
+
+		memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_name = &from[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	do {
+		ret = recvmmsg(uc->fd.fd, msgs, UDP_CHAN_BATCH,
+			       MSG_DONTWAIT, NULL);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		if (errno != EAGAIN)
+			perror("udp_chan_got_packets: recvmmsg");
+		return;
+	}
+
+	for (i = 0; i < ret; i++) {
+		if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			continue;
+
+		udp_chan_got_datagram(uc, buf[i], msgs[i].msg_len, &from[i]);
+
+		/*
+		 * Our callback may have stopped us.
+		 */
+		if (uc->fd.fd < 0)
+			return;
+	}
+}
+
+static void udp_chan_send_keepalive(void *_uc)
+{
+	struct udp_chan *uc = _uc;
+
+	iv_validate_now();
+	uc->keepalive_timer.expires = iv_now;
+	timespec_add_ms(&uc->keepalive_timer.expires,
+			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
+	iv_timer_register(&uc->keepalive_timer);
+
+	if (uc->peer_known) {
+		udp_chan_send(uc, NULL, 0);
+		udp_chan_flush(uc);
+	}
+}
+
+static int udp_chan_init_cipher(gnutls_aead_cipher_hd_t *h, const uint8_t *key)
+{
+	gnutls_datum_t k;
+	int ret;
+
+	k.data = (void *)key;
+	k.size = UDP_CHAN_KEY_LEN;
+
+	ret = gnutls_aead_cipher_init(h, GNUTLS_CIPHER_AES_256_GCM, &k);
+	if (ret < 0) {
+		gtls_perror("gnutls_aead_cipher_init", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+int udp_chan_start(struct udp_chan *uc, const uint8_t *keys,
+		   const struct sockaddr_storage *server)
+{
+	const uint8_t *ckey;
+	const uint8_t *skey;
+	struct sockaddr_in6 addr;
+	int client;
+	int off;
+	int fd;
+
+	client = (server != NULL);
+	if (client && server->ss_family != AF_INET6 &&
+	    server->ss_family != AF_INET) {
+		return -1;
+	}
+
+	ckey = keys;
+	skey = keys + UDP_CHAN_KEY_LEN + UDP_CHAN_SALT_LEN;
+
+	fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("udp_chan_start: socket");
+		return -1;
+	}
+
+	off = 0;
+	if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)) < 0) {
+		perror("udp_chan_start: setsockopt(IPV6_V6ONLY)");
+		close(fd);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("udp_chan_start: bind");
+		close(fd);
+		return -1;
+	}
+
+	if (udp_chan_init_cipher(&uc->tx_cipher, client ? ckey : skey) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	if (udp_chan_init_cipher(&uc->rx_cipher, client ? skey : ckey) < 0) {
+		gnutls_aead_cipher_deinit(uc->tx_cipher);
+		close(fd);
+		return -1;
+	}
+
+	memcpy(uc->tx_salt, (client ? ckey : skey) + UDP_CHAN_KEY_LEN,
+	       UDP_CHAN_SALT_LEN);
+	memcpy(uc->rx_salt, (client ? skey : ckey) + UDP_CHAN_KEY_LEN,
+	       UDP_CHAN_SALT_LEN);
+
+	uc->tx_seq = 0;
+	uc->rx_seq = 0;
+	uc->rx_window = 0;
+	uc->client = client;
+	uc->peer_known = 0;
+	memset(&uc->peer, 0, sizeof(uc->peer));
+	uc->peer.sin6_family = AF_INET6;
+	if (client && server->ss_family == AF_INET6) {
+		const struct sockaddr_in6 *a6;
+
+		a6 = (const struct sockaddr_in6 *)server;
+		uc->peer.sin6_addr = a6->sin6_addr;
+		uc->peer.sin6_scope_id = a6->sin6_scope_id;
+	} else if (client) {
+		const struct sockaddr_in *a4;
+		uint8_t *a;
+
+		a4 = (const struct sockaddr_in *)server;
+		a = uc->peer.sin6_addr.s6_addr;
+		a[10] = 0xff;
+		a[11] = 0xff;
+		memcpy(a + 12, &a4->sin_addr, 4);
+	}
+	uc->last_rx.tv_sec = 0;
+	uc->last_rx.tv_nsec = 0;
+	uc->tx_count = 0;
+
+	IV_FD_INIT(&uc->fd);
+	uc->fd.fd = fd;
+	uc->fd.cookie = uc;
+	uc->fd.handler_in = udp_chan_got_packets;
+	iv_fd_register(&uc->fd);
+
+	IV_TIMER_INIT(&uc->keepalive_timer);
+	iv_validate_now();
+	uc->keepalive_timer.expires = iv_now;
+	uc->keepalive_timer.cookie = uc;
+	uc->keepalive_timer.handler = udp_chan_send_keepalive;
+	iv_timer_register(&uc->keepalive_timer);
+
+	return 0;
+}
+
+void udp_chan_stop(struct udp_chan *uc)
+{
+	iv_timer_unregister(&uc->keepalive_timer);
+
+	iv_fd_unregister(&uc->fd);
+	close(uc->fd.fd);
+	uc->fd.fd = -1;
+
+	gnutls_aead_cipher_deinit(uc->tx_cipher);
+	gnutls_aead_cipher_deinit(uc->rx_cipher);
+}
+
+int udp_chan_get_port(struct udp_chan *uc)
+{
+	struct sockaddr_in6 addr;
+	socklen_t len;
+
+	len = sizeof(addr);
+	if (getsockname(uc->fd.fd, (struct sockaddr *)&addr, &len) < 0) {
+		perror("udp_chan_get_port: getsockname");
+		return -1;
+	}
+
+	return ntohs(addr.sin6_port);
+}
+
+void udp_chan_set_peer_port(struct udp_chan *uc, int port)
+{
+	if (!uc->client || uc->peer_known)
+		return;
+
+	uc->peer.sin6_port = htons(port);
+	uc->peer_known = 1;
+
+	udp_chan_send(uc, NULL, 0);
+	udp_chan_flush(uc);
+}
+
+int udp_chan_usable(struct udp_chan *uc)
+{
+	struct timespec expiry;
+
+	if (!uc->peer_known || (!uc->last_rx.tv_sec && !uc->last_rx.tv_nsec))
+		return 0;
+
+	expiry = uc->last_rx;
+	expiry.tv_sec += KEEPALIVE_TIMEOUT;
+
+	iv_validate_now();
+
+	return expiry.tv_sec > iv_now.tv_sec ||
+	       (expiry.tv_sec == iv_now.tv_sec &&
+		expiry.tv_nsec > iv_now.tv_nsec);
+}
+
+int udp_chan_send(struct udp_chan *uc, const uint8_t *rec, int len)
+{
+	uint8_t *buf;
+	uint8_t nonce[NONCE_LEN];
+	size_t ctlen;
+	int i;
+	int ret;
+
+	if (!uc->peer_known || SEQ_LEN + len + TAG_LEN > UDP_CHAN_MAX_DGRAM)
+		return -1;
+
+	buf = uc->tx_buf[uc->tx_count];
+	for (i = 0; i < SEQ_LEN; i++)
+		buf[i] = uc->tx_seq >> (8 * (SEQ_LEN - 1 - i));
+
+	udp_chan_nonce(nonce, uc->tx_salt, uc->tx_seq);
+
+	ctlen = UDP_CHAN_MAX_DGRAM - SEQ_LEN;
+	ret = gnutls_aead_cipher_encrypt(uc->tx_cipher, nonce, NONCE_LEN,
+					 buf, SEQ_LEN, TAG_LEN, rec, len,
+					 buf + SEQ_LEN, &ctlen);
+	if (ret < 0) {
+		gtls_perror("gnutls_aead_cipher_encrypt", ret);
+		return -1;
+	}
+
+	uc->tx_seq++;
+	uc->tx_len[uc->tx_count] = SEQ_LEN + ctlen;
+
+	uc->tx_count++;
+	if (uc->tx_count == UDP_CHAN_BATCH)
+		udp_chan_flush(uc);
+
+	return 0;
+}
+
+void udp_chan_flush(struct udp_chan *uc)
+{
+	struct mmsghdr msgs[UDP_CHAN_BATCH];
+	struct iovec iov[UDP_CHAN_BATCH];
+	int i;
+	int ret;
+
+	if (!uc->tx_count)
+		return;
+
+	for (i = 0; i < uc->tx_count; i++) {
+		iov[i].iov_base = uc->tx_buf[i];
+		iov[i].iov_len = uc->tx_len[i];
+
+		memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_name = &uc->peer;
+		msgs[i].msg_hdr.msg_namelen = sizeof(uc->peer);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	/*
+	 * Datagrams that the socket doesn't take are dropped, just like
+	 * they would have been had they been lost on the way.
+	 */
+	do {
+		ret = sendmmsg(uc->fd.fd, msgs, uc->tx_count, MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0 && errno != EAGAIN && errno != ENOBUFS)
+		perror("udp_chan_flush: sendmmsg");
+
+	uc->tx_count = 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UDP_CHAN_H
+#define __UDP_CHAN_H
+
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include <iv.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+ * An AEAD-over-UDP channel for data plane records, keyed with keying
+ * material exported from an established tconn session.  The client
+ * side is passed the address of its TLS peer, and starts sending once
+ * it learns the peer's UDP port with udp_chan_set_peer_port().  The
+ * server side learns its peer's address from the authenticated
+ * datagrams that it receives.
+ */
+#define UDP_CHAN_LABEL		"EXPORTER-dvpn-udp-data"
+#define UDP_CHAN_KEY_LEN	32
+#define UDP_CHAN_SALT_LEN	4
+#define UDP_CHAN_KEYING_LEN	(2 * (UDP_CHAN_KEY_LEN + UDP_CHAN_SALT_LEN))
+
+#define UDP_CHAN_BATCH		32
+#define UDP_CHAN_MAX_DGRAM	2048
+
+struct udp_chan {
+	void			*cookie;
+	void			(*record_received)(void *cookie,
+						   const uint8_t *rec, int len);
+
+	struct iv_fd		fd;
+	struct iv_timer		keepalive_timer;
+	gnutls_aead_cipher_hd_t	tx_cipher;
+	gnutls_aead_cipher_hd_t	rx_cipher;
+	uint8_t			tx_salt[UDP_CHAN_SALT_LEN];
+	uint8_t			rx_salt[UDP_CHAN_SALT_LEN];
+	uint64_t		tx_seq;
+	uint64_t		rx_seq;
+	uint64_t		rx_window;
+	int			client;
+	int			peer_known;
+	struct sockaddr_in6	peer;
+	struct timespec		last_rx;
+	int			tx_count;
+	int			tx_len[UDP_CHAN_BATCH];
+	uint8_t			tx_buf[UDP_CHAN_BATCH][UDP_CHAN_MAX_DGRAM];
+};
+
+int udp_chan_start(struct udp_chan *uc, const uint8_t *keys,
+		   const struct sockaddr_storage *server);
+void udp_chan_stop(struct udp_chan *uc);
+int udp_chan_get_port(struct udp_chan *uc);
+void udp_chan_set_peer_port(struct udp_chan *uc, int port);
+int udp_chan_usable(struct udp_chan *uc);
+int udp_chan_send(struct udp_chan *uc, const uint8_t *rec, int len);
+void udp_chan_flush(struct udp_chan *uc);
+
+
+#endif
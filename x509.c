@@ -23,7 +23,6 @@
 #include <gnutls/gnutls.h>
 #include <gnutls/abstract.h>
 #include <gnutls/x509.h>
-#include <nettle/sha2.h>
 #include <stdint.h>
 #include <string.h>
 #include <unistd.h>
@@ -129,23 +128,22 @@ err:
 	return -1;
 }
 
+/*
+ * The SHA-256 key ID that gnutls computes is the hash of the DER
+ * encoded SubjectPublicKeyInfo, which is what our node ids are.
+ */
 int get_pubkey_id(uint8_t *id, gnutls_pubkey_t pubkey)
 {
-	uint8_t buf[65536];
 	size_t len;
 	int ret;
-	struct sha256_ctx ctx;
 
-	len = sizeof(buf);
+	len = NODE_ID_LEN;
 
-	ret = gnutls_pubkey_export(pubkey, GNUTLS_X509_FMT_DER, buf, &len);
+	ret = gnutls_pubkey_get_key_id(pubkey, GNUTLS_KEYID_USE_SHA256,
+				       id, &len);
 	if (ret < 0)
 		return ret;
 
-	sha256_init(&ctx);
-	sha256_update(&ctx, len, buf);
-	sha256_digest(&ctx, SHA256_DIGEST_SIZE, id);
-
 	return 0;
 }
 